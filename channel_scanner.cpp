@@ -1,16 +1,34 @@
 #include "channel_scanner.hpp"
 #include "protocol_types.hpp"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include <algorithm>
 #include <cstring>
 
 static const char *TAG = "ChannelScanner";
 
-RealChannelScanner::RealChannelScanner(IWiFiHAL &wifi_hal, IMessageCodec &message_codec, NodeId my_node_id, NodeType my_node_type)
+// Channels most access points are configured for, tried before the rest
+static constexpr uint8_t COMMON_CHANNELS[] = {1, 6, 11};
+
+RealChannelScanner::RealChannelScanner(IWiFiHAL &wifi_hal,
+                                       IMessageCodec &message_codec,
+                                       NodeId my_node_id,
+                                       NodeType my_node_type,
+                                       IStorage *hint_store,
+                                       const Config &config)
     : wifi_hal_(wifi_hal)
     , message_codec_(message_codec)
     , my_node_id_(my_node_id)
     , my_node_type_(my_node_type)
+    , hint_store_(hint_store)
+    , config_(config)
 {
+    hint_mutex_ = xSemaphoreCreateMutex();
+}
+
+RealChannelScanner::~RealChannelScanner()
+{
+    if (hint_mutex_) vSemaphoreDelete(hint_mutex_);
 }
 
 void RealChannelScanner::update_node_info(NodeId id, NodeType type)
@@ -19,50 +37,218 @@ void RealChannelScanner::update_node_info(NodeId id, NodeType type)
     my_node_type_ = type;
 }
 
-IChannelScanner::ScanResult RealChannelScanner::scan(uint8_t start_channel)
+uint16_t RealChannelScanner::dwell_ms() const
 {
-    ESP_LOGI(TAG, "Starting channel scan to find Hub.");
-    bool hub_found = false;
-    uint8_t current_channel = start_channel;
-    if (current_channel < 1 || current_channel > 13) {
-        current_channel = 1;
+    xSemaphoreTake(hint_mutex_, portMAX_DELAY);
+    uint16_t dwell = adaptive_dwell_ms();
+    xSemaphoreGive(hint_mutex_);
+    return dwell;
+}
+
+uint16_t RealChannelScanner::adaptive_dwell_ms() const
+{
+    if (latency_ewma_x8_ == 0) return config_.max_dwell_ms;
+    uint32_t dwell = (latency_ewma_x8_ * config_.latency_margin + 7) / 8;
+    return static_cast<uint16_t>(std::clamp<uint32_t>(dwell, config_.min_dwell_ms, config_.max_dwell_ms));
+}
+
+size_t RealChannelScanner::build_order(uint8_t start_channel, uint8_t *order) const
+{
+    bool taken[SCAN_MAX_CHANNEL + 1] = {};
+    size_t count = 0;
+    auto push = [&](int channel) {
+        if (channel < 1 || channel > SCAN_MAX_CHANNEL || taken[channel]) return;
+        taken[channel] = true;
+        order[count++] = static_cast<uint8_t>(channel);
+    };
+
+    // The channel we lost the hub on, then where it was seen recently
+    push(start_channel);
+    for (uint8_t hint : hints_) push(hint);
+
+    // A hub following its access point usually moves to a neighbouring channel
+    push(start_channel - 1);
+    push(start_channel + 1);
+
+    // Channels the hub has been seen on before, most frequent first
+    uint8_t ranked[SCAN_MAX_CHANNEL];
+    size_t ranked_count = 0;
+    for (uint8_t ch = 1; ch <= SCAN_MAX_CHANNEL; ch++) {
+        if (hits_[ch] > 0) ranked[ranked_count++] = ch;
     }
+    std::stable_sort(ranked, ranked + ranked_count, [this](uint8_t a, uint8_t b) { return hits_[a] > hits_[b]; });
+    for (size_t i = 0; i < ranked_count; i++) push(ranked[i]);
 
-    // Note: get_time_ms logic should be handled by HAL or passed?
-    // Let's assume HAL provides time or we just use a loop count.
-    // Original used get_time_ms.
-
-    // For simplicity, let's keep the loop.
-    for (uint8_t offset = 0; offset < 13 && !hub_found; ++offset) {
-        uint8_t channel = ((current_channel - 1 + offset) % 13) + 1;
-        wifi_hal_.set_channel(channel);
-
-        MessageHeader probe_header;
-        probe_header.msg_type       = MessageType::CHANNEL_SCAN_PROBE;
-        probe_header.sender_node_id = my_node_id_;
-        probe_header.sender_type    = my_node_type_;
-        probe_header.dest_node_id   = ReservedIds::HUB;
-        probe_header.sequence_number = 0;
-        probe_header.timestamp_ms    = 0; // Not critical for probe
-
-        auto encoded = message_codec_.encode(probe_header, nullptr, 0);
-        if (encoded.empty()) continue;
-
-        const uint8_t broadcast_mac[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-
-        for (uint8_t attempt = 0; attempt < SCAN_CHANNEL_ATTEMPTS && !hub_found; attempt++) {
-            wifi_hal_.send_packet(broadcast_mac, encoded.data(), encoded.size());
-
-            // Notification bits: NOTIFY_HUB_FOUND | NOTIFY_LINK_ALIVE
-            // Let's use 0x04 | 0x200 = 0x204
-            if (wifi_hal_.wait_for_event(0x204, SCAN_CHANNEL_TIMEOUT_MS)) {
-                ESP_LOGI(TAG, "Hub found on channel %d.", channel);
-                hub_found = true;
-                current_channel = channel;
-                break;
-            }
+    for (uint8_t ch : COMMON_CHANNELS) push(ch);
+    for (uint8_t ch = 1; ch <= SCAN_MAX_CHANNEL; ch++) push(ch);
+    return count;
+}
+
+void RealChannelScanner::load_hints()
+{
+    if (hints_loaded_) return;
+    hints_loaded_ = true;
+    if (hint_store_ == nullptr || hint_store_->load_channel_hints(hints_, CHANNEL_HINT_COUNT) != ESP_OK) {
+        memset(hints_, 0, sizeof(hints_));
+        return;
+    }
+    for (uint8_t &hint : hints_) {
+        if (hint > SCAN_MAX_CHANNEL) hint = 0;
+    }
+}
+
+void RealChannelScanner::record_hub_channel(uint8_t channel)
+{
+    if (channel < 1 || channel > SCAN_MAX_CHANNEL) return;
+    xSemaphoreTake(hint_mutex_, portMAX_DELAY);
+    move_hint_to_front(channel);
+    xSemaphoreGive(hint_mutex_);
+}
+
+void RealChannelScanner::move_hint_to_front(uint8_t channel)
+{
+    load_hints();
+    if (hints_[0] == channel) return;
+
+    // Move to front
+    size_t pos = CHANNEL_HINT_COUNT - 1;
+    for (size_t i = 0; i < CHANNEL_HINT_COUNT; i++) {
+        if (hints_[i] == channel) {
+            pos = i;
+            break;
         }
     }
+    memmove(&hints_[1], &hints_[0], pos);
+    hints_[0] = channel;
+
+    if (hint_store_) hint_store_->save_channel_hints(hints_, CHANNEL_HINT_COUNT);
+}
+
+void RealChannelScanner::record_hit(uint8_t channel, uint32_t latency_ms)
+{
+    xSemaphoreTake(hint_mutex_, portMAX_DELAY);
+    move_hint_to_front(channel);
+    if (hits_[channel] < UINT8_MAX) hits_[channel]++;
+
+    // EWMA with alpha 1/4 in 1/8 ms fixed point; the first sample seeds it
+    uint32_t sample_x8 = std::max<uint32_t>(latency_ms, 1) * 8;
+    if (latency_ewma_x8_ == 0) {
+        latency_ewma_x8_ = sample_x8;
+    } else {
+        latency_ewma_x8_ = (latency_ewma_x8_ * 3 + sample_x8) / 4;
+    }
+    xSemaphoreGive(hint_mutex_);
+}
+
+uint32_t RealChannelScanner::start(uint8_t start_channel, ScanCallback on_done, void *ctx)
+{
+    if (start_channel < 1 || start_channel > SCAN_MAX_CHANNEL) {
+        start_channel = 1;
+    }
+    scanning_       = true;
+    start_channel_  = start_channel;
+    on_done_        = on_done;
+    on_done_ctx_    = ctx;
+    result_         = {start_channel, false, 0, 0};
+    scan_start_us_  = esp_timer_get_time();
+    probe_wire_len_ = 0;
+
+    MessageHeader probe_header = {};
+    probe_header.msg_type       = MessageType::CHANNEL_SCAN_PROBE;
+    probe_header.sender_node_id = my_node_id_;
+    probe_header.sender_type    = my_node_type_;
+    probe_header.dest_node_id   = ReservedIds::HUB;
+    probe_header.sequence_number = 0;
+    probe_header.timestamp_ms    = 0; // Not critical for probe
+
+    // Probes are broadcast to a hub whose capabilities are unknown: legacy format.
+    // The probe is the same on every channel, so encode it once.
+    const uint8_t broadcast_mac[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t frame[sizeof(MessageHeader) + CRC_SIZE];
+    size_t frame_len = message_codec_.encode(probe_header, nullptr, 0, frame, sizeof(frame));
+    if (frame_len > 0) {
+        probe_wire_len_ = message_codec_.encode_wire(broadcast_mac, frame, frame_len, PeerCapability::NONE, false,
+                                                     probe_wire_, sizeof(probe_wire_));
+    }
+    if (probe_wire_len_ == 0) {
+        finish(false);
+        return 0;
+    }
+
+    xSemaphoreTake(hint_mutex_, portMAX_DELAY);
+    load_hints();
+    channel_count_ = build_order(start_channel, order_);
+    first_dwell_   = adaptive_dwell_ms();
+    xSemaphoreGive(hint_mutex_);
+    next_index_    = 0;
+    pass_          = 0;
+    ESP_LOGI(TAG, "Starting channel scan to find Hub (dwell %u ms).", first_dwell_);
+
+    return probe_next();
+}
+
+uint32_t RealChannelScanner::on_dwell_elapsed()
+{
+    if (!scanning_) return 0;
+    return probe_next();
+}
+
+void RealChannelScanner::on_hub_found()
+{
+    if (!scanning_ || result_.probes == 0) return;
+
+    uint32_t latency_ms = static_cast<uint32_t>((esp_timer_get_time() - probe_start_us_) / 1000);
+    record_hit(result_.channel, latency_ms);
+    finish(true);
+}
+
+void RealChannelScanner::cancel()
+{
+    scanning_ = false;
+    on_done_  = nullptr;
+}
+
+uint32_t RealChannelScanner::probe_next()
+{
+    if (next_index_ >= channel_count_) {
+        next_index_ = 0;
+        pass_++;
+    }
+    if (pass_ >= config_.passes) {
+        finish(false);
+        return 0;
+    }
+
+    uint8_t channel = order_[next_index_++];
+    wifi_hal_.set_channel(channel);
+    result_.channel = channel;
+
+    const uint8_t broadcast_mac[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    probe_start_us_ = esp_timer_get_time();
+    wifi_hal_.send_packet(broadcast_mac, probe_wire_, probe_wire_len_);
+    result_.probes++;
+
+    // The first pass uses the adaptive dwell, later ones the full timeout
+    return (pass_ == 0) ? first_dwell_ : config_.max_dwell_ms;
+}
+
+void RealChannelScanner::finish(bool hub_found)
+{
+    result_.hub_found   = hub_found;
+    result_.duration_ms = static_cast<uint32_t>((esp_timer_get_time() - scan_start_us_) / 1000);
+    if (!hub_found) {
+        result_.channel = start_channel_;
+    }
+
+    if (hub_found) {
+        ESP_LOGI(TAG, "Hub found on channel %d after %u probes, %lu ms.", result_.channel, result_.probes,
+                 (unsigned long)result_.duration_ms);
+    } else {
+        ESP_LOGW(TAG, "Hub not found after %u probes, %lu ms.", result_.probes, (unsigned long)result_.duration_ms);
+    }
 
-    return {current_channel, hub_found};
+    scanning_            = false;
+    ScanCallback on_done = on_done_;
+    on_done_             = nullptr;
+    if (on_done) on_done(result_, on_done_ctx_);
 }
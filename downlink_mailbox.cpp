@@ -0,0 +1,101 @@
+#include "downlink_mailbox.hpp"
+#include "protocol_messages.hpp"
+#include <cstring>
+
+esp_err_t DownlinkMailbox::hold(const TxPacket &packet, uint64_t now_ms)
+{
+    expire(now_ms);
+
+    // Latest value wins, in the replaced frame's place in the queue
+    Slot *same = find_coalescable(packet);
+    if (same != nullptr) {
+        same->held_ms = now_ms;
+        same->packet  = packet;
+        return ESP_OK;
+    }
+
+    Slot *free_slot = nullptr;
+    size_t held     = 0;
+    for (auto &slot : slots_) {
+        if (!slot.in_use) {
+            if (free_slot == nullptr) free_slot = &slot;
+        }
+        else if (memcmp(slot.packet.dest_mac, packet.dest_mac, 6) == 0) {
+            held++;
+        }
+    }
+    if (free_slot == nullptr || held >= PEER_SLOTS) return ESP_ERR_NO_MEM;
+
+    free_slot->in_use  = true;
+    free_slot->order   = next_order_++;
+    free_slot->held_ms = now_ms;
+    free_slot->packet  = packet;
+    return ESP_OK;
+}
+
+bool DownlinkMailbox::take(const uint8_t *mac, TxPacket &packet, uint64_t now_ms)
+{
+    expire(now_ms);
+
+    Slot *oldest = nullptr;
+    for (auto &slot : slots_) {
+        // Wrap-safe: orders are compared by distance, not value
+        if (slot.in_use && memcmp(slot.packet.dest_mac, mac, 6) == 0 &&
+            (oldest == nullptr || static_cast<int32_t>(slot.order - oldest->order) < 0)) {
+            oldest = &slot;
+        }
+    }
+    if (oldest == nullptr) return false;
+
+    packet         = oldest->packet;
+    oldest->in_use = false;
+    return true;
+}
+
+size_t DownlinkMailbox::pending(const uint8_t *mac, uint64_t now_ms)
+{
+    expire(now_ms);
+
+    size_t count = 0;
+    for (const auto &slot : slots_) {
+        if (slot.in_use && memcmp(slot.packet.dest_mac, mac, 6) == 0) count++;
+    }
+    return count;
+}
+
+size_t DownlinkMailbox::expire(uint64_t now_ms)
+{
+    size_t dropped = 0;
+    for (auto &slot : slots_) {
+        if (slot.in_use && now_ms - slot.held_ms >= TTL_MS) {
+            slot.in_use = false;
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+void DownlinkMailbox::clear()
+{
+    for (auto &slot : slots_) slot.in_use = false;
+    next_order_ = 0;
+}
+
+DownlinkMailbox::Slot *DownlinkMailbox::find_coalescable(const TxPacket &packet)
+{
+    // Held frames are canonical: the header is still in the clear
+    const auto *header = reinterpret_cast<const MessageHeader *>(packet.data);
+    if (packet.len < sizeof(MessageHeader) ||
+        (header->msg_type != MessageType::DATA && header->msg_type != MessageType::COMMAND)) {
+        return nullptr;
+    }
+
+    for (auto &slot : slots_) {
+        const auto *held = reinterpret_cast<const MessageHeader *>(slot.packet.data);
+        if (slot.in_use && memcmp(slot.packet.dest_mac, packet.dest_mac, 6) == 0 &&
+            held->msg_type == header->msg_type && held->payload_type == header->payload_type) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
@@ -4,9 +4,12 @@
 #include "esp_rom_crc.h"
 #include "esp_timer.h"
 #include "esp_wifi.h"
+#include "espnow_stats.hpp"
+#include "latency_histogram.hpp"
 #include "channel_scanner.hpp"
 #include "heartbeat_manager.hpp"
 #include "message_codec.hpp"
+#include "message_registry.hpp"
 #include "pairing_manager.hpp"
 #include "peer_manager.hpp"
 #include "protocol_messages.hpp"
@@ -25,16 +28,16 @@ EspNow &EspNow::instance()
 {
     static EspNowStorage storage;
     static auto peer_manager = std::make_unique<RealPeerManager>(storage);
-    static auto message_codec = std::make_unique<RealMessageCodec>();
+    static auto message_codec = std::make_unique<RealMessageCodec>(PeerCapability::SUPPORTED, &storage);
 
     static RealWiFiHAL wifi_hal;
     static RealTxStateMachine tx_fsm;
-    static RealChannelScanner scanner(wifi_hal, *message_codec, ReservedIds::HUB, ReservedTypes::HUB);
+    static RealChannelScanner scanner(wifi_hal, *message_codec, ReservedIds::HUB, ReservedTypes::HUB, &storage);
 
-    static auto tx_manager = std::make_unique<RealTxManager>(tx_fsm, scanner, wifi_hal, *message_codec);
+    static auto tx_manager = std::make_unique<RealTxManager>(tx_fsm, scanner, wifi_hal, *message_codec, *peer_manager);
 
-    static auto heartbeat_mgr = std::make_unique<RealHeartbeatManager>(*tx_manager, *peer_manager, *message_codec, ReservedIds::HUB);
-    static auto pairing_mgr = std::make_unique<RealPairingManager>(*tx_manager, *peer_manager, *message_codec);
+    static auto heartbeat_mgr = std::make_unique<RealHeartbeatManager>(*tx_manager, *peer_manager, *message_codec, wifi_hal, ReservedIds::HUB);
+    static auto pairing_mgr = std::make_unique<RealPairingManager>(*tx_manager, *peer_manager, *message_codec, wifi_hal);
     static auto message_router = std::make_unique<RealMessageRouter>(*peer_manager, *tx_manager, *heartbeat_mgr, *pairing_mgr, *message_codec);
 
     static EspNow instance(std::move(peer_manager), std::move(tx_manager), &scanner, std::move(message_codec), std::move(heartbeat_mgr), std::move(pairing_mgr), std::move(message_router));
@@ -72,6 +75,21 @@ esp_err_t EspNow::deinit()
     is_initialized_ = false;
     ESP_LOGI(TAG, "Deinitializing EspNow component...");
 
+    if (liveness_timer_ != nullptr) {
+        xTimerDelete(liveness_timer_, portMAX_DELAY);
+        liveness_timer_ = nullptr;
+    }
+    if (stats_timer_ != nullptr) {
+        xTimerDelete(stats_timer_, portMAX_DELAY);
+        stats_timer_ = nullptr;
+    }
+    if (channel_switch_timer_ != nullptr) {
+        xTimerDelete(channel_switch_timer_, portMAX_DELAY);
+        channel_switch_timer_ = nullptr;
+    }
+    pending_channel_ = 0;
+    peer_manager_->set_event_queue(nullptr);
+
     if (tx_manager_) tx_manager_->deinit();
     if (heartbeat_manager_) heartbeat_manager_->deinit();
     if (pairing_manager_) pairing_manager_->deinit();
@@ -92,8 +110,11 @@ esp_err_t EspNow::deinit()
     if (rx_dispatch_task_handle_ != nullptr) vTaskDelete(rx_dispatch_task_handle_);
     if (transport_worker_task_handle_ != nullptr) vTaskDelete(transport_worker_task_handle_);
 
-    std::vector<PeerInfo> peers = peer_manager_->get_all();
-    for (const auto &peer : peers) esp_now_del_peer(peer.mac);
+    message_codec_->flush_replay_floors();
+    peer_manager_->for_each([this](const PeerInfo &peer) {
+        esp_now_del_peer(peer.mac);
+        message_codec_->remove_session_key(peer.mac);
+    });
     esp_now_deinit();
 
     if (rx_dispatch_queue_ != nullptr) vQueueDelete(rx_dispatch_queue_);
@@ -114,7 +135,6 @@ esp_err_t EspNow::deinit()
 esp_err_t EspNow::init(const EspNowConfig &config)
 {
     if (is_initialized_) return ESP_ERR_INVALID_STATE;
-    if (config.app_rx_queue == nullptr) return ESP_ERR_INVALID_ARG;
 
     config_ = config;
 
@@ -126,6 +146,15 @@ esp_err_t EspNow::init(const EspNowConfig &config)
         config_.wifi_channel = stored_channel;
     }
 
+    uint16_t capabilities = config_.capabilities;
+    if (!config_.enable_encryption) capabilities &= ~PeerCapability::AEAD;
+    if (config_.wake_period_ms == 0) capabilities &= ~PeerCapability::WAKE_SLOTS;
+    message_codec_->set_capabilities(capabilities);
+    pairing_manager_->set_network_key(config_.enable_encryption ? config_.network_key : nullptr);
+
+    uint8_t own_mac[6];
+    if (esp_read_mac(own_mac, ESP_MAC_WIFI_STA) == ESP_OK) message_codec_->set_local_mac(own_mac);
+
     ESP_ERROR_CHECK(esp_now_init());
     ESP_ERROR_CHECK(esp_now_register_recv_cb(esp_now_recv_cb));
     ESP_ERROR_CHECK(esp_now_register_send_cb(esp_now_send_cb));
@@ -160,19 +189,56 @@ esp_err_t EspNow::init(const EspNowConfig &config)
         message_router_->set_node_info(config_.node_id, config_.node_type);
     }
 
-    std::vector<PeerInfo> peers = peer_manager_->get_all();
-    for (auto &peer : peers) {
+    // get_session_key() takes the peer lock, so keys are looked up after the walk
+    struct LoadedPeer
+    {
+        uint8_t mac[6];
+        NodeId node_id;
+    };
+    LoadedPeer loaded[MAX_PEERS];
+    size_t loaded_count = 0;
+    peer_manager_->for_each([&](const PeerInfo &peer) {
         esp_now_peer_info_t info = {};
         memcpy(info.peer_addr, peer.mac, 6);
         info.channel = peer.channel;
         info.ifidx = WIFI_IF_STA;
         info.encrypt = false;
         esp_now_add_peer(&info);
+
+        if (loaded_count < MAX_PEERS) {
+            memcpy(loaded[loaded_count].mac, peer.mac, 6);
+            loaded[loaded_count++].node_id = peer.node_id;
+        }
+    });
+
+    for (size_t i = 0; config_.enable_encryption && i < loaded_count; i++) {
+        uint8_t session_key[SecureEnvelope::KEY_SIZE];
+        if (peer_manager_->get_session_key(loaded[i].node_id, session_key)) {
+            message_codec_->install_session_key(loaded[i].mac, session_key);
+            memset(session_key, 0, sizeof(session_key));
+        }
     }
 
+    heartbeat_manager_->set_wake_period(config_.wake_period_ms);
+    peer_manager_->set_wake_period(config_.wake_period_ms);
     if (heartbeat_manager_->init(config_.heartbeat_interval_ms, config_.node_type) != ESP_OK) return ESP_FAIL;
     if (pairing_manager_->init(config_.node_type, config_.node_id) != ESP_OK) return ESP_FAIL;
 
+    peer_manager_->set_event_queue(config_.app_event_queue);
+    liveness_timer_ = xTimerCreate("peer_liveness", pdMS_TO_TICKS(PEER_LIVENESS_TICK_MS), pdTRUE, this, liveness_timer_cb);
+    if (liveness_timer_ == nullptr || xTimerStart(liveness_timer_, 0) != pdPASS) return ESP_FAIL;
+
+    if (config_.node_type == ReservedTypes::HUB) {
+        channel_switch_timer_ = xTimerCreate("channel_switch", pdMS_TO_TICKS(CHANNEL_SWITCH_DELAY_MS), pdFALSE, this,
+                                             channel_switch_timer_cb);
+        if (channel_switch_timer_ == nullptr) return ESP_FAIL;
+    }
+
+    if (config_.stats_reporter != nullptr && config_.stats_report_interval_ms > 0) {
+        stats_timer_ = xTimerCreate("espnow_stats", pdMS_TO_TICKS(config_.stats_report_interval_ms), pdTRUE, this, stats_timer_cb);
+        if (stats_timer_ == nullptr || xTimerStart(stats_timer_, 0) != pdPASS) return ESP_FAIL;
+    }
+
     ESP_LOGI(TAG, "EspNow component initialized successfully.");
     return ESP_OK;
 }
@@ -182,7 +248,7 @@ esp_err_t EspNow::send_data(NodeId dest_node_id, PayloadType payload_type, const
     TxPacket tx_packet;
     if (!peer_manager_->find_mac(dest_node_id, tx_packet.dest_mac)) return ESP_ERR_NOT_FOUND;
 
-    MessageHeader header;
+    MessageHeader header = {};
     header.msg_type = MessageType::DATA;
     header.sequence_number = 0;
     header.sender_type = config_.node_type;
@@ -190,16 +256,13 @@ esp_err_t EspNow::send_data(NodeId dest_node_id, PayloadType payload_type, const
     header.payload_type = payload_type;
     header.requires_ack = require_ack;
     header.dest_node_id = dest_node_id;
-    header.timestamp_ms = get_time_ms();
+    header.timestamp_ms = get_header_time_ms();
 
-    auto encoded = message_codec_->encode(header, payload, len);
-    if (encoded.empty()) return ESP_ERR_INVALID_ARG;
-
-    tx_packet.len = encoded.size();
-    memcpy(tx_packet.data, encoded.data(), tx_packet.len);
+    tx_packet.len = message_codec_->encode(header, payload, len, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len == 0) return ESP_ERR_INVALID_ARG;
     tx_packet.requires_ack = require_ack;
 
-    return tx_manager_->queue_packet(tx_packet);
+    return submit(tx_packet);
 }
 
 esp_err_t EspNow::send_command(NodeId dest_node_id, CommandType command_type, const void *payload, size_t len, bool require_ack)
@@ -207,7 +270,7 @@ esp_err_t EspNow::send_command(NodeId dest_node_id, CommandType command_type, co
     TxPacket tx_packet;
     if (!peer_manager_->find_mac(dest_node_id, tx_packet.dest_mac)) return ESP_ERR_NOT_FOUND;
 
-    MessageHeader header;
+    MessageHeader header = {};
     header.msg_type = MessageType::COMMAND;
     header.sequence_number = 0;
     header.sender_type = config_.node_type;
@@ -215,16 +278,13 @@ esp_err_t EspNow::send_command(NodeId dest_node_id, CommandType command_type, co
     header.payload_type = static_cast<PayloadType>(command_type);
     header.requires_ack = require_ack;
     header.dest_node_id = dest_node_id;
-    header.timestamp_ms = get_time_ms();
-
-    auto encoded = message_codec_->encode(header, payload, len);
-    if (encoded.empty()) return ESP_ERR_INVALID_ARG;
+    header.timestamp_ms = get_header_time_ms();
 
-    tx_packet.len = encoded.size();
-    memcpy(tx_packet.data, encoded.data(), tx_packet.len);
+    tx_packet.len = message_codec_->encode(header, payload, len, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len == 0) return ESP_ERR_INVALID_ARG;
     tx_packet.requires_ack = require_ack;
 
-    return tx_manager_->queue_packet(tx_packet);
+    return submit(tx_packet);
 }
 
 esp_err_t EspNow::confirm_reception(AckStatus status)
@@ -236,8 +296,7 @@ esp_err_t EspNow::confirm_reception(AckStatus status)
     }
 
     const auto &header_to_ack = last_header_requiring_ack_.value();
-    AckMessage ack;
-    ack.header.msg_type = MessageType::ACK;
+    AckMessage ack = {};
     ack.header.sender_node_id = config_.node_id;
     ack.header.sender_type = config_.node_type;
     ack.header.dest_node_id = header_to_ack.sender_node_id;
@@ -252,27 +311,35 @@ esp_err_t EspNow::confirm_reception(AckStatus status)
         return ESP_ERR_NOT_FOUND;
     }
 
-    auto encoded = message_codec_->encode(ack.header, &ack.ack_sequence, sizeof(AckMessage) - sizeof(MessageHeader));
-    if (encoded.empty()) {
+    tx_packet.len = encode_message(*message_codec_, ack, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len == 0) {
         last_header_requiring_ack_.reset();
         xSemaphoreGive(ack_mutex_);
         return ESP_FAIL;
     }
-
-    tx_packet.len = encoded.size();
-    memcpy(tx_packet.data, encoded.data(), tx_packet.len);
     tx_packet.requires_ack = false;
 
-    esp_err_t err = tx_manager_->queue_packet(tx_packet);
+    // A successful ACK can ride on the response the app is likely about to send;
+    // error statuses carry detail the piggyback field cannot, so they go out now.
+    esp_err_t err = (status == AckStatus::OK) ? tx_manager_->schedule_ack(tx_packet, header_to_ack.sequence_number)
+                                              : tx_manager_->queue_packet(tx_packet);
     last_header_requiring_ack_.reset();
     xSemaphoreGive(ack_mutex_);
     return err;
 }
 
-std::vector<PeerInfo> EspNow::get_peers() { return peer_manager_->get_all(); }
-std::vector<NodeId> EspNow::get_offline_peers() const { return peer_manager_->get_offline(get_time_ms()); }
+size_t EspNow::get_peers(PeerInfo *peers, size_t max) { return peer_manager_->get_all(peers, max); }
+size_t EspNow::get_offline_peers(NodeId *ids, size_t max) const
+{
+    return peer_manager_->get_offline(get_time_ms(), ids, max);
+}
 esp_err_t EspNow::add_peer(NodeId node_id, const uint8_t *mac, uint8_t channel, NodeType type) { return peer_manager_->add(node_id, mac, channel, type); }
-esp_err_t EspNow::remove_peer(NodeId node_id) { return peer_manager_->remove(node_id); }
+esp_err_t EspNow::remove_peer(NodeId node_id)
+{
+    uint8_t mac[6];
+    if (peer_manager_->find_mac(node_id, mac)) message_codec_->remove_session_key(mac);
+    return peer_manager_->remove(node_id);
+}
 esp_err_t EspNow::start_pairing(uint32_t timeout_ms) { return pairing_manager_->start(timeout_ms); }
 
 void EspNow::esp_now_recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int len)
@@ -284,11 +351,15 @@ void EspNow::esp_now_recv_cb(const esp_now_recv_info_t *info, const uint8_t *dat
     packet.len = len;
     packet.rssi = info->rx_ctrl->rssi;
     packet.timestamp_us = esp_timer_get_time();
-    xQueueSendFromISR(instance().rx_dispatch_queue_, &packet, 0);
+    Stats::add(Stats::Counter::RX_FRAMES);
+    if (xQueueSendFromISR(instance().rx_dispatch_queue_, &packet, 0) != pdTRUE) {
+        Stats::add(Stats::Counter::RX_QUEUE_DROPS);
+    }
 }
 
 void EspNow::esp_now_send_cb(const esp_now_send_info_t *info, esp_now_send_status_t status)
 {
+    Latency::record_send_cb();
     if (info->tx_status == WIFI_SEND_FAIL) instance().tx_manager_->notify_physical_fail();
 }
 
@@ -296,18 +367,33 @@ void EspNow::rx_dispatch_task(void *arg)
 {
     EspNow *self = static_cast<EspNow *>(arg);
     RxPacket packet;
+    uint8_t canonical[MAX_FRAME_SIZE];
     while (true) {
         uint32_t notifications = 0;
         if (xTaskNotifyWait(0, 0x100, &notifications, 0) == pdTRUE && (notifications & 0x100)) break;
         if (xQueueReceive(self->rx_dispatch_queue_, &packet, pdMS_TO_TICKS(100)) == pdTRUE) {
-            if (!self->message_codec_->validate_crc(packet.data, packet.len)) continue;
+            Latency::record(LatencyStage::RX_DISPATCH, packet.timestamp_us);
+            // Everything past this point works on the canonical frame layout
+            size_t len = self->message_codec_->decode_wire(packet.src_mac, packet.data, packet.len, canonical,
+                                                              sizeof(canonical));
+            if (len == 0) continue;
+            memcpy(packet.data, canonical, len);
+            packet.len = len;
+
             auto header_opt = self->message_codec_->decode_header(packet.data, packet.len);
             if (!header_opt) continue;
             const MessageHeader *header = &header_opt.value();
 
-            if (self->message_router_->should_dispatch_to_worker(header->msg_type)) {
-                xQueueSend(self->transport_worker_queue_, &packet, 0);
-            } else {
+            switch (self->message_router_->route_context(header->msg_type)) {
+            case RouteContext::NONE:
+                break;
+            case RouteContext::WORKER:
+                if (xQueueSend(self->transport_worker_queue_, &packet, 0) != pdTRUE) {
+                    Stats::add(Stats::Counter::RX_QUEUE_DROPS);
+                }
+                break;
+            case RouteContext::INLINE:
+            case RouteContext::APP:
                 if (header->requires_ack) {
                     if (xSemaphoreTake(self->ack_mutex_, pdMS_TO_TICKS(10)) == pdTRUE) {
                         self->last_header_requiring_ack_ = *header;
@@ -315,6 +401,7 @@ void EspNow::rx_dispatch_task(void *arg)
                     }
                 }
                 self->message_router_->handle_packet(packet);
+                break;
             }
         }
     }
@@ -329,6 +416,7 @@ void EspNow::transport_worker_task(void *arg)
         uint32_t notifications = 0;
         if (xTaskNotifyWait(0, 0x100, &notifications, 0) == pdTRUE && (notifications & 0x100)) break;
         if (xQueueReceive(self->transport_worker_queue_, &packet, pdMS_TO_TICKS(100)) == pdTRUE) {
+            Latency::record(LatencyStage::RX_WORKER, packet.timestamp_us);
             auto header_opt = self->message_codec_->decode_header(packet.data, packet.len);
             if (!header_opt) continue;
             const MessageHeader &header = header_opt.value();
@@ -337,14 +425,21 @@ void EspNow::transport_worker_task(void *arg)
 
             // Special handling for channel updates that affect the global config
             if (header.msg_type == MessageType::HEARTBEAT_RESPONSE) {
-                auto resp = reinterpret_cast<const HeartbeatResponse *>(packet.data);
-                self->update_wifi_channel(resp->wifi_channel);
+                HeartbeatResponse resp;
+                if (decode_message(packet, resp) > 0) {
+                    self->update_wifi_channel(resp.wifi_channel);
+                    if (self->scanner_ptr_) self->scanner_ptr_->record_hub_channel(resp.wifi_channel);
+                }
             } else if (header.msg_type == MessageType::CHANNEL_SCAN_RESPONSE) {
                 uint8_t ch;
                 esp_wifi_get_channel(&ch, nullptr);
                 self->update_wifi_channel(ch);
+            } else if (header.msg_type == MessageType::CHANNEL_ANNOUNCE) {
+                self->follow_channel_announce(packet, header);
             }
         }
+        // At least every 100 ms, with the queue wait; keeps storage off the RX path
+        self->message_codec_->flush_replay_floors();
     }
     vTaskDelete(NULL);
 }
@@ -352,6 +447,168 @@ void EspNow::transport_worker_task(void *arg)
 
 uint64_t EspNow::get_time_ms() const { return esp_timer_get_time() / 1000; }
 
+esp_err_t EspNow::submit(const TxPacket &tx_packet)
+{
+    // A peer that sleeps between wake slots or has gone offline would miss the
+    // frame and only burn retries: hold it until the peer is heard from
+    if (config_.node_type == ReservedTypes::HUB) {
+        bool sleeps = config_.wake_period_ms > 0 &&
+                      (peer_manager_->get_capabilities(tx_packet.dest_mac) & PeerCapability::WAKE_SLOTS);
+        if (sleeps || peer_manager_->is_offline(tx_packet.dest_mac)) return tx_manager_->hold_packet(tx_packet);
+    }
+    return tx_manager_->queue_packet(tx_packet);
+}
+
+uint64_t EspNow::get_header_time_ms() const
+{
+    // Timestamps from different nodes are only comparable on the network clock
+    uint64_t now_ms = get_time_ms();
+    uint64_t network_ms;
+    return heartbeat_manager_->to_network_time(now_ms, network_ms) ? network_ms : now_ms;
+}
+
+bool EspNow::get_network_time_ms(uint64_t &network_ms) const
+{
+    return heartbeat_manager_->to_network_time(get_time_ms(), network_ms);
+}
+
+uint8_t EspNow::get_downlink_pending() const
+{
+    return heartbeat_manager_->downlink_pending();
+}
+
+esp_err_t EspNow::subscribe(const AppSubscription &subscription, int &id)
+{
+    return message_router_->subscribe(subscription, id);
+}
+
+esp_err_t EspNow::unsubscribe(int id)
+{
+    return message_router_->unsubscribe(id);
+}
+
+esp_err_t EspNow::register_message_type(MessageType type, RouteContext context, MessageHandler handler, void *ctx)
+{
+    // The RX tasks read the route table without a lock
+    if (is_initialized_) return ESP_ERR_INVALID_STATE;
+    return message_router_->register_message_type(type, context, handler, ctx);
+}
+
+bool EspNow::network_to_local_time_ms(uint64_t network_ms, uint64_t &local_ms) const
+{
+    return heartbeat_manager_->to_local_time(network_ms, local_ms);
+}
+
+void EspNow::liveness_timer_cb(TimerHandle_t timer)
+{
+    auto *self = static_cast<EspNow *>(pvTimerGetTimerID(timer));
+    self->peer_manager_->check_liveness(self->get_time_ms());
+}
+
+EspNowStats EspNow::get_stats() const
+{
+    EspNowStats stats = Stats::snapshot();
+    peer_manager_->for_each([&stats](const PeerInfo &peer) {
+        stats.peer_count++;
+        if (peer.online) stats.peers_online++;
+    });
+    return stats;
+}
+
+void EspNow::reset_stats()
+{
+    Stats::reset();
+    Latency::reset();
+}
+
+esp_err_t EspNow::get_latency_histogram(LatencyStage stage, LatencyHistogram &histogram) const
+{
+#if CONFIG_ESPNOW_LATENCY_HISTOGRAMS
+    return Latency::snapshot(stage, histogram) ? ESP_OK : ESP_ERR_INVALID_ARG;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void EspNow::stats_timer_cb(TimerHandle_t timer)
+{
+    auto *self = static_cast<EspNow *>(pvTimerGetTimerID(timer));
+    self->config_.stats_reporter(self->get_stats(), self->config_.stats_reporter_ctx);
+}
+
+void EspNow::channel_switch_timer_cb(TimerHandle_t timer)
+{
+    auto *self      = static_cast<EspNow *>(pvTimerGetTimerID(timer));
+    uint8_t channel = self->pending_channel_.exchange(0);
+    if (channel != 0) self->switch_channel(channel);
+}
+
+esp_err_t EspNow::change_channel(uint8_t channel)
+{
+    if (!is_initialized_) return ESP_ERR_INVALID_STATE;
+    if (channel < 1 || channel > SCAN_MAX_CHANNEL) return ESP_ERR_INVALID_ARG;
+    if (channel == config_.wifi_channel && pending_channel_ == 0) return ESP_OK;
+
+    if (config_.node_type == ReservedTypes::HUB) {
+        // Tell the nodes on the old channel so they can follow without scanning
+        ChannelAnnounce announce = {};
+        announce.header.sender_node_id = config_.node_id;
+        announce.header.sender_type    = config_.node_type;
+        announce.header.dest_node_id   = ReservedIds::BROADCAST;
+        announce.header.timestamp_ms   = get_time_ms();
+        announce.new_channel           = channel;
+        announce.switch_delay_ms       = CHANNEL_SWITCH_DELAY_MS;
+
+        TxPacket tx_packet;
+        tx_packet.len = encode_message(*message_codec_, announce, tx_packet.data, sizeof(tx_packet.data));
+        if (tx_packet.len > 0) {
+            memset(tx_packet.dest_mac, 0xFF, 6);
+            tx_packet.requires_ack = false;
+            for (uint8_t i = 0; i < CHANNEL_ANNOUNCE_REPEATS; i++) {
+                tx_manager_->queue_packet(tx_packet);
+            }
+        }
+
+        // Move once the announcements are out, without holding up the caller;
+        // a later request replaces the pending one and restarts the delay
+        pending_channel_ = channel;
+        return xTimerReset(channel_switch_timer_, 0) == pdPASS ? ESP_OK : ESP_FAIL;
+    }
+
+    return switch_channel(channel);
+}
+
+esp_err_t EspNow::switch_channel(uint8_t channel)
+{
+    esp_err_t err = esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to switch to channel %d: %s", channel, esp_err_to_name(err));
+        return err;
+    }
+    peer_manager_->set_channel_all(channel);
+    update_wifi_channel(channel);
+    ESP_LOGI(TAG, "Switched to channel %d.", channel);
+    return ESP_OK;
+}
+
+void EspNow::follow_channel_announce(const RxPacket &packet, const MessageHeader &header)
+{
+    if (config_.node_type == ReservedTypes::HUB || header.sender_type != ReservedTypes::HUB) return;
+    ChannelAnnounce announce;
+    if (decode_message(packet, announce) == 0) return;
+
+    // Announcements travel in the clear: only follow the hub we paired with
+    uint8_t hub_mac[6];
+    if (!peer_manager_->find_mac(header.sender_node_id, hub_mac) || memcmp(hub_mac, packet.src_mac, 6) != 0) return;
+
+    uint8_t channel = announce.new_channel;
+    if (channel < 1 || channel > SCAN_MAX_CHANNEL) return;
+
+    ESP_LOGI(TAG, "Hub announced a move to channel %d.", channel);
+    if (scanner_ptr_) scanner_ptr_->record_hub_channel(channel);
+    if (channel != config_.wifi_channel) switch_channel(channel);
+}
+
 void EspNow::update_wifi_channel(uint8_t channel)
 {
     if (config_.wifi_channel != channel) {
@@ -0,0 +1,36 @@
+#include "espnow_stats.hpp"
+
+namespace Stats {
+
+Row rows[portNUM_PROCESSORS];
+
+EspNowStats snapshot()
+{
+    uint32_t totals[COUNTERS] = {};
+    for (const auto &row : rows) {
+        for (size_t i = 0; i < COUNTERS; i++) totals[i] += row.values[i].load(std::memory_order_relaxed);
+    }
+
+    EspNowStats stats = {};
+    uint32_t *fields[] = {
+        &stats.tx_queued,          &stats.tx_queue_full,   &stats.tx_sent,
+        &stats.tx_phy_failures,    &stats.tx_retries,      &stats.tx_ack_timeouts,
+        &stats.tx_max_retry_drops, &stats.scans,           &stats.scan_time_ms,
+        &stats.rx_frames,          &stats.rx_queue_drops,  &stats.rx_crc_failures,
+        &stats.rx_header_failures, &stats.app_queue_drops, &stats.peers_added,
+        &stats.peers_removed,      &stats.peers_evicted,   &stats.nvs_commits,
+        &stats.nvs_bytes_written,
+    };
+    static_assert(sizeof(fields) / sizeof(fields[0]) == COUNTERS, "Every counter needs a field");
+    for (size_t i = 0; i < COUNTERS; i++) *fields[i] = totals[i];
+    return stats;
+}
+
+void reset()
+{
+    for (auto &row : rows) {
+        for (auto &value : row.values) value.store(0, std::memory_order_relaxed);
+    }
+}
+
+} // namespace Stats
@@ -2,6 +2,7 @@
 #include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_rom_crc.h"
+#include "espnow_stats.hpp"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include <algorithm>
@@ -12,6 +13,30 @@ static const char *TAG           = "EspNowStorage";
 static const char *NVS_NAMESPACE = "espnow_store";
 static const char *NVS_KEY       = "persist_data";
 
+// Layout written by version 1, before peer capabilities, session keys,
+// channel hints and replay state were added. Only read, to migrate it.
+struct PersistentPeerV1
+{
+    uint8_t mac[6];
+    NodeType type;
+    NodeId node_id;
+    uint8_t channel;
+    bool paired;
+    uint32_t heartbeat_interval_ms;
+};
+
+struct PersistentDataV1
+{
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint8_t wifi_channel;
+    uint8_t num_peers;
+    PersistentPeerV1 peers[PersistentData::MAX_PERSISTENT_PEERS];
+    uint32_t crc;
+};
+
 // --- Real RTC Backend ---
 static RTC_DATA_ATTR PersistentData g_rtc_storage;
 
@@ -77,6 +102,10 @@ public:
         if (err == ESP_OK) {
             err = nvs_commit(handle);
         }
+        if (err == ESP_OK) {
+            Stats::add(Stats::Counter::NVS_COMMITS);
+            Stats::add(Stats::Counter::NVS_BYTES_WRITTEN, size);
+        }
         nvs_close(handle);
 
         if (err != ESP_OK) {
@@ -118,10 +147,13 @@ EspNowStorage::EspNowStorage(std::unique_ptr<IPersistenceBackend> rtc_backend,
         nvs_backend_ = std::move(nvs_backend);
     else
         nvs_backend_ = std::make_unique<RealNvsBackend>();
+
+    mutex_ = xSemaphoreCreateMutex();
 }
 
 EspNowStorage::~EspNowStorage()
 {
+    if (mutex_) vSemaphoreDelete(mutex_);
 }
 
 uint32_t EspNowStorage::calculate_crc(const PersistentData &data)
@@ -130,59 +162,289 @@ uint32_t EspNowStorage::calculate_crc(const PersistentData &data)
     return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&data), length);
 }
 
-esp_err_t EspNowStorage::load(uint8_t &wifi_channel, std::vector<PersistentPeer> &peers)
+bool EspNowStorage::read_valid(IPersistenceBackend &backend, PersistentData &data)
 {
-    PersistentData data;
+    if (backend.load(&data, sizeof(PersistentData)) != ESP_OK) {
+        return false;
+    }
+    return data.magic == PersistentData::MAGIC && data.version == PersistentData::VERSION &&
+           data.crc == calculate_crc(data);
+}
 
-    // 1. Try RTC
-    if (rtc_backend_->load(&data, sizeof(PersistentData)) == ESP_OK) {
-        uint32_t calculated_crc = calculate_crc(data);
-        if (data.magic == PersistentData::MAGIC && data.version == PersistentData::VERSION &&
-            data.crc == calculated_crc) {
-            ESP_LOGI(TAG, "Loaded data from RTC");
-            wifi_channel = data.wifi_channel;
-            peers.clear();
-            for (int i = 0; i < data.num_peers; ++i) {
-                peers.push_back(data.peers[i]);
+bool EspNowStorage::migrate_v1(PersistentData &data)
+{
+    // Only NVS outlives the firmware update that changed the layout
+    PersistentDataV1 old;
+    if (nvs_backend_->load(&old, sizeof(old)) != ESP_OK) {
+        return false;
+    }
+    uint32_t crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&old), offsetof(PersistentDataV1, crc));
+    if (old.magic != PersistentData::MAGIC || old.version != PersistentDataV1::VERSION || old.crc != crc) {
+        return false;
+    }
+
+    // Capabilities and session keys were never stored: NONE and no key, as for
+    // a peer paired by older firmware
+    memset(&data, 0, sizeof(PersistentData));
+    data.magic        = PersistentData::MAGIC;
+    data.version      = PersistentData::VERSION;
+    data.wifi_channel = old.wifi_channel;
+    data.num_peers    = std::min<size_t>(old.num_peers, PersistentData::MAX_PERSISTENT_PEERS);
+    for (size_t i = 0; i < data.num_peers; ++i) {
+        PersistentPeer &peer = data.peers[i];
+        memcpy(peer.mac, old.peers[i].mac, 6);
+        peer.type                  = old.peers[i].type;
+        peer.node_id               = old.peers[i].node_id;
+        peer.channel               = old.peers[i].channel;
+        peer.paired                = old.peers[i].paired;
+        peer.heartbeat_interval_ms = old.peers[i].heartbeat_interval_ms;
+        peer.capabilities          = PeerCapability::NONE;
+    }
+    return true;
+}
+
+void EspNowStorage::load_cached_state()
+{
+    if (cached_state_loaded_) return;
+
+    PersistentData data;
+    bool from_rtc = read_valid(*rtc_backend_, data);
+    if (from_rtc || read_valid(*nvs_backend_, data)) {
+        boot_epoch_     = data.boot_epoch;
+        epoch_ceiling_  = data.epoch_ceiling;
+        epoch_from_rtc_ = from_rtc;
+        memcpy(channel_hints_, data.channel_hints, sizeof(channel_hints_));
+        memcpy(replay_floors_, data.replay_floors, sizeof(replay_floors_));
+        for (auto &floor : replay_floors_) {
+            if (!from_rtc) {
+                // RTC was lost: the exact counter may have moved past the NVS copy
+                floor.counter = floor.counter_ceiling;
             }
-            return ESP_OK;
+            floor_stamp_ = std::max(floor_stamp_, floor.last_used);
         }
     }
+    cached_state_loaded_ = true;
+}
+
+esp_err_t EspNowStorage::load(uint8_t &wifi_channel, PersistentPeer *peers, size_t max, size_t &count)
+{
+    PersistentData data;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    count = 0;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    load_cached_state();
 
+    // 1. Try RTC
+    if (read_valid(*rtc_backend_, data)) {
+        ESP_LOGI(TAG, "Loaded data from RTC");
+        err = ESP_OK;
+    }
     // 2. Try NVS
-    if (nvs_backend_->load(&data, sizeof(PersistentData)) == ESP_OK) {
-        uint32_t calculated_crc = calculate_crc(data);
-        if (data.magic == PersistentData::MAGIC && data.version == PersistentData::VERSION &&
-            data.crc == calculated_crc) {
-            ESP_LOGI(TAG, "Loaded data from NVS");
-            wifi_channel = data.wifi_channel;
-            peers.clear();
-            for (int i = 0; i < data.num_peers; ++i) {
-                peers.push_back(data.peers[i]);
-            }
-            // Sync RTC
-            rtc_backend_->save(&data, sizeof(PersistentData));
-            return ESP_OK;
-        }
+    else if (read_valid(*nvs_backend_, data)) {
+        ESP_LOGI(TAG, "Loaded data from NVS");
+        // Sync RTC, with the replay floors raised to their NVS ceilings
+        stamp(data);
+        rtc_backend_->save(&data, sizeof(PersistentData));
+        err = ESP_OK;
+    }
+    // 3. Peers stored by firmware that wrote version 1
+    else if (migrate_v1(data)) {
+        ESP_LOGI(TAG, "Migrated version 1 data from NVS");
+        write(data, true);
+        err = ESP_OK;
     }
 
-    return ESP_ERR_NOT_FOUND;
+    if (err == ESP_OK) {
+        wifi_channel = data.wifi_channel;
+        count = std::min({max, static_cast<size_t>(data.num_peers), PersistentData::MAX_PERSISTENT_PEERS});
+        std::copy_n(data.peers, count, peers);
+    }
+    xSemaphoreGive(mutex_);
+    return err;
 }
 
-esp_err_t EspNowStorage::save(uint8_t wifi_channel, const std::vector<PersistentPeer> &peers, bool force_nvs_commit)
+esp_err_t EspNowStorage::save(uint8_t wifi_channel, const PersistentPeer *peers, size_t count, bool force_nvs_commit)
 {
     PersistentData data;
     memset(&data, 0, sizeof(PersistentData));
     data.magic        = PersistentData::MAGIC;
     data.version      = PersistentData::VERSION;
     data.wifi_channel = wifi_channel;
-    data.num_peers    = std::min(peers.size(), PersistentData::MAX_PERSISTENT_PEERS);
+    data.num_peers    = std::min(count, PersistentData::MAX_PERSISTENT_PEERS);
 
     for (size_t i = 0; i < data.num_peers; ++i) {
         data.peers[i] = peers[i];
     }
 
-    data.crc = calculate_crc(data);
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    esp_err_t err = write(data, force_nvs_commit);
+    xSemaphoreGive(mutex_);
+    return err;
+}
+
+esp_err_t EspNowStorage::next_epoch(uint32_t &epoch)
+{
+    PersistentData data;
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    if (!read_valid(*rtc_backend_, data) && !read_valid(*nvs_backend_, data)) {
+        // Nothing to attach the epoch to yet; session keys are only installed
+        // for peers that have already been saved.
+        xSemaphoreGive(mutex_);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    load_cached_state();
+    uint32_t next = boot_epoch_ + 1;
+    if (!epoch_from_rtc_ && next < epoch_ceiling_) {
+        // RTC was lost: epochs below the ceiling may already have been used
+        next = epoch_ceiling_;
+    }
+
+    // NVS only needs the ceiling, so it is written once per EPOCH_LEASE epochs
+    const uint32_t previous_epoch   = boot_epoch_;
+    const uint32_t previous_ceiling = epoch_ceiling_;
+    bool commit_nvs                 = next >= epoch_ceiling_;
+    if (commit_nvs) {
+        epoch_ceiling_ = next + EPOCH_LEASE;
+    }
+    boot_epoch_ = next;
+
+    esp_err_t err = write(data, commit_nvs);
+    if (err != ESP_OK) {
+        boot_epoch_    = previous_epoch;
+        epoch_ceiling_ = previous_ceiling;
+    }
+    else {
+        epoch_from_rtc_ = true;
+        epoch           = next;
+    }
+    xSemaphoreGive(mutex_);
+    return err;
+}
+
+esp_err_t EspNowStorage::load_channel_hints(uint8_t *hints, size_t count)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    load_cached_state();
+    bool any = false;
+    for (size_t i = 0; i < count; ++i) {
+        hints[i] = (i < CHANNEL_HINT_COUNT) ? channel_hints_[i] : 0;
+        any |= (hints[i] != 0);
+    }
+    xSemaphoreGive(mutex_);
+    return any ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t EspNowStorage::save_channel_hints(const uint8_t *hints, size_t count)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    load_cached_state();
+    for (size_t i = 0; i < CHANNEL_HINT_COUNT; ++i) {
+        channel_hints_[i] = (i < count) ? hints[i] : 0;
+    }
+
+    esp_err_t err = ESP_OK; // Written with the first save() if nothing is stored yet
+    PersistentData data;
+    if (read_valid(*rtc_backend_, data) || read_valid(*nvs_backend_, data)) {
+        if (memcmp(data.channel_hints, channel_hints_, sizeof(channel_hints_)) != 0) {
+            stamp(data);
+            err = rtc_backend_->save(&data, sizeof(PersistentData));
+        }
+    }
+    xSemaphoreGive(mutex_);
+    return err;
+}
+
+esp_err_t EspNowStorage::load_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t &epoch, uint32_t &counter)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    load_cached_state();
+    ReplayFloor *floor = find_floor(mac);
+    bool found         = floor && floor->key_check == key_check;
+    if (found) {
+        epoch   = floor->epoch;
+        counter = floor->counter;
+    }
+    xSemaphoreGive(mutex_);
+    return found ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t EspNowStorage::save_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t epoch, uint32_t counter)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    load_cached_state();
+
+    ReplayFloor *floor = find_floor(mac);
+    if (!floor) {
+        // Reuse a free entry, or the one saved longest ago
+        floor = &replay_floors_[0];
+        for (auto &candidate : replay_floors_) {
+            if (!candidate.in_use || (floor->in_use && candidate.last_used < floor->last_used)) {
+                floor = &candidate;
+            }
+        }
+        memset(floor, 0, sizeof(*floor));
+        memcpy(floor->mac, mac, 6);
+        floor->in_use = true;
+    }
+    else if (floor->key_check == key_check &&
+             (epoch < floor->epoch || (epoch == floor->epoch && counter <= floor->counter))) {
+        // An older snapshot that lost the race to a newer save
+        xSemaphoreGive(mutex_);
+        return ESP_OK;
+    }
+
+    // Renewed while REPLAY_SAVE_AHEAD frames still fit under the ceiling, which
+    // FrameCipher accepts before it saves again
+    bool commit_nvs = floor->key_check != key_check || floor->epoch != epoch ||
+                      counter + REPLAY_SAVE_AHEAD > floor->counter_ceiling;
+    floor->key_check = key_check;
+    floor->epoch     = epoch;
+    floor->counter   = counter;
+    floor->last_used = ++floor_stamp_;
+    if (commit_nvs) {
+        floor->counter_ceiling = counter + REPLAY_LEASE;
+    }
+
+    esp_err_t err = ESP_OK; // Written with the first save() if nothing is stored yet
+    PersistentData data;
+    if (read_valid(*rtc_backend_, data) || read_valid(*nvs_backend_, data)) {
+        if (commit_nvs) {
+            err = write(data, true);
+        }
+        else {
+            stamp(data);
+            err = rtc_backend_->save(&data, sizeof(PersistentData));
+        }
+    }
+    xSemaphoreGive(mutex_);
+    return err;
+}
+
+ReplayFloor *EspNowStorage::find_floor(const uint8_t *mac)
+{
+    for (auto &floor : replay_floors_) {
+        if (floor.in_use && memcmp(floor.mac, mac, 6) == 0) {
+            return &floor;
+        }
+    }
+    return nullptr;
+}
+
+void EspNowStorage::stamp(PersistentData &data)
+{
+    load_cached_state();
+    memcpy(data.channel_hints, channel_hints_, sizeof(channel_hints_));
+    data.boot_epoch    = boot_epoch_;
+    data.epoch_ceiling = epoch_ceiling_;
+    memcpy(data.replay_floors, replay_floors_, sizeof(replay_floors_));
+    data.crc           = calculate_crc(data);
+}
+
+esp_err_t EspNowStorage::write(PersistentData &data, bool force_nvs_commit)
+{
+    stamp(data);
 
     // Get current RTC data to check if dirty
     PersistentData current_rtc;
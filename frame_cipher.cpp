@@ -0,0 +1,364 @@
+#include "frame_cipher.hpp"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "mbedtls/md.h"
+#include <cstring>
+
+static const char *TAG = "FrameCipher";
+
+namespace {
+
+constexpr size_t CCM_NONCE_SIZE = 6 + SecureEnvelope::EPOCH_SIZE + SecureEnvelope::COUNTER_SIZE;
+constexpr char SESSION_LABEL[]  = "espnow-session-v1";
+
+void put_le(uint32_t value, uint8_t *out, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+uint32_t get_le(const uint8_t *in, size_t size)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value |= static_cast<uint32_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+// Sender MAC followed by the explicit epoch and counter from the envelope header
+void make_nonce(const uint8_t *sender_mac, const uint8_t *envelope, uint8_t *nonce)
+{
+    memcpy(nonce, sender_mac, 6);
+    memcpy(nonce + 6, envelope + 1, SecureEnvelope::EPOCH_SIZE + SecureEnvelope::COUNTER_SIZE);
+}
+
+} // namespace
+
+FrameCipher::FrameCipher(IStorage *epoch_store)
+    : epoch_store_(epoch_store)
+{
+    mutex_ = xSemaphoreCreateMutex();
+    for (auto &slot : slots_) {
+        slot.in_use = false;
+        mbedtls_ccm_init(&slot.ccm);
+    }
+}
+
+FrameCipher::~FrameCipher()
+{
+    for (auto &slot : slots_) {
+        mbedtls_ccm_free(&slot.ccm);
+    }
+    if (mutex_) vSemaphoreDelete(mutex_);
+}
+
+void FrameCipher::set_local_mac(const uint8_t *mac)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    memcpy(local_mac_, mac, 6);
+    xSemaphoreGive(mutex_);
+}
+
+esp_err_t FrameCipher::install_key(const uint8_t *mac, const uint8_t *key)
+{
+    if (!mac || !key) return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    KeySlot *slot = find(mac);
+    if (!slot) {
+        for (auto &candidate : slots_) {
+            if (!candidate.in_use) {
+                slot = &candidate;
+                break;
+            }
+        }
+    }
+    if (!slot) {
+        xSemaphoreGive(mutex_);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (mbedtls_ccm_setkey(&slot->ccm, MBEDTLS_CIPHER_ID_AES, key, 8 * SecureEnvelope::KEY_SIZE) != 0) {
+        slot->in_use = false;
+        xSemaphoreGive(mutex_);
+        return ESP_FAIL;
+    }
+    slot->in_use = true;
+    memcpy(slot->mac, mac, 6);
+    slot->key_check = make_key_check(key);
+    slot->rx_seen   = false;
+    // A floor loaded after a power loss sits at its NVS ceiling, which covers
+    // nothing beyond it: the first frame is saved before it is accepted
+    slot->saved     = false;
+    slot->unsaved   = false;
+
+    // Everything up to the stored floor counts as seen, window included
+    uint32_t epoch   = 0;
+    uint32_t counter = 0;
+    if (epoch_store_ && epoch_store_->load_replay_floor(mac, slot->key_check, epoch, counter) == ESP_OK) {
+        slot->rx_seen    = true;
+        slot->rx_epoch   = epoch;
+        slot->rx_counter = counter;
+        slot->rx_window  = ~0u;
+    }
+    xSemaphoreGive(mutex_);
+    return ESP_OK;
+}
+
+void FrameCipher::remove_key(const uint8_t *mac)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    KeySlot *slot = find(mac);
+    if (slot) {
+        mbedtls_ccm_free(&slot->ccm);
+        mbedtls_ccm_init(&slot->ccm);
+        slot->in_use = false;
+    }
+    xSemaphoreGive(mutex_);
+}
+
+bool FrameCipher::has_key(const uint8_t *mac)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    bool found = find(mac) != nullptr;
+    xSemaphoreGive(mutex_);
+    return found;
+}
+
+size_t FrameCipher::seal(const uint8_t *dest_mac, const uint8_t *frame, size_t len, uint8_t *out, size_t out_len)
+{
+    if (len + SecureEnvelope::OVERHEAD > out_len) return 0;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    KeySlot *slot = find(dest_mac);
+    if (!slot || !advance_counter()) {
+        xSemaphoreGive(mutex_);
+        return 0;
+    }
+
+    out[0] = SecureEnvelope::MARKER;
+    put_le(epoch_, out + 1, SecureEnvelope::EPOCH_SIZE);
+    put_le(counter_, out + 1 + SecureEnvelope::EPOCH_SIZE, SecureEnvelope::COUNTER_SIZE);
+
+    uint8_t nonce[CCM_NONCE_SIZE];
+    make_nonce(local_mac_, out, nonce);
+
+    uint8_t *ciphertext = out + SecureEnvelope::HEADER_SIZE;
+    int ret = mbedtls_ccm_encrypt_and_tag(&slot->ccm, len, nonce, sizeof(nonce), out, SecureEnvelope::HEADER_SIZE,
+                                          frame, ciphertext, ciphertext + len, SecureEnvelope::TAG_SIZE);
+    xSemaphoreGive(mutex_);
+
+    return (ret == 0) ? len + SecureEnvelope::OVERHEAD : 0;
+}
+
+size_t FrameCipher::open(const uint8_t *src_mac, const uint8_t *envelope, size_t len, uint8_t *out, size_t out_len)
+{
+    if (len <= SecureEnvelope::OVERHEAD || envelope[0] != SecureEnvelope::MARKER) return 0;
+
+    size_t inner_len = len - SecureEnvelope::OVERHEAD;
+    if (inner_len > out_len) return 0;
+
+    uint32_t epoch   = get_le(envelope + 1, SecureEnvelope::EPOCH_SIZE);
+    uint32_t counter = get_le(envelope + 1 + SecureEnvelope::EPOCH_SIZE, SecureEnvelope::COUNTER_SIZE);
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    KeySlot *slot = find(src_mac);
+    if (!slot) {
+        xSemaphoreGive(mutex_);
+        return 0;
+    }
+
+    // Cheap rejection first; the window only moves once the tag has verified
+    if (is_replay(*slot, epoch, counter)) {
+        xSemaphoreGive(mutex_);
+        return 0;
+    }
+
+    uint8_t nonce[CCM_NONCE_SIZE];
+    make_nonce(src_mac, envelope, nonce);
+
+    // mbedtls compares the tag in constant time before releasing any plaintext
+    const uint8_t *ciphertext = envelope + SecureEnvelope::HEADER_SIZE;
+    int ret = mbedtls_ccm_auth_decrypt(&slot->ccm, inner_len, nonce, sizeof(nonce), envelope,
+                                       SecureEnvelope::HEADER_SIZE, ciphertext, out, ciphertext + inner_len,
+                                       SecureEnvelope::TAG_SIZE);
+    if (ret == 0) {
+        bool advanced = !slot->rx_seen || epoch != slot->rx_epoch || counter > slot->rx_counter;
+        mark_received(*slot, epoch, counter);
+        if (advanced && epoch_store_) {
+            if (covered_by_save(*slot)) {
+                slot->unsaved = true; // Left to flush_replay_floors()
+            }
+            else if (epoch_store_->save_replay_floor(src_mac, slot->key_check, slot->rx_epoch, slot->rx_counter) ==
+                     ESP_OK) {
+                note_saved(*slot, slot->rx_epoch, slot->rx_counter);
+            }
+        }
+    }
+    xSemaphoreGive(mutex_);
+
+    return (ret == 0) ? inner_len : 0;
+}
+
+void FrameCipher::flush_replay_floors()
+{
+    if (!epoch_store_) return;
+
+    struct Floor
+    {
+        uint8_t mac[6];
+        uint32_t key_check;
+        uint32_t epoch;
+        uint32_t counter;
+    };
+    Floor floors[MAX_PEERS];
+    size_t count = 0;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    for (auto &slot : slots_) {
+        if (!slot.in_use || !slot.unsaved) continue;
+        Floor &floor = floors[count++];
+        memcpy(floor.mac, slot.mac, 6);
+        floor.key_check = slot.key_check;
+        floor.epoch     = slot.rx_epoch;
+        floor.counter   = slot.rx_counter;
+        slot.unsaved    = false;
+    }
+    xSemaphoreGive(mutex_);
+
+    // The store is written without the cipher locked, so sealing and opening
+    // carry on meanwhile; only a completed save may widen what open() accepts
+    // without one
+    for (size_t i = 0; i < count; i++) {
+        const Floor &floor = floors[i];
+        bool saved = epoch_store_->save_replay_floor(floor.mac, floor.key_check, floor.epoch, floor.counter) == ESP_OK;
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        KeySlot *slot = find(floor.mac);
+        if (slot && slot->key_check == floor.key_check) {
+            if (saved) {
+                note_saved(*slot, floor.epoch, floor.counter);
+            }
+            else {
+                slot->unsaved = true; // Tried again next time
+            }
+        }
+        xSemaphoreGive(mutex_);
+    }
+}
+
+esp_err_t FrameCipher::derive_session_key(const uint8_t *network_key,
+                                          const uint8_t *hub_mac,
+                                          const uint8_t *node_mac,
+                                          const uint8_t *node_nonce,
+                                          const uint8_t *hub_nonce,
+                                          uint8_t *session_key)
+{
+    uint8_t input[sizeof(SESSION_LABEL) - 1 + 6 + 6 + 2 * SecureEnvelope::NONCE_SIZE];
+    size_t pos = 0;
+    memcpy(input + pos, SESSION_LABEL, sizeof(SESSION_LABEL) - 1);
+    pos += sizeof(SESSION_LABEL) - 1;
+    memcpy(input + pos, hub_mac, 6);
+    pos += 6;
+    memcpy(input + pos, node_mac, 6);
+    pos += 6;
+    memcpy(input + pos, node_nonce, SecureEnvelope::NONCE_SIZE);
+    pos += SecureEnvelope::NONCE_SIZE;
+    memcpy(input + pos, hub_nonce, SecureEnvelope::NONCE_SIZE);
+    pos += SecureEnvelope::NONCE_SIZE;
+
+    uint8_t digest[32];
+    int ret = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), network_key, SecureEnvelope::KEY_SIZE,
+                              input, pos, digest);
+    if (ret != 0) return ESP_FAIL;
+
+    memcpy(session_key, digest, SecureEnvelope::KEY_SIZE);
+    memset(digest, 0, sizeof(digest));
+    return ESP_OK;
+}
+
+FrameCipher::KeySlot *FrameCipher::find(const uint8_t *mac)
+{
+    for (auto &slot : slots_) {
+        if (slot.in_use && memcmp(slot.mac, mac, 6) == 0) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+bool FrameCipher::is_replay(const KeySlot &slot, uint32_t epoch, uint32_t counter)
+{
+    if (!slot.rx_seen || epoch > slot.rx_epoch) return false;
+    if (epoch < slot.rx_epoch) return true;
+    if (counter > slot.rx_counter) return false;
+
+    uint32_t age = slot.rx_counter - counter;
+    return age >= REPLAY_WINDOW || (slot.rx_window & (1u << age));
+}
+
+void FrameCipher::mark_received(KeySlot &slot, uint32_t epoch, uint32_t counter)
+{
+    if (!slot.rx_seen || epoch > slot.rx_epoch) {
+        slot.rx_seen    = true;
+        slot.rx_epoch   = epoch;
+        slot.rx_counter = counter;
+        slot.rx_window  = 1;
+    }
+    else if (counter > slot.rx_counter) {
+        uint32_t shift  = counter - slot.rx_counter;
+        slot.rx_window  = (shift >= REPLAY_WINDOW) ? 1 : (slot.rx_window << shift) | 1;
+        slot.rx_counter = counter;
+    }
+    else {
+        slot.rx_window |= 1u << (slot.rx_counter - counter);
+    }
+}
+
+bool FrameCipher::covered_by_save(const KeySlot &slot)
+{
+    return slot.saved && slot.rx_epoch == slot.saved_epoch &&
+           slot.rx_counter - slot.saved_counter < IStorage::REPLAY_SAVE_AHEAD;
+}
+
+void FrameCipher::note_saved(KeySlot &slot, uint32_t epoch, uint32_t counter)
+{
+    // Saves from open() and flush_replay_floors() may finish out of order
+    bool newer = !slot.saved || epoch > slot.saved_epoch || (epoch == slot.saved_epoch && counter > slot.saved_counter);
+    if (!newer) return;
+    slot.saved         = true;
+    slot.saved_epoch   = epoch;
+    slot.saved_counter = counter;
+}
+
+uint32_t FrameCipher::make_key_check(const uint8_t *key)
+{
+    // One-way, so the stored value says nothing useful about the key
+    uint8_t digest[32] = {};
+    mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, SecureEnvelope::KEY_SIZE, digest);
+    return get_le(digest, sizeof(uint32_t));
+}
+
+bool FrameCipher::advance_counter()
+{
+    if (!epoch_valid_ || counter_ >= SecureEnvelope::MAX_COUNTER) {
+        uint32_t epoch = 0;
+        if (epoch_store_) {
+            esp_err_t err = epoch_store_->next_epoch(epoch);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "No boot epoch available: %s", esp_err_to_name(err));
+                return false;
+            }
+        }
+        else {
+            epoch = esp_random();
+        }
+        epoch_       = epoch;
+        counter_     = 0;
+        epoch_valid_ = true;
+    }
+    counter_++;
+    return true;
+}
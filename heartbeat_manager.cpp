@@ -1,21 +1,29 @@
 #include "heartbeat_manager.hpp"
 #include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
 #include "esp_timer.h"
+#include "message_registry.hpp"
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 
 static const char *TAG = "HeartbeatMgr";
 
-RealHeartbeatManager::RealHeartbeatManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec, NodeId my_id)
+RealHeartbeatManager::RealHeartbeatManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec, IWiFiHAL &wifi_hal, NodeId my_id)
     : tx_mgr_(tx_mgr)
     , peer_mgr_(peer_mgr)
     , codec_(codec)
+    , wifi_hal_(wifi_hal)
     , my_id_(my_id)
 {
+    mutex_ = xSemaphoreCreateMutex();
 }
 
 RealHeartbeatManager::~RealHeartbeatManager()
 {
     deinit();
+    if (mutex_) vSemaphoreDelete(mutex_);
 }
 
 void RealHeartbeatManager::update_node_id(NodeId id)
@@ -30,10 +38,28 @@ esp_err_t RealHeartbeatManager::init(uint32_t interval_ms, NodeType type)
 
     if (my_type_ != ReservedTypes::HUB && interval_ms_ > 0)
     {
-        timer_ = xTimerCreate("heartbeat", pdMS_TO_TICKS(interval_ms_), pdTRUE, this, timer_cb);
+        // Nodes powered up together must not heartbeat in lockstep: start at a phase of their own
+        uint32_t first_ms = std::max<uint32_t>(phase_offset_ms(), 1);
+        timer_ = xTimerCreate("heartbeat", std::max<TickType_t>(pdMS_TO_TICKS(first_ms), 1), pdFALSE, this, timer_cb);
         if (timer_ == nullptr) return ESP_FAIL;
+        awaiting_response_ = false;
+        missed_            = 0;
+        last_sent_ms_      = 0;
+        time_sync_.reset();
+        slot_period_ms_ = 0;
+        if (wake_period_ms_ > 0)
+        {
+            listen_timer_ = xTimerCreate("hb_listen", pdMS_TO_TICKS(WAKE_LISTEN_MS), pdFALSE, this, listen_timer_cb);
+            if (listen_timer_ == nullptr) return ESP_FAIL;
+        }
         xTimerStart(timer_, 0);
     }
+    else if (my_type_ == ReservedTypes::HUB)
+    {
+        beacon_timer_ = xTimerCreate("hb_beacon", std::max<TickType_t>(pdMS_TO_TICKS(HEARTBEAT_BEACON_WINDOW_MS), 1), pdFALSE, this, beacon_timer_cb);
+        if (beacon_timer_ == nullptr) return ESP_FAIL;
+        beacon_count_ = 0;
+    }
     return ESP_OK;
 }
 
@@ -45,41 +71,334 @@ esp_err_t RealHeartbeatManager::deinit()
         xTimerDelete(timer_, portMAX_DELAY);
         timer_ = nullptr;
     }
+    if (beacon_timer_)
+    {
+        xTimerStop(beacon_timer_, portMAX_DELAY);
+        xTimerDelete(beacon_timer_, portMAX_DELAY);
+        beacon_timer_ = nullptr;
+    }
+    if (listen_timer_)
+    {
+        xTimerStop(listen_timer_, portMAX_DELAY);
+        xTimerDelete(listen_timer_, portMAX_DELAY);
+        listen_timer_ = nullptr;
+        set_listening(true);
+    }
     return ESP_OK;
 }
 
-void RealHeartbeatManager::handle_response(NodeId hub_id, uint8_t channel)
+uint32_t RealHeartbeatManager::phase_offset_ms() const
+{
+    // FNV-1a over the MAC and node id: stable across reboots, distinct per node
+    uint8_t mac[6] = {};
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    uint32_t hash = 2166136261u;
+    for (uint8_t b : mac) hash = (hash ^ b) * 16777619u;
+    hash = (hash ^ my_id_) * 16777619u;
+    return hash % interval_ms_;
+}
+
+uint32_t RealHeartbeatManager::jittered_interval_ms() const
+{
+    uint32_t spread = interval_ms_ / HEARTBEAT_JITTER_DIVISOR;
+    if (spread == 0) return interval_ms_;
+    return interval_ms_ - spread + esp_random() % (2 * spread + 1);
+}
+
+uint32_t RealHeartbeatManager::backoff_ms() const
+{
+    // Uniform in [BASE, BASE << missed), never later than the regular interval
+    uint32_t window = HEARTBEAT_BACKOFF_BASE_MS << missed_;
+    return std::min(HEARTBEAT_BACKOFF_BASE_MS + esp_random() % window, interval_ms_);
+}
+
+void RealHeartbeatManager::schedule(uint32_t delay_ms)
+{
+    if (timer_ == nullptr) return;
+    xTimerChangePeriod(timer_, std::max<TickType_t>(pdMS_TO_TICKS(delay_ms), 1), 0);
+}
+
+void RealHeartbeatManager::notify_link_activity(NodeId peer_id)
+{
+    // Heartbeats are only needed on idle links: restart the interval
+    if (timer_ == nullptr || peer_id != ReservedIds::HUB) return;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    awaiting_response_ = false;
+    missed_            = 0;
+    if (in_wake_mode())
+    {
+        // The hub is sending: keep listening, the next heartbeat waits for the next slot
+        schedule(next_wake_delay_ms());
+        if (listening_) listen_for(WAKE_LISTEN_MS);
+    }
+    else
+    {
+        schedule(jittered_interval_ms());
+    }
+    xSemaphoreGive(mutex_);
+}
+
+void RealHeartbeatManager::handle_response(NodeId hub_id, uint8_t channel, uint32_t next_heartbeat_ms)
 {
     ESP_LOGI(TAG, "Heartbeat response received from Hub. Wifi Channel: %d", channel);
+    if (timer_ == nullptr) return;
+
+    // The hub's slot hint spreads its nodes evenly over the interval; without one, jitter
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    awaiting_response_ = false;
+    missed_            = 0;
+    if (in_wake_mode())
+    {
+        // Stay up for whatever the hub held for this node, then sleep until the next slot
+        schedule(next_wake_delay_ms());
+        listen_for(downlink_pending_ > 0 ? WAKE_PENDING_LISTEN_MS : WAKE_LISTEN_MS);
+    }
+    else
+    {
+        bool hint_valid = next_heartbeat_ms > 0 && next_heartbeat_ms <= 2 * interval_ms_;
+        schedule(hint_valid ? next_heartbeat_ms : jittered_interval_ms());
+    }
+    xSemaphoreGive(mutex_);
+}
+
+void RealHeartbeatManager::handle_wake_slot(uint32_t period_ms, uint32_t offset_ms)
+{
+    if (listen_timer_ == nullptr) return;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    slot_period_ms_ = period_ms;
+    slot_offset_ms_ = period_ms > 0 ? offset_ms % period_ms : 0;
+    if (period_ms == 0)
+    {
+        xTimerStop(listen_timer_, 0);
+        set_listening(true);
+    }
+    xSemaphoreGive(mutex_);
 }
 
-void RealHeartbeatManager::handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms)
+bool RealHeartbeatManager::in_wake_mode() const
+{
+    return listen_timer_ != nullptr && slot_period_ms_ > 0 && time_sync_.synchronized();
+}
+
+uint32_t RealHeartbeatManager::next_wake_delay_ms() const
+{
+    // Next slot start on the network clock, woken WAKE_GUARD_MS early for clock error
+    uint64_t now_ms     = esp_timer_get_time() / 1000;
+    uint64_t network_ms = time_sync_.to_hub_time(now_ms) + WAKE_GUARD_MS;
+    uint64_t slot_ms    = network_ms - network_ms % slot_period_ms_ + slot_offset_ms_;
+    if (slot_ms <= network_ms) slot_ms += slot_period_ms_;
+
+    uint64_t wake_ms = time_sync_.to_local_time(slot_ms) - WAKE_GUARD_MS;
+    return wake_ms > now_ms ? static_cast<uint32_t>(wake_ms - now_ms) : 1;
+}
+
+void RealHeartbeatManager::set_listening(bool listening)
+{
+    if (listening_ == listening) return;
+    if (wifi_hal_.set_listening(listening) == ESP_OK) listening_ = listening;
+}
+
+void RealHeartbeatManager::listen_for(uint32_t window_ms)
+{
+    set_listening(true);
+    xTimerChangePeriod(listen_timer_, std::max<TickType_t>(pdMS_TO_TICKS(window_ms), 1), 0);
+}
+
+uint32_t RealHeartbeatManager::wake_slot_offset_ms(NodeId sender_id)
+{
+    // Same ranking as slot_hint_ms(), among the nodes that sleep
+    uint32_t rank  = 0;
+    uint32_t count = 0;
+    peer_mgr_.for_each([&](const PeerInfo &peer) {
+        if (!(peer.capabilities & PeerCapability::WAKE_SLOTS)) return;
+        count++;
+        if (peer.node_id < sender_id) rank++;
+    });
+    if (count == 0) return 0;
+    return static_cast<uint32_t>(static_cast<uint64_t>(wake_period_ms_) * rank / count);
+}
+
+uint32_t RealHeartbeatManager::slot_hint_ms(NodeId sender_id, uint64_t now_ms)
+{
+    // Nodes get equal slots of their interval, in node id order
+    uint32_t interval = 0;
+    uint32_t rank     = 0;
+    uint32_t count    = 0;
+    peer_mgr_.for_each([&](const PeerInfo &peer) {
+        if (peer.type == ReservedTypes::HUB) return;
+        count++;
+        if (peer.node_id < sender_id) rank++;
+        if (peer.node_id == sender_id) interval = peer.heartbeat_interval_ms;
+    });
+    if (interval == 0 || count == 0) return 0;
+
+    uint32_t slot_start = static_cast<uint32_t>(static_cast<uint64_t>(interval) * rank / count);
+    uint32_t phase      = static_cast<uint32_t>(now_ms % interval);
+    uint32_t delay      = (slot_start + interval - phase) % interval;
+    // Never ask for the next heartbeat much sooner than a regular one
+    if (delay < interval / 2) delay += interval;
+    return delay;
+}
+
+void RealHeartbeatManager::handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms)
 {
     uint64_t now_ms = esp_timer_get_time() / 1000;
     peer_mgr_.update_last_seen(sender_id, now_ms);
     ESP_LOGI(TAG, "Heartbeat received from Node ID %d.", (int)sender_id);
 
-    HeartbeatResponse response;
-    response.header.msg_type       = MessageType::HEARTBEAT_RESPONSE;
+    // Sleeping nodes need their timestamps and slot, and any node with held
+    // frames the pending count, none of which a beacon can carry
+    uint16_t caps = peer_mgr_.get_capabilities(mac);
+    if (beacon_timer_ != nullptr && (caps & PeerCapability::HEARTBEAT_BEACON) &&
+        !(caps & PeerCapability::WAKE_SLOTS) && tx_mgr_.held_count(mac) == 0)
+    {
+        queue_beacon_ack(sender_id);
+    }
+    else
+    {
+        send_response(sender_id, mac, uptime_ms, received_ms);
+    }
+}
+
+void RealHeartbeatManager::send_response(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms)
+{
+    uint64_t now_ms            = esp_timer_get_time() / 1000;
+    HeartbeatResponse response = {};
     response.header.sender_node_id = my_id_;
     response.header.sender_type    = my_type_;
     response.header.dest_node_id   = sender_id;
     response.header.sequence_number = 0;
     response.server_time_ms        = now_ms;
-    response.wifi_channel          = 1; // Needs real channel, but for now fixed
+    response.wifi_channel          = DEFAULT_WIFI_CHANNEL;
+    wifi_hal_.get_channel(&response.wifi_channel);
+    response.next_heartbeat_ms     = slot_hint_ms(sender_id, now_ms);
+    response.origin_time_ms        = uptime_ms;
+    response.receive_time_ms       = received_ms;
+    if (wake_period_ms_ > 0 && (peer_mgr_.get_capabilities(mac) & PeerCapability::WAKE_SLOTS))
+    {
+        response.wake_period_ms = wake_period_ms_;
+        response.wake_offset_ms = wake_slot_offset_ms(sender_id);
+    }
+    // Released by the router once this heartbeat has been handled
+    response.pending_frames = static_cast<uint8_t>(std::min<size_t>(tx_mgr_.held_count(mac), UINT8_MAX));
 
     TxPacket tx_packet;
     memcpy(tx_packet.dest_mac, mac, 6);
-    auto encoded = codec_.encode(response.header, &response.server_time_ms, sizeof(HeartbeatResponse) - sizeof(MessageHeader));
-    if (!encoded.empty())
+    tx_packet.len = encode_message(codec_, response, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len > 0)
     {
-        tx_packet.len = encoded.size();
-        memcpy(tx_packet.data, encoded.data(), tx_packet.len);
         tx_packet.requires_ack = false;
         tx_mgr_.queue_packet(tx_packet);
     }
 }
 
+void RealHeartbeatManager::queue_beacon_ack(NodeId sender_id)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    bool listed = std::find(beacon_acks_, beacon_acks_ + beacon_count_, sender_id) != beacon_acks_ + beacon_count_;
+    if (!listed)
+    {
+        beacon_acks_[beacon_count_++] = sender_id;
+        if (beacon_count_ == 1) xTimerReset(beacon_timer_, 0);
+    }
+    bool full = beacon_count_ == HEARTBEAT_BEACON_MAX_ACKS;
+    xSemaphoreGive(mutex_);
+
+    if (full)
+    {
+        xTimerStop(beacon_timer_, 0);
+        send_beacon();
+    }
+}
+
+void RealHeartbeatManager::send_beacon()
+{
+    HeartbeatBeacon beacon = {};
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    beacon.acked_count = beacon_count_;
+    memcpy(beacon.acked_ids, beacon_acks_, beacon_count_);
+    beacon_count_ = 0;
+    xSemaphoreGive(mutex_);
+    if (beacon.acked_count == 0) return;
+
+    beacon.header.sender_node_id = my_id_;
+    beacon.header.sender_type    = my_type_;
+    beacon.header.dest_node_id   = ReservedIds::BROADCAST;
+    beacon.server_time_ms        = esp_timer_get_time() / 1000;
+    beacon.wifi_channel          = DEFAULT_WIFI_CHANNEL;
+    wifi_hal_.get_channel(&beacon.wifi_channel);
+
+    // Only the used part of the id list goes on air
+    size_t len = offsetof(HeartbeatBeacon, acked_ids) + beacon.acked_count;
+    TxPacket tx_packet;
+    tx_packet.len = encode_message(codec_, beacon, tx_packet.data, sizeof(tx_packet.data), len);
+    if (tx_packet.len == 0) return;
+
+    const uint8_t broadcast_mac[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    memcpy(tx_packet.dest_mac, broadcast_mac, 6);
+    tx_packet.requires_ack = false;
+    tx_mgr_.queue_packet(tx_packet);
+}
+
+uint32_t RealHeartbeatManager::response_timeout_ms()
+{
+    // A hub that batches answers only sends them once its beacon window closes
+    uint8_t hub_mac[6];
+    if (peer_mgr_.find_mac(ReservedIds::HUB, hub_mac) &&
+        (peer_mgr_.get_capabilities(hub_mac) & PeerCapability::HEARTBEAT_BEACON))
+    {
+        return HEARTBEAT_BEACON_WINDOW_MS + HEARTBEAT_RESPONSE_TIMEOUT_MS;
+    }
+    return HEARTBEAT_RESPONSE_TIMEOUT_MS;
+}
+
+void RealHeartbeatManager::handle_time_sample(uint64_t origin_ms, uint64_t hub_receive_ms, uint64_t hub_send_ms,
+                                              uint64_t local_receive_ms)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    // A late answer to an earlier attempt would pair the wrong send time
+    if (my_type_ != ReservedTypes::HUB && origin_ms != 0 && origin_ms == last_sent_ms_)
+    {
+        bool was_synchronized = time_sync_.synchronized();
+        if (time_sync_.add_sample(origin_ms, hub_receive_ms, hub_send_ms, local_receive_ms) && !was_synchronized)
+        {
+            ESP_LOGI(TAG, "Clock synchronized to hub, offset %lld ms.", (long long)(time_sync_.offset_us(local_receive_ms) / 1000));
+        }
+        last_sent_ms_ = 0;
+    }
+    xSemaphoreGive(mutex_);
+}
+
+bool RealHeartbeatManager::to_network_time(uint64_t local_ms, uint64_t &network_ms)
+{
+    if (my_type_ == ReservedTypes::HUB)
+    {
+        network_ms = local_ms;
+        return true;
+    }
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    bool synchronized = time_sync_.synchronized();
+    if (synchronized) network_ms = time_sync_.to_hub_time(local_ms);
+    xSemaphoreGive(mutex_);
+    return synchronized;
+}
+
+bool RealHeartbeatManager::to_local_time(uint64_t network_ms, uint64_t &local_ms)
+{
+    if (my_type_ == ReservedTypes::HUB)
+    {
+        local_ms = network_ms;
+        return true;
+    }
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    bool synchronized = time_sync_.synchronized();
+    if (synchronized) local_ms = time_sync_.to_local_time(network_ms);
+    xSemaphoreGive(mutex_);
+    return synchronized;
+}
+
 void RealHeartbeatManager::send_heartbeat()
 {
     TxPacket tx_packet;
@@ -89,25 +408,82 @@ void RealHeartbeatManager::send_heartbeat()
         memcpy(tx_packet.dest_mac, broadcast_mac, 6);
     }
 
-    HeartbeatMessage heartbeat;
-    heartbeat.header.msg_type       = MessageType::HEARTBEAT;
+    HeartbeatMessage heartbeat = {};
     heartbeat.header.sender_node_id = my_id_;
     heartbeat.header.sender_type    = my_type_;
     heartbeat.header.dest_node_id   = ReservedIds::HUB;
     heartbeat.header.sequence_number = 0;
     heartbeat.uptime_ms             = esp_timer_get_time() / 1000;
 
-    auto encoded = codec_.encode(heartbeat.header, &heartbeat.battery_mv, sizeof(HeartbeatMessage) - sizeof(MessageHeader));
-    if (!encoded.empty())
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    last_sent_ms_ = heartbeat.uptime_ms;
+    xSemaphoreGive(mutex_);
+
+    tx_packet.len = encode_message(codec_, heartbeat, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len > 0)
     {
-        tx_packet.len = encoded.size();
-        memcpy(tx_packet.data, encoded.data(), tx_packet.len);
         tx_packet.requires_ack = false;
         tx_mgr_.queue_packet(tx_packet);
     }
 }
 
+void RealHeartbeatManager::on_timer()
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    if (awaiting_response_)
+    {
+        // No answer within HEARTBEAT_RESPONSE_TIMEOUT_MS: most likely a collision
+        missed_++;
+        awaiting_response_ = false;
+        if (missed_ <= HEARTBEAT_MAX_RETRIES)
+        {
+            schedule(backoff_ms());
+        }
+        else
+        {
+            ESP_LOGW(TAG, "No heartbeat response after %d retries.", HEARTBEAT_MAX_RETRIES);
+            missed_ = 0;
+            if (in_wake_mode())
+            {
+                schedule(next_wake_delay_ms());
+                set_listening(false);
+            }
+            else
+            {
+                schedule(jittered_interval_ms());
+            }
+        }
+        xSemaphoreGive(mutex_);
+        return;
+    }
+
+    awaiting_response_ = true;
+    schedule(response_timeout_ms());
+    if (listen_timer_ != nullptr)
+    {
+        // Awake for the answer; the listen window only starts once it arrives
+        xTimerStop(listen_timer_, 0);
+        set_listening(true);
+    }
+    xSemaphoreGive(mutex_);
+
+    send_heartbeat();
+}
+
 void RealHeartbeatManager::timer_cb(TimerHandle_t xTimer)
 {
-    static_cast<RealHeartbeatManager *>(pvTimerGetTimerID(xTimer))->send_heartbeat();
+    static_cast<RealHeartbeatManager *>(pvTimerGetTimerID(xTimer))->on_timer();
+}
+
+void RealHeartbeatManager::listen_timer_cb(TimerHandle_t xTimer)
+{
+    auto *self = static_cast<RealHeartbeatManager *>(pvTimerGetTimerID(xTimer));
+    xSemaphoreTake(self->mutex_, portMAX_DELAY);
+    if (self->in_wake_mode() && !self->awaiting_response_) self->set_listening(false);
+    xSemaphoreGive(self->mutex_);
+}
+
+void RealHeartbeatManager::beacon_timer_cb(TimerHandle_t xTimer)
+{
+    static_cast<RealHeartbeatManager *>(pvTimerGetTimerID(xTimer))->send_beacon();
 }
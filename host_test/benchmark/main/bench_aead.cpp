@@ -0,0 +1,108 @@
+#include "benchmarks.hpp"
+#include "frame_cipher.hpp"
+#include "message_codec.hpp"
+#include "protocol_messages.hpp"
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+constexpr uint32_t ITERATIONS  = 20000;
+constexpr size_t FRAME_SIZES[] = {16, 64, 128, ESP_NOW_MAX_DATA_LEN - SecureEnvelope::OVERHEAD};
+const uint8_t NODE_MAC[6]      = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x0A};
+const uint8_t HUB_MAC[6]       = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x01};
+const uint8_t SESSION_KEY[16]  = {0x10, 0x32, 0x54, 0x76, 0x98, 0xBA, 0xDC, 0xFE,
+                                  0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF};
+
+volatile size_t sink;
+
+void bench_envelope()
+{
+    FrameCipher node;
+    FrameCipher hub;
+    node.set_local_mac(NODE_MAC);
+    hub.set_local_mac(HUB_MAC);
+    node.install_key(HUB_MAC, SESSION_KEY);
+    hub.install_key(NODE_MAC, SESSION_KEY);
+
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    uint8_t envelope[ESP_NOW_MAX_DATA_LEN];
+    uint8_t opened[ESP_NOW_MAX_DATA_LEN];
+    for (size_t i = 0; i < sizeof(frame); i++) frame[i] = static_cast<uint8_t>(i * 7);
+
+    printf("\n%8s %12s %12s %10s\n", "bytes", "seal ns", "open ns", "MB/s");
+    for (size_t size : FRAME_SIZES) {
+        double seal_ns = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+            sink = node.seal(HUB_MAC, frame, size, envelope, sizeof(envelope));
+        });
+
+        // Every open needs a fresh counter, so seal outside the timed region
+        static uint8_t sealed[ITERATIONS / 10][ESP_NOW_MAX_DATA_LEN];
+        constexpr uint32_t OPEN_BATCH = ITERATIONS / 10;
+        size_t sealed_len             = 0;
+        for (uint32_t i = 0; i < OPEN_BATCH; i++) {
+            sealed_len = node.seal(HUB_MAC, frame, size, sealed[i], sizeof(sealed[i]));
+        }
+        double open_ns = bench_ns_per_op(OPEN_BATCH, [&](uint32_t i) {
+            sink = hub.open(NODE_MAC, sealed[i], sealed_len, opened, sizeof(opened));
+        });
+
+        printf("%8zu %12.1f %12.1f %10.2f\n", size, seal_ns, open_ns, size * 1000.0 / seal_ns);
+    }
+}
+
+// Full wire path with and without a session key, to see the per-frame cost
+void bench_secure_wire()
+{
+    RealMessageCodec plain;
+    RealMessageCodec node;
+    RealMessageCodec hub;
+    node.set_local_mac(NODE_MAC);
+    hub.set_local_mac(HUB_MAC);
+    node.install_session_key(HUB_MAC, SESSION_KEY);
+    hub.install_session_key(NODE_MAC, SESSION_KEY);
+
+    MessageHeader header   = {};
+    header.msg_type        = MessageType::DATA;
+    header.sequence_number = 1;
+    header.payload_type    = 0x01;
+
+    uint8_t payload[64];
+    for (size_t i = 0; i < sizeof(payload); i++) payload[i] = static_cast<uint8_t>(i);
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t frame_len = plain.encode(header, payload, sizeof(payload), frame, sizeof(frame));
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    const uint16_t caps = PeerCapability::COMPACT_HEADER;
+
+    size_t plain_len   = 0;
+    double plain_enc   = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+        plain_len = plain.encode_wire(HUB_MAC, frame, frame_len, caps, false, wire, sizeof(wire));
+    });
+    double plain_dec   = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+        sink = plain.decode_wire(NODE_MAC, wire, plain_len, canonical, sizeof(canonical));
+    });
+    size_t secure_len  = 0;
+    double secure_enc  = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+        secure_len = node.encode_wire(HUB_MAC, frame, frame_len, caps, false, wire, sizeof(wire));
+    });
+    // Only the last envelope is fresh; decode it once per iteration after re-sealing
+    double secure_dec = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+        secure_len = node.encode_wire(HUB_MAC, frame, frame_len, caps, false, wire, sizeof(wire));
+        sink       = hub.decode_wire(NODE_MAC, wire, secure_len, canonical, sizeof(canonical));
+    }) - secure_enc;
+
+    printf("\n%-8s %8s %12s %12s\n", "path", "wire", "encode ns", "decode ns");
+    printf("%-8s %8zu %12.1f %12.1f\n", "plain", plain_len, plain_enc, plain_dec);
+    printf("%-8s %8zu %12.1f %12.1f\n", "aead", secure_len, secure_enc, secure_dec);
+}
+
+} // namespace
+
+void bench_aead()
+{
+    printf("\n== AES-128-CCM envelope ==\n");
+    bench_envelope();
+    bench_secure_wire();
+}
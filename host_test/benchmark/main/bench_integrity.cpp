@@ -0,0 +1,87 @@
+#include "benchmarks.hpp"
+#include "integrity_check.hpp"
+#include "message_codec.hpp"
+#include "protocol_messages.hpp"
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+constexpr uint32_t ITERATIONS   = 200000;
+constexpr size_t FRAME_SIZES[]  = {16, 64, 128, ESP_NOW_MAX_DATA_LEN - 4};
+const uint8_t PEER_MAC[6]       = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x01};
+
+struct Variant
+{
+    const char *name;
+    IntegrityCheck::Type type;
+    uint16_t caps;
+};
+
+const Variant VARIANTS[] = {
+    {"crc8", IntegrityCheck::Type::CRC8, PeerCapability::COMPACT_HEADER},
+    {"crc16", IntegrityCheck::Type::CRC16, PeerCapability::COMPACT_HEADER | PeerCapability::CRC16},
+    {"crc32", IntegrityCheck::Type::CRC32, PeerCapability::COMPACT_HEADER | PeerCapability::CRC32},
+};
+
+volatile uint32_t sink;
+
+void bench_trailers()
+{
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    for (size_t i = 0; i < sizeof(frame); i++) frame[i] = static_cast<uint8_t>(i * 31);
+
+    printf("\n%-8s %8s %12s %12s\n", "check", "bytes", "append ns", "verify ns");
+    for (const auto &variant : VARIANTS) {
+        for (size_t size : FRAME_SIZES) {
+            double append_ns = bench_ns_per_op(ITERATIONS, [&](uint32_t i) {
+                frame[0] = static_cast<uint8_t>(i);
+                sink     = IntegrityCheck::append(variant.type, frame, size, sizeof(frame));
+            });
+            size_t total     = IntegrityCheck::append(variant.type, frame, size, sizeof(frame));
+            double verify_ns = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+                sink = IntegrityCheck::verify(variant.type, frame, total);
+            });
+            printf("%-8s %8zu %12.1f %12.1f\n", variant.name, size, append_ns, verify_ns);
+        }
+    }
+}
+
+// Full wire path, so the trailer cost can be seen against the rest of the codec
+void bench_wire_round_trip()
+{
+    RealMessageCodec codec;
+    MessageHeader header   = {};
+    header.msg_type        = MessageType::DATA;
+    header.sequence_number = 1;
+    header.payload_type    = 0x01;
+
+    uint8_t payload[MAX_PAYLOAD_SIZE];
+    for (size_t i = 0; i < sizeof(payload); i++) payload[i] = static_cast<uint8_t>(i);
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t frame_len = codec.encode(header, payload, sizeof(payload), frame, sizeof(frame));
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+
+    printf("\n%-8s %8s %12s %12s\n", "check", "wire", "encode ns", "decode ns");
+    for (const auto &variant : VARIANTS) {
+        size_t wire_len  = 0;
+        double encode_ns = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+            wire_len = codec.encode_wire(PEER_MAC, frame, frame_len, variant.caps, false, wire, sizeof(wire));
+        });
+        double decode_ns = bench_ns_per_op(ITERATIONS, [&](uint32_t) {
+            sink = codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical));
+        });
+        printf("%-8s %8zu %12.1f %12.1f\n", variant.name, wire_len, encode_ns, decode_ns);
+    }
+}
+
+} // namespace
+
+void bench_integrity()
+{
+    printf("\n== Integrity checks ==\n");
+    bench_trailers();
+    bench_wire_round_trip();
+}
@@ -0,0 +1,285 @@
+#include "alloc_tracker.hpp"
+#include "benchmarks.hpp"
+#include "espnow_stats.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sim_node.hpp"
+#include "tx_manager.hpp"
+#include "tx_state_machine.hpp"
+extern "C" {
+#include "Mockesp_now.h"
+}
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+namespace {
+
+constexpr NodeType SENSOR_TYPE      = 0x02;
+constexpr uint32_t TX_STACK_SIZE    = 4096;
+constexpr UBaseType_t TX_PRIORITY   = 5;
+constexpr int64_t SCENARIO_LIMIT_US = 30000000;
+constexpr uint16_t AGREED_CAPS      = SIM_CAPABILITIES & ~PeerCapability::AEAD;
+const uint8_t HUB_MAC[6]            = {0x24, 0x0A, 0xC4, 0x00, 0x00, ReservedIds::HUB};
+
+struct Scenario
+{
+    const char *name;
+    size_t senders;
+    uint32_t frames_per_sender;
+    uint8_t loss_pct; // Each way
+    bool requires_ack;
+};
+
+const Scenario SCENARIOS[] = {
+    {"single_peer_stream", 1, 500, 0, true},
+    {"single_peer_unacked", 1, 500, 0, false},
+    {"fan_in_19", MAX_PEERS, 50, 0, true},
+    {"lossy_link", 1, 200, 20, true},
+};
+
+constexpr size_t PAYLOAD_LEN = 64;
+
+// A node with the production TX path: RealTxManager's own task sends over the medium
+struct Sender
+{
+    Sender(SimMedium &medium, const uint8_t *mac, NodeId id, uint32_t frames)
+        : id(id)
+        , station(medium.attach(mac, 1, [this](const RxPacket &packet) { receive(packet); }))
+        , hal(medium, station)
+        , codec(SIM_CAPABILITIES)
+        , peers(storage)
+        , scanner(hal, codec, id, SENSOR_TYPE)
+        , tx(fsm, scanner, hal, codec, peers)
+        , heartbeat(tx, peers, codec, hal, id)
+        , pairing(tx, peers, codec, hal)
+        , router(peers, tx, heartbeat, pairing, codec)
+        , sent_us(frames, 0)
+        , done_us(frames, 0)
+    {
+        hal.peer_table = &peers;
+        router.set_node_info(id, SENSOR_TYPE);
+    }
+
+    const NodeId id;
+    const size_t station;
+    MockStorage storage;
+    SimWiFiHAL hal;
+    RealMessageCodec codec;
+    RealPeerManager peers;
+    RealTxStateMachine fsm;
+    RealChannelScanner scanner;
+    RealTxManager tx;
+    RealHeartbeatManager heartbeat;
+    RealPairingManager pairing;
+    RealMessageRouter router;
+
+    // Indexed by sequence number: the TX task numbers this node's frames in queue order
+    std::vector<int64_t> sent_us;
+    std::vector<int64_t> done_us; // ACK, or hub delivery for unacknowledged frames; 0 until then
+    std::atomic<uint32_t> done{0};
+
+    void complete(uint16_t sequence)
+    {
+        if (sequence >= done_us.size() || done_us[sequence] != 0) return;
+        done_us[sequence] = esp_timer_get_time();
+        done.fetch_add(1, std::memory_order_release);
+    }
+
+    void receive(const RxPacket &wire)
+    {
+        RxPacket packet;
+        packet.len = codec.decode_wire(wire.src_mac, wire.data, wire.len, packet.data, sizeof(packet.data));
+        if (packet.len == 0) return;
+        memcpy(packet.src_mac, wire.src_mac, 6);
+        packet.rssi         = wire.rssi;
+        packet.timestamp_us = wire.timestamp_us;
+
+        auto header = reinterpret_cast<const MessageHeader *>(packet.data);
+        if (header->msg_type == MessageType::ACK) {
+            complete(reinterpret_cast<const AckMessage *>(packet.data)->ack_sequence);
+        }
+        router.handle_packet(packet);
+    }
+};
+
+struct Result
+{
+    uint32_t frames;
+    uint32_t completed;
+    double elapsed_s;
+    int64_t p50_us;
+    int64_t p99_us;
+    double cpu_us_per_frame;
+    double allocs_per_frame;
+    uint32_t tx_queue_peak;
+    uint32_t air_peak_in_flight;
+    EspNowStats stats;
+};
+
+int64_t cpu_time_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t percentile(std::vector<int64_t> &sorted, uint32_t pct)
+{
+    if (sorted.empty()) return 0;
+    return sorted[(sorted.size() - 1) * pct / 100];
+}
+
+// Delivers frames as their arrival time passes
+struct Air
+{
+    SimMedium &medium;
+    std::atomic<bool> running{true};
+    std::atomic<bool> stopped{false};
+
+    static void task(void *arg)
+    {
+        auto *self = static_cast<Air *>(arg);
+        while (self->running.load()) {
+            self->medium.run_due();
+            vTaskDelay(1);
+        }
+        self->stopped.store(true);
+        vTaskDelete(NULL);
+    }
+};
+
+Result run(const Scenario &scenario)
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_mod_peer_IgnoreAndReturn(ESP_OK);
+
+    SimMedium medium(1, esp_timer_get_time);
+    SimLink link;
+    link.loss_pct   = scenario.loss_pct;
+    link.latency_us = 500;
+    link.jitter_us  = 500;
+    medium.set_default_link(link);
+
+    SimNode hub(medium, HUB_MAC, ReservedIds::HUB, ReservedTypes::HUB, 1);
+    hub.auto_ack = scenario.requires_ack;
+
+    std::vector<std::unique_ptr<Sender>> senders;
+    uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x00};
+    for (size_t i = 0; i < scenario.senders; i++) {
+        mac[5] = static_cast<uint8_t>(2 + i);
+        senders.push_back(std::make_unique<Sender>(medium, mac, mac[5], scenario.frames_per_sender));
+        Sender &sender = *senders.back();
+        hub.peers.add(sender.id, mac, 1, SENSOR_TYPE);
+        hub.peers.set_capabilities(sender.id, AGREED_CAPS);
+        sender.peers.add(ReservedIds::HUB, HUB_MAC, 1, ReservedTypes::HUB);
+        sender.peers.set_capabilities(ReservedIds::HUB, AGREED_CAPS);
+        sender.tx.init(TX_STACK_SIZE, TX_PRIORITY);
+    }
+
+    // Without ACKs a frame is done once the hub has it
+    hub.on_frame = [&](const RxPacket &packet) {
+        auto header = reinterpret_cast<const MessageHeader *>(packet.data);
+        if (scenario.requires_ack || header->msg_type != MessageType::DATA) return;
+        size_t index = header->sender_node_id - 2;
+        if (index < senders.size()) senders[index]->complete(header->sequence_number);
+    };
+
+    Air air{medium};
+    xTaskCreate(Air::task, "sim_air", 4096, &air, TX_PRIORITY + 1, nullptr);
+
+    const uint32_t total = scenario.senders * scenario.frames_per_sender;
+    uint8_t payload[PAYLOAD_LEN];
+    Stats::reset();
+    // The medium carries frames without allocating, so what is counted is the
+    // components' own: the senders' TX path and the hub's RX and ACK path
+    uint64_t allocs_before = AllocTracker::allocations();
+    int64_t cpu_before     = cpu_time_us();
+    int64_t start_us       = esp_timer_get_time();
+
+    for (uint32_t f = 0; f < scenario.frames_per_sender; f++) {
+        for (auto &sender : senders) {
+            MessageHeader header  = {};
+            header.msg_type       = MessageType::DATA;
+            header.sender_type    = SENSOR_TYPE;
+            header.sender_node_id = sender->id;
+            header.payload_type   = 0x01;
+            header.requires_ack   = scenario.requires_ack;
+            header.dest_node_id   = ReservedIds::HUB;
+            memset(payload, static_cast<int>(f), sizeof(payload));
+            TxPacket packet;
+            memcpy(packet.dest_mac, HUB_MAC, 6);
+            packet.len          = sender->codec.encode(header, payload, sizeof(payload), packet.data, sizeof(packet.data));
+            packet.requires_ack = scenario.requires_ack;
+            sender->sent_us[f]  = esp_timer_get_time();
+            // A full queue blocks for 100 ms; keep offering the frame
+            while (sender->tx.queue_packet(packet) == ESP_ERR_TIMEOUT) {
+            }
+        }
+    }
+
+    auto finished = [&] {
+        uint32_t completed = 0;
+        for (auto &sender : senders) completed += sender->done.load(std::memory_order_acquire);
+        return completed + Stats::snapshot().tx_max_retry_drops;
+    };
+    while (finished() < total && esp_timer_get_time() - start_us < SCENARIO_LIMIT_US) vTaskDelay(1);
+
+    Result result         = {};
+    result.cpu_us_per_frame = static_cast<double>(cpu_time_us() - cpu_before) / total;
+    result.allocs_per_frame = static_cast<double>(AllocTracker::allocations() - allocs_before) / total;
+    result.stats          = Stats::snapshot();
+
+    air.running.store(false);
+    while (!air.stopped.load()) vTaskDelay(1);
+    for (auto &sender : senders) sender->tx.deinit();
+
+    std::vector<int64_t> latencies;
+    int64_t end_us = start_us;
+    for (auto &sender : senders) {
+        for (uint32_t f = 0; f < scenario.frames_per_sender; f++) {
+            if (sender->done_us[f] == 0) continue;
+            latencies.push_back(sender->done_us[f] - sender->sent_us[f]);
+            end_us = std::max(end_us, sender->done_us[f]);
+        }
+        result.tx_queue_peak = std::max(result.tx_queue_peak, sender->tx.queue_high_water());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    result.frames             = total;
+    result.completed          = latencies.size();
+    result.elapsed_s          = static_cast<double>(end_us - start_us) / 1e6;
+    result.p50_us             = percentile(latencies, 50);
+    result.p99_us             = percentile(latencies, 99);
+    result.air_peak_in_flight = medium.stats().peak_in_flight;
+    return result;
+}
+
+} // namespace
+
+void bench_link()
+{
+    printf("\n== Links over the simulated medium ==\n");
+    printf("%-20s %6s %10s %10s %10s %10s %8s %7s %8s\n", "scenario", "done", "msgs/s", "p50 us", "p99 us",
+           "cpu us/f", "allocs/f", "txq pk", "retries");
+    for (const auto &scenario : SCENARIOS) {
+        Result r      = run(scenario);
+        double rate   = r.elapsed_s > 0 ? r.completed / r.elapsed_s : 0;
+        printf("%-20s %6u %10.0f %10lld %10lld %10.1f %8.1f %7u %8u\n", scenario.name, (unsigned)r.completed, rate,
+               (long long)r.p50_us, (long long)r.p99_us, r.cpu_us_per_frame, r.allocs_per_frame,
+               (unsigned)r.tx_queue_peak, (unsigned)r.stats.tx_retries);
+        printf("BENCH_JSON {\"bench\":\"link\",\"scenario\":\"%s\",\"senders\":%u,\"frames\":%u,\"loss_pct\":%u,"
+               "\"acked\":%s,\"completed\":%u,\"msgs_per_s\":%.1f,\"latency_p50_us\":%lld,\"latency_p99_us\":%lld,"
+               "\"cpu_us_per_frame\":%.2f,\"allocs_per_frame\":%.2f,\"tx_queue_peak\":%u,\"air_peak_in_flight\":%u,"
+               "\"tx_sent\":%u,\"tx_retries\":%u,\"tx_drops\":%u}\n",
+               scenario.name, (unsigned)scenario.senders, (unsigned)r.frames, (unsigned)scenario.loss_pct,
+               scenario.requires_ack ? "true" : "false", (unsigned)r.completed, rate, (long long)r.p50_us,
+               (long long)r.p99_us, r.cpu_us_per_frame, r.allocs_per_frame, (unsigned)r.tx_queue_peak,
+               (unsigned)r.air_peak_in_flight, (unsigned)r.stats.tx_sent, (unsigned)r.stats.tx_retries,
+               (unsigned)r.stats.tx_max_retry_drops);
+    }
+}
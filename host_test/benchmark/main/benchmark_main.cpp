@@ -0,0 +1,13 @@
+#include "benchmarks.hpp"
+#include "esp_system.h"
+#include <cstdio>
+
+extern "C" void app_main(void)
+{
+    printf("EspNow host benchmarks (host timings are only comparable with each other)\n");
+    printf("Lines starting with BENCH_JSON hold one JSON object per scenario, for tracking regressions\n");
+    bench_integrity();
+    bench_aead();
+    bench_link();
+    esp_restart();
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "esp_timer.h"
+#include <cstdint>
+
+// Runs fn `iterations` times and returns the mean cost in nanoseconds.
+template <typename Fn> double bench_ns_per_op(uint32_t iterations, Fn &&fn)
+{
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < iterations; i++) {
+        fn(i);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    return static_cast<double>(elapsed_us) * 1000.0 / iterations;
+}
+
+void bench_integrity();
+void bench_aead();
+void bench_link();
@@ -0,0 +1,188 @@
+#include "channel_scanner.hpp"
+#include "message_codec.hpp"
+#include "mock_storage.hpp"
+#include "mock_wifi_hal.hpp"
+#include "unity.h"
+#include <vector>
+
+static constexpr NodeId TEST_NODE_ID     = 10;
+static constexpr NodeType TEST_NODE_TYPE = 2;
+
+// Steps a scan the way the TX task does, without waiting out the dwells
+struct ScanDriver
+{
+    IChannelScanner::ScanResult result = {};
+    int completions                    = 0;
+    std::vector<uint32_t> dwells;
+
+    static void on_done(const IChannelScanner::ScanResult &r, void *ctx)
+    {
+        auto self    = static_cast<ScanDriver *>(ctx);
+        self->result = r;
+        self->completions++;
+    }
+
+    IChannelScanner::ScanResult run(RealChannelScanner &scanner, MockWiFiHAL &hal, uint8_t start_channel)
+    {
+        dwells.clear();
+        uint32_t dwell = scanner.start(start_channel, on_done, this);
+        while (dwell > 0) {
+            dwells.push_back(dwell);
+            if (hal.take_response()) {
+                scanner.on_hub_found();
+                break;
+            }
+            dwell = scanner.on_dwell_elapsed();
+        }
+        return result;
+    }
+};
+
+TEST_CASE("ChannelScanner stops at the first hub response", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE);
+    ScanDriver driver;
+
+    hal.hub_channel = 7;
+    auto result     = driver.run(scanner, hal, 7);
+
+    TEST_ASSERT_EQUAL(1, driver.completions);
+    TEST_ASSERT_FALSE(scanner.is_scanning());
+    TEST_ASSERT_TRUE(result.hub_found);
+    TEST_ASSERT_EQUAL(7, result.channel);
+    TEST_ASSERT_EQUAL(1, result.probes);
+    TEST_ASSERT_EQUAL(1, hal.probed_channels.size());
+}
+
+TEST_CASE("ChannelScanner tries neighbours and common channels first", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE);
+    ScanDriver driver;
+
+    hal.hub_channel = 0; // Nobody answers
+    auto result     = driver.run(scanner, hal, 4);
+
+    TEST_ASSERT_EQUAL(1, driver.completions);
+    TEST_ASSERT_FALSE(result.hub_found);
+    TEST_ASSERT_EQUAL(4, result.channel);
+    TEST_ASSERT_EQUAL(SCAN_MAX_CHANNEL * SCAN_CHANNEL_ATTEMPTS, result.probes);
+
+    const uint8_t expected[] = {4, 3, 5, 1, 6, 11, 2, 7, 8, 9, 10, 12, 13};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, hal.probed_channels.data(), sizeof(expected));
+}
+
+TEST_CASE("ChannelScanner remembers where the hub was found", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE);
+    ScanDriver driver;
+
+    hal.hub_channel = 9;
+    TEST_ASSERT_TRUE(driver.run(scanner, hal, 1).hub_found);
+
+    // Lost again from a different channel: the last hub channel comes right after it
+    hal.probed_channels.clear();
+    hal.hub_channel = 0;
+    driver.run(scanner, hal, 3);
+    TEST_ASSERT_EQUAL(3, hal.probed_channels[0]);
+    TEST_ASSERT_EQUAL(9, hal.probed_channels[1]);
+}
+
+TEST_CASE("ChannelScanner persists recent hub channels as hints", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    MockStorage storage;
+    ScanDriver driver;
+
+    {
+        RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE, &storage);
+        hal.hub_channel = 11;
+        TEST_ASSERT_TRUE(driver.run(scanner, hal, 1).hub_found);
+        scanner.record_hub_channel(6); // e.g. from a hub channel announcement
+        scanner.record_hub_channel(6); // Unchanged: not saved again
+    }
+    const uint8_t expected_hints[CHANNEL_HINT_COUNT] = {6, 11, 0, 0};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected_hints, storage.channel_hints, CHANNEL_HINT_COUNT);
+    TEST_ASSERT_EQUAL(2, storage.hint_save_count);
+
+    // After a reboot the hub moved to the last announced channel: the second probe finds it
+    RealChannelScanner rebooted(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE, &storage);
+    hal.probed_channels.clear();
+    hal.hub_channel = 6;
+    auto result     = driver.run(rebooted, hal, 11);
+    TEST_ASSERT_TRUE(result.hub_found);
+    TEST_ASSERT_EQUAL(6, result.channel);
+    TEST_ASSERT_EQUAL(2, result.probes);
+}
+
+TEST_CASE("ChannelScanner shortens its dwell from measured latency", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE);
+    ScanDriver driver;
+
+    // Nothing measured yet: full timeout
+    TEST_ASSERT_EQUAL(SCAN_CHANNEL_TIMEOUT_MS, scanner.dwell_ms());
+
+    hal.hub_channel = 6;
+    TEST_ASSERT_TRUE(driver.run(scanner, hal, 6).hub_found);
+    TEST_ASSERT_LESS_THAN(SCAN_CHANNEL_TIMEOUT_MS, scanner.dwell_ms());
+    TEST_ASSERT_GREATER_OR_EQUAL(SCAN_MIN_DWELL_MS, scanner.dwell_ms());
+
+    // First pass uses the short dwell, the fallback pass the full timeout
+    hal.hub_channel = 0;
+    driver.run(scanner, hal, 6);
+    TEST_ASSERT_EQUAL(SCAN_MAX_CHANNEL * 2, driver.dwells.size());
+    TEST_ASSERT_EQUAL(scanner.dwell_ms(), driver.dwells.front());
+    TEST_ASSERT_EQUAL(SCAN_CHANNEL_TIMEOUT_MS, driver.dwells.back());
+}
+
+TEST_CASE("ChannelScanner honours a custom configuration", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    RealChannelScanner::Config config;
+    config.max_dwell_ms = 20;
+    config.passes       = 1;
+    RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE, nullptr, config);
+    ScanDriver driver;
+
+    auto result = driver.run(scanner, hal, 0); // Out of range: starts from channel 1
+    TEST_ASSERT_FALSE(result.hub_found);
+    TEST_ASSERT_EQUAL(1, result.channel);
+    TEST_ASSERT_EQUAL(SCAN_MAX_CHANNEL, result.probes);
+    TEST_ASSERT_EQUAL(20, driver.dwells.front());
+}
+
+TEST_CASE("ChannelScanner can be cancelled and ignores stray responses", "[channel_scanner]")
+{
+    MockWiFiHAL hal;
+    RealMessageCodec codec;
+    RealChannelScanner scanner(hal, codec, TEST_NODE_ID, TEST_NODE_TYPE);
+    ScanDriver driver;
+
+    scanner.on_hub_found(); // No scan running
+    TEST_ASSERT_EQUAL(0, driver.completions);
+
+    TEST_ASSERT_TRUE(scanner.start(1, ScanDriver::on_done, &driver) > 0);
+    TEST_ASSERT_TRUE(scanner.is_scanning());
+    scanner.cancel();
+    TEST_ASSERT_FALSE(scanner.is_scanning());
+    TEST_ASSERT_EQUAL(0, scanner.on_dwell_elapsed());
+    scanner.on_hub_found();
+    TEST_ASSERT_EQUAL(0, driver.completions);
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+}
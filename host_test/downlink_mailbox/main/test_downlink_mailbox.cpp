@@ -0,0 +1,109 @@
+#include "downlink_mailbox.hpp"
+#include "esp_system.h"
+#include "protocol_messages.hpp"
+#include "unity.h"
+#include <cstring>
+
+static const uint8_t MAC_A[6] = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x0A};
+static const uint8_t MAC_B[6] = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x0B};
+
+// Canonical frame with one payload byte used as a marker
+static TxPacket make_packet(const uint8_t *mac, uint8_t marker, MessageType type = MessageType::HEARTBEAT_RESPONSE,
+                            PayloadType payload_type = 0)
+{
+    TxPacket packet = {};
+    memcpy(packet.dest_mac, mac, 6);
+    MessageHeader header = {};
+    header.msg_type      = type;
+    header.payload_type  = payload_type;
+    memcpy(packet.data, &header, sizeof(header));
+    packet.data[sizeof(MessageHeader)] = marker;
+    packet.len                         = sizeof(MessageHeader) + 1 + CRC_SIZE;
+    return packet;
+}
+
+static uint8_t marker(const TxPacket &packet) { return packet.data[sizeof(MessageHeader)]; }
+
+TEST_CASE("Mailbox releases frames per peer in the order they were held", "[mailbox]")
+{
+    DownlinkMailbox mailbox;
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_A, 1), 0));
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_B, 2), 0));
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_A, 3), 0));
+    TEST_ASSERT_EQUAL(2, mailbox.pending(MAC_A, 0));
+    TEST_ASSERT_EQUAL(1, mailbox.pending(MAC_B, 0));
+
+    TxPacket packet;
+    TEST_ASSERT_TRUE(mailbox.take(MAC_A, packet, 0));
+    TEST_ASSERT_EQUAL(1, marker(packet));
+    TEST_ASSERT_TRUE(mailbox.take(MAC_A, packet, 0));
+    TEST_ASSERT_EQUAL(3, marker(packet));
+    TEST_ASSERT_FALSE(mailbox.take(MAC_A, packet, 0));
+    TEST_ASSERT_EQUAL(1, mailbox.pending(MAC_B, 0));
+}
+
+TEST_CASE("Mailbox bounds each peer's share and the total", "[mailbox]")
+{
+    DownlinkMailbox mailbox;
+    for (size_t i = 0; i < DownlinkMailbox::PEER_SLOTS; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_A, i), 0));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, mailbox.hold(make_packet(MAC_A, 0), 0));
+
+    // Other peers fill the rest
+    uint8_t mac[6] = {0x24, 0x6F, 0x28, 0x00, 0x01, 0x00};
+    for (size_t i = DownlinkMailbox::PEER_SLOTS; i < DownlinkMailbox::SLOTS; i++) {
+        mac[5] = i;
+        TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(mac, i), 0));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, mailbox.hold(make_packet(MAC_B, 0), 0));
+
+    // A slot freed by one peer can be used by another
+    TxPacket packet;
+    TEST_ASSERT_TRUE(mailbox.take(MAC_A, packet, 0));
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_B, 0), 0));
+
+    mailbox.clear();
+    TEST_ASSERT_EQUAL(0, mailbox.pending(MAC_A, 0));
+    TEST_ASSERT_EQUAL(0, mailbox.pending(MAC_B, 0));
+}
+
+TEST_CASE("Mailbox keeps only the latest value per payload type", "[mailbox]")
+{
+    DownlinkMailbox mailbox;
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_A, 1, MessageType::DATA, 7), 0));
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_A, 2, MessageType::COMMAND, 7), 0));
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_B, 3, MessageType::DATA, 7), 0));
+    TEST_ASSERT_EQUAL(ESP_OK, mailbox.hold(make_packet(MAC_A, 4, MessageType::DATA, 7), 10));
+    TEST_ASSERT_EQUAL(2, mailbox.pending(MAC_A, 10));
+
+    // The newer value takes the older one's turn
+    TxPacket packet;
+    TEST_ASSERT_TRUE(mailbox.take(MAC_A, packet, 10));
+    TEST_ASSERT_EQUAL(4, marker(packet));
+    TEST_ASSERT_TRUE(mailbox.take(MAC_A, packet, 10));
+    TEST_ASSERT_EQUAL(2, marker(packet));
+    TEST_ASSERT_EQUAL(1, mailbox.pending(MAC_B, 10));
+}
+
+TEST_CASE("Mailbox drops frames that waited longer than the TTL", "[mailbox]")
+{
+    DownlinkMailbox mailbox;
+    mailbox.hold(make_packet(MAC_A, 1), 1000);
+    mailbox.hold(make_packet(MAC_A, 2), 2000);
+
+    TEST_ASSERT_EQUAL(2, mailbox.pending(MAC_A, 1000 + DownlinkMailbox::TTL_MS - 1));
+    TEST_ASSERT_EQUAL(1, mailbox.expire(1000 + DownlinkMailbox::TTL_MS));
+
+    TxPacket packet;
+    TEST_ASSERT_TRUE(mailbox.take(MAC_A, packet, 1000 + DownlinkMailbox::TTL_MS));
+    TEST_ASSERT_EQUAL(2, marker(packet));
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
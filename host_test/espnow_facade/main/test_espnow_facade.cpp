@@ -26,3 +26,14 @@ TEST_CASE("EspNow can be instantiated with mocks", "[espnow]")
 
     TEST_ASSERT_TRUE(true);
 }
+
+TEST_CASE("EspNow registers message types before init", "[espnow]")
+{
+    auto cs = std::make_unique<MockChannelScanner>();
+    EspNow espnow(std::make_unique<MockPeerManager>(), std::make_unique<MockTxManager>(), cs.get(),
+                  std::make_unique<MockMessageCodec>(), std::make_unique<MockHeartbeatManager>(),
+                  std::make_unique<MockPairingManager>(), std::make_unique<MockMessageRouter>());
+
+    TEST_ASSERT_EQUAL(ESP_OK, espnow.register_message_type(static_cast<MessageType>(0x40), RouteContext::APP,
+                                                           nullptr, nullptr));
+}
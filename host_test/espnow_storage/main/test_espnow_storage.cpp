@@ -0,0 +1,133 @@
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "espnow_storage.hpp"
+#include "unity.h"
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+static const uint8_t PEER_MAC[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x02};
+
+// A blob store that, like NVS, only hands back a blob of the size asked for
+class MemoryBackend : public IPersistenceBackend
+{
+public:
+    explicit MemoryBackend(std::vector<uint8_t> &blob)
+        : blob_(blob)
+    {
+    }
+
+    inline esp_err_t load(void *data, size_t size) override
+    {
+        if (blob_.empty()) return ESP_ERR_NOT_FOUND;
+        if (blob_.size() != size) return ESP_ERR_INVALID_SIZE;
+        memcpy(data, blob_.data(), size);
+        return ESP_OK;
+    }
+    inline esp_err_t save(const void *data, size_t size) override
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        blob_.assign(bytes, bytes + size);
+        return ESP_OK;
+    }
+
+private:
+    std::vector<uint8_t> &blob_;
+};
+
+// What firmware storing version 1 wrote to NVS
+struct PersistentPeerV1
+{
+    uint8_t mac[6];
+    NodeType type;
+    NodeId node_id;
+    uint8_t channel;
+    bool paired;
+    uint32_t heartbeat_interval_ms;
+};
+
+struct PersistentDataV1
+{
+    uint32_t magic;
+    uint32_t version;
+    uint8_t wifi_channel;
+    uint8_t num_peers;
+    PersistentPeerV1 peers[PersistentData::MAX_PERSISTENT_PEERS];
+    uint32_t crc;
+};
+
+static std::vector<uint8_t> v1_blob(uint8_t wifi_channel)
+{
+    PersistentDataV1 v1 = {};
+    v1.magic            = PersistentData::MAGIC;
+    v1.version          = 1;
+    v1.wifi_channel     = wifi_channel;
+    v1.num_peers        = 1;
+    memcpy(v1.peers[0].mac, PEER_MAC, 6);
+    v1.peers[0].type                  = ReservedTypes::HUB;
+    v1.peers[0].node_id               = 3;
+    v1.peers[0].channel               = wifi_channel;
+    v1.peers[0].paired                = true;
+    v1.peers[0].heartbeat_interval_ms = 30000;
+    v1.crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&v1), offsetof(PersistentDataV1, crc));
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&v1);
+    return std::vector<uint8_t>(bytes, bytes + sizeof(v1));
+}
+
+static std::unique_ptr<EspNowStorage> storage_on(std::vector<uint8_t> &rtc, std::vector<uint8_t> &nvs)
+{
+    return std::make_unique<EspNowStorage>(std::make_unique<MemoryBackend>(rtc), std::make_unique<MemoryBackend>(nvs));
+}
+
+TEST_CASE("Storage migrates peers stored as version 1 in NVS", "[storage]")
+{
+    std::vector<uint8_t> rtc;
+    std::vector<uint8_t> nvs = v1_blob(6);
+
+    uint8_t wifi_channel = 0;
+    PersistentPeer peers[PersistentData::MAX_PERSISTENT_PEERS];
+    size_t count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, storage_on(rtc, nvs)->load(wifi_channel, peers, PersistentData::MAX_PERSISTENT_PEERS, count));
+    TEST_ASSERT_EQUAL(6, wifi_channel);
+    TEST_ASSERT_EQUAL(1, count);
+    TEST_ASSERT_EQUAL_MEMORY(PEER_MAC, peers[0].mac, 6);
+    TEST_ASSERT_EQUAL(ReservedTypes::HUB, peers[0].type);
+    TEST_ASSERT_EQUAL(3, peers[0].node_id);
+    TEST_ASSERT_TRUE(peers[0].paired);
+    TEST_ASSERT_EQUAL(30000, peers[0].heartbeat_interval_ms);
+    TEST_ASSERT_EQUAL(PeerCapability::NONE, peers[0].capabilities);
+    TEST_ASSERT_FALSE(peers[0].has_session_key);
+
+    // Rewritten in the current layout, so the next boot finds it without RTC
+    TEST_ASSERT_EQUAL(sizeof(PersistentData), nvs.size());
+    rtc.clear();
+    count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, storage_on(rtc, nvs)->load(wifi_channel, peers, PersistentData::MAX_PERSISTENT_PEERS, count));
+    TEST_ASSERT_EQUAL(1, count);
+    TEST_ASSERT_EQUAL_MEMORY(PEER_MAC, peers[0].mac, 6);
+}
+
+TEST_CASE("Storage does not migrate a corrupt version 1 blob", "[storage]")
+{
+    std::vector<uint8_t> rtc;
+    std::vector<uint8_t> nvs = v1_blob(6);
+    nvs[offsetof(PersistentDataV1, wifi_channel)] = 11;
+
+    uint8_t wifi_channel = 0;
+    PersistentPeer peers[PersistentData::MAX_PERSISTENT_PEERS];
+    size_t count = 0;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND,
+                      storage_on(rtc, nvs)->load(wifi_channel, peers, PersistentData::MAX_PERSISTENT_PEERS, count));
+    TEST_ASSERT_EQUAL(0, count);
+    TEST_ASSERT_EQUAL(sizeof(PersistentDataV1), nvs.size());
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
@@ -0,0 +1,205 @@
+#include "heartbeat_manager.hpp"
+#include "message_codec.hpp"
+#include "mock_peer_manager.hpp"
+#include "mock_tx_manager.hpp"
+#include "mock_wifi_hal.hpp"
+#include "protocol_messages.hpp"
+#include "unity.h"
+#include <cstring>
+
+static constexpr uint32_t TEST_INTERVAL_MS = 10000;
+static const uint8_t NODE_MAC[6]           = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x10};
+
+static PeerInfo make_peer(NodeId id, NodeType type, uint32_t interval_ms)
+{
+    PeerInfo peer              = {};
+    peer.node_id               = id;
+    peer.type                  = type;
+    peer.heartbeat_interval_ms = interval_ms;
+    peer.mac[5]                = id;
+    return peer;
+}
+
+static HeartbeatResponse last_response(const MockTxManager &tx)
+{
+    HeartbeatResponse resp = {};
+    TEST_ASSERT_FALSE(tx.queued.empty());
+    const TxPacket &packet = tx.queued.back();
+    TEST_ASSERT_EQUAL(sizeof(HeartbeatResponse) + CRC_SIZE, packet.len);
+    memcpy(&resp, packet.data, sizeof(resp));
+    return resp;
+}
+
+TEST_CASE("Hub reports its real channel in heartbeat responses", "[heartbeat]")
+{
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.init(0, ReservedTypes::HUB);
+
+    hal.channel = 11;
+    hub.handle_request(10, NODE_MAC, 0, 0);
+    TEST_ASSERT_EQUAL(11, last_response(tx).wifi_channel);
+}
+
+TEST_CASE("Hub echoes the round-trip timestamps for time sync", "[heartbeat][time_sync]")
+{
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.init(0, ReservedTypes::HUB);
+
+    hub.handle_request(10, NODE_MAC, 1234, 5678);
+    HeartbeatResponse resp = last_response(tx);
+    TEST_ASSERT_EQUAL(1234, resp.origin_time_ms);
+    TEST_ASSERT_EQUAL(5678, resp.receive_time_ms);
+
+    uint64_t network_ms = 0;
+    TEST_ASSERT_TRUE(hub.to_network_time(42, network_ms));
+    TEST_ASSERT_EQUAL(42, network_ms);
+}
+
+TEST_CASE("Hub spreads heartbeat slots evenly across the interval", "[heartbeat]")
+{
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.init(0, ReservedTypes::HUB);
+
+    const NodeId nodes[] = {13, 10, 12, 11};
+    for (NodeId id : nodes) peers.peers.push_back(make_peer(id, 2, TEST_INTERVAL_MS));
+
+    for (NodeId id : nodes) {
+        hub.handle_request(id, NODE_MAC, 0, 0);
+        HeartbeatResponse resp = last_response(tx);
+
+        // The hint lands the next heartbeat on the start of the node's slot (ranked by id)
+        uint32_t expected_slot = (id - 10) * TEST_INTERVAL_MS / 4;
+        TEST_ASSERT_EQUAL(expected_slot, (resp.server_time_ms + resp.next_heartbeat_ms) % TEST_INTERVAL_MS);
+        TEST_ASSERT_GREATER_OR_EQUAL(TEST_INTERVAL_MS / 2, resp.next_heartbeat_ms);
+        TEST_ASSERT_LESS_THAN(TEST_INTERVAL_MS * 3 / 2, resp.next_heartbeat_ms);
+    }
+}
+
+TEST_CASE("Hub sends no slot hint for nodes without a heartbeat interval", "[heartbeat]")
+{
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.init(0, ReservedTypes::HUB);
+
+    peers.peers.push_back(make_peer(10, 2, 0));
+    hub.handle_request(10, NODE_MAC, 0, 0);
+    TEST_ASSERT_EQUAL(0, last_response(tx).next_heartbeat_ms);
+
+    hub.handle_request(42, NODE_MAC, 0, 0); // Unknown node
+    TEST_ASSERT_EQUAL(0, last_response(tx).next_heartbeat_ms);
+}
+
+TEST_CASE("Hub batches heartbeats from beacon-capable nodes into one broadcast", "[heartbeat][beacon]")
+{
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.init(0, ReservedTypes::HUB);
+    peers.capabilities = PeerCapability::HEARTBEAT_BEACON;
+    hal.channel        = 6;
+
+    // Repeats within a window are acknowledged once
+    hub.handle_request(10, NODE_MAC, 0, 0);
+    hub.handle_request(10, NODE_MAC, 0, 0);
+    for (NodeId id = 11; id < 10 + HEARTBEAT_BEACON_MAX_ACKS - 1; id++) hub.handle_request(id, NODE_MAC, 0, 0);
+    TEST_ASSERT_TRUE(tx.queued.empty());
+
+    // A full batch goes out without waiting for the window
+    hub.handle_request(10 + HEARTBEAT_BEACON_MAX_ACKS - 1, NODE_MAC, 0, 0);
+    TEST_ASSERT_EQUAL(1, tx.queued.size());
+    const TxPacket &packet = tx.queued.back();
+    const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    TEST_ASSERT_EQUAL_MEMORY(broadcast_mac, packet.dest_mac, 6);
+    TEST_ASSERT_EQUAL(sizeof(HeartbeatBeacon) + CRC_SIZE, packet.len);
+
+    HeartbeatBeacon beacon;
+    memcpy(&beacon, packet.data, sizeof(beacon));
+    TEST_ASSERT_EQUAL(MessageType::HEARTBEAT_BEACON, beacon.header.msg_type);
+    TEST_ASSERT_EQUAL(6, beacon.wifi_channel);
+    TEST_ASSERT_EQUAL(HEARTBEAT_BEACON_MAX_ACKS, beacon.acked_count);
+    for (uint8_t i = 0; i < HEARTBEAT_BEACON_MAX_ACKS; i++) TEST_ASSERT_EQUAL(10 + i, beacon.acked_ids[i]);
+
+    // Peers without the capability keep their unicast answer
+    peers.capabilities = PeerCapability::NONE;
+    hub.handle_request(10, NODE_MAC, 0, 0);
+    TEST_ASSERT_EQUAL(2, tx.queued.size());
+    TEST_ASSERT_EQUAL(MessageType::HEARTBEAT_RESPONSE, last_response(tx).header.msg_type);
+}
+
+TEST_CASE("Hub assigns sleeping nodes evenly spread wake slots", "[heartbeat][wake]")
+{
+    const uint32_t wake_period_ms = 4000;
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.set_wake_period(wake_period_ms);
+    hub.init(0, ReservedTypes::HUB);
+    peers.capabilities = PeerCapability::WAKE_SLOTS | PeerCapability::HEARTBEAT_BEACON;
+
+    // Always-on peers do not take a slot
+    for (NodeId id : {40, 10, 30, 20}) {
+        PeerInfo peer      = make_peer(id, 2, 0);
+        peer.capabilities  = PeerCapability::WAKE_SLOTS;
+        peers.peers.push_back(peer);
+    }
+    peers.peers.push_back(make_peer(15, 2, 0));
+
+    // Sleeping nodes are answered directly even when they could take a beacon
+    for (NodeId id : {10, 20, 30, 40}) {
+        hub.handle_request(id, NODE_MAC, 0, 0);
+        HeartbeatResponse resp = last_response(tx);
+        TEST_ASSERT_EQUAL(wake_period_ms, resp.wake_period_ms);
+        TEST_ASSERT_EQUAL((id / 10 - 1) * wake_period_ms / 4, resp.wake_offset_ms);
+    }
+
+    peers.capabilities = PeerCapability::NONE;
+    hub.handle_request(15, NODE_MAC, 0, 0);
+    TEST_ASSERT_EQUAL(0, last_response(tx).wake_period_ms);
+}
+
+TEST_CASE("Hub announces held frames instead of batching the answer", "[heartbeat][mailbox]")
+{
+    MockTxManager tx;
+    MockPeerManager peers;
+    RealMessageCodec codec;
+    MockWiFiHAL hal;
+    RealHeartbeatManager hub(tx, peers, codec, hal, ReservedIds::HUB);
+    hub.init(0, ReservedTypes::HUB);
+    peers.capabilities = PeerCapability::HEARTBEAT_BEACON;
+
+    TxPacket held = {};
+    memcpy(held.dest_mac, NODE_MAC, 6);
+    tx.hold_packet(held);
+    tx.hold_packet(held);
+
+    hub.handle_request(10, NODE_MAC, 0, 0);
+    HeartbeatResponse resp = last_response(tx);
+    TEST_ASSERT_EQUAL(MessageType::HEARTBEAT_RESPONSE, resp.header.msg_type);
+    TEST_ASSERT_EQUAL(2, resp.pending_frames);
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+}
@@ -0,0 +1,98 @@
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "latency_histogram.hpp"
+#include "unity.h"
+
+// Latencies are measured against the real clock, so each one sits well inside its
+// bucket to leave room for the time the test itself takes
+static void record_ago(LatencyStage stage, int64_t us) { Latency::record(stage, esp_timer_get_time() - us); }
+
+static LatencyHistogram snapshot_of(LatencyStage stage)
+{
+    LatencyHistogram histogram;
+    TEST_ASSERT_TRUE(Latency::snapshot(stage, histogram));
+    return histogram;
+}
+
+static uint32_t sum_of_counts(const LatencyHistogram &histogram)
+{
+    uint32_t sum = 0;
+    for (uint32_t count : histogram.counts) sum += count;
+    return sum;
+}
+
+TEST_CASE("Latency samples land in their log2 bucket", "[latency]")
+{
+    Latency::reset();
+    record_ago(LatencyStage::TX_ACK, 700);     // [512, 1024) us
+    record_ago(LatencyStage::TX_ACK, 3000);    // [2048, 4096) us
+    record_ago(LatencyStage::TX_ACK, 3000);
+    record_ago(LatencyStage::TX_ACK, 5000000); // Past 2^19 us, clamped to the last bucket
+
+    LatencyHistogram histogram = snapshot_of(LatencyStage::TX_ACK);
+    TEST_ASSERT_EQUAL(1, histogram.counts[9]);
+    TEST_ASSERT_EQUAL(2, histogram.counts[11]);
+    TEST_ASSERT_EQUAL(1, histogram.counts[LatencyHistogram::BUCKETS - 1]);
+    TEST_ASSERT_EQUAL(4, histogram.samples);
+    TEST_ASSERT_EQUAL(4, sum_of_counts(histogram));
+    TEST_ASSERT_GREATER_OR_EQUAL(5000000, histogram.max_us);
+    TEST_ASSERT_GREATER_OR_EQUAL(700 + 3000 + 3000 + 5000000, histogram.total_us);
+
+    // Other stages are untouched
+    TEST_ASSERT_EQUAL(0, snapshot_of(LatencyStage::TX_DEQUEUE).samples);
+}
+
+TEST_CASE("Latency ignores frames that were never stamped", "[latency]")
+{
+    Latency::reset();
+    TxPacket packet = {};
+    Latency::record(LatencyStage::RX_DISPATCH, packet);
+    Latency::record(LatencyStage::RX_DISPATCH, esp_timer_get_time() + 1000000); // From the future
+    TEST_ASSERT_EQUAL(0, snapshot_of(LatencyStage::RX_DISPATCH).samples);
+
+    TxPacket stamped = Latency::stamped(packet);
+    TEST_ASSERT_TRUE(stamped.enqueued_us > 0);
+    TEST_ASSERT_EQUAL(0, packet.enqueued_us);
+    Latency::record(LatencyStage::RX_DISPATCH, stamped);
+    TEST_ASSERT_EQUAL(1, snapshot_of(LatencyStage::RX_DISPATCH).samples);
+}
+
+TEST_CASE("Latency send callback is timed from the last radio send", "[latency]")
+{
+    Latency::reset();
+    TxPacket packet    = {};
+    packet.enqueued_us = esp_timer_get_time() - 3000;
+    Latency::note_radio_send(packet);
+    Latency::record_send_cb();
+
+    LatencyHistogram histogram = snapshot_of(LatencyStage::TX_SEND_CB);
+    TEST_ASSERT_EQUAL(1, histogram.samples);
+    TEST_ASSERT_EQUAL(1, histogram.counts[11]);
+}
+
+TEST_CASE("Latency reset clears every stage and snapshot rejects unknown stages", "[latency]")
+{
+    for (size_t i = 0; i < static_cast<size_t>(LatencyStage::COUNT); i++) {
+        record_ago(static_cast<LatencyStage>(i), 100);
+    }
+    Latency::reset();
+
+    for (size_t i = 0; i < static_cast<size_t>(LatencyStage::COUNT); i++) {
+        LatencyHistogram histogram = snapshot_of(static_cast<LatencyStage>(i));
+        TEST_ASSERT_EQUAL(0, histogram.samples);
+        TEST_ASSERT_EQUAL(0, histogram.total_us);
+        TEST_ASSERT_EQUAL(0, histogram.max_us);
+        TEST_ASSERT_EQUAL(0, sum_of_counts(histogram));
+    }
+
+    LatencyHistogram histogram;
+    TEST_ASSERT_FALSE(Latency::snapshot(LatencyStage::COUNT, histogram));
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
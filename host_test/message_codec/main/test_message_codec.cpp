@@ -0,0 +1,725 @@
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "app_protocol_types.hpp"
+#include "espnow_stats.hpp"
+#include "message_codec.hpp"
+#include "message_registry.hpp"
+#include "mock_storage.hpp"
+#include "protocol_messages.hpp"
+#include "unity.h"
+#include <cstring>
+#include <vector>
+
+enum class TestNodeId : NodeId
+{
+    TEST_HUB      = 1,
+    TEST_SENSOR_A = 10,
+};
+
+enum class TestNodeType : NodeType
+{
+    HUB    = 1,
+    SENSOR = 2
+};
+
+static const uint8_t PEER_MAC[6] = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x0A};
+
+static MessageHeader make_header(MessageType type)
+{
+    MessageHeader header   = {};
+    header.msg_type        = type;
+    header.sequence_number = 42;
+    header.sender_type     = to_node_type(TestNodeType::SENSOR);
+    header.sender_node_id  = to_node_id(TestNodeId::TEST_SENSOR_A);
+    header.payload_type    = 0x02;
+    header.requires_ack    = true;
+    header.dest_node_id    = to_node_id(TestNodeId::TEST_HUB);
+    header.timestamp_ms    = 123456;
+    return header;
+}
+
+// Canonical frame in a vector sized to it
+static std::vector<uint8_t> encode_frame(IMessageCodec &codec, const MessageHeader &header, const void *payload,
+                                         size_t len)
+{
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t frame_len = codec.encode(header, payload, len, frame, sizeof(frame));
+    return std::vector<uint8_t>(frame, frame + frame_len);
+}
+
+static void assert_headers_equal(const MessageHeader &expected, const MessageHeader &actual)
+{
+    TEST_ASSERT_EQUAL(expected.msg_type, actual.msg_type);
+    TEST_ASSERT_EQUAL(expected.sequence_number, actual.sequence_number);
+    TEST_ASSERT_EQUAL(expected.sender_type, actual.sender_type);
+    TEST_ASSERT_EQUAL(expected.sender_node_id, actual.sender_node_id);
+    TEST_ASSERT_EQUAL(expected.payload_type, actual.payload_type);
+    TEST_ASSERT_EQUAL(expected.requires_ack, actual.requires_ack);
+    TEST_ASSERT_EQUAL(expected.dest_node_id, actual.dest_node_id);
+    TEST_ASSERT_EQUAL(expected.timestamp_ms, actual.timestamp_ms);
+    TEST_ASSERT_EQUAL(expected.piggyback_ack, actual.piggyback_ack);
+}
+
+TEST_CASE("Codec legacy wire format matches the original 16-byte header", "[codec]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+
+    auto frame = encode_frame(codec, header, payload, sizeof(payload));
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, wire, sizeof(wire));
+
+    TEST_ASSERT_EQUAL(LEGACY_HEADER_SIZE + sizeof(payload) + CRC_SIZE, wire_len);
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(MessageType::DATA), wire[0]);
+    TEST_ASSERT_EQUAL_MEMORY(payload, wire + LEGACY_HEADER_SIZE, sizeof(payload));
+}
+
+TEST_CASE("Codec encodes into the caller's buffer only when the frame fits", "[codec]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+    const size_t frame_len = sizeof(MessageHeader) + sizeof(payload) + CRC_SIZE;
+
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    memset(frame, 0xAA, sizeof(frame));
+    TEST_ASSERT_EQUAL(0, codec.encode(header, payload, sizeof(payload), frame, frame_len - 1));
+    TEST_ASSERT_EQUAL(frame_len, codec.encode(header, payload, sizeof(payload), frame, frame_len));
+    TEST_ASSERT_EQUAL_MEMORY(payload, frame + sizeof(MessageHeader), sizeof(payload));
+    TEST_ASSERT_EQUAL(0, frame[frame_len - 1]); // CRC slot cleared
+
+    uint8_t oversized[ESP_NOW_MAX_DATA_LEN] = {};
+    TEST_ASSERT_EQUAL(0, codec.encode(header, oversized, sizeof(oversized), frame, sizeof(frame)));
+}
+
+TEST_CASE("Codec round-trips legacy frames into the canonical layout", "[codec]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+
+    auto frame = encode_frame(codec, header, payload, sizeof(payload));
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, wire, sizeof(wire));
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    size_t len = codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical));
+    TEST_ASSERT_EQUAL(frame.size(), len);
+
+    auto decoded = codec.decode_header(canonical, len);
+    TEST_ASSERT_TRUE(decoded.has_value());
+    assert_headers_equal(header, decoded.value());
+    TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+}
+
+TEST_CASE("Codec accepts legacy frames up to the original payload limit", "[codec]")
+{
+    RealMessageCodec codec;
+    LegacyMessageHeader legacy = {};
+    legacy.msg_type            = MessageType::DATA;
+    legacy.sender_node_id      = 7;
+
+    // A full-size frame from a legacy sender, whose payload limit counts the 16-byte header
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    memcpy(wire, &legacy, sizeof(legacy));
+    for (size_t i = 0; i < LEGACY_MAX_PAYLOAD_SIZE; i++) wire[LEGACY_HEADER_SIZE + i] = static_cast<uint8_t>(i);
+    size_t wire_len = IntegrityCheck::append(IntegrityCheck::Type::CRC8, wire, ESP_NOW_MAX_DATA_LEN - CRC_SIZE,
+                                             sizeof(wire));
+    TEST_ASSERT_EQUAL(ESP_NOW_MAX_DATA_LEN, wire_len);
+
+    uint8_t canonical[MAX_FRAME_SIZE];
+    TEST_ASSERT_EQUAL(0, codec.decode_wire(PEER_MAC, wire, wire_len, canonical, MAX_FRAME_SIZE - 1));
+    TEST_ASSERT_EQUAL(MAX_FRAME_SIZE, codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(LEGACY_MAX_PAYLOAD_SIZE - 1, canonical[MAX_FRAME_SIZE - CRC_SIZE - 1]);
+    TEST_ASSERT_EQUAL(MAX_FRAME_SIZE, sizeof(RxPacket::data)); // The RX path decodes into packets
+}
+
+TEST_CASE("Codec round-trips compact frames with a piggybacked ACK", "[codec]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    header.piggyback_ack = PIGGYBACK_ACK_VALID | 300;
+    uint8_t payload[4]   = {9, 8, 7, 6};
+
+    auto frame = encode_frame(codec, header, payload, sizeof(payload));
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false, wire, sizeof(wire));
+
+    TEST_ASSERT_EQUAL(CompactHeader::MARKER | CompactHeader::VERSION_1, wire[0]);
+    TEST_ASSERT_LESS_THAN(LEGACY_HEADER_SIZE + sizeof(payload) + CRC_SIZE, wire_len);
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    size_t len = codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical));
+    TEST_ASSERT_EQUAL(frame.size(), len);
+
+    auto decoded = codec.decode_header(canonical, len);
+    TEST_ASSERT_TRUE(decoded.has_value());
+    assert_headers_equal(header, decoded.value());
+    TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+}
+
+TEST_CASE("Codec compact header omits unset optional fields", "[codec]")
+{
+    RealMessageCodec codec;
+    MessageHeader header   = {};
+    header.msg_type        = MessageType::HEARTBEAT;
+    header.sequence_number = 5;
+
+    auto frame = encode_frame(codec, header, nullptr, 0);
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false, wire, sizeof(wire));
+
+    TEST_ASSERT_EQUAL(CompactHeader::MIN_SIZE + CRC_SIZE, wire_len);
+}
+
+TEST_CASE("Codec uses legacy format when compact is disabled locally", "[codec]")
+{
+    RealMessageCodec codec(PeerCapability::NONE);
+    MessageHeader header = make_header(MessageType::DATA);
+
+    auto frame = encode_frame(codec, header, nullptr, 0);
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false, wire, sizeof(wire));
+
+    TEST_ASSERT_EQUAL(LEGACY_HEADER_SIZE + CRC_SIZE, wire_len);
+}
+
+TEST_CASE("Codec rejects corrupted and truncated frames", "[codec]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+
+    auto frame = encode_frame(codec, header, payload, sizeof(payload));
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false, wire, sizeof(wire));
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    wire[wire_len - 2] ^= 0xFF;
+    TEST_ASSERT_EQUAL(0, codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(0, codec.decode_wire(PEER_MAC, wire, 3, canonical, sizeof(canonical)));
+}
+
+TEST_CASE("Codec counts rejected frames in the stats", "[codec][stats]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+
+    auto frame = encode_frame(codec, header, payload, sizeof(payload));
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false, wire, sizeof(wire));
+
+    Stats::reset();
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    TEST_ASSERT_EQUAL(frame.size(), codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical)));
+    wire[wire_len - 2] ^= 0xFF;
+    codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical));
+    codec.decode_wire(PEER_MAC, wire, 1, canonical, sizeof(canonical));
+
+    EspNowStats stats = Stats::snapshot();
+    TEST_ASSERT_EQUAL(1, stats.rx_crc_failures);
+    TEST_ASSERT_EQUAL(1, stats.rx_header_failures);
+}
+
+TEST_CASE("Codec uses the strongest agreed integrity check on compact frames", "[codec][integrity]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+    auto frame           = encode_frame(codec, header, payload, sizeof(payload));
+
+    const struct
+    {
+        uint16_t caps;
+        uint8_t version;
+    } cases[] = {
+        {PeerCapability::COMPACT_HEADER, CompactHeader::VERSION_1},
+        {PeerCapability::COMPACT_HEADER | PeerCapability::CRC16, CompactHeader::VERSION_2},
+        {PeerCapability::COMPACT_HEADER | PeerCapability::CRC16 | PeerCapability::CRC32, CompactHeader::VERSION_3},
+    };
+
+    size_t previous_len = 0;
+    for (const auto &c : cases) {
+        uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+        size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), c.caps, false, wire, sizeof(wire));
+        TEST_ASSERT_EQUAL(CompactHeader::MARKER | c.version, wire[0]);
+        TEST_ASSERT_GREATER_THAN(previous_len, wire_len);
+        previous_len = wire_len;
+
+        uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+        size_t len = codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical));
+        TEST_ASSERT_EQUAL(frame.size(), len);
+        TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+
+        wire[wire_len - 1] ^= 0x80;
+        TEST_ASSERT_EQUAL(0, codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical)));
+    }
+}
+
+TEST_CASE("Codec rejects compact frames with an unknown version", "[codec][integrity]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    auto frame           = encode_frame(codec, header, nullptr, 0);
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false,
+                                        wire, sizeof(wire));
+    wire[0]                  = CompactHeader::MARKER | 0x0F;
+    wire[wire_len - CRC_SIZE] = esp_rom_crc8_le(0, wire, wire_len - CRC_SIZE);
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    TEST_ASSERT_EQUAL(0, codec.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical)));
+}
+
+static size_t encode_delta_frame(RealMessageCodec &codec, const uint8_t *payload, size_t len, uint8_t *wire,
+                                 uint16_t sequence, bool acked = true)
+{
+    MessageHeader header   = make_header(MessageType::DATA);
+    header.sequence_number = sequence;
+    auto frame             = encode_frame(codec, header, payload, len);
+    size_t wire_len        = codec.encode_wire(PEER_MAC, frame.data(), frame.size(),
+                                               PeerCapability::COMPACT_HEADER | PeerCapability::PAYLOAD_DELTA, false,
+                                               wire, ESP_NOW_MAX_DATA_LEN);
+    if (acked) codec.confirm_delivery(PEER_MAC, frame.data(), frame.size());
+    return wire_len;
+}
+
+TEST_CASE("Codec delta-codes repeated DATA payloads against the last keyframe", "[codec][delta]")
+{
+    RealMessageCodec sender;
+    RealMessageCodec receiver;
+    uint8_t payload[64];
+    for (size_t i = 0; i < sizeof(payload); i++) payload[i] = static_cast<uint8_t>(i);
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    size_t keyframe_len = encode_delta_frame(sender, payload, sizeof(payload), wire, 1);
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_KEYFRAME);
+    TEST_ASSERT_EQUAL(sizeof(MessageHeader) + sizeof(payload) + CRC_SIZE,
+                      receiver.decode_wire(PEER_MAC, wire, keyframe_len, canonical, sizeof(canonical)));
+
+    payload[10] ^= 0x55;
+    payload[40] ^= 0x01;
+    size_t delta_len = encode_delta_frame(sender, payload, sizeof(payload), wire, 2);
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_DELTA);
+    TEST_ASSERT_LESS_THAN(keyframe_len, delta_len);
+
+    size_t len = receiver.decode_wire(PEER_MAC, wire, delta_len, canonical, sizeof(canonical));
+    TEST_ASSERT_EQUAL(sizeof(MessageHeader) + sizeof(payload) + CRC_SIZE, len);
+    TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+}
+
+TEST_CASE("Codec sends whole payloads until the peer acknowledges a keyframe", "[codec][delta]")
+{
+    RealMessageCodec sender;
+    RealMessageCodec receiver;
+    uint8_t payload[32] = {};
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    encode_delta_frame(sender, payload, sizeof(payload), wire, 1, false); // Keyframe lost on air, never acked
+
+    // Still a keyframe, which the receiver decodes without the lost one
+    payload[3]     = 7;
+    size_t len     = encode_delta_frame(sender, payload, sizeof(payload), wire, 2);
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_KEYFRAME);
+    size_t decoded = receiver.decode_wire(PEER_MAC, wire, len, canonical, sizeof(canonical));
+    TEST_ASSERT_EQUAL(sizeof(MessageHeader) + sizeof(payload) + CRC_SIZE, decoded);
+    TEST_ASSERT_EQUAL(7, canonical[sizeof(MessageHeader) + 3]);
+
+    // Acknowledged, so the next change travels as a delta the receiver can apply
+    payload[4] = 9;
+    len        = encode_delta_frame(sender, payload, sizeof(payload), wire, 3);
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_DELTA);
+    TEST_ASSERT_EQUAL(decoded, receiver.decode_wire(PEER_MAC, wire, len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+
+    // A shorter payload needs a new keyframe, which an ACK for an older frame does not confirm
+    encode_delta_frame(sender, payload, sizeof(payload) / 2, wire, 4, false);
+    MessageHeader stale   = make_header(MessageType::DATA);
+    stale.sequence_number = 3;
+    auto stale_frame      = encode_frame(sender, stale, payload, sizeof(payload) / 2);
+    sender.confirm_delivery(PEER_MAC, stale_frame.data(), stale_frame.size());
+    payload[6] = 2;
+    encode_delta_frame(sender, payload, sizeof(payload) / 2, wire, 5);
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_KEYFRAME);
+}
+
+TEST_CASE("Codec keeps the delta reference when a frame falls back to legacy", "[codec][delta]")
+{
+    RealMessageCodec sender;
+    RealMessageCodec receiver;
+    uint8_t payload[MAX_PAYLOAD_SIZE] = {};
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    size_t len = encode_delta_frame(sender, payload, sizeof(payload), wire, 1);
+    TEST_ASSERT_NOT_EQUAL(0, receiver.decode_wire(PEER_MAC, wire, len, canonical, sizeof(canonical)));
+
+    // A retransmitted keyframe with a huge timestamp only fits as legacy
+    payload[0]             = 1;
+    MessageHeader header   = make_header(MessageType::DATA);
+    header.sequence_number = 2;
+    header.timestamp_ms    = UINT64_MAX;
+    auto frame             = encode_frame(sender, header, payload, sizeof(payload));
+    len = sender.encode_wire(PEER_MAC, frame.data(), frame.size(),
+                             PeerCapability::COMPACT_HEADER | PeerCapability::PAYLOAD_DELTA, true, wire, sizeof(wire));
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(MessageType::DATA), wire[0]);
+    sender.confirm_delivery(PEER_MAC, frame.data(), frame.size());
+
+    // Deltas still refer to the keyframe the receiver holds
+    payload[1] = 2;
+    len        = encode_delta_frame(sender, payload, sizeof(payload), wire, 3);
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_DELTA);
+    TEST_ASSERT_NOT_EQUAL(0, receiver.decode_wire(PEER_MAC, wire, len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+}
+
+TEST_CASE("Codec sends periodic and retransmitted frames as keyframes", "[codec][delta]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[32]  = {};
+    auto frame           = encode_frame(codec, header, payload, sizeof(payload));
+    uint16_t caps        = PeerCapability::COMPACT_HEADER | PeerCapability::PAYLOAD_DELTA;
+    // The generation byte sits right before the payload
+    auto generation_at = [&](size_t wire_len) { return wire_len - CRC_SIZE - sizeof(payload) - 1; };
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), caps, false, wire, sizeof(wire));
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_KEYFRAME);
+    uint8_t generation = wire[generation_at(len)];
+
+    len = codec.encode_wire(PEER_MAC, frame.data(), frame.size(), caps, true, wire, sizeof(wire));
+    TEST_ASSERT_TRUE(wire[1] & CompactHeader::FLAG_KEYFRAME);
+    TEST_ASSERT_EQUAL(generation, wire[generation_at(len)]); // Same reference, same generation
+    codec.confirm_delivery(PEER_MAC, frame.data(), frame.size());
+
+    int keyframes = 0;
+    for (int i = 0; i < PayloadDeltaCodec::KEYFRAME_INTERVAL; i++) {
+        codec.encode_wire(PEER_MAC, frame.data(), frame.size(), caps, false, wire, sizeof(wire));
+        if (wire[1] & CompactHeader::FLAG_KEYFRAME) keyframes++;
+    }
+    TEST_ASSERT_EQUAL(1, keyframes);
+}
+
+TEST_CASE("Codec does not delta-code without the agreed capability", "[codec][delta]")
+{
+    RealMessageCodec codec;
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[32]  = {};
+    auto frame           = encode_frame(codec, header, payload, sizeof(payload));
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    for (int i = 0; i < 2; i++) {
+        codec.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false, wire,
+                          sizeof(wire));
+        TEST_ASSERT_FALSE(wire[1] & (CompactHeader::FLAG_KEYFRAME | CompactHeader::FLAG_DELTA));
+    }
+}
+
+static const uint8_t HUB_MAC[6]        = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x01};
+static const uint8_t SESSION_KEY[16]   = {0x10, 0x32, 0x54, 0x76, 0x98, 0xBA, 0xDC, 0xFE,
+                                          0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF};
+
+// Sensor (PEER_MAC) and hub codecs sharing a session key
+static void make_secure_pair(RealMessageCodec &sensor, RealMessageCodec &hub)
+{
+    sensor.set_local_mac(PEER_MAC);
+    hub.set_local_mac(HUB_MAC);
+    TEST_ASSERT_EQUAL(ESP_OK, sensor.install_session_key(HUB_MAC, SESSION_KEY));
+    TEST_ASSERT_EQUAL(ESP_OK, hub.install_session_key(PEER_MAC, SESSION_KEY));
+}
+
+TEST_CASE("Codec seals frames to keyed peers and opens them on the other side", "[codec][aead]")
+{
+    RealMessageCodec sensor;
+    RealMessageCodec hub;
+    make_secure_pair(sensor, hub);
+
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[8]   = {'s', 'e', 'c', 'r', 'e', 't', '!', 0};
+    auto frame           = encode_frame(sensor, header, payload, sizeof(payload));
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = sensor.encode_wire(HUB_MAC, frame.data(), frame.size(), PeerCapability::COMPACT_HEADER, false,
+                                         wire, sizeof(wire));
+    TEST_ASSERT_EQUAL(SecureEnvelope::MARKER, wire[0]);
+    TEST_ASSERT_TRUE(memmem(wire, wire_len, payload, sizeof(payload)) == nullptr);
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    size_t len = hub.decode_wire(PEER_MAC, wire, wire_len, canonical, sizeof(canonical));
+    TEST_ASSERT_EQUAL(frame.size(), len);
+    assert_headers_equal(header, hub.decode_header(canonical, len).value());
+    TEST_ASSERT_EQUAL_MEMORY(payload, canonical + sizeof(MessageHeader), sizeof(payload));
+}
+
+TEST_CASE("Codec rejects tampered, replayed and misattributed envelopes", "[codec][aead]")
+{
+    RealMessageCodec sensor;
+    RealMessageCodec hub;
+    make_secure_pair(sensor, hub);
+
+    MessageHeader header = make_header(MessageType::DATA);
+    uint8_t payload[4]   = {1, 2, 3, 4};
+    auto frame           = encode_frame(sensor, header, payload, sizeof(payload));
+
+    uint8_t first[ESP_NOW_MAX_DATA_LEN];
+    uint8_t second[ESP_NOW_MAX_DATA_LEN];
+    size_t first_len  = sensor.encode_wire(HUB_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, first,
+                                           sizeof(first));
+    size_t second_len = sensor.encode_wire(HUB_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, second,
+                                           sizeof(second));
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    uint8_t tampered[ESP_NOW_MAX_DATA_LEN];
+    memcpy(tampered, second, second_len);
+    tampered[SecureEnvelope::HEADER_SIZE] ^= 0x01;
+    TEST_ASSERT_EQUAL(0, hub.decode_wire(PEER_MAC, tampered, second_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(0, hub.decode_wire(HUB_MAC, second, second_len, canonical, sizeof(canonical)));
+
+    // Out of order within the window is fine, a second copy is not
+    TEST_ASSERT_EQUAL(frame.size(), hub.decode_wire(PEER_MAC, second, second_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(frame.size(), hub.decode_wire(PEER_MAC, first, first_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(0, hub.decode_wire(PEER_MAC, first, first_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(0, hub.decode_wire(PEER_MAC, second, second_len, canonical, sizeof(canonical)));
+}
+
+TEST_CASE("Codec keeps rejecting replayed envelopes after the receiver reboots", "[codec][aead]")
+{
+    MockStorage hub_storage;
+    RealMessageCodec sensor;
+    sensor.set_local_mac(PEER_MAC);
+    TEST_ASSERT_EQUAL(ESP_OK, sensor.install_session_key(HUB_MAC, SESSION_KEY));
+
+    auto frame = encode_frame(sensor, make_header(MessageType::DATA), nullptr, 0);
+    uint8_t old_wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t new_wire[ESP_NOW_MAX_DATA_LEN];
+    size_t old_len = sensor.encode_wire(HUB_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, old_wire,
+                                        sizeof(old_wire));
+    size_t new_len = sensor.encode_wire(HUB_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, new_wire,
+                                        sizeof(new_wire));
+
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+    {
+        RealMessageCodec hub(PeerCapability::SUPPORTED, &hub_storage);
+        hub.set_local_mac(HUB_MAC);
+        TEST_ASSERT_EQUAL(ESP_OK, hub.install_session_key(PEER_MAC, SESSION_KEY));
+        TEST_ASSERT_EQUAL(frame.size(), hub.decode_wire(PEER_MAC, old_wire, old_len, canonical, sizeof(canonical)));
+    }
+
+    // Same key reloaded from storage after the reboot: the old frame stays spent
+    RealMessageCodec rebooted(PeerCapability::SUPPORTED, &hub_storage);
+    rebooted.set_local_mac(HUB_MAC);
+    TEST_ASSERT_EQUAL(ESP_OK, rebooted.install_session_key(PEER_MAC, SESSION_KEY));
+    TEST_ASSERT_EQUAL(0, rebooted.decode_wire(PEER_MAC, old_wire, old_len, canonical, sizeof(canonical)));
+    TEST_ASSERT_EQUAL(frame.size(), rebooted.decode_wire(PEER_MAC, new_wire, new_len, canonical, sizeof(canonical)));
+}
+
+TEST_CASE("Codec saves replay floors off the RX path unless a frame outruns the last save", "[codec][aead]")
+{
+    MockStorage hub_storage;
+    RealMessageCodec sensor;
+    sensor.set_local_mac(PEER_MAC);
+    TEST_ASSERT_EQUAL(ESP_OK, sensor.install_session_key(HUB_MAC, SESSION_KEY));
+    RealMessageCodec hub(PeerCapability::SUPPORTED, &hub_storage);
+    hub.set_local_mac(HUB_MAC);
+    TEST_ASSERT_EQUAL(ESP_OK, hub.install_session_key(PEER_MAC, SESSION_KEY));
+
+    auto frame = encode_frame(sensor, make_header(MessageType::DATA), nullptr, 0);
+    auto deliver = [&](size_t count) {
+        uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+        uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+        for (size_t i = 0; i < count; i++) {
+            size_t len = sensor.encode_wire(HUB_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, wire,
+                                            sizeof(wire));
+            TEST_ASSERT_EQUAL(frame.size(), hub.decode_wire(PEER_MAC, wire, len, canonical, sizeof(canonical)));
+        }
+    };
+
+    // Nothing covers the first frame of a freshly installed key
+    deliver(1);
+    TEST_ASSERT_EQUAL(1, hub_storage.replay_floor_saves);
+    deliver(10);
+    TEST_ASSERT_EQUAL(1, hub_storage.replay_floor_saves);
+    hub.flush_replay_floors();
+    TEST_ASSERT_EQUAL(2, hub_storage.replay_floor_saves);
+    TEST_ASSERT_EQUAL(11, hub_storage.replay_floors[0].counter);
+    hub.flush_replay_floors();
+    TEST_ASSERT_EQUAL(2, hub_storage.replay_floor_saves);
+
+    // The save at 11 covers everything below 11 + REPLAY_SAVE_AHEAD
+    deliver(IStorage::REPLAY_SAVE_AHEAD - 1);
+    TEST_ASSERT_EQUAL(2, hub_storage.replay_floor_saves);
+    deliver(1);
+    TEST_ASSERT_EQUAL(3, hub_storage.replay_floor_saves);
+    TEST_ASSERT_EQUAL(11 + IStorage::REPLAY_SAVE_AHEAD, hub_storage.replay_floors[0].counter);
+}
+
+TEST_CASE("Codec rejects plaintext frames from keyed peers except pairing", "[codec][aead]")
+{
+    RealMessageCodec attacker;
+    RealMessageCodec hub;
+    hub.set_local_mac(HUB_MAC);
+    hub.install_session_key(PEER_MAC, SESSION_KEY);
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    uint8_t canonical[ESP_NOW_MAX_DATA_LEN];
+
+    auto data      = encode_frame(attacker, make_header(MessageType::DATA), nullptr, 0);
+    size_t data_len = attacker.encode_wire(HUB_MAC, data.data(), data.size(), PeerCapability::NONE, false, wire,
+                                           sizeof(wire));
+    TEST_ASSERT_NOT_EQUAL(SecureEnvelope::MARKER, wire[0]);
+    TEST_ASSERT_EQUAL(0, hub.decode_wire(PEER_MAC, wire, data_len, canonical, sizeof(canonical)));
+
+    auto pair       = encode_frame(attacker, make_header(MessageType::PAIR_REQUEST), nullptr, 0);
+    size_t pair_len = attacker.encode_wire(HUB_MAC, pair.data(), pair.size(), PeerCapability::NONE, false, wire,
+                                           sizeof(wire));
+    TEST_ASSERT_EQUAL(pair.size(), hub.decode_wire(PEER_MAC, wire, pair_len, canonical, sizeof(canonical)));
+}
+
+TEST_CASE("Codec sends pairing frames in the clear even to keyed peers", "[codec][aead]")
+{
+    RealMessageCodec hub;
+    hub.set_local_mac(HUB_MAC);
+    hub.install_session_key(PEER_MAC, SESSION_KEY);
+
+    auto frame = encode_frame(hub, make_header(MessageType::PAIR_RESPONSE), nullptr, 0);
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    hub.encode_wire(PEER_MAC, frame.data(), frame.size(), PeerCapability::NONE, false, wire, sizeof(wire));
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(MessageType::PAIR_RESPONSE), wire[0]);
+}
+
+TEST_CASE("Codec accepts plaintext channel announcements from keyed peers", "[codec][aead]")
+{
+    RealMessageCodec hub;
+    RealMessageCodec node;
+    hub.set_local_mac(HUB_MAC);
+    node.set_local_mac(PEER_MAC);
+    node.install_session_key(HUB_MAC, SESSION_KEY);
+
+    const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t new_channel            = 6;
+    auto frame = encode_frame(hub, make_header(MessageType::CHANNEL_ANNOUNCE), &new_channel, sizeof(new_channel));
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = hub.encode_wire(broadcast_mac, frame.data(), frame.size(), PeerCapability::NONE, false, wire,
+                                      sizeof(wire));
+    TEST_ASSERT_EQUAL(static_cast<uint8_t>(MessageType::CHANNEL_ANNOUNCE), wire[0]);
+
+    uint8_t out[ESP_NOW_MAX_DATA_LEN];
+    TEST_ASSERT_EQUAL(frame.size(), node.decode_wire(HUB_MAC, wire, wire_len, out, sizeof(out)));
+}
+
+TEST_CASE("Both sides derive the same session key from the pairing nonces", "[codec][aead]")
+{
+    const uint8_t network_key[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    const uint8_t node_nonce[8]   = {0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7};
+    const uint8_t hub_nonce[8]    = {0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7};
+
+    uint8_t hub_key[16];
+    uint8_t node_key[16];
+    uint8_t other_key[16];
+    TEST_ASSERT_EQUAL(ESP_OK, FrameCipher::derive_session_key(network_key, HUB_MAC, PEER_MAC, node_nonce, hub_nonce, hub_key));
+    TEST_ASSERT_EQUAL(ESP_OK, FrameCipher::derive_session_key(network_key, HUB_MAC, PEER_MAC, node_nonce, hub_nonce, node_key));
+    TEST_ASSERT_EQUAL_MEMORY(hub_key, node_key, sizeof(hub_key));
+
+    TEST_ASSERT_EQUAL(ESP_OK, FrameCipher::derive_session_key(network_key, HUB_MAC, PEER_MAC, hub_nonce, node_nonce, other_key));
+    TEST_ASSERT_TRUE(memcmp(hub_key, other_key, sizeof(hub_key)) != 0);
+}
+
+TEST_CASE("Registered messages round-trip over the wire with their type set", "[codec][registry]")
+{
+    RealMessageCodec codec;
+    HeartbeatResponse sent = {};
+    sent.header            = make_header(MessageType::DATA); // Overridden by the registry
+    sent.server_time_ms    = 987654321;
+    sent.wifi_channel      = 6;
+    sent.next_heartbeat_ms = 1500;
+    sent.pending_frames    = 2;
+
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t frame_len = encode_message(codec, sent, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(sizeof(HeartbeatResponse) + CRC_SIZE, frame_len);
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    size_t wire_len = codec.encode_wire(PEER_MAC, frame, frame_len, PeerCapability::COMPACT_HEADER, false, wire, sizeof(wire));
+    RxPacket packet;
+    packet.len = codec.decode_wire(PEER_MAC, wire, wire_len, packet.data, sizeof(packet.data));
+
+    HeartbeatResponse received;
+    TEST_ASSERT_EQUAL(sizeof(HeartbeatResponse), decode_message(packet, received));
+    TEST_ASSERT_EQUAL(MessageType::HEARTBEAT_RESPONSE, received.header.msg_type);
+    TEST_ASSERT_EQUAL(sent.header.sequence_number, received.header.sequence_number);
+    TEST_ASSERT_EQUAL(sent.server_time_ms, received.server_time_ms);
+    TEST_ASSERT_EQUAL(6, received.wifi_channel);
+    TEST_ASSERT_EQUAL(1500, received.next_heartbeat_ms);
+    TEST_ASSERT_EQUAL(2, received.pending_frames);
+
+    // Read as the wrong struct, the frame is refused and the struct left alone
+    HeartbeatMessage other = {};
+    other.uptime_ms        = 7;
+    TEST_ASSERT_EQUAL(0, decode_message(packet, other));
+    TEST_ASSERT_EQUAL(7, other.uptime_ms);
+}
+
+TEST_CASE("Registry accepts older, shorter messages and refuses truncated ones", "[codec][registry]")
+{
+    RealMessageCodec codec;
+    PairResponse resp = {};
+    resp.header       = make_header(MessageType::PAIR_RESPONSE);
+    resp.status       = PairStatus::ACCEPTED;
+    resp.wifi_channel = 11;
+    resp.capabilities = PeerCapability::COMPACT_HEADER;
+
+    // Firmware from before capabilities ended the response at that field
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t old_len   = offsetof(PairResponse, capabilities);
+    size_t frame_len = encode_message(codec, resp, frame, sizeof(frame), old_len);
+    TEST_ASSERT_EQUAL(old_len + CRC_SIZE, frame_len);
+
+    PairResponse decoded;
+    memset(&decoded, 0xAA, sizeof(decoded));
+    TEST_ASSERT_EQUAL(old_len, decode_message(frame, frame_len, decoded));
+    TEST_ASSERT_EQUAL(11, decoded.wifi_channel);
+    TEST_ASSERT_EQUAL(PeerCapability::NONE, decoded.capabilities); // Zeroed, not stale
+
+    // Below the registered minimum nothing is sent or read
+    TEST_ASSERT_EQUAL(0, encode_message(codec, resp, frame, sizeof(frame), old_len - 1));
+    TEST_ASSERT_EQUAL(0, decode_message(frame, old_len, decoded));
+    TEST_ASSERT_EQUAL(0, decode_message(static_cast<const uint8_t *>(nullptr), frame_len, decoded));
+
+    // Nor into a buffer too small for the frame
+    TEST_ASSERT_EQUAL(0, encode_message(codec, resp, frame, old_len));
+}
+
+TEST_CASE("Registry matches application payloads by payload type", "[codec][registry]")
+{
+    RealMessageCodec codec;
+    SolarSensorReport report = {};
+    report.header            = make_header(MessageType::DATA);
+    report.voltage_mv        = 5100;
+
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t frame_len = encode_message(codec, report, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL(sizeof(SolarSensorReport) + CRC_SIZE, frame_len);
+    TEST_ASSERT_EQUAL(to_payload_type(IrrigationPayloadType::SOLAR_SENSOR_REPORT),
+                      frame[offsetof(MessageHeader, payload_type)]);
+
+    SolarSensorReport solar;
+    TEST_ASSERT_EQUAL(sizeof(SolarSensorReport), decode_message(frame, frame_len, solar));
+    TEST_ASSERT_EQUAL(5100, solar.voltage_mv);
+
+    WaterLevelReport water;
+    TEST_ASSERT_EQUAL(0, decode_message(frame, frame_len, water));
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
@@ -0,0 +1,328 @@
+#include "app_protocol_types.hpp"
+#include "espnow_stats.hpp"
+#include "message_codec.hpp"
+#include "message_registry.hpp"
+#include "message_router.hpp"
+#include "mock_heartbeat_manager.hpp"
+#include "mock_pairing_manager.hpp"
+#include "mock_peer_manager.hpp"
+#include "mock_tx_manager.hpp"
+#include "unity.h"
+extern "C" {
+#include "Mockesp_wifi.h"
+}
+#include <cstring>
+
+static constexpr NodeId SOLAR_ID   = to_node_id(IrrigationNodeId::SOLAR_SENSOR);
+static constexpr NodeId WEATHER_ID = to_node_id(IrrigationNodeId::WEATHER);
+
+// A hub router built on mocks, with the real codec to build frames
+struct Router
+{
+    MockPeerManager peers;
+    MockTxManager tx;
+    MockHeartbeatManager heartbeat;
+    MockPairingManager pairing;
+    RealMessageCodec codec;
+    RealMessageRouter router{peers, tx, heartbeat, pairing, codec};
+
+    template <typename T> RxPacket frame(const T &msg, NodeId sender, size_t len = sizeof(T))
+    {
+        T copy                     = msg;
+        copy.header.sender_node_id = sender;
+        copy.header.dest_node_id   = ReservedIds::HUB;
+        RxPacket packet            = {};
+        packet.len                 = encode_message(codec, copy, packet.data, sizeof(packet.data), len);
+        packet.src_mac[5]          = sender;
+        TEST_ASSERT_NOT_EQUAL(0, packet.len);
+        return packet;
+    }
+};
+
+struct Calls
+{
+    int count = 0;
+    RxPacket last;
+};
+
+static void record_call(const RxPacket &packet, void *ctx)
+{
+    auto *calls = static_cast<Calls *>(ctx);
+    calls->count++;
+    calls->last = packet;
+}
+
+TEST_CASE("Router hands each consumer only the payload type it subscribed to", "[router]")
+{
+    Router r;
+    QueueHandle_t app_queue   = xQueueCreate(4, sizeof(RxPacket));
+    QueueHandle_t solar_queue = xQueueCreate(4, sizeof(SolarSensorReport));
+    r.router.set_app_queue(app_queue);
+
+    int id = -1;
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.subscribe(subscription_to_queue<SolarSensorReport>(solar_queue), id));
+
+    SolarSensorReport solar = {};
+    solar.voltage_mv        = 4800;
+    r.router.handle_packet(r.frame(solar, SOLAR_ID));
+
+    SolarSensorReport received;
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(solar_queue, &received, 0));
+    TEST_ASSERT_EQUAL(4800, received.voltage_mv);
+    TEST_ASSERT_EQUAL(SOLAR_ID, received.header.sender_node_id);
+    TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(app_queue)); // Claimed, so not in the catch-all
+
+    // Traffic nobody subscribed to still reaches the app queue, and only there
+    WaterLevelReport water = {};
+    r.router.handle_packet(r.frame(water, WEATHER_ID));
+    TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(solar_queue));
+    TEST_ASSERT_EQUAL(1, uxQueueMessagesWaiting(app_queue));
+
+    // After unsubscribing, solar reports fall back to the app queue too
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.unsubscribe(id));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, r.router.unsubscribe(id));
+    r.router.handle_packet(r.frame(solar, SOLAR_ID));
+    TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(solar_queue));
+    TEST_ASSERT_EQUAL(2, uxQueueMessagesWaiting(app_queue));
+
+    vQueueDelete(solar_queue);
+    vQueueDelete(app_queue);
+}
+
+TEST_CASE("Router matches subscriptions by sender and fans out to all matches", "[router]")
+{
+    Router r;
+    Calls from_solar, from_anyone;
+    int solar_id = -1, any_id = -1;
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.subscribe(subscription_to_handler<SolarSensorReport>(record_call, &from_solar,
+                                                                                          SOLAR_ID),
+                                                 solar_id));
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.subscribe(subscription_to_handler<SolarSensorReport>(record_call, &from_anyone),
+                                                 any_id));
+    TEST_ASSERT_NOT_EQUAL(solar_id, any_id);
+
+    SolarSensorReport solar = {};
+    solar.current_ma        = 120;
+    r.router.handle_packet(r.frame(solar, SOLAR_ID));
+    r.router.handle_packet(r.frame(solar, WEATHER_ID));
+
+    TEST_ASSERT_EQUAL(1, from_solar.count);
+    TEST_ASSERT_EQUAL(2, from_anyone.count);
+
+    SolarSensorReport decoded;
+    TEST_ASSERT_EQUAL(sizeof(SolarSensorReport), decode_message(from_solar.last, decoded));
+    TEST_ASSERT_EQUAL(120, decoded.current_ma);
+    TEST_ASSERT_EQUAL(WEATHER_ID, from_anyone.last.data[offsetof(MessageHeader, sender_node_id)]);
+}
+
+TEST_CASE("Router drops frames too short for the subscribed struct", "[router]")
+{
+    Router r;
+    Calls calls;
+    int id = -1;
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.subscribe(subscription_to_handler<WaterLevelReport>(record_call, &calls), id));
+
+    WaterLevelReport water = {};
+    RxPacket packet        = r.frame(water, WEATHER_ID);
+    packet.len -= 1; // One byte short of a WaterLevelReport
+    r.router.handle_packet(packet);
+    TEST_ASSERT_EQUAL(0, calls.count);
+}
+
+TEST_CASE("Router refuses subscriptions it cannot honour", "[router]")
+{
+    Router r;
+    Calls calls;
+    QueueHandle_t queue = xQueueCreate(1, sizeof(RxPacket));
+    int id              = -1;
+
+    AppSubscription heartbeats = {};
+    heartbeats.msg_type        = MessageType::HEARTBEAT; // Consumed by the stack
+    heartbeats.handler         = record_call;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.subscribe(heartbeats, id));
+
+    AppSubscription both = {};
+    both.handler         = record_call;
+    both.queue           = queue;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.subscribe(both, id));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.subscribe(AppSubscription{}, id));
+
+    AppSubscription any = {};
+    any.any_payload_type = true;
+    any.queue            = queue;
+    for (size_t i = 0; i < APP_SUBSCRIPTIONS_MAX; i++) TEST_ASSERT_EQUAL(ESP_OK, r.router.subscribe(any, id));
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, r.router.subscribe(any, id));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.unsubscribe(-1));
+
+    // A full subscriber queue drops the frame and counts it
+    Stats::reset();
+    SolarSensorReport solar = {};
+    r.router.handle_packet(r.frame(solar, SOLAR_ID));
+    TEST_ASSERT_EQUAL(1, uxQueueMessagesWaiting(queue));
+    TEST_ASSERT_EQUAL(APP_SUBSCRIPTIONS_MAX - 1, Stats::snapshot().app_queue_drops);
+
+    vQueueDelete(queue);
+}
+
+static void record_routed(const RxPacket &packet, const MessageHeader &header, void *ctx)
+{
+    record_call(packet, ctx);
+}
+
+TEST_CASE("Router releases held frames on a sleeper's heartbeat and on any frame from others", "[router]")
+{
+    Router r;
+    r.router.set_node_info(ReservedIds::HUB, ReservedTypes::HUB);
+    r.peers.capabilities = PeerCapability::WAKE_SLOTS;
+
+    // A sleeper may send data just before turning its receiver off
+    SolarSensorReport solar = {};
+    r.router.handle_packet(r.frame(solar, SOLAR_ID));
+    TEST_ASSERT_EQUAL(0, r.tx.release_count);
+
+    // Its heartbeat is the wake poll, answered while it listens
+    HeartbeatMessage heartbeat = {};
+    r.router.handle_packet(r.frame(heartbeat, SOLAR_ID));
+    TEST_ASSERT_EQUAL(1, r.tx.release_count);
+
+    // A peer that does not sleep may skip heartbeats while it is busy sending
+    r.peers.capabilities = PeerCapability::NONE;
+    r.router.handle_packet(r.frame(solar, SOLAR_ID));
+    TEST_ASSERT_EQUAL(2, r.tx.release_count);
+    r.router.handle_packet(r.frame(heartbeat, SOLAR_ID));
+    TEST_ASSERT_EQUAL(3, r.tx.release_count);
+}
+
+TEST_CASE("Router reports logical ACKs with their sender and sequence", "[router]")
+{
+    Router r;
+    r.router.set_node_info(ReservedIds::HUB, ReservedTypes::HUB);
+
+    AckMessage ack   = {};
+    ack.ack_sequence = 0x8123; // Passed on whole, the TX manager compares 15 bits
+    r.router.handle_packet(r.frame(ack, SOLAR_ID));
+
+    SolarSensorReport solar    = {};
+    solar.header.piggyback_ack = PIGGYBACK_ACK_VALID | 0x0042;
+    r.router.handle_packet(r.frame(solar, WEATHER_ID));
+
+    // Not an ACK at all
+    solar.header.piggyback_ack = 0;
+    r.router.handle_packet(r.frame(solar, WEATHER_ID));
+
+    TEST_ASSERT_EQUAL(2, r.tx.logical_acks.size());
+    TEST_ASSERT_EQUAL(SOLAR_ID, r.tx.logical_acks[0].mac[5]);
+    TEST_ASSERT_EQUAL_HEX16(0x8123, r.tx.logical_acks[0].sequence);
+    TEST_ASSERT_EQUAL(WEATHER_ID, r.tx.logical_acks[1].mac[5]);
+    TEST_ASSERT_EQUAL_HEX16(0x0042, r.tx.logical_acks[1].sequence);
+}
+
+TEST_CASE("Router answers scan probes from unpaired nodes by broadcast", "[router]")
+{
+    esp_wifi_get_channel_IgnoreAndReturn(ESP_OK);
+    static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    Router hub;
+    hub.router.set_node_info(ReservedIds::HUB, ReservedTypes::HUB);
+
+    // No peer entry for the prober, so esp_now_send() could not unicast to it
+    MessageHeader probe  = {};
+    probe.msg_type       = MessageType::CHANNEL_SCAN_PROBE;
+    probe.sender_node_id = SOLAR_ID;
+    probe.dest_node_id   = ReservedIds::HUB;
+    RxPacket packet      = {};
+    packet.len           = hub.codec.encode(probe, nullptr, 0, packet.data, sizeof(packet.data));
+    packet.src_mac[5]    = SOLAR_ID;
+    hub.router.handle_packet(packet);
+    TEST_ASSERT_EQUAL(1, hub.tx.queued.size());
+    TEST_ASSERT_EQUAL_MEMORY(broadcast_mac, hub.tx.queued[0].dest_mac, 6);
+
+    // Only the node that probed takes the broadcast response as its own
+    RxPacket response = {};
+    response.len      = hub.tx.queued[0].len;
+    memcpy(response.data, hub.tx.queued[0].data, response.len);
+    Router solar;
+    solar.router.set_node_info(SOLAR_ID, 0x02);
+    solar.router.handle_packet(response);
+    Router weather;
+    weather.router.set_node_info(WEATHER_ID, 0x02);
+    weather.router.handle_packet(response);
+    TEST_ASSERT_EQUAL(1, solar.tx.hub_found);
+    TEST_ASSERT_EQUAL(0, weather.tx.hub_found);
+}
+
+TEST_CASE("Router routes registered message types through its table", "[router]")
+{
+    Router r;
+    constexpr auto TELEMETRY = static_cast<MessageType>(0x40);
+    constexpr auto BULK      = static_cast<MessageType>(0x41);
+    TEST_ASSERT_EQUAL(RouteContext::NONE, r.router.route_context(TELEMETRY));
+    TEST_ASSERT_EQUAL(RouteContext::WORKER, r.router.route_context(MessageType::HEARTBEAT));
+    TEST_ASSERT_EQUAL(RouteContext::APP, r.router.route_context(MessageType::DATA));
+
+    Calls calls;
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.register_message_type(TELEMETRY, RouteContext::INLINE, record_routed, &calls));
+    TEST_ASSERT_EQUAL(RouteContext::INLINE, r.router.route_context(TELEMETRY));
+
+    MessageHeader header  = {};
+    header.msg_type       = TELEMETRY;
+    header.sender_node_id = SOLAR_ID;
+    header.dest_node_id   = ReservedIds::HUB;
+    const uint8_t value[] = {1, 2, 3};
+    RxPacket packet       = {};
+    packet.len            = r.codec.encode(header, value, sizeof(value), packet.data, sizeof(packet.data));
+    r.router.handle_packet(packet);
+    TEST_ASSERT_EQUAL(1, calls.count);
+
+    // An APP route hands the type to subscriptions
+    Calls subscribed;
+    int id = -1;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.subscribe(AppSubscription{BULK}, id));
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.register_message_type(BULK, RouteContext::APP, nullptr, nullptr));
+    AppSubscription bulk  = {};
+    bulk.msg_type         = BULK;
+    bulk.any_payload_type = true;
+    bulk.handler          = record_call;
+    bulk.ctx              = &subscribed;
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.subscribe(bulk, id));
+    header.msg_type = BULK;
+    packet.len      = r.codec.encode(header, value, sizeof(value), packet.data, sizeof(packet.data));
+    r.router.handle_packet(packet);
+    TEST_ASSERT_EQUAL(1, subscribed.count);
+    TEST_ASSERT_EQUAL(1, calls.count);
+
+    // Removing the route drops the type again
+    TEST_ASSERT_EQUAL(ESP_OK, r.router.register_message_type(TELEMETRY, RouteContext::NONE, nullptr, nullptr));
+    TEST_ASSERT_EQUAL(RouteContext::NONE, r.router.route_context(TELEMETRY));
+}
+
+TEST_CASE("Router refuses to route built-in and reserved message types", "[router]")
+{
+    Router r;
+    Calls calls;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE,
+                      r.router.register_message_type(MessageType::DATA, RouteContext::INLINE, record_routed, &calls));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, r.router.register_message_type(MessageType::CHANNEL_ANNOUNCE,
+                                                                            RouteContext::NONE, nullptr, nullptr));
+    TEST_ASSERT_EQUAL(RouteContext::WORKER, r.router.route_context(MessageType::CHANNEL_ANNOUNCE));
+
+    // Wire markers, not MessageTypes
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.register_message_type(static_cast<MessageType>(0xD1),
+                                                                          RouteContext::INLINE, record_routed, &calls));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, r.router.register_message_type(static_cast<MessageType>(0xE3),
+                                                                          RouteContext::INLINE, record_routed, &calls));
+
+    // INLINE and WORKER need a handler; APP takes none
+    constexpr auto CUSTOM = static_cast<MessageType>(0x40);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                      r.router.register_message_type(CUSTOM, RouteContext::WORKER, nullptr, nullptr));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                      r.router.register_message_type(CUSTOM, RouteContext::APP, record_routed, &calls));
+    TEST_ASSERT_EQUAL(RouteContext::NONE, r.router.route_context(CUSTOM));
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+}
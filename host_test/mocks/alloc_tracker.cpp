@@ -0,0 +1,72 @@
+#include "alloc_tracker.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// glibc exports its allocator under __libc_* names, so malloc() can be wrapped
+// without dlsym(). Sanitizers bring their own allocator: leave it alone there.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define ALLOC_TRACKER_HOOK_MALLOC 1
+#else
+#define ALLOC_TRACKER_HOOK_MALLOC 0
+#endif
+
+namespace {
+std::atomic<uint64_t> allocations{0};
+std::atomic<size_t> last_size{0};
+
+inline void record(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    last_size.store(size, std::memory_order_relaxed);
+}
+
+void *new_alloc(size_t size)
+{
+#if !ALLOC_TRACKER_HOOK_MALLOC
+    record(size); // Otherwise malloc() below counts it
+#endif
+    void *ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) abort();
+    return ptr;
+}
+} // namespace
+
+uint64_t AllocTracker::allocations() { return ::allocations.load(std::memory_order_relaxed); }
+size_t AllocTracker::last_size() { return ::last_size.load(std::memory_order_relaxed); }
+bool AllocTracker::hooks_malloc() { return ALLOC_TRACKER_HOOK_MALLOC; }
+
+#if ALLOC_TRACKER_HOOK_MALLOC
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    record(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    record(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    record(size);
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+void *operator new(size_t size) { return new_alloc(size); }
+void *operator new[](size_t size) { return new_alloc(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return new_alloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return new_alloc(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
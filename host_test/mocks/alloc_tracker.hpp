@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Counts heap allocations made by the whole process, from every thread:
+// operator new and, on glibc, malloc(), calloc() and realloc() as well, which
+// is where FreeRTOS queues, timers and tasks come from on the Linux target.
+// Link alloc_tracker.cpp into the test app to install the hooks.
+namespace AllocTracker {
+uint64_t allocations();
+size_t last_size(); // Size of the most recent allocation, to tell where it came from
+bool hooks_malloc(); // False where only operator new is seen
+} // namespace AllocTracker
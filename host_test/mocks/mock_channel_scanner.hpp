@@ -5,9 +5,15 @@
 class MockChannelScanner : public IChannelScanner
 {
 public:
-    inline ScanResult scan(uint8_t start_channel) override
+    inline uint32_t start(uint8_t start_channel, ScanCallback on_done, void *ctx) override
     {
-        return {start_channel, false};
+        if (on_done) on_done({start_channel, false, 0, 0}, ctx);
+        return 0;
     }
+    inline uint32_t on_dwell_elapsed() override { return 0; }
+    inline void on_hub_found() override {}
+    inline bool is_scanning() const override { return false; }
+    inline void cancel() override {}
+    inline void record_hub_channel(uint8_t channel) override {}
     inline void update_node_info(NodeId id, NodeType type) override {}
 };
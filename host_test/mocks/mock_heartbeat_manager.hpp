@@ -8,6 +8,17 @@ public:
     inline esp_err_t init(uint32_t interval_ms, NodeType type) override { return ESP_OK; }
     inline void update_node_id(NodeId id) override {}
     inline esp_err_t deinit() override { return ESP_OK; }
-    inline void handle_response(NodeId hub_id, uint8_t channel) override {}
-    inline void handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms) override {}
+    inline void notify_link_activity(NodeId peer_id) override {}
+    inline void handle_response(NodeId hub_id, uint8_t channel, uint32_t next_heartbeat_ms) override {}
+    inline void handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms) override {}
+    inline void handle_time_sample(uint64_t origin_ms, uint64_t hub_receive_ms, uint64_t hub_send_ms,
+                                   uint64_t local_receive_ms) override
+    {
+    }
+    inline bool to_network_time(uint64_t local_ms, uint64_t &network_ms) override { return false; }
+    inline bool to_local_time(uint64_t network_ms, uint64_t &local_ms) override { return false; }
+    inline void set_wake_period(uint32_t period_ms) override {}
+    inline void handle_wake_slot(uint32_t period_ms, uint32_t offset_ms) override {}
+    inline void handle_downlink_pending(uint8_t count) override {}
+    inline uint8_t downlink_pending() const override { return 0; }
 };
@@ -1,15 +1,15 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
-#include <vector>
 #include <optional>
 
 class MockMessageCodec : public IMessageCodec
 {
 public:
-    inline std::vector<uint8_t> encode(const MessageHeader &header, const void *payload, size_t len) override
+    inline size_t encode(const MessageHeader &header, const void *payload, size_t len, uint8_t *out,
+                         size_t out_len) override
     {
-        return std::vector<uint8_t>();
+        return 0;
     }
     inline std::optional<MessageHeader> decode_header(const uint8_t *data, size_t len) override
     {
@@ -23,4 +23,42 @@ public:
     {
         return 0;
     }
+    inline size_t encode_wire(const uint8_t *dest_mac,
+                              const uint8_t *frame,
+                              size_t len,
+                              uint16_t peer_caps,
+                              bool retransmission,
+                              uint8_t *out,
+                              size_t out_len) override
+    {
+        return 0;
+    }
+    inline size_t decode_wire(const uint8_t *src_mac, const uint8_t *wire, size_t len, uint8_t *out, size_t out_len) override
+    {
+        return 0;
+    }
+    inline void confirm_delivery(const uint8_t *dest_mac, const uint8_t *frame, size_t len) override
+    {
+    }
+    inline uint16_t capabilities() const override
+    {
+        return PeerCapability::NONE;
+    }
+    inline void set_capabilities(uint16_t capabilities) override
+    {
+    }
+    inline esp_err_t set_local_mac(const uint8_t *mac) override
+    {
+        return ESP_OK;
+    }
+    inline esp_err_t install_session_key(const uint8_t *mac, const uint8_t *key) override
+    {
+        return ESP_OK;
+    }
+    inline void remove_session_key(const uint8_t *mac) override
+    {
+    }
+    inline void flush_replay_floors() override
+    {
+    }
 };
@@ -6,7 +6,14 @@ class MockMessageRouter : public IMessageRouter
 {
 public:
     inline void handle_packet(const RxPacket &packet) override {}
-    inline bool should_dispatch_to_worker(MessageType type) override { return false; }
+    inline RouteContext route_context(MessageType type) override { return RouteContext::APP; }
     inline void set_app_queue(QueueHandle_t app_queue) override {}
     inline void set_node_info(NodeId id, NodeType type) override {}
+    inline esp_err_t subscribe(const AppSubscription &subscription, int &id) override { return ESP_ERR_NO_MEM; }
+    inline esp_err_t unsubscribe(int id) override { return ESP_ERR_NOT_FOUND; }
+    inline esp_err_t register_message_type(MessageType type, RouteContext context, MessageHandler handler,
+                                           void *ctx) override
+    {
+        return ESP_OK;
+    }
 };
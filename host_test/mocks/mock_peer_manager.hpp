@@ -1,11 +1,28 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
+#include <algorithm>
+#include <cstring>
 #include <vector>
 
 class MockPeerManager : public IPeerManager
 {
 public:
+    using IPeerManager::for_each;
+
+    struct Delivery
+    {
+        uint8_t mac[6];
+        bool delivered;
+        uint8_t retries;
+        uint32_t rtt_ms;
+    };
+
+    std::vector<PeerInfo> peers;                      // Returned by get_all()
+    uint16_t capabilities = PeerCapability::NONE; // Returned by get_capabilities()
+    bool offline          = false;                // Returned by is_offline()
+    std::vector<Delivery> deliveries;             // Every call to record_delivery()
+
     inline esp_err_t add(NodeId id, const uint8_t *mac, uint8_t channel, NodeType type, uint32_t heartbeat_interval_ms = 0) override
     {
         return ESP_OK;
@@ -18,17 +35,67 @@ public:
     {
         return false;
     }
-    inline std::vector<PeerInfo> get_all() override
+    inline size_t get_all(PeerInfo *out, size_t max) override
     {
-        return {};
+        size_t count = std::min(max, peers.size());
+        std::copy_n(peers.begin(), count, out);
+        return count;
     }
-    inline std::vector<NodeId> get_offline(uint64_t now_ms) override
+    inline size_t get_offline(uint64_t now_ms, NodeId *out, size_t max) override
     {
-        return {};
+        return 0;
+    }
+    inline void for_each(PeerVisitor visit, void *ctx) override
+    {
+        for (const auto &peer : peers) visit(peer, ctx);
     }
     inline void update_last_seen(NodeId id, uint64_t now_ms) override
     {
     }
+    inline esp_err_t set_capabilities(NodeId id, uint16_t capabilities) override
+    {
+        return ESP_OK;
+    }
+    inline uint16_t get_capabilities(const uint8_t *mac) override
+    {
+        return capabilities;
+    }
+    inline bool is_offline(const uint8_t *mac) override
+    {
+        return offline;
+    }
+    inline void record_rx(NodeId id, int8_t rssi) override {}
+    inline void record_delivery(const uint8_t *mac, bool delivered, uint8_t retries, uint32_t rtt_ms) override
+    {
+        Delivery delivery = {{}, delivered, retries, rtt_ms};
+        memcpy(delivery.mac, mac, 6);
+        deliveries.push_back(delivery);
+    }
+    inline uint32_t ack_timeout_ms(const uint8_t *mac, uint8_t retries) override
+    {
+        return LinkMetrics{}.ack_timeout_ms(retries);
+    }
+    inline esp_err_t set_session_key(NodeId id, const uint8_t *key) override
+    {
+        return ESP_OK;
+    }
+    inline bool get_session_key(NodeId id, uint8_t *key) override
+    {
+        return false;
+    }
+    inline esp_err_t set_channel_all(uint8_t channel) override
+    {
+        return ESP_OK;
+    }
+    inline void set_event_queue(QueueHandle_t queue) override
+    {
+    }
+    inline void check_liveness(uint64_t now_ms) override
+    {
+    }
+    inline void set_wake_period(uint32_t period_ms) override
+    {
+    }
     inline esp_err_t load_from_storage(uint8_t &wifi_channel) override
     {
         return ESP_OK;
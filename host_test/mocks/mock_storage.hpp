@@ -1,6 +1,8 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
+#include <algorithm>
+#include <cstring>
 #include <vector>
 
 class MockStorage : public IStorage
@@ -11,24 +13,84 @@ public:
     bool save_called    = false;
     int save_call_count = 0;
 
-    inline esp_err_t load(uint8_t &wifi_channel, std::vector<PersistentPeer> &peers) override
+    inline esp_err_t load(uint8_t &wifi_channel, PersistentPeer *peers, size_t max, size_t &count) override
     {
         wifi_channel = saved_channel;
-        peers        = saved_peers;
+        count        = std::min(max, saved_peers.size());
+        std::copy_n(saved_peers.begin(), count, peers);
         return ESP_OK;
     }
 
     inline esp_err_t save(uint8_t wifi_channel,
-                          const std::vector<PersistentPeer> &peers,
+                          const PersistentPeer *peers,
+                          size_t count,
                           bool force_nvs_commit) override
     {
         saved_channel = wifi_channel;
-        saved_peers   = peers;
+        saved_peers.assign(peers, peers + count);
         save_called   = true;
         save_call_count++;
         return ESP_OK;
     }
 
+    uint32_t epoch = 0;
+    inline esp_err_t next_epoch(uint32_t &out) override
+    {
+        out = ++epoch;
+        return ESP_OK;
+    }
+
+    uint8_t channel_hints[CHANNEL_HINT_COUNT] = {};
+    int hint_save_count                       = 0;
+    inline esp_err_t load_channel_hints(uint8_t *hints, size_t count) override
+    {
+        for (size_t i = 0; i < count; i++) hints[i] = i < CHANNEL_HINT_COUNT ? channel_hints[i] : 0;
+        return ESP_OK;
+    }
+    inline esp_err_t save_channel_hints(const uint8_t *hints, size_t count) override
+    {
+        for (size_t i = 0; i < CHANNEL_HINT_COUNT; i++) channel_hints[i] = i < count ? hints[i] : 0;
+        hint_save_count++;
+        return ESP_OK;
+    }
+
+    struct ReplayFloor
+    {
+        uint8_t mac[6];
+        uint32_t key_check;
+        uint32_t epoch;
+        uint32_t counter;
+    };
+    std::vector<ReplayFloor> replay_floors;
+    int replay_floor_saves = 0; // Calls to save_replay_floor()
+    inline esp_err_t load_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t &epoch,
+                                       uint32_t &counter) override
+    {
+        for (const auto &floor : replay_floors) {
+            if (memcmp(floor.mac, mac, 6) == 0 && floor.key_check == key_check) {
+                epoch   = floor.epoch;
+                counter = floor.counter;
+                return ESP_OK;
+            }
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+    inline esp_err_t save_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t epoch,
+                                       uint32_t counter) override
+    {
+        replay_floor_saves++;
+        for (auto &floor : replay_floors) {
+            if (memcmp(floor.mac, mac, 6) == 0) {
+                floor = {{}, key_check, epoch, counter};
+                memcpy(floor.mac, mac, 6);
+                return ESP_OK;
+            }
+        }
+        replay_floors.push_back({{}, key_check, epoch, counter});
+        memcpy(replay_floors.back().mac, mac, 6);
+        return ESP_OK;
+    }
+
     void reset()
     { // ← Helper pra limpar entre testes
         saved_channel = 0;
@@ -1,16 +1,48 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
+#include <cstring>
+#include <vector>
 
 class MockTxManager : public ITxManager
 {
 public:
+    struct LogicalAck
+    {
+        uint8_t mac[6];
+        uint16_t sequence;
+    };
+
+    std::vector<TxPacket> queued; // Every packet passed to queue_packet()
+    std::vector<TxPacket> held;   // Every packet passed to hold_packet()
+    int release_count = 0;        // Calls to release_held()
+    int hub_found     = 0;        // Calls to notify_hub_found()
+    std::vector<LogicalAck> logical_acks; // Every call to notify_logical_ack()
+
     inline esp_err_t init(uint32_t stack_size, UBaseType_t priority) override { return ESP_OK; }
     inline esp_err_t deinit() override { return ESP_OK; }
-    inline esp_err_t queue_packet(const TxPacket &packet) override { return ESP_OK; }
+    inline esp_err_t queue_packet(const TxPacket &packet) override
+    {
+        queued.push_back(packet);
+        return ESP_OK;
+    }
+    inline esp_err_t schedule_ack(const TxPacket &ack_packet, uint16_t ack_sequence) override { return ESP_OK; }
+    inline esp_err_t hold_packet(const TxPacket &packet) override
+    {
+        held.push_back(packet);
+        return ESP_OK;
+    }
+    inline void release_held(const uint8_t *mac) override { release_count++; }
+    inline size_t held_count(const uint8_t *mac) override { return held.size(); }
     inline void notify_physical_fail() override {}
     inline void notify_link_alive() override {}
-    inline void notify_logical_ack() override {}
-    inline void notify_hub_found() override {}
+    inline void notify_logical_ack(const uint8_t *mac, uint16_t sequence) override
+    {
+        LogicalAck ack;
+        memcpy(ack.mac, mac, 6);
+        ack.sequence = sequence;
+        logical_acks.push_back(ack);
+    }
+    inline void notify_hub_found() override { hub_found++; }
     inline TaskHandle_t get_task_handle() const override { return nullptr; }
 };
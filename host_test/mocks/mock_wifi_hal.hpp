@@ -0,0 +1,56 @@
+#pragma once
+
+#include "espnow_interfaces.hpp"
+#include <vector>
+
+// Radio stand-in: records the channel of every frame sent and pretends a hub on
+// hub_channel answers each of them. Waits return immediately instead of blocking.
+class MockWiFiHAL : public IWiFiHAL
+{
+public:
+    uint8_t channel     = 1;
+    uint8_t hub_channel = 0; // 0: no hub in range
+    bool listening      = true;
+    bool held           = false; // hold_listening(), independent of listening
+    std::vector<uint8_t> probed_channels;
+
+    // True once per frame sent on hub_channel
+    inline bool take_response()
+    {
+        bool answered     = pending_response_;
+        pending_response_ = false;
+        return answered;
+    }
+
+    inline esp_err_t set_channel(uint8_t ch) override
+    {
+        channel = ch;
+        return ESP_OK;
+    }
+    inline esp_err_t get_channel(uint8_t *ch) override
+    {
+        *ch = channel;
+        return ESP_OK;
+    }
+    inline esp_err_t send_packet(const uint8_t *mac, const uint8_t *data, size_t len) override
+    {
+        probed_channels.push_back(channel);
+        pending_response_ = (channel == hub_channel);
+        return ESP_OK;
+    }
+    inline bool wait_for_event(uint32_t event_mask, uint32_t timeout_ms) override { return take_response(); }
+    inline void set_task_to_notify(TaskHandle_t task_handle) override {}
+    inline esp_err_t set_listening(bool on) override
+    {
+        listening = on;
+        return ESP_OK;
+    }
+    inline esp_err_t hold_listening(bool hold) override
+    {
+        held = hold;
+        return ESP_OK;
+    }
+
+private:
+    bool pending_response_ = false;
+};
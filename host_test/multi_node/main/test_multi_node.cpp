@@ -0,0 +1,317 @@
+#include "esp_system.h"
+#include "sim_node.hpp"
+#include "unity.h"
+extern "C" {
+#include "Mockesp_now.h"
+#include "Mockesp_wifi.h"
+}
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+static constexpr NodeType SENSOR_TYPE      = 0x02;
+static constexpr size_t SENSOR_COUNT       = 50;
+static constexpr uint32_t PAIR_TIMEOUT_MS  = 60000;
+static constexpr uint64_t PAIR_RETRY_US    = 500000; // Stands in for the 5 s periodic pair request
+static constexpr uint64_t SCENARIO_LIMIT_US = 60000000;
+
+static void ignore_radio_driver()
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_mod_peer_IgnoreAndReturn(ESP_OK);
+    esp_wifi_get_channel_IgnoreAndReturn(ESP_OK);
+}
+
+// A hub (node id 1) and SENSOR_COUNT sensors (ids 2 and up) on one medium
+struct Network
+{
+    SimMedium medium;
+    std::unique_ptr<SimNode> hub;
+    std::vector<std::unique_ptr<SimNode>> sensors;
+
+    explicit Network(uint32_t seed, const SimLink &link, uint8_t hub_channel = 1, uint8_t sensor_channel = 1,
+                     size_t sensor_count = SENSOR_COUNT)
+        : medium(seed)
+    {
+        medium.set_default_link(link);
+        uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, ReservedIds::HUB};
+        hub = std::make_unique<SimNode>(medium, mac, ReservedIds::HUB, ReservedTypes::HUB, hub_channel);
+        hub->pairing.start(PAIR_TIMEOUT_MS);
+        for (size_t i = 0; i < sensor_count; i++) {
+            mac[5] = static_cast<uint8_t>(2 + i);
+            sensors.push_back(std::make_unique<SimNode>(medium, mac, mac[5], SENSOR_TYPE, sensor_channel));
+        }
+    }
+
+    size_t paired() const
+    {
+        size_t count = 0;
+        for (auto &sensor : sensors) count += sensor->paired_at_us != 0;
+        return count;
+    }
+
+    // Every sensor asks to pair at once and retries until the hub answers.
+    // Returns the virtual time until the last one paired, 0 if some never did.
+    uint64_t pair_all()
+    {
+        for (auto &sensor : sensors) sensor->restart_pairing(PAIR_TIMEOUT_MS);
+        uint64_t start_us = medium.now_us();
+        while (paired() < sensors.size() && medium.now_us() - start_us < SCENARIO_LIMIT_US) {
+            medium.run_for(PAIR_RETRY_US);
+            for (auto &sensor : sensors) {
+                if (sensor->paired_at_us == 0) sensor->restart_pairing(PAIR_TIMEOUT_MS);
+            }
+        }
+        if (paired() < sensors.size()) return 0;
+
+        uint64_t last_us = 0;
+        for (auto &sensor : sensors) last_us = std::max(last_us, sensor->paired_at_us);
+        return last_us - start_us;
+    }
+};
+
+TEST_CASE("A hub and 50 sensors pair over a lossy medium", "[multi_node]")
+{
+    ignore_radio_driver();
+    SimLink link;
+    link.loss_pct   = 20;
+    link.latency_us = 1000;
+    link.jitter_us  = 3000;
+    Network net(42, link);
+
+    uint64_t convergence_us = net.pair_all();
+    printf("pairing: %u sensors in %llu ms, %u frames sent, %u lost\n", (unsigned)net.paired(),
+           (unsigned long long)(convergence_us / 1000), (unsigned)net.medium.stats().sent,
+           (unsigned)net.medium.stats().lost);
+
+    TEST_ASSERT_NOT_EQUAL(0, convergence_us);
+    TEST_ASSERT_EQUAL(SENSOR_COUNT, net.paired());
+    // More sensors than ESP-NOW peers: the hub keeps the most recently paired.
+    // Each response went out while its sensor still had an entry; the evicted
+    // ones cannot be reached until they pair again.
+    PeerInfo hub_peers[MAX_PEERS + 1];
+    TEST_ASSERT_EQUAL(MAX_PEERS, net.hub->peers.get_all(hub_peers, MAX_PEERS + 1));
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        // The pair request that added it counts as hearing from it
+        TEST_ASSERT_TRUE(hub_peers[i].online);
+    }
+    size_t reachable = 0;
+    for (auto &sensor : net.sensors) {
+        uint8_t mac[6];
+        reachable += net.hub->peers.find_mac(sensor->id, mac);
+    }
+    TEST_ASSERT_EQUAL(MAX_PEERS, reachable);
+    for (auto &sensor : net.sensors) {
+        TEST_ASSERT_FALSE(sensor->pairing.is_active());
+        // No network key is set, so no session key is agreed
+        TEST_ASSERT_EQUAL_HEX16(SIM_CAPABILITIES & ~PeerCapability::AEAD, sensor->peers.get_capabilities(net.hub->mac()));
+    }
+}
+
+TEST_CASE("The same seed replays the same run", "[multi_node]")
+{
+    ignore_radio_driver();
+    SimLink link;
+    link.loss_pct      = 30;
+    link.duplicate_pct = 5;
+    link.jitter_us     = 5000;
+
+    Network first(7, link, 1, 1, 10);
+    Network second(7, link, 1, 1, 10);
+    TEST_ASSERT_EQUAL_UINT64(first.pair_all(), second.pair_all());
+    TEST_ASSERT_EQUAL(first.medium.stats().sent, second.medium.stats().sent);
+    TEST_ASSERT_EQUAL(first.medium.stats().lost, second.medium.stats().lost);
+    TEST_ASSERT_EQUAL(first.medium.stats().duplicated, second.medium.stats().duplicated);
+    for (size_t i = 0; i < first.sensors.size(); i++) {
+        TEST_ASSERT_EQUAL_UINT64(first.sensors[i]->paired_at_us, second.sensors[i]->paired_at_us);
+    }
+}
+
+TEST_CASE("The hub answers heartbeats only from sensors in its peer table", "[multi_node]")
+{
+    ignore_radio_driver();
+    Network net(1, SimLink());
+    TEST_ASSERT_NOT_EQUAL(0, net.pair_all());
+
+    // Staggered over one second, as the phase offsets spread them
+    for (size_t i = 0; i < net.sensors.size(); i++) {
+        SimNode *sensor = net.sensors[i].get();
+        net.medium.schedule(i * 1000000 / SENSOR_COUNT, [sensor]() { sensor->send_heartbeat(); });
+    }
+    net.medium.run_for(2000000);
+
+    // Every heartbeat is heard, but a response can only be unicast to a sensor
+    // the hub still has a peer entry for
+    TEST_ASSERT_EQUAL(SENSOR_COUNT, net.hub->received[MessageType::HEARTBEAT]);
+    size_t answered = 0;
+    for (auto &sensor : net.sensors) {
+        uint8_t mac[6];
+        uint32_t expected = net.hub->peers.find_mac(sensor->id, mac) ? 1 : 0;
+        TEST_ASSERT_EQUAL(expected, sensor->received[MessageType::HEARTBEAT_RESPONSE]);
+        answered += expected;
+    }
+    TEST_ASSERT_EQUAL(MAX_PEERS, answered);
+    TEST_ASSERT_EQUAL(SENSOR_COUNT - MAX_PEERS, net.hub->hal.unregistered);
+    TEST_ASSERT_EQUAL(0, net.hub->rejected);
+}
+
+TEST_CASE("A data burst from every sensor measures hub throughput", "[multi_node]")
+{
+    ignore_radio_driver();
+    SimLink link;
+    link.loss_pct  = 10;
+    link.jitter_us = 2000;
+    Network net(3, link);
+    TEST_ASSERT_NOT_EQUAL(0, net.pair_all());
+
+    const size_t frames_per_sensor = 20;
+    uint8_t payload[100];
+    uint64_t start_us = net.medium.now_us();
+    for (size_t f = 0; f < frames_per_sensor; f++) {
+        for (auto &sensor : net.sensors) {
+            memset(payload, static_cast<int>(f), sizeof(payload));
+            TEST_ASSERT_EQUAL(ESP_OK, sensor->send_data(ReservedIds::HUB, 1, payload, sizeof(payload)));
+        }
+    }
+    net.medium.run_until_done([] { return false; }, 10000000);
+    uint64_t elapsed_us = net.medium.now_us() - start_us;
+
+    uint32_t frames = net.hub->received[MessageType::DATA];
+    printf("burst: %u/%u frames, %u rejected, %u bytes in %llu ms, %llu kbit/s\n", (unsigned)frames,
+           (unsigned)(frames_per_sensor * SENSOR_COUNT), (unsigned)net.hub->rejected, (unsigned)net.hub->data_bytes,
+           (unsigned long long)(elapsed_us / 1000), (unsigned long long)(net.hub->data_bytes * 8000ULL / elapsed_us));
+
+    // The sensors share one channel: the burst takes at least its airtime
+    uint64_t airtime_us = frames_per_sensor * SENSOR_COUNT * SimMedium::PHY_OVERHEAD_US;
+    TEST_ASSERT_GREATER_THAN_UINT64(airtime_us, elapsed_us);
+    TEST_ASSERT_LESS_THAN_UINT64(2000000, elapsed_us);
+    TEST_ASSERT_EQUAL(frames * sizeof(payload), net.hub->data_bytes);
+    TEST_ASSERT_UINT32_WITHIN(100, frames_per_sensor * SENSOR_COUNT * 9 / 10, frames + net.hub->rejected);
+}
+
+TEST_CASE("Sensors on the wrong channel find the hub by scanning", "[multi_node]")
+{
+    ignore_radio_driver();
+    Network net(5, SimLink(), 6, 1, 8);
+
+    // Pairing requests on channel 1 go unheard
+    for (auto &sensor : net.sensors) sensor->restart_pairing(PAIR_TIMEOUT_MS);
+    net.medium.run_for(1000000);
+    TEST_ASSERT_EQUAL(0, net.paired());
+    TEST_ASSERT_NOT_EQUAL(0, net.medium.stats().off_channel);
+
+    for (auto &sensor : net.sensors) sensor->scan(1);
+    bool all_done = net.medium.run_until_done(
+        [&net] {
+            for (auto &sensor : net.sensors) {
+                if (!sensor->scan_done) return false;
+            }
+            return true;
+        },
+        SCENARIO_LIMIT_US);
+    TEST_ASSERT_TRUE(all_done);
+
+    for (auto &sensor : net.sensors) {
+        TEST_ASSERT_TRUE(sensor->scan_result.hub_found);
+        TEST_ASSERT_EQUAL(6, sensor->scan_result.channel);
+        TEST_ASSERT_EQUAL(6, net.medium.channel(sensor->station));
+    }
+
+    // Pairing on the hub's channel now completes
+    TEST_ASSERT_NOT_EQUAL(0, net.pair_all());
+}
+
+TEST_CASE("Pairing in the clear never downgrades an encrypted link", "[multi_node][aead]")
+{
+    ignore_radio_driver();
+    const uint8_t network_key[SecureEnvelope::KEY_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    const uint8_t hub_mac[6]                            = {0x24, 0x0A, 0xC4, 0x00, 0x00, ReservedIds::HUB};
+    const uint8_t plain_mac[6]                          = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x02};
+    const uint8_t keyed_mac[6]                          = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x03};
+
+    // A hub that requires encryption turns away a sensor that cannot offer it
+    {
+        SimMedium medium(3);
+        SimNode hub(medium, hub_mac, ReservedIds::HUB, ReservedTypes::HUB, 1);
+        hub.pairing.set_network_key(network_key);
+        hub.pairing.start(PAIR_TIMEOUT_MS);
+        SimNode plain(medium, plain_mac, 2, SENSOR_TYPE, 1, SIM_CAPABILITIES & ~PeerCapability::AEAD);
+        plain.restart_pairing(PAIR_TIMEOUT_MS);
+        medium.run_for(PAIR_RETRY_US);
+
+        TEST_ASSERT_EQUAL(1, plain.received[MessageType::PAIR_RESPONSE]);
+        TEST_ASSERT_TRUE(plain.pairing.is_active());
+        uint8_t mac[6];
+        TEST_ASSERT_FALSE(hub.peers.find_mac(2, mac));
+    }
+
+    // A keyed sensor ignores a cleartext acceptance and keeps its session key
+    SimMedium medium(3);
+    SimNode hub(medium, hub_mac, ReservedIds::HUB, ReservedTypes::HUB, 1, SIM_CAPABILITIES & ~PeerCapability::AEAD);
+    hub.pairing.start(PAIR_TIMEOUT_MS);
+    SimNode keyed(medium, keyed_mac, 3, SENSOR_TYPE, 1);
+    keyed.pairing.set_network_key(network_key);
+    keyed.peers.add(ReservedIds::HUB, hub_mac, 1, ReservedTypes::HUB);
+    TEST_ASSERT_EQUAL(ESP_OK, keyed.peers.set_session_key(ReservedIds::HUB, network_key));
+    TEST_ASSERT_EQUAL(ESP_OK, keyed.codec.install_session_key(hub_mac, network_key));
+    keyed.restart_pairing(PAIR_TIMEOUT_MS);
+    medium.run_for(PAIR_RETRY_US);
+
+    TEST_ASSERT_EQUAL(1, keyed.received[MessageType::PAIR_RESPONSE]);
+    TEST_ASSERT_TRUE(keyed.pairing.is_active());
+    uint8_t key[SecureEnvelope::KEY_SIZE];
+    TEST_ASSERT_TRUE(keyed.peers.get_session_key(ReservedIds::HUB, key));
+
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    MessageHeader header  = {};
+    header.msg_type       = MessageType::DATA;
+    header.sender_node_id = 3;
+    header.dest_node_id   = ReservedIds::HUB;
+    size_t frame_len      = keyed.codec.encode(header, nullptr, 0, frame, sizeof(frame));
+    TEST_ASSERT_NOT_EQUAL(0, keyed.codec.encode_wire(hub_mac, frame, frame_len, PeerCapability::NONE, false, wire,
+                                                     sizeof(wire)));
+    TEST_ASSERT_EQUAL(SecureEnvelope::MARKER, wire[0]);
+}
+
+TEST_CASE("A hub that cannot agree a session key keeps no peer entry", "[multi_node][aead]")
+{
+    ignore_radio_driver();
+    const uint8_t network_key[SecureEnvelope::KEY_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    const uint8_t hub_mac[6]                            = {0x24, 0x0A, 0xC4, 0x00, 0x00, ReservedIds::HUB};
+    const uint8_t sensor_mac[6]                         = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x02};
+
+    SimMedium medium(5);
+    SimNode hub(medium, hub_mac, ReservedIds::HUB, ReservedTypes::HUB, 1);
+    hub.pairing.set_network_key(network_key);
+    hub.pairing.start(PAIR_TIMEOUT_MS);
+    SimNode sensor(medium, sensor_mac, 2, SENSOR_TYPE, 1);
+    sensor.pairing.set_network_key(network_key);
+
+    // Every key slot taken, so the key for the sensor cannot be installed
+    uint8_t other_mac[6] = {0x24, 0x0A, 0xC4, 0x00, 0x01, 0x00};
+    for (size_t i = 0; i < MAX_PEERS; i++) {
+        other_mac[5] = static_cast<uint8_t>(i);
+        TEST_ASSERT_EQUAL(ESP_OK, hub.codec.install_session_key(other_mac, network_key));
+    }
+
+    sensor.restart_pairing(PAIR_TIMEOUT_MS);
+    medium.run_for(PAIR_RETRY_US);
+
+    // Refused, and not left behind in the table as a cleartext peer
+    TEST_ASSERT_EQUAL(1, sensor.received[MessageType::PAIR_RESPONSE]);
+    TEST_ASSERT_TRUE(sensor.pairing.is_active());
+    uint8_t mac[6];
+    TEST_ASSERT_FALSE(hub.peers.find_mac(2, mac));
+    uint8_t key[SecureEnvelope::KEY_SIZE];
+    TEST_ASSERT_FALSE(hub.peers.get_session_key(2, key));
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
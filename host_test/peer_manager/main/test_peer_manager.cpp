@@ -1,11 +1,14 @@
 #include "esp_system.h"
 #include "mock_storage.hpp"
 #include "peer_manager.hpp"
+#include "static_vector.hpp"
 #include "unity.h"
 extern "C" {
 #include "Mockesp_now.h"
 }
+#include <algorithm>
 #include <cstring>
+#include <vector>
 
 enum class TestNodeId : NodeId
 {
@@ -21,6 +24,14 @@ enum class TestNodeType : NodeType
     SENSOR = 2
 };
 
+// Snapshot of the peer table in a vector
+static std::vector<PeerInfo> all_peers(IPeerManager &pm)
+{
+    PeerInfo peers[MAX_PEERS];
+    size_t count = pm.get_all(peers, MAX_PEERS);
+    return std::vector<PeerInfo>(peers, peers + count);
+}
+
 TEST_CASE("PeerManager can add and find peers", "[peer_manager]")
 {
     esp_now_add_peer_IgnoreAndReturn(ESP_OK);
@@ -57,13 +68,13 @@ TEST_CASE("PeerManager handles LRU", "[peer_manager]")
     }
 
     // Check if list is full
-    TEST_ASSERT_EQUAL(MAX_PEERS, pm.get_all().size());
+    TEST_ASSERT_EQUAL(MAX_PEERS, all_peers(pm).size());
 
     // Add one more, oldest (ID 100) should be removed
     uint8_t mac_new[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
     pm.add((TestNodeId)200, mac_new, 1, TestNodeType::SENSOR);
 
-    TEST_ASSERT_EQUAL(MAX_PEERS, pm.get_all().size());    // List is still full
+    TEST_ASSERT_EQUAL(MAX_PEERS, all_peers(pm).size());    // List is still full
     TEST_ASSERT_FALSE(pm.find_mac((NodeId)100, nullptr)); // Oldest peer should be removed
     TEST_ASSERT_TRUE(pm.find_mac((NodeId)200, nullptr));  // New peer should be added
 }
@@ -86,8 +97,8 @@ TEST_CASE("PeerManager LRU with duplicate when full", "[peer_manager]")
     pm.add((TestNodeId)1, existing_mac, 1, TestNodeType::SENSOR);
 
     // Não deve remover ninguém, apenas mover para frente
-    TEST_ASSERT_EQUAL(MAX_PEERS, pm.get_all().size());
-    TEST_ASSERT_EQUAL((NodeId)1, pm.get_all()[0].node_id); // Must be the first
+    TEST_ASSERT_EQUAL(MAX_PEERS, all_peers(pm).size());
+    TEST_ASSERT_EQUAL((NodeId)1, all_peers(pm)[0].node_id); // Must be the first
 }
 
 TEST_CASE("PeerManager detects offline peers", "[peer_manager]")
@@ -107,12 +118,47 @@ TEST_CASE("PeerManager detects offline peers", "[peer_manager]")
     // Offline threshold is 2.5 * 1000 = 2500ms.
     // So at 12501ms it should be offline.
 
-    auto offline = pm.get_offline(12000);
-    TEST_ASSERT_EQUAL(0, offline.size());
+    NodeId offline[MAX_PEERS];
+    TEST_ASSERT_EQUAL(0, pm.get_offline(12000, offline, MAX_PEERS));
+
+    TEST_ASSERT_EQUAL(1, pm.get_offline(12501, offline, MAX_PEERS));
+    TEST_ASSERT_EQUAL(to_node_id(TestNodeId::TEST_SENSOR_A), offline[0]);
+    TEST_ASSERT_EQUAL(0, pm.get_offline(12501, offline, 0));
+}
+
+TEST_CASE("PeerManager times out sleeping peers by the wake period", "[peer_manager]")
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_mod_peer_IgnoreAndReturn(ESP_OK);
+
+    MockStorage storage;
+    RealPeerManager pm(storage);
+    pm.set_wake_period(10000);
+
+    uint8_t awake_mac[6]    = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06};
+    uint8_t sleeping_mac[6] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x07};
+    pm.add(TestNodeId::TEST_SENSOR_A, awake_mac, 1, TestNodeType::SENSOR, 1000);
+    pm.add(TestNodeId::TEST_SENSOR_B, sleeping_mac, 1, TestNodeType::SENSOR, 1000);
+    pm.set_capabilities(TestNodeId::TEST_SENSOR_B, PeerCapability::WAKE_SLOTS);
+    TEST_ASSERT_FALSE(pm.is_offline(awake_mac)); // Not heard from yet, but not expired either
+    pm.update_last_seen(TestNodeId::TEST_SENSOR_A, 10000);
+    pm.update_last_seen(TestNodeId::TEST_SENSOR_B, 10000);
 
-    offline = pm.get_offline(12501);
-    TEST_ASSERT_EQUAL(1, offline.size());
+    // 2.5 heartbeat intervals for the one, 2.5 wake periods for the sleeper
+    NodeId offline[MAX_PEERS];
+    TEST_ASSERT_EQUAL(1, pm.get_offline(12501, offline, MAX_PEERS));
     TEST_ASSERT_EQUAL(to_node_id(TestNodeId::TEST_SENSOR_A), offline[0]);
+    TEST_ASSERT_EQUAL(1, pm.get_offline(35000, offline, MAX_PEERS));
+    TEST_ASSERT_EQUAL(2, pm.get_offline(35001, offline, MAX_PEERS));
+
+    pm.check_liveness(12600);
+    TEST_ASSERT_TRUE(pm.is_offline(awake_mac));
+    TEST_ASSERT_FALSE(pm.is_offline(sleeping_mac));
+    pm.check_liveness(35100);
+    TEST_ASSERT_TRUE(pm.is_offline(sleeping_mac));
+    pm.update_last_seen(TestNodeId::TEST_SENSOR_B, 35200);
+    TEST_ASSERT_FALSE(pm.is_offline(sleeping_mac));
 }
 
 TEST_CASE("PeerManager persists to storage on add", "[peer_manager]")
@@ -141,7 +187,7 @@ TEST_CASE("PeerManager loads peers from storage", "[peer_manager]")
     MockStorage storage;
 
     // Pre populate storage
-    PersistentPeer p1;
+    PersistentPeer p1 = {};
     memcpy(p1.mac, "\xAA\xBB\xCC\xDD\xEE\xFF", 6);
     p1.node_id               = to_node_id(TestNodeId::TEST_SENSOR_A);
     p1.channel               = 6;
@@ -162,7 +208,7 @@ TEST_CASE("PeerManager loads peers from storage", "[peer_manager]")
     // Check channel
     TEST_ASSERT_EQUAL(ESP_OK, err);
     TEST_ASSERT_EQUAL(6, channel);
-    TEST_ASSERT_EQUAL(1, pm.get_all().size());
+    TEST_ASSERT_EQUAL(1, all_peers(pm).size());
 
     // Check peer
     uint8_t found_mac[6];
@@ -188,7 +234,7 @@ TEST_CASE("PeerManager updates existing peer", "[peer_manager]")
     pm.add(TestNodeId::TEST_SENSOR_A, mac_new, 1, TestNodeType::SENSOR); // Same NodeId!
 
     // Must be only one peer, not duplicated
-    TEST_ASSERT_EQUAL(1, pm.get_all().size());
+    TEST_ASSERT_EQUAL(1, all_peers(pm).size());
 
     // MAC must be the new one
     uint8_t found_mac[6];
@@ -209,14 +255,14 @@ TEST_CASE("PeerManager removes peer", "[peer_manager]")
     pm.add(TestNodeId::TEST_SENSOR_A, mac, 1, TestNodeType::SENSOR);
 
     // Check if it was saved
-    TEST_ASSERT_EQUAL(1, pm.get_all().size());
+    TEST_ASSERT_EQUAL(1, all_peers(pm).size());
 
     // Remove the peer
     esp_err_t err = pm.remove(TestNodeId::TEST_SENSOR_A);
     TEST_ASSERT_EQUAL(ESP_OK, err);
 
     // Check if it was removed
-    TEST_ASSERT_EQUAL(0, pm.get_all().size());
+    TEST_ASSERT_EQUAL(0, all_peers(pm).size());
     TEST_ASSERT_FALSE(pm.find_mac(TestNodeId::TEST_SENSOR_A, nullptr));
 }
 
@@ -233,7 +279,7 @@ TEST_CASE("PeerManager returns error removing non-existent peer", "[peer_manager
     pm.add(TestNodeId::TEST_SENSOR_A, mac, 1, TestNodeType::SENSOR);
 
     // Check if it was saved
-    TEST_ASSERT_EQUAL(1, pm.get_all().size());
+    TEST_ASSERT_EQUAL(1, all_peers(pm).size());
 
     // Try to remove non-existent peer
     esp_err_t err = pm.remove(TestNodeId::TEST_SENSOR_B);
@@ -275,14 +321,14 @@ TEST_CASE("PeerManager moves re-added peer to front (LRU)", "[peer_manager]")
     pm.add(TestNodeId::TEST_SENSOR_A, mac2, 1, TestNodeType::SENSOR);
     pm.add(TestNodeId::TEST_SENSOR_B, mac3, 1, TestNodeType::SENSOR);
 
-    auto peers = pm.get_all();
+    auto peers = all_peers(pm);
     // The last peer add must be first on vector list
     TEST_ASSERT_EQUAL(to_node_id(TestNodeId::TEST_SENSOR_B), peers[0].node_id);
 
     // Re adding HUB should move it to the front
     pm.add(TestNodeId::TEST_HUB, mac1, 1, TestNodeType::HUB);
 
-    peers = pm.get_all();
+    peers = all_peers(pm);
     // HUB must be the first
     TEST_ASSERT_EQUAL(to_node_id(TestNodeId::TEST_HUB), peers[0].node_id);
 }
@@ -302,18 +348,42 @@ TEST_CASE("PeerManager updates peer channel", "[peer_manager]")
     // Change channel to 6 but same MAC
     pm.add(TestNodeId::TEST_SENSOR_A, mac, 6, TestNodeType::SENSOR);
 
-    auto peers = pm.get_all();
+    auto peers = all_peers(pm);
     TEST_ASSERT_EQUAL(1, peers.size());
     TEST_ASSERT_EQUAL(6, peers[0].channel); // Must be channel 6
 }
 
+TEST_CASE("PeerManager moves all peers to a new channel without reordering", "[peer_manager]")
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_mod_peer_IgnoreAndReturn(ESP_OK);
+
+    MockStorage storage;
+    RealPeerManager pm(storage);
+
+    uint8_t mac_a[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x01};
+    uint8_t mac_b[6] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0x02};
+    pm.add(TestNodeId::TEST_SENSOR_A, mac_a, 1, TestNodeType::SENSOR);
+    pm.add(TestNodeId::TEST_SENSOR_B, mac_b, 1, TestNodeType::SENSOR);
+    int saves = storage.save_call_count;
+
+    TEST_ASSERT_EQUAL(ESP_OK, pm.set_channel_all(11));
+
+    auto peers = all_peers(pm);
+    TEST_ASSERT_EQUAL(2, peers.size());
+    TEST_ASSERT_EQUAL((NodeId)TestNodeId::TEST_SENSOR_B, peers[0].node_id); // LRU order untouched
+    TEST_ASSERT_EQUAL(11, peers[0].channel);
+    TEST_ASSERT_EQUAL(11, peers[1].channel);
+    TEST_ASSERT_EQUAL(saves, storage.save_call_count); // Caller persists
+}
+
 TEST_CASE("PeerManager handles storage save failure", "[peer_manager]")
 {
     esp_now_add_peer_IgnoreAndReturn(ESP_OK);
 
     class FailingStorage : public MockStorage
     {
-        esp_err_t save(uint8_t, const std::vector<PersistentPeer> &, bool) override
+        esp_err_t save(uint8_t, const PersistentPeer *, size_t, bool) override
         {
             return ESP_FAIL;
         }
@@ -327,10 +397,318 @@ TEST_CASE("PeerManager handles storage save failure", "[peer_manager]")
 
     // pm.add with save (to storage) failure, still returns ESP_OK
     TEST_ASSERT_EQUAL(ESP_OK, err);
-    TEST_ASSERT_EQUAL(1, pm.get_all().size());     // Peer list has one peer
+    TEST_ASSERT_EQUAL(1, all_peers(pm).size());     // Peer list has one peer
     TEST_ASSERT_EQUAL(0, storage.save_call_count); // Storage NVS has not saved
 }
 
+TEST_CASE("PeerManager persists session keys and drops them with the peer", "[peer_manager]")
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+
+    MockStorage storage;
+    RealPeerManager pm(storage);
+
+    uint8_t mac[6]  = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF};
+    uint8_t key[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    pm.add(TestNodeId::TEST_SENSOR_A, mac, 1, TestNodeType::SENSOR);
+    TEST_ASSERT_EQUAL(ESP_OK, pm.set_session_key(TestNodeId::TEST_SENSOR_A, key));
+
+    TEST_ASSERT_EQUAL(1, storage.saved_peers.size());
+    TEST_ASSERT_TRUE(storage.saved_peers[0].has_session_key);
+    TEST_ASSERT_EQUAL_MEMORY(key, storage.saved_peers[0].session_key, sizeof(key));
+
+    // A fresh manager restores the key from storage
+    RealPeerManager restored(storage);
+    uint8_t channel;
+    uint8_t loaded[16];
+    restored.load_from_storage(channel);
+    TEST_ASSERT_TRUE(restored.get_session_key((NodeId)TestNodeId::TEST_SENSOR_A, loaded));
+    TEST_ASSERT_EQUAL_MEMORY(key, loaded, sizeof(key));
+
+    pm.remove(TestNodeId::TEST_SENSOR_A);
+    TEST_ASSERT_FALSE(pm.get_session_key((NodeId)TestNodeId::TEST_SENSOR_A, loaded));
+}
+
+TEST_CASE("TimerWheel fires deadlines on their tick, including ones past a revolution", "[peer_manager][timer_wheel]")
+{
+    TimerWheel wheel(100);
+    std::vector<NodeId> fired;
+    auto collect = [&](NodeId id) { fired.push_back(id); };
+
+    wheel.schedule(1, 250);
+    wheel.schedule(2, 100 * (TimerWheel::SLOTS + 3)); // Same bucket as tick 3, one round later
+    wheel.schedule(3, 500);
+    wheel.cancel(3);
+
+    TEST_ASSERT_EQUAL(0, wheel.advance(200, collect));
+    TEST_ASSERT_EQUAL(1, wheel.advance(300, collect));
+    TEST_ASSERT_EQUAL(1, fired[0]);
+    TEST_ASSERT_FALSE(wheel.is_scheduled(1));
+    TEST_ASSERT_TRUE(wheel.is_scheduled(2));
+
+    TEST_ASSERT_EQUAL(0, wheel.advance(100 * (TimerWheel::SLOTS + 2), collect));
+    TEST_ASSERT_EQUAL(1, wheel.advance(100 * (TimerWheel::SLOTS + 3), collect));
+    TEST_ASSERT_EQUAL(2, fired[1]);
+
+    // Rescheduling moves the deadline, and a long gap still fires everything due
+    wheel.schedule(4, 100 * (TimerWheel::SLOTS + 10));
+    wheel.schedule(4, 100 * (TimerWheel::SLOTS + 20));
+    TEST_ASSERT_EQUAL(0, wheel.advance(100 * (TimerWheel::SLOTS + 15), collect));
+    TEST_ASSERT_EQUAL(1, wheel.advance(100 * (4 * TimerWheel::SLOTS), collect));
+    TEST_ASSERT_EQUAL(4, fired[2]);
+}
+
+TEST_CASE("TimerWheel callbacks may reschedule and cancel other timers", "[peer_manager][timer_wheel]")
+{
+    TimerWheel wheel(100);
+    std::vector<NodeId> fired;
+
+    // Same bucket, so each callback touches the entry the walk would visit next
+    wheel.schedule(1, 300);
+    wheel.schedule(2, 300);
+    wheel.schedule(3, 300);
+    wheel.schedule(4, 500);
+    auto reshuffle = [&](NodeId id) {
+        fired.push_back(id);
+        if (id == 3) wheel.schedule(2, 1000);
+        if (id == 2) wheel.cancel(4);
+    };
+
+    TEST_ASSERT_EQUAL(3, wheel.advance(300, reshuffle));
+    TEST_ASSERT_EQUAL(3, fired.size());
+    TEST_ASSERT_TRUE(wheel.is_scheduled(2));
+    TEST_ASSERT_FALSE(wheel.is_scheduled(4));
+
+    // Only the timer scheduled from the callback is left
+    fired.clear();
+    TEST_ASSERT_EQUAL(0, wheel.advance(900, reshuffle));
+    TEST_ASSERT_EQUAL(1, wheel.advance(1000, reshuffle));
+    TEST_ASSERT_EQUAL(2, fired[0]);
+}
+
+TEST_CASE("LinkMetrics tracks RSSI, delivery and RTT percentiles", "[peer_manager][link]")
+{
+    LinkMetrics link = {};
+    TEST_ASSERT_EQUAL(1000, link.delivery_ratio_permille());
+    TEST_ASSERT_EQUAL(LOGICAL_ACK_TIMEOUT_MS, link.ack_timeout_ms(0));
+
+    link.on_rx(-60);
+    link.on_rx(-80);
+    TEST_ASSERT_EQUAL(-80, link.rssi_min);
+    TEST_ASSERT_EQUAL(-60, link.rssi_max);
+    TEST_ASSERT_INT_WITHIN(1, -62, link.rssi());
+
+    // Nine fast round trips and one slow one
+    for (int i = 0; i < 9; i++) link.on_delivered(0, 6);
+    link.on_delivered(0, 100);
+    TEST_ASSERT_EQUAL(8, link.rtt_percentile_ms(50));
+    TEST_ASSERT_EQUAL(100, link.rtt_percentile_ms(99));
+
+    // A retransmitted frame counts as delivered but gives no RTT sample
+    link.on_delivered(2, 0);
+    link.on_lost();
+    TEST_ASSERT_EQUAL(11, link.delivered);
+    TEST_ASSERT_EQUAL(1, link.lost);
+    TEST_ASSERT_TRUE(link.delivery_ratio_permille() < 1000);
+    TEST_ASSERT_TRUE(link.retries_x16 > 0);
+
+    // The timeout follows the measured RTT and backs off on retries
+    uint32_t timeout = link.ack_timeout_ms(0);
+    TEST_ASSERT_TRUE(timeout >= ACK_TIMEOUT_MIN_MS && timeout < LOGICAL_ACK_TIMEOUT_MS);
+    TEST_ASSERT_EQUAL(std::min(timeout * 2, ACK_TIMEOUT_MAX_MS), link.ack_timeout_ms(1));
+}
+
+TEST_CASE("PeerManager reports link metrics per peer", "[peer_manager][link]")
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+
+    MockStorage storage;
+    RealPeerManager pm(storage);
+    uint8_t mac_a[6] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x0A};
+    uint8_t mac_b[6] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x0B};
+    pm.add(TestNodeId::TEST_SENSOR_A, mac_a, 1, TestNodeType::SENSOR);
+    pm.add(TestNodeId::TEST_SENSOR_B, mac_b, 1, TestNodeType::SENSOR);
+
+    pm.record_rx(to_node_id(TestNodeId::TEST_SENSOR_A), -70);
+    pm.record_delivery(mac_a, true, 0, 20);
+    pm.record_delivery(mac_b, false, MAX_LOGICAL_RETRIES, 0);
+
+    for (const auto &peer : all_peers(pm)) {
+        if (peer.node_id == to_node_id(TestNodeId::TEST_SENSOR_A)) {
+            TEST_ASSERT_EQUAL(-70, peer.link.rssi());
+            TEST_ASSERT_EQUAL(1000, peer.link.delivery_ratio_permille());
+            TEST_ASSERT_EQUAL(20, peer.link.srtt_ms());
+        }
+        else {
+            TEST_ASSERT_EQUAL(0, peer.link.rx_frames);
+            TEST_ASSERT_EQUAL(0, peer.link.delivery_ratio_permille());
+        }
+    }
+
+    TEST_ASSERT_EQUAL(20 + 4 * 10, pm.ack_timeout_ms(mac_a, 0)); // srtt + 4 * rttvar
+    TEST_ASSERT_EQUAL(LOGICAL_ACK_TIMEOUT_MS, pm.ack_timeout_ms(mac_b, 0));
+}
+
+TEST_CASE("PeerManager posts liveness transitions to the event queue", "[peer_manager]")
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+
+    MockStorage storage;
+    RealPeerManager pm(storage);
+    QueueHandle_t events = xQueueCreate(4, sizeof(PeerEvent));
+    pm.set_event_queue(events);
+
+    uint8_t mac[6] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06};
+    pm.add(TestNodeId::TEST_SENSOR_A, mac, 1, TestNodeType::SENSOR, 1000);
+
+    PeerEvent event;
+    pm.update_last_seen(TestNodeId::TEST_SENSOR_A, 10000);
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(events, &event, 0));
+    TEST_ASSERT_TRUE(event.type == PeerEventType::ONLINE);
+    TEST_ASSERT_EQUAL(to_node_id(TestNodeId::TEST_SENSOR_A), event.node_id);
+
+    // Traffic within the timeout only pushes the deadline out
+    pm.update_last_seen(TestNodeId::TEST_SENSOR_A, 11000);
+    pm.check_liveness(13000);
+    TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(events));
+    TEST_ASSERT_TRUE(all_peers(pm)[0].online);
+
+    pm.check_liveness(13500);
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(events, &event, 0));
+    TEST_ASSERT_TRUE(event.type == PeerEventType::OFFLINE);
+    TEST_ASSERT_EQUAL(13500, event.timestamp_ms);
+    TEST_ASSERT_FALSE(all_peers(pm)[0].online);
+
+    pm.check_liveness(20000);
+    TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(events));
+
+    pm.update_last_seen(TestNodeId::TEST_SENSOR_A, 20100);
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(events, &event, 0));
+    TEST_ASSERT_TRUE(event.type == PeerEventType::ONLINE);
+
+    // Removed peers never report
+    pm.remove(TestNodeId::TEST_SENSOR_A);
+    pm.check_liveness(30000);
+    TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(events));
+
+    vQueueDelete(events);
+}
+
+TEST_CASE("PeerManager copies into caller buffers and visits peers in place", "[peer_manager]")
+{
+    esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+    esp_now_mod_peer_IgnoreAndReturn(ESP_OK);
+
+    MockStorage storage;
+    RealPeerManager pm(storage);
+    for (int i = 0; i < 3; ++i) {
+        uint8_t mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, (uint8_t)i};
+        pm.add((TestNodeId)(100 + i), mac, 1, TestNodeType::SENSOR);
+    }
+
+    PeerInfo peers[2];
+    TEST_ASSERT_EQUAL(2, pm.get_all(peers, 2)); // Truncated to the buffer, newest first
+    TEST_ASSERT_EQUAL((NodeId)102, peers[0].node_id);
+    TEST_ASSERT_EQUAL((NodeId)101, peers[1].node_id);
+
+    NodeId visited[MAX_PEERS];
+    size_t count = 0;
+    pm.for_each([&](const PeerInfo &peer) { visited[count++] = peer.node_id; });
+    TEST_ASSERT_EQUAL(3, count);
+    TEST_ASSERT_EQUAL((NodeId)100, visited[2]);
+
+    // Saving stages the table without a heap copy
+    pm.persist(6);
+    TEST_ASSERT_EQUAL(6, storage.saved_channel);
+    TEST_ASSERT_EQUAL(3, storage.saved_peers.size());
+    TEST_ASSERT_EQUAL((NodeId)100, storage.saved_peers[2].node_id);
+}
+
+TEST_CASE("PeerManager loads no more peers than its table holds", "[peer_manager]")
+{
+    MockStorage storage;
+    storage.saved_channel = 3;
+    for (int i = 0; i < MAX_PEERS + 2; ++i) {
+        PersistentPeer p = {};
+        p.mac[5]         = (uint8_t)i;
+        p.node_id        = (NodeId)(100 + i);
+        p.paired         = true;
+        storage.saved_peers.push_back(p);
+    }
+
+    RealPeerManager pm(storage);
+    uint8_t channel = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, pm.load_from_storage(channel));
+    TEST_ASSERT_EQUAL(3, channel);
+
+    PeerInfo peers[MAX_PEERS + 2];
+    TEST_ASSERT_EQUAL(MAX_PEERS, pm.get_all(peers, MAX_PEERS + 2));
+    TEST_ASSERT_EQUAL((NodeId)(100 + MAX_PEERS - 1), peers[MAX_PEERS - 1].node_id);
+}
+
+// Storage that looks a peer up while it reads, as RX and TX tasks may during a slow NVS read
+class LookupDuringLoadStorage : public MockStorage
+{
+public:
+    IPeerManager *pm = nullptr;
+    bool found       = true;
+
+    inline esp_err_t load(uint8_t &wifi_channel, PersistentPeer *peers, size_t max, size_t &count) override
+    {
+        uint8_t mac[6];
+        found = pm->find_mac(100, mac);
+        return MockStorage::load(wifi_channel, peers, max, count);
+    }
+};
+
+TEST_CASE("PeerManager reads storage without holding its lock", "[peer_manager]")
+{
+    LookupDuringLoadStorage storage;
+    PersistentPeer p = {};
+    p.node_id        = 100;
+    storage.saved_peers.push_back(p);
+
+    RealPeerManager pm(storage);
+    storage.pm      = &pm;
+    uint8_t channel = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, pm.load_from_storage(channel));
+    TEST_ASSERT_FALSE(storage.found);
+
+    uint8_t mac[6];
+    TEST_ASSERT_TRUE(pm.find_mac(100, mac));
+}
+
+TEST_CASE("StaticVector inserts, erases and refuses to grow past its capacity", "[peer_manager][static_vector]")
+{
+    StaticVector<int, 4> v;
+    TEST_ASSERT_TRUE(v.empty());
+    TEST_ASSERT_TRUE(v.push_back(2));
+    TEST_ASSERT_TRUE(v.push_back(4));
+    TEST_ASSERT_TRUE(v.insert(v.begin(), 1));
+    TEST_ASSERT_TRUE(v.insert(v.begin() + 2, 3));
+    TEST_ASSERT_TRUE(v.full());
+    TEST_ASSERT_FALSE(v.push_back(5));
+    TEST_ASSERT_FALSE(v.insert(v.begin(), 0));
+    for (size_t i = 0; i < v.size(); ++i) TEST_ASSERT_EQUAL((int)i + 1, v[i]);
+
+    auto next = v.erase(v.begin() + 1);
+    TEST_ASSERT_EQUAL(3, *next);
+    TEST_ASSERT_EQUAL(3, v.size());
+    v.pop_back();
+    TEST_ASSERT_EQUAL(3, v.back());
+
+    const int values[] = {7, 8, 9, 10, 11};
+    v.assign(values, 5);
+    TEST_ASSERT_EQUAL(4, v.size()); // Truncated to the capacity
+    TEST_ASSERT_EQUAL(10, v.back());
+    v.clear();
+    TEST_ASSERT_TRUE(v.begin() == v.end());
+}
+
 extern "C" void app_main(void)
 {
     UNITY_BEGIN();
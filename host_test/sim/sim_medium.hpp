@@ -0,0 +1,263 @@
+#pragma once
+
+#include "espnow_types.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <vector>
+
+// Radio conditions between two stations, applied per frame and per receiver
+struct SimLink
+{
+    uint8_t loss_pct      = 0;    // Chance the frame never arrives
+    uint8_t duplicate_pct = 0;    // Chance it arrives twice, as after a lost MAC-level ACK
+    uint32_t latency_us   = 1000; // From the end of the transmission
+    uint32_t jitter_us    = 0;    // Uniform extra delay in [0, jitter_us]
+    int8_t rssi           = -50;
+};
+
+/**
+ * @brief Shared ESP-NOW air for many simulated stations in one process.
+ *
+ * Time is virtual: nothing happens between events, and events due at the same
+ * microsecond run in the order they were scheduled. Loss, duplication and
+ * jitter come from a PRNG seeded at construction, so a scenario replays exactly
+ * for a given seed. A station hears a frame only if it is tuned to the channel
+ * it was sent on, both when it is sent and when it arrives, and is listening
+ * when it arrives. Stations on a channel share its airtime at BITRATE_KBPS: a
+ * frame waits until the channel is clear, as carrier sense would make it, so
+ * collisions are not modelled.
+ *
+ * Frame delivery runs the receiver synchronously, which may send further
+ * frames. The medium is locked so a FreeRTOS timer left running by a component
+ * cannot corrupt it, but such frames make a run non-deterministic.
+ *
+ * Given a clock, the medium runs on that clock instead of a virtual one, for
+ * components driven by their own tasks and timers: a task calls run_due()
+ * periodically to deliver the frames that have arrived by then.
+ *
+ * Up to EVENT_RESERVE events in flight, sending and delivering frames makes no
+ * heap allocation, so allocation counts taken across the medium are the
+ * components' own.
+ */
+class SimMedium
+{
+public:
+    static constexpr uint32_t BITRATE_KBPS    = 1000; // ESP-NOW default PHY rate
+    static constexpr uint32_t PHY_OVERHEAD_US = 200;  // Preamble, MAC header, SIFS and MAC-level ACK
+    static constexpr uint8_t BROADCAST_MAC[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    static constexpr size_t EVENT_RESERVE     = 1024; // Events the queue holds before it first grows
+
+    using Receiver = std::function<void(const RxPacket &packet)>;
+    using Clock    = int64_t (*)();
+
+    struct Stats
+    {
+        uint32_t sent           = 0; // Frames put on air
+        uint32_t delivered      = 0; // Copies handed to a receiver
+        uint32_t lost           = 0; // Copies dropped by link loss
+        uint32_t duplicated     = 0; // Extra copies
+        uint32_t off_channel    = 0; // Copies missed by a receiver tuned elsewhere or not listening
+        uint32_t peak_in_flight = 0; // Most copies in the air at once
+    };
+
+    explicit SimMedium(uint32_t seed = 1, Clock clock = nullptr)
+        : rng_(seed)
+        , clock_(clock)
+    {
+        std::vector<Event> storage;
+        storage.reserve(EVENT_RESERVE);
+        events_ = decltype(events_)(std::greater<Event>(), std::move(storage));
+    }
+
+    // Returns the station index used by every other call
+    inline size_t attach(const uint8_t *mac, uint8_t channel, Receiver receiver)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        Station station;
+        memcpy(station.mac, mac, 6);
+        station.channel  = channel;
+        station.receiver = std::move(receiver);
+        stations_.push_back(std::move(station));
+        return stations_.size() - 1;
+    }
+
+    inline void set_default_link(const SimLink &link) { default_link_ = link; }
+    // Overrides the link from one station to another; not symmetric
+    inline void set_link(size_t from, size_t to, const SimLink &link) { links_[{from, to}] = link; }
+
+    inline void set_channel(size_t station, uint8_t channel) { stations_[station].channel = channel; }
+    inline uint8_t channel(size_t station) const { return stations_[station].channel; }
+    inline void set_listening(size_t station, bool listening) { stations_[station].listening = listening; }
+    inline const uint8_t *mac(size_t station) const { return stations_[station].mac; }
+
+    inline uint64_t now_us() const { return clock_ ? static_cast<uint64_t>(clock_()) : now_us_; }
+    inline uint64_t now_ms() const { return now_us() / 1000; }
+    inline const Stats &stats() const { return stats_; }
+
+    inline void schedule(uint64_t delay_us, std::function<void()> action)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        Event event;
+        event.at_us  = now_us() + delay_us;
+        event.seq    = next_seq_++;
+        event.action = std::move(action);
+        events_.push(std::move(event));
+    }
+
+    // Sends one frame from station over the air to dest_mac, broadcast or unicast
+    inline void transmit(size_t from, const uint8_t *dest_mac, const uint8_t *data, size_t len)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        Station &sender = stations_[from];
+        uint64_t &clear = channel_clear_us_[sender.channel];
+        uint64_t end    = std::max(now_us(), clear) + PHY_OVERHEAD_US + len * 8 * 1000 / BITRATE_KBPS;
+        clear           = end;
+        stats_.sent++;
+
+        bool broadcast = memcmp(dest_mac, BROADCAST_MAC, 6) == 0;
+        for (size_t to = 0; to < stations_.size(); to++) {
+            Station &receiver = stations_[to];
+            if (to == from || (!broadcast && memcmp(receiver.mac, dest_mac, 6) != 0)) continue;
+            if (receiver.channel != sender.channel) {
+                stats_.off_channel++;
+                continue;
+            }
+
+            const SimLink &link = link_for(from, to);
+            if (roll(link.loss_pct)) {
+                stats_.lost++;
+                continue;
+            }
+            int copies = roll(link.duplicate_pct) ? 2 : 1;
+            if (copies == 2) stats_.duplicated++;
+
+            for (int i = 0; i < copies; i++) {
+                uint64_t arrival = end + link.latency_us + (link.jitter_us ? rng_() % (link.jitter_us + 1) : 0);
+                Event event;
+                event.at_us   = arrival;
+                event.seq     = next_seq_++;
+                event.to      = to;
+                event.channel = sender.channel;
+                memcpy(event.packet.src_mac, sender.mac, 6);
+                memcpy(event.packet.data, data, len);
+                event.packet.len          = len;
+                event.packet.rssi         = link.rssi;
+                event.packet.timestamp_us = static_cast<int64_t>(arrival);
+                events_.push(std::move(event));
+                stats_.peak_in_flight = std::max(stats_.peak_in_flight, ++in_flight_);
+            }
+        }
+    }
+
+    // Runs the next event. Returns false if there is none.
+    inline bool step()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (events_.empty()) return false;
+        Event event = events_.top();
+        events_.pop();
+        now_us_ = event.at_us;
+        if (event.action) {
+            event.action();
+        } else {
+            deliver(event.to, event.channel, event.packet);
+        }
+        return true;
+    }
+
+    // Runs every event due up to end_us, then moves the clock to it
+    inline void run_until(uint64_t end_us)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        while (!events_.empty() && events_.top().at_us <= end_us) step();
+        if (now_us_ < end_us) now_us_ = end_us;
+    }
+
+    inline void run_for(uint64_t duration_us) { run_until(now_us_ + duration_us); }
+
+    // With a clock: runs every event due by now. Returns how many ran.
+    inline size_t run_due()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        size_t count = 0;
+        while (!events_.empty() && events_.top().at_us <= now_us()) {
+            step();
+            count++;
+        }
+        return count;
+    }
+
+    // Runs events until done() holds, none is left or limit_us has passed. Returns done().
+    inline bool run_until_done(const std::function<bool()> &done, uint64_t limit_us)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        uint64_t end_us = now_us_ + limit_us;
+        while (!done() && !events_.empty() && events_.top().at_us <= end_us) step();
+        return done();
+    }
+
+private:
+    struct Station
+    {
+        uint8_t mac[6];
+        uint8_t channel        = 1;
+        bool listening         = true;
+        Receiver receiver;
+    };
+
+    // A frame copy in flight, or a scheduled action. Frames are carried inline
+    // so a transmission makes no heap allocation once the queue has grown.
+    struct Event
+    {
+        uint64_t at_us  = 0;
+        uint64_t seq    = 0;
+        size_t to       = 0;
+        uint8_t channel = 0;
+        RxPacket packet;
+        std::function<void()> action; // Empty for a frame
+
+        bool operator>(const Event &other) const
+        {
+            return at_us != other.at_us ? at_us > other.at_us : seq > other.seq;
+        }
+    };
+
+    inline const SimLink &link_for(size_t from, size_t to) const
+    {
+        auto it = links_.find({from, to});
+        return it != links_.end() ? it->second : default_link_;
+    }
+
+    inline bool roll(uint8_t pct) { return pct > 0 && rng_() % 100 < pct; }
+
+    inline void deliver(size_t to, uint8_t channel, const RxPacket &packet)
+    {
+        in_flight_--;
+        Station &receiver = stations_[to];
+        // Retuned or asleep while the frame was in flight
+        if (receiver.channel != channel || !receiver.listening) {
+            stats_.off_channel++;
+            return;
+        }
+        stats_.delivered++;
+        receiver.receiver(packet);
+    }
+
+    std::recursive_mutex mutex_;
+    std::mt19937 rng_;
+    Clock clock_;
+    uint64_t now_us_    = 0;
+    uint32_t in_flight_ = 0;
+    uint64_t next_seq_  = 0;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events_;
+    std::vector<Station> stations_;
+    uint64_t channel_clear_us_[SCAN_MAX_CHANNEL + 1] = {}; // When the air is next free, per channel
+    Stats stats_;
+    SimLink default_link_;
+    std::map<std::pair<size_t, size_t>, SimLink> links_;
+};
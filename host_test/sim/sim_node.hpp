@@ -0,0 +1,207 @@
+#pragma once
+
+#include "channel_scanner.hpp"
+#include "heartbeat_manager.hpp"
+#include "message_codec.hpp"
+#include "message_router.hpp"
+#include "mock_storage.hpp"
+#include "pairing_manager.hpp"
+#include "peer_manager.hpp"
+#include "protocol_messages.hpp"
+#include "sim_medium.hpp"
+#include "sim_tx_manager.hpp"
+#include "sim_wifi_hal.hpp"
+#include <cstring>
+#include <functional>
+#include <map>
+
+// Beacons and wake slots are paced by FreeRTOS timers on the wall clock, which
+// the medium's virtual clock cannot drive
+constexpr uint16_t SIM_CAPABILITIES =
+    PeerCapability::SUPPORTED & ~(PeerCapability::HEARTBEAT_BEACON | PeerCapability::WAKE_SLOTS);
+
+/**
+ * @brief One hub or node on a SimMedium, built from the real protocol components.
+ *
+ * Received frames go through RealMessageCodec::decode_wire() and
+ * RealMessageRouter::handle_packet() as in the EspNow RX worker, only
+ * synchronously. What a component would do from its own timer the scenario
+ * does instead, on the medium's clock: send_heartbeat() sends the frame the
+ * heartbeat timer would, restart_pairing() stands in for the periodic pairing
+ * request, and scan() steps the RealChannelScanner from medium events.
+ */
+class SimNode
+{
+public:
+    SimNode(SimMedium &medium, const uint8_t *mac, NodeId id, NodeType type, uint8_t channel,
+            uint16_t capabilities = SIM_CAPABILITIES)
+        : id(id)
+        , type(type)
+        , medium(medium)
+        , station(medium.attach(mac, channel, [this](const RxPacket &packet) { receive(packet); }))
+        , hal(medium, station)
+        , codec(capabilities)
+        , peers(storage)
+        , tx(medium, hal, codec, peers)
+        , scanner(hal, codec, id, type)
+        , heartbeat(tx, peers, codec, hal, id)
+        , pairing(tx, peers, codec, hal)
+        , router(peers, tx, heartbeat, pairing, codec)
+    {
+        tx.scanner     = &scanner;
+        hal.peer_table = &peers;
+        router.set_node_info(id, type);
+        pairing.init(type, id);
+        // Without an interval no heartbeat timer is created
+        heartbeat.init(0, type);
+    }
+
+    ~SimNode()
+    {
+        pairing.deinit();
+        heartbeat.deinit();
+    }
+
+    const NodeId id;
+    const NodeType type;
+    SimMedium &medium;
+    const size_t station;
+
+    MockStorage storage;
+    SimWiFiHAL hal;
+    RealMessageCodec codec;
+    RealPeerManager peers;
+    SimTxManager tx;
+    RealChannelScanner scanner;
+    RealHeartbeatManager heartbeat;
+    RealPairingManager pairing;
+    RealMessageRouter router;
+
+    std::map<MessageType, uint32_t> received; // Decoded frames by type
+    uint32_t rejected       = 0;              // Frames decode_wire() refused
+    uint32_t data_bytes     = 0;              // DATA payload bytes received
+    uint64_t paired_at_us   = 0;              // When the hub accepted pairing, 0 if never
+    bool scan_done          = false;
+    IChannelScanner::ScanResult scan_result = {};
+
+    bool auto_ack = false; // Confirms DATA and COMMAND frames that ask for it, as the app would at once
+    std::function<void(const RxPacket &packet)> on_frame; // Sees every decoded frame before the router
+
+    inline const uint8_t *mac() const { return medium.mac(station); }
+
+    inline esp_err_t restart_pairing(uint32_t timeout_ms)
+    {
+        pairing.deinit();
+        return pairing.start(timeout_ms);
+    }
+
+    inline void send_heartbeat()
+    {
+        TxPacket tx_packet;
+        if (!peers.find_mac(ReservedIds::HUB, tx_packet.dest_mac)) {
+            memcpy(tx_packet.dest_mac, SimMedium::BROADCAST_MAC, 6);
+        }
+
+        HeartbeatMessage heartbeat_msg      = {};
+        heartbeat_msg.header.msg_type       = MessageType::HEARTBEAT;
+        heartbeat_msg.header.sender_node_id = id;
+        heartbeat_msg.header.sender_type    = type;
+        heartbeat_msg.header.dest_node_id   = ReservedIds::HUB;
+        heartbeat_msg.uptime_ms             = medium.now_ms();
+        queue(tx_packet, heartbeat_msg.header, &heartbeat_msg.battery_mv,
+              sizeof(HeartbeatMessage) - sizeof(MessageHeader));
+    }
+
+    inline esp_err_t send_data(NodeId dest_id, PayloadType payload_type, const void *payload, size_t len)
+    {
+        TxPacket tx_packet;
+        if (!peers.find_mac(dest_id, tx_packet.dest_mac)) return ESP_ERR_NOT_FOUND;
+
+        MessageHeader header  = {};
+        header.msg_type       = MessageType::DATA;
+        header.sender_type    = type;
+        header.sender_node_id = id;
+        header.payload_type   = payload_type;
+        header.dest_node_id   = dest_id;
+        header.timestamp_ms   = medium.now_ms();
+        return queue(tx_packet, header, payload, len);
+    }
+
+    inline void scan(uint8_t start_channel)
+    {
+        scan_done = false;
+        arm_dwell(scanner.start(start_channel, on_scan_done, this));
+    }
+
+private:
+    uint32_t scan_generation_ = 0;
+
+    inline void receive(const RxPacket &wire)
+    {
+        RxPacket packet;
+        packet.len = codec.decode_wire(wire.src_mac, wire.data, wire.len, packet.data, sizeof(packet.data));
+        if (packet.len == 0) {
+            rejected++;
+            return;
+        }
+        memcpy(packet.src_mac, wire.src_mac, 6);
+        packet.rssi         = wire.rssi;
+        packet.timestamp_us = wire.timestamp_us;
+
+        auto header = reinterpret_cast<const MessageHeader *>(packet.data);
+        received[header->msg_type]++;
+        if (header->msg_type == MessageType::DATA) {
+            data_bytes += packet.len - sizeof(MessageHeader) - CRC_SIZE;
+        }
+
+        bool was_pairing = pairing.is_active();
+        if (on_frame) on_frame(packet);
+        router.handle_packet(packet);
+        if (auto_ack && header->requires_ack &&
+            (header->msg_type == MessageType::DATA || header->msg_type == MessageType::COMMAND)) {
+            send_ack(packet.src_mac, *header);
+        }
+        if (was_pairing && !pairing.is_active() && paired_at_us == 0) paired_at_us = medium.now_us();
+    }
+
+    inline void send_ack(const uint8_t *mac, const MessageHeader &acked)
+    {
+        TxPacket tx_packet;
+        memcpy(tx_packet.dest_mac, mac, 6);
+
+        AckMessage ack            = {};
+        ack.header.msg_type       = MessageType::ACK;
+        ack.header.sender_node_id = id;
+        ack.header.sender_type    = type;
+        ack.header.dest_node_id   = acked.sender_node_id;
+        ack.ack_sequence          = acked.sequence_number;
+        ack.status                = AckStatus::OK;
+        queue(tx_packet, ack.header, &ack.ack_sequence, sizeof(AckMessage) - sizeof(MessageHeader));
+    }
+
+    inline esp_err_t queue(TxPacket &tx_packet, const MessageHeader &header, const void *payload, size_t len)
+    {
+        tx_packet.len = codec.encode(header, payload, len, tx_packet.data, sizeof(tx_packet.data));
+        if (tx_packet.len == 0) return ESP_ERR_INVALID_ARG;
+        tx_packet.requires_ack = false;
+        return tx.queue_packet(tx_packet);
+    }
+
+    // Dwell timers are medium events; one left over from an earlier scan is ignored
+    inline void arm_dwell(uint32_t dwell_ms)
+    {
+        if (dwell_ms == 0) return;
+        uint32_t generation = ++scan_generation_;
+        medium.schedule(static_cast<uint64_t>(dwell_ms) * 1000, [this, generation]() {
+            if (generation == scan_generation_ && scanner.is_scanning()) arm_dwell(scanner.on_dwell_elapsed());
+        });
+    }
+
+    static void on_scan_done(const IChannelScanner::ScanResult &result, void *ctx)
+    {
+        auto *self        = static_cast<SimNode *>(ctx);
+        self->scan_done   = true;
+        self->scan_result = result;
+        self->hal.set_channel(result.channel);
+    }
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "downlink_mailbox.hpp"
+#include "espnow_interfaces.hpp"
+#include "protocol_messages.hpp"
+#include "sim_medium.hpp"
+#include <cstring>
+
+// Deterministic stand-in for RealTxManager: encodes each frame for its peer and
+// hands it to the radio at once, in the caller's context, instead of from a TX
+// task. There are no logical ACKs or retries; held frames wait in a real
+// DownlinkMailbox on the medium's clock. A scan response is passed straight to
+// the scanner, as the TX task would.
+class SimTxManager : public ITxManager
+{
+public:
+    SimTxManager(SimMedium &medium, IWiFiHAL &hal, IMessageCodec &codec, IPeerManager &peer_mgr)
+        : medium_(medium)
+        , hal_(hal)
+        , codec_(codec)
+        , peer_mgr_(peer_mgr)
+    {
+    }
+
+    IChannelScanner *scanner = nullptr;
+    uint32_t sent            = 0; // Frames handed to the radio
+    uint32_t encode_failures = 0;
+    uint32_t logical_acks    = 0;
+
+    inline esp_err_t init(uint32_t stack_size, UBaseType_t priority) override { return ESP_OK; }
+    inline esp_err_t deinit() override { return ESP_OK; }
+
+    inline esp_err_t queue_packet(const TxPacket &packet) override
+    {
+        TxPacket frame = packet;
+        reinterpret_cast<MessageHeader *>(frame.data)->sequence_number = sequence_counter_++;
+
+        uint16_t caps   = peer_mgr_.get_capabilities(frame.dest_mac) & codec_.capabilities();
+        size_t wire_len = codec_.encode_wire(frame.dest_mac, frame.data, frame.len, caps, false, wire_buf_,
+                                             sizeof(wire_buf_));
+        if (wire_len == 0) {
+            encode_failures++;
+            return ESP_ERR_INVALID_SIZE;
+        }
+        sent++;
+        return hal_.send_packet(frame.dest_mac, wire_buf_, wire_len);
+    }
+    inline esp_err_t schedule_ack(const TxPacket &ack_packet, uint16_t ack_sequence) override
+    {
+        return queue_packet(ack_packet);
+    }
+
+    inline esp_err_t hold_packet(const TxPacket &packet) override { return mailbox_.hold(packet, medium_.now_ms()); }
+    inline void release_held(const uint8_t *mac) override
+    {
+        TxPacket packet;
+        while (mailbox_.take(mac, packet, medium_.now_ms())) queue_packet(packet);
+    }
+    inline size_t held_count(const uint8_t *mac) override { return mailbox_.pending(mac, medium_.now_ms()); }
+
+    inline void notify_physical_fail() override {}
+    inline void notify_link_alive() override {}
+    inline void notify_logical_ack(const uint8_t *mac, uint16_t sequence) override { logical_acks++; }
+    inline void notify_hub_found() override
+    {
+        if (scanner != nullptr && scanner->is_scanning()) scanner->on_hub_found();
+    }
+    inline TaskHandle_t get_task_handle() const override { return nullptr; }
+
+private:
+    SimMedium &medium_;
+    IWiFiHAL &hal_;
+    IMessageCodec &codec_;
+    IPeerManager &peer_mgr_;
+    DownlinkMailbox mailbox_;
+    uint16_t sequence_counter_ = 0;
+    uint8_t wire_buf_[ESP_NOW_MAX_DATA_LEN];
+};
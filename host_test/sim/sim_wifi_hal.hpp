@@ -0,0 +1,76 @@
+#pragma once
+
+#include "espnow_interfaces.hpp"
+#include "sim_medium.hpp"
+#include <cstring>
+
+// Radio of one station on a SimMedium. Sends go on air at once; there is no TX
+// task to notify, so waits return immediately.
+//
+// Like esp_now_send(), a unicast send fails with ESP_ERR_ESPNOW_NOT_FOUND unless
+// the destination is in the driver's peer table. RealPeerManager adds and
+// removes its peers there as it does in its own table, so peer_table stands in
+// for the driver's; without one every unicast send is refused.
+class SimWiFiHAL : public IWiFiHAL
+{
+public:
+    SimWiFiHAL(SimMedium &medium, size_t station)
+        : medium_(medium)
+        , station_(station)
+    {
+    }
+
+    IPeerManager *peer_table = nullptr;
+    uint32_t unregistered    = 0; // Unicast sends refused for want of a peer entry
+
+    inline esp_err_t set_channel(uint8_t ch) override
+    {
+        if (ch < 1 || ch > SCAN_MAX_CHANNEL) return ESP_ERR_INVALID_ARG;
+        medium_.set_channel(station_, ch);
+        return ESP_OK;
+    }
+    inline esp_err_t get_channel(uint8_t *ch) override
+    {
+        *ch = medium_.channel(station_);
+        return ESP_OK;
+    }
+    inline esp_err_t send_packet(const uint8_t *mac, const uint8_t *data, size_t len) override
+    {
+        if (len == 0 || len > ESP_NOW_MAX_DATA_LEN) return ESP_ERR_INVALID_SIZE;
+        if (memcmp(mac, SimMedium::BROADCAST_MAC, 6) != 0 && !registered(mac)) {
+            unregistered++;
+            return ESP_ERR_ESPNOW_NOT_FOUND;
+        }
+        medium_.transmit(station_, mac, data, len);
+        return ESP_OK;
+    }
+    inline bool wait_for_event(uint32_t event_mask, uint32_t timeout_ms) override { return false; }
+    inline void set_task_to_notify(TaskHandle_t task_handle) override {}
+    inline esp_err_t set_listening(bool on) override
+    {
+        listening_ = on;
+        medium_.set_listening(station_, listening_ || held_);
+        return ESP_OK;
+    }
+    inline esp_err_t hold_listening(bool hold) override
+    {
+        held_ = hold;
+        medium_.set_listening(station_, listening_ || held_);
+        return ESP_OK;
+    }
+
+private:
+    inline bool registered(const uint8_t *mac)
+    {
+        bool found = false;
+        if (peer_table != nullptr) {
+            peer_table->for_each([&](const PeerInfo &peer) { found = found || memcmp(peer.mac, mac, 6) == 0; });
+        }
+        return found;
+    }
+
+    SimMedium &medium_;
+    size_t station_;
+    bool listening_ = true;
+    bool held_      = false;
+};
@@ -0,0 +1,89 @@
+#include "esp_system.h"
+#include "time_sync.hpp"
+#include "unity.h"
+
+// Hub clock ahead of the local one by OFFSET_MS, running fast by drift_ppm
+static constexpr int64_t OFFSET_MS = 5000;
+
+static uint64_t hub_clock(uint64_t local_ms, int32_t drift_ppm)
+{
+    return local_ms + OFFSET_MS + static_cast<int64_t>(local_ms) * drift_ppm / 1000000;
+}
+
+// One heartbeat round trip sent at local time t1 with the given one-way delays
+static bool exchange(TimeSync &sync, uint64_t t1, uint32_t up_ms, uint32_t down_ms, int32_t drift_ppm = 0)
+{
+    uint64_t t2 = hub_clock(t1 + up_ms, drift_ppm);
+    uint64_t t3 = t2 + 2; // Hub processing
+    uint64_t t4 = t1 + up_ms + 2 + down_ms;
+    return sync.add_sample(t1, t2, t3, t4);
+}
+
+TEST_CASE("TimeSync derives offset and delay from one round trip", "[time_sync]")
+{
+    TimeSync sync;
+    TEST_ASSERT_FALSE(sync.synchronized());
+    TEST_ASSERT_TRUE(exchange(sync, 1000, 10, 10));
+
+    TEST_ASSERT_TRUE(sync.synchronized());
+    TEST_ASSERT_EQUAL(20, sync.delay_ms());
+    TEST_ASSERT_EQUAL(OFFSET_MS * 1000, sync.offset_us(1022));
+    TEST_ASSERT_EQUAL(2000 + OFFSET_MS, sync.to_hub_time(2000));
+    TEST_ASSERT_EQUAL(2000, sync.to_local_time(2000 + OFFSET_MS));
+}
+
+TEST_CASE("TimeSync rejects inconsistent timestamps", "[time_sync]")
+{
+    TimeSync sync;
+    TEST_ASSERT_FALSE(sync.add_sample(1000, 6000, 6002, 999));  // Received before sent
+    TEST_ASSERT_FALSE(sync.add_sample(1000, 6000, 6100, 1050)); // Hub held it longer than the round trip
+    TEST_ASSERT_FALSE(sync.synchronized());
+}
+
+TEST_CASE("TimeSync trusts the round trip with the least queueing", "[time_sync]")
+{
+    TimeSync sync;
+    exchange(sync, 1000, 10, 10);
+
+    // A response stuck 80 ms in a queue would pull the offset 40 ms off
+    exchange(sync, 61000, 10, 90);
+    TEST_ASSERT_EQUAL(20, sync.delay_ms());
+    TEST_ASSERT_EQUAL(61000 + OFFSET_MS, sync.to_hub_time(61000));
+}
+
+TEST_CASE("TimeSync estimates drift and extrapolates between heartbeats", "[time_sync]")
+{
+    const int32_t drift_ppm = 100;
+    TimeSync sync;
+    for (uint64_t t = 1000; t < 1000 + 10 * 60000; t += 60000) {
+        TEST_ASSERT_TRUE(exchange(sync, t, 10, 10, drift_ppm));
+    }
+
+    TEST_ASSERT_INT_WITHIN(20, drift_ppm, sync.drift_ppm());
+
+    // Ten minutes after the last heartbeat the hub clock has moved 60 ms further
+    uint64_t later = 1000 + 20 * 60000;
+    TEST_ASSERT_INT_WITHIN(3, hub_clock(later, drift_ppm), sync.to_hub_time(later));
+    TEST_ASSERT_INT_WITHIN(3, later, sync.to_local_time(hub_clock(later, drift_ppm)));
+}
+
+TEST_CASE("TimeSync restarts when the hub clock steps", "[time_sync]")
+{
+    TimeSync sync;
+    exchange(sync, 1000, 10, 10);
+    exchange(sync, 61000, 10, 10);
+
+    // The hub rebooted: its clock now reads 60 s behind the local one
+    uint64_t t1 = 121000;
+    TEST_ASSERT_TRUE(sync.add_sample(t1, t1 - 60000 + 10, t1 - 60000 + 12, t1 + 50));
+    TEST_ASSERT_TRUE(sync.synchronized());
+    TEST_ASSERT_INT_WITHIN(20, 130000 - 60000, sync.to_hub_time(130000));
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
@@ -0,0 +1,171 @@
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "message_codec.hpp"
+#include "mock_channel_scanner.hpp"
+#include "mock_peer_manager.hpp"
+#include "tx_manager.hpp"
+#include "tx_state_machine.hpp"
+#include "unity.h"
+#include <atomic>
+#include <cstring>
+
+static constexpr uint32_t TX_STACK_SIZE  = 4096;
+static constexpr UBaseType_t TX_PRIORITY = 5;
+static constexpr int64_t WAIT_LIMIT_US   = 5000000;
+static constexpr size_t MAX_FRAMES       = 8;
+
+static const uint8_t PEER_A_MAC[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x02};
+static const uint8_t PEER_B_MAC[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x03};
+
+// Radio stand-in that keeps every frame sent, decoded back to its canonical form
+class RecordingWiFiHAL : public IWiFiHAL
+{
+public:
+    explicit RecordingWiFiHAL(IMessageCodec &codec)
+        : codec_(codec)
+    {
+    }
+
+    inline size_t sent() const { return sent_.load(std::memory_order_acquire); }
+    inline const MessageHeader &header(size_t i) const { return *reinterpret_cast<const MessageHeader *>(frames_[i]); }
+    inline uint8_t compact_flags(size_t i) const { return compact_flags_[i]; }
+
+    inline esp_err_t set_channel(uint8_t ch) override { return ESP_OK; }
+    inline esp_err_t get_channel(uint8_t *ch) override
+    {
+        *ch = 1;
+        return ESP_OK;
+    }
+    inline esp_err_t send_packet(const uint8_t *mac, const uint8_t *data, size_t len) override
+    {
+        size_t i = sent();
+        if (i == MAX_FRAMES) return ESP_FAIL;
+        if (codec_.decode_wire(mac, data, len, frames_[i], sizeof(frames_[i])) == 0) return ESP_FAIL;
+        compact_flags_[i] = ((data[0] & CompactHeader::MARKER_MASK) == CompactHeader::MARKER) ? data[1] : 0;
+        sent_.store(i + 1, std::memory_order_release);
+        return ESP_OK;
+    }
+    inline bool wait_for_event(uint32_t event_mask, uint32_t timeout_ms) override { return false; }
+    inline void set_task_to_notify(TaskHandle_t task_handle) override {}
+    inline esp_err_t set_listening(bool on) override { return ESP_OK; }
+    inline esp_err_t hold_listening(bool hold) override { return ESP_OK; }
+
+private:
+    IMessageCodec &codec_;
+    std::atomic<size_t> sent_{0};
+    uint8_t frames_[MAX_FRAMES][ESP_NOW_MAX_DATA_LEN];
+    uint8_t compact_flags_[MAX_FRAMES];
+};
+
+// The real TX task and state machine; peers and the scanner are mocks
+struct Tx
+{
+    RealMessageCodec codec;
+    RecordingWiFiHAL hal{codec};
+    MockPeerManager peers;
+    MockChannelScanner scanner;
+    RealTxStateMachine fsm;
+    RealTxManager tx{fsm, scanner, hal, codec, peers};
+
+    Tx() { tx.init(TX_STACK_SIZE, TX_PRIORITY); }
+    ~Tx() { tx.deinit(); }
+
+    TxPacket packet(const uint8_t *mac, MessageType type, bool requires_ack)
+    {
+        MessageHeader header = {};
+        header.msg_type      = type;
+        header.requires_ack  = requires_ack;
+        uint8_t payload[8]   = {};
+
+        TxPacket packet;
+        memcpy(packet.dest_mac, mac, 6);
+        packet.len          = codec.encode(header, payload, sizeof(payload), packet.data, sizeof(packet.data));
+        packet.requires_ack = requires_ack;
+        TEST_ASSERT_NOT_EQUAL(0, packet.len);
+        return packet;
+    }
+
+    bool wait_sent(size_t count)
+    {
+        int64_t start_us = esp_timer_get_time();
+        while (hal.sent() < count) {
+            if (esp_timer_get_time() - start_us > WAIT_LIMIT_US) return false;
+            vTaskDelay(1);
+        }
+        return true;
+    }
+};
+
+TEST_CASE("TX manager completes a frame only on the ACK its peer sends for it", "[tx_manager]")
+{
+    Tx t;
+    TEST_ASSERT_EQUAL(ESP_OK, t.tx.queue_packet(t.packet(PEER_A_MAC, MessageType::DATA, true)));
+    TEST_ASSERT_EQUAL(ESP_OK, t.tx.queue_packet(t.packet(PEER_A_MAC, MessageType::DATA, false)));
+    TEST_ASSERT_TRUE(t.wait_sent(1));
+    uint16_t sequence = t.hal.header(0).sequence_number;
+
+    // Another peer's ACK with the same sequence, and this peer's ACK for another frame
+    t.tx.notify_logical_ack(PEER_B_MAC, sequence);
+    t.tx.notify_logical_ack(PEER_A_MAC, sequence + 1);
+    vTaskDelay(pdMS_TO_TICKS(LOGICAL_ACK_TIMEOUT_MS / 5));
+    TEST_ASSERT_EQUAL(1, t.hal.sent());
+
+    // A piggybacked ACK carries 15 bits of the sequence
+    t.tx.notify_logical_ack(PEER_A_MAC, sequence ^ 0x8000);
+    TEST_ASSERT_TRUE(t.wait_sent(2));
+    TEST_ASSERT_EQUAL(0, t.hal.header(1).requires_ack);
+
+    // One link sample, for the peer that answered
+    TEST_ASSERT_EQUAL(1, t.peers.deliveries.size());
+    TEST_ASSERT_EQUAL_MEMORY(PEER_A_MAC, t.peers.deliveries[0].mac, 6);
+    TEST_ASSERT_TRUE(t.peers.deliveries[0].delivered);
+    TEST_ASSERT_EQUAL(0, t.peers.deliveries[0].retries);
+    TEST_ASSERT_TRUE(t.peers.deliveries[0].rtt_ms >= LOGICAL_ACK_TIMEOUT_MS / 5);
+}
+
+TEST_CASE("TX manager confirms a delta keyframe only on the ACK for it", "[tx_manager][delta]")
+{
+    Tx t;
+    t.peers.capabilities = PeerCapability::COMPACT_HEADER | PeerCapability::PAYLOAD_DELTA;
+    TEST_ASSERT_EQUAL(ESP_OK, t.tx.queue_packet(t.packet(PEER_A_MAC, MessageType::DATA, true)));
+    TEST_ASSERT_EQUAL(ESP_OK, t.tx.queue_packet(t.packet(PEER_A_MAC, MessageType::DATA, true)));
+    TEST_ASSERT_TRUE(t.wait_sent(1));
+    TEST_ASSERT_TRUE(t.hal.compact_flags(0) & CompactHeader::FLAG_KEYFRAME);
+    uint16_t sequence = t.hal.header(0).sequence_number;
+
+    // Confirming the keyframe on this would have the next frame sent as a delta
+    // against a reference the peer may never have received
+    t.tx.notify_logical_ack(PEER_B_MAC, sequence);
+    vTaskDelay(pdMS_TO_TICKS(LOGICAL_ACK_TIMEOUT_MS / 5));
+    TEST_ASSERT_EQUAL(1, t.hal.sent());
+
+    t.tx.notify_logical_ack(PEER_A_MAC, sequence);
+    TEST_ASSERT_TRUE(t.wait_sent(2));
+    TEST_ASSERT_TRUE(t.hal.compact_flags(1) & CompactHeader::FLAG_DELTA);
+    t.tx.notify_logical_ack(PEER_A_MAC, t.hal.header(1).sequence_number);
+}
+
+TEST_CASE("TX manager retransmits without the piggybacked ACK", "[tx_manager]")
+{
+    Tx t;
+    t.peers.capabilities = PeerCapability::COMPACT_HEADER;
+    TEST_ASSERT_EQUAL(ESP_OK, t.tx.schedule_ack(t.packet(PEER_A_MAC, MessageType::ACK, false), 0x0042));
+    TEST_ASSERT_EQUAL(ESP_OK, t.tx.queue_packet(t.packet(PEER_A_MAC, MessageType::DATA, true)));
+    TEST_ASSERT_TRUE(t.wait_sent(1));
+    TEST_ASSERT_EQUAL_HEX16(PIGGYBACK_ACK_VALID | 0x0042, t.hal.header(0).piggyback_ack);
+
+    // No ACK comes back, so the frame is sent again
+    TEST_ASSERT_TRUE(t.wait_sent(2));
+    TEST_ASSERT_EQUAL(t.hal.header(0).sequence_number, t.hal.header(1).sequence_number);
+    TEST_ASSERT_EQUAL_HEX16(0, t.hal.header(1).piggyback_ack);
+
+    t.tx.notify_logical_ack(PEER_A_MAC, t.hal.header(0).sequence_number);
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
@@ -0,0 +1,283 @@
+#include "alloc_tracker.hpp"
+#include "channel_scanner.hpp"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "heartbeat_manager.hpp"
+#include "message_codec.hpp"
+#include "message_registry.hpp"
+#include "message_router.hpp"
+#include "mock_storage.hpp"
+#include "pairing_manager.hpp"
+#include "peer_manager.hpp"
+#include "protocol_messages.hpp"
+#include "tx_manager.hpp"
+#include "tx_state_machine.hpp"
+#include "unity.h"
+extern "C" {
+#include "Mockesp_now.h"
+#include "Mockesp_wifi.h"
+}
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+static constexpr NodeType SENSOR_TYPE           = 0x02;
+static constexpr NodeId SENSOR_ID               = 2;
+static constexpr uint32_t TX_STACK_SIZE         = 4096;
+static constexpr UBaseType_t TX_PRIORITY        = 5;
+static constexpr uint32_t HEARTBEAT_INTERVAL_MS = 50;
+static constexpr uint32_t WARMUP_ROUNDS         = 10;
+static constexpr uint32_t MEASURED_ROUNDS       = 100;
+static constexpr int64_t WAIT_LIMIT_US          = 5000000;
+// Beacons and wake slots only change which hub timer answers a heartbeat
+static constexpr uint16_t AGREED_CAPS =
+    PeerCapability::SUPPORTED & ~(PeerCapability::AEAD | PeerCapability::HEARTBEAT_BEACON | PeerCapability::WAKE_SLOTS);
+
+static const uint8_t HUB_MAC[6]    = {0x24, 0x0A, 0xC4, 0x00, 0x00, ReservedIds::HUB};
+static const uint8_t SENSOR_MAC[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, SENSOR_ID};
+
+struct Station;
+
+// Radio of one station. A frame sent is decoded and routed by the other station
+// at once, from the sender's TX task, standing in for its RX task.
+class LoopbackWiFiHAL : public IWiFiHAL
+{
+public:
+    Station *remote = nullptr;
+
+    explicit LoopbackWiFiHAL(Station &self)
+        : self_(self)
+    {
+    }
+
+    inline esp_err_t set_channel(uint8_t ch) override { return ESP_OK; }
+    inline esp_err_t get_channel(uint8_t *ch) override
+    {
+        *ch = 1;
+        return ESP_OK;
+    }
+    esp_err_t send_packet(const uint8_t *mac, const uint8_t *data, size_t len) override;
+    inline bool wait_for_event(uint32_t event_mask, uint32_t timeout_ms) override { return false; }
+    inline void set_task_to_notify(TaskHandle_t task_handle) override {}
+    inline esp_err_t set_listening(bool listening) override { return ESP_OK; }
+    inline esp_err_t hold_listening(bool hold) override { return ESP_OK; }
+
+private:
+    Station &self_;
+};
+
+// A hub or sensor built from the production components, with its TX task
+struct Station
+{
+    Station(const uint8_t *station_mac, NodeId id, NodeType type)
+        : id(id)
+        , type(type)
+        , hal(*this)
+        , codec(AGREED_CAPS)
+        , peers(storage)
+        , scanner(hal, codec, id, type)
+        , tx(fsm, scanner, hal, codec, peers)
+        , heartbeat(tx, peers, codec, hal, id)
+        , pairing(tx, peers, codec, hal)
+        , router(peers, tx, heartbeat, pairing, codec)
+    {
+        memcpy(mac, station_mac, 6);
+        router.set_node_info(id, type);
+        pairing.init(type, id);
+    }
+
+    uint8_t mac[6];
+    const NodeId id;
+    const NodeType type;
+    MockStorage storage;
+    LoopbackWiFiHAL hal;
+    RealMessageCodec codec;
+    RealPeerManager peers;
+    RealTxStateMachine fsm;
+    RealChannelScanner scanner;
+    RealTxManager tx;
+    RealHeartbeatManager heartbeat;
+    RealPairingManager pairing;
+    RealMessageRouter router;
+
+    std::atomic<uint32_t> routed[256] = {}; // Frames handled, by MessageType
+
+    inline uint32_t count(MessageType type) const { return routed[static_cast<uint8_t>(type)].load(); }
+
+    void receive(const uint8_t *src_mac, const uint8_t *wire, size_t len)
+    {
+        RxPacket packet;
+        packet.len = codec.decode_wire(src_mac, wire, len, packet.data, sizeof(packet.data));
+        if (packet.len == 0) return;
+        memcpy(packet.src_mac, src_mac, 6);
+        packet.rssi         = -50;
+        packet.timestamp_us = esp_timer_get_time();
+
+        router.handle_packet(packet);
+        routed[static_cast<uint8_t>(reinterpret_cast<const MessageHeader *>(packet.data)->msg_type)]++;
+    }
+};
+
+esp_err_t LoopbackWiFiHAL::send_packet(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+    if (remote != nullptr) remote->receive(self_.mac, data, len);
+    return ESP_OK;
+}
+
+template <typename Fn> static bool wait_until(Fn &&done)
+{
+    int64_t start_us = esp_timer_get_time();
+    while (!done()) {
+        if (esp_timer_get_time() - start_us > WAIT_LIMIT_US) return false;
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+static void assert_no_allocations(uint64_t before)
+{
+    uint64_t made = AllocTracker::allocations() - before;
+    char message[64];
+    snprintf(message, sizeof(message), "%llu allocations, the last of %zu bytes", (unsigned long long)made,
+             AllocTracker::last_size());
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, made, message);
+}
+
+// A hub and a paired sensor. Everything that allocates, from the peer tables
+// to the FreeRTOS queues and timers, is set up here.
+struct Link
+{
+    Station hub{HUB_MAC, ReservedIds::HUB, ReservedTypes::HUB};
+    Station sensor{SENSOR_MAC, SENSOR_ID, SENSOR_TYPE};
+    QueueHandle_t app_queue;
+
+    explicit Link(uint32_t sensor_heartbeat_ms)
+    {
+        esp_now_add_peer_IgnoreAndReturn(ESP_OK);
+        esp_now_del_peer_IgnoreAndReturn(ESP_OK);
+        esp_now_mod_peer_IgnoreAndReturn(ESP_OK);
+        esp_wifi_get_channel_IgnoreAndReturn(ESP_OK);
+
+        hub.hal.remote    = &sensor;
+        sensor.hal.remote = &hub;
+        hub.peers.add(SENSOR_ID, SENSOR_MAC, 1, SENSOR_TYPE, sensor_heartbeat_ms);
+        hub.peers.set_capabilities(SENSOR_ID, AGREED_CAPS);
+        sensor.peers.add(ReservedIds::HUB, HUB_MAC, 1, ReservedTypes::HUB);
+        sensor.peers.set_capabilities(ReservedIds::HUB, AGREED_CAPS);
+
+        app_queue = xQueueCreate(4, sizeof(RxPacket));
+        hub.router.set_app_queue(app_queue);
+        hub.heartbeat.init(0, ReservedTypes::HUB);
+        sensor.heartbeat.init(sensor_heartbeat_ms, SENSOR_TYPE);
+        hub.tx.init(TX_STACK_SIZE, TX_PRIORITY);
+        sensor.tx.init(TX_STACK_SIZE, TX_PRIORITY);
+    }
+
+    ~Link()
+    {
+        sensor.heartbeat.deinit();
+        sensor.tx.deinit();
+        hub.tx.deinit();
+        hub.heartbeat.deinit();
+        hub.router.set_app_queue(nullptr);
+        vQueueDelete(app_queue);
+    }
+
+    // A DATA frame with requires_ack, confirmed by the hub's application the way
+    // EspNow::send() and confirm_reception() do it
+    bool round_trip(uint8_t fill)
+    {
+        MessageHeader header  = {};
+        header.msg_type       = MessageType::DATA;
+        header.sender_type    = SENSOR_TYPE;
+        header.sender_node_id = SENSOR_ID;
+        header.payload_type   = 0x01;
+        header.requires_ack   = true;
+        header.dest_node_id   = ReservedIds::HUB;
+        header.timestamp_ms   = esp_timer_get_time() / 1000;
+        uint8_t payload[32];
+        memset(payload, fill, sizeof(payload));
+
+        TxPacket packet;
+        memcpy(packet.dest_mac, HUB_MAC, 6);
+        packet.len          = sensor.codec.encode(header, payload, sizeof(payload), packet.data, sizeof(packet.data));
+        packet.requires_ack = true;
+        uint32_t acks       = sensor.count(MessageType::ACK);
+        if (packet.len == 0 || sensor.tx.queue_packet(packet) != ESP_OK) return false;
+
+        RxPacket received;
+        if (xQueueReceive(app_queue, &received, pdMS_TO_TICKS(WAIT_LIMIT_US / 1000)) != pdTRUE) return false;
+        const auto *data = reinterpret_cast<const MessageHeader *>(received.data);
+
+        AckMessage ack            = {};
+        ack.header.sender_node_id = ReservedIds::HUB;
+        ack.header.sender_type    = ReservedTypes::HUB;
+        ack.header.dest_node_id   = data->sender_node_id;
+        ack.ack_sequence          = data->sequence_number;
+        ack.status                = AckStatus::OK;
+
+        TxPacket ack_packet;
+        memcpy(ack_packet.dest_mac, received.src_mac, 6);
+        ack_packet.len          = encode_message(hub.codec, ack, ack_packet.data, sizeof(ack_packet.data));
+        ack_packet.requires_ack = false;
+        if (ack_packet.len == 0 || hub.tx.schedule_ack(ack_packet, ack.ack_sequence) != ESP_OK) return false;
+
+        return wait_until([&] { return sensor.count(MessageType::ACK) > acks; });
+    }
+
+    bool heartbeats_answered(uint32_t count)
+    {
+        return wait_until([&] { return sensor.count(MessageType::HEARTBEAT_RESPONSE) >= count; });
+    }
+};
+
+TEST_CASE("Acknowledged DATA frames allocate nothing once the link is up", "[zero_alloc]")
+{
+    Link link(0);
+    for (uint32_t i = 0; i < WARMUP_ROUNDS; i++) TEST_ASSERT_TRUE(link.round_trip(i));
+
+    uint64_t before = AllocTracker::allocations();
+    for (uint32_t i = 0; i < MEASURED_ROUNDS; i++) TEST_ASSERT_TRUE(link.round_trip(i));
+    assert_no_allocations(before);
+
+    TEST_ASSERT_EQUAL(WARMUP_ROUNDS + MEASURED_ROUNDS, link.hub.count(MessageType::DATA));
+}
+
+TEST_CASE("Heartbeats and their responses allocate nothing", "[zero_alloc]")
+{
+    Link link(HEARTBEAT_INTERVAL_MS);
+    TEST_ASSERT_TRUE(link.heartbeats_answered(WARMUP_ROUNDS));
+
+    uint64_t before = AllocTracker::allocations();
+    TEST_ASSERT_TRUE(link.heartbeats_answered(WARMUP_ROUNDS + MEASURED_ROUNDS / 4));
+    assert_no_allocations(before);
+
+    // The hub consulted its peer table for the slot hint of every one
+    TEST_ASSERT_GREATER_OR_EQUAL(WARMUP_ROUNDS + MEASURED_ROUNDS / 4, link.hub.count(MessageType::HEARTBEAT));
+}
+
+TEST_CASE("Peer table queries fill caller buffers without allocating", "[zero_alloc]")
+{
+    Link link(0);
+    PeerInfo peers[MAX_PEERS];
+    NodeId offline[MAX_PEERS];
+    uint32_t visited = 0;
+
+    uint64_t before = AllocTracker::allocations();
+    TEST_ASSERT_EQUAL(1, link.hub.peers.get_all(peers, MAX_PEERS));
+    TEST_ASSERT_EQUAL(0, link.hub.peers.get_offline(esp_timer_get_time() / 1000, offline, MAX_PEERS));
+    link.hub.peers.for_each([&visited](const PeerInfo &) { visited++; });
+    assert_no_allocations(before);
+
+    TEST_ASSERT_EQUAL(SENSOR_ID, peers[0].node_id);
+    TEST_ASSERT_EQUAL(1, visited);
+}
+
+extern "C" void app_main(void)
+{
+    if (!AllocTracker::hooks_malloc()) printf("Only operator new is tracked on this host\n");
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    UNITY_END();
+    esp_restart();
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include "message_registry.hpp"
 #include "protocol_messages.hpp"
 #include "protocol_types.hpp"
 
@@ -81,3 +82,9 @@ static_assert(sizeof(WaterLevelReport) <= MAX_PAYLOAD_SIZE,
               "WaterLevelReport payload is too large");
 static_assert(sizeof(SolarSensorReport) <= MAX_PAYLOAD_SIZE,
               "SolarSensorReport payload is too large");
+
+// Sent as DATA frames; decode_message() also checks the payload type
+template <> struct MessageTraits<WaterLevelReport>
+    : DataMessageSpec<WaterLevelReport, to_payload_type(IrrigationPayloadType::WATER_LEVEL_REPORT)> {};
+template <> struct MessageTraits<SolarSensorReport>
+    : DataMessageSpec<SolarSensorReport, to_payload_type(IrrigationPayloadType::SOLAR_SENSOR_REPORT)> {};
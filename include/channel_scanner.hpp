@@ -1,20 +1,97 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 class RealChannelScanner : public IChannelScanner
 {
 public:
-    RealChannelScanner(IWiFiHAL &wifi_hal, IMessageCodec &message_codec, NodeId my_node_id, NodeType my_node_type);
+    struct Config
+    {
+        uint16_t min_dwell_ms;   // Floor for the adaptive dwell
+        uint16_t max_dwell_ms;   // Dwell until a latency is measured, and for fallback passes
+        uint8_t latency_margin;  // Dwell is the latency estimate times this factor
+        uint8_t passes;          // Passes over all channels before giving up
+
+        Config()
+            : min_dwell_ms(SCAN_MIN_DWELL_MS)
+            , max_dwell_ms(SCAN_CHANNEL_TIMEOUT_MS)
+            , latency_margin(3)
+            , passes(SCAN_CHANNEL_ATTEMPTS)
+        {
+        }
+    };
+
+    // hint_store keeps the recent hub channels across deep sleep; may be null
+    RealChannelScanner(IWiFiHAL &wifi_hal,
+                       IMessageCodec &message_codec,
+                       NodeId my_node_id,
+                       NodeType my_node_type,
+                       IStorage *hint_store = nullptr,
+                       const Config &config = Config());
+    ~RealChannelScanner();
+
+    RealChannelScanner(const RealChannelScanner &)            = delete;
+    RealChannelScanner &operator=(const RealChannelScanner &) = delete;
 
     using IChannelScanner::update_node_info;
 
-    ScanResult scan(uint8_t start_channel) override;
+    uint32_t start(uint8_t start_channel, ScanCallback on_done, void *ctx) override;
+    uint32_t on_dwell_elapsed() override;
+    void on_hub_found() override;
+    bool is_scanning() const override { return scanning_; }
+    void cancel() override;
+    void record_hub_channel(uint8_t channel) override;
     void update_node_info(NodeId id, NodeType type) override;
 
+    // Current first-pass dwell, for diagnostics and tests
+    uint16_t dwell_ms() const;
+
 private:
+    // Fills order with every channel once, most likely first. Returns the count.
+    size_t build_order(uint8_t start_channel, uint8_t *order) const;
+    void record_hit(uint8_t channel, uint32_t latency_ms);
+    // Callers hold hint_mutex_
+    void load_hints();
+    void move_hint_to_front(uint8_t channel);
+    uint16_t adaptive_dwell_ms() const;
+    // Tunes to the next channel in order and probes it. Returns its dwell, 0 if none is left.
+    uint32_t probe_next();
+    void finish(bool hub_found);
+
     IWiFiHAL &wifi_hal_;
     IMessageCodec &message_codec_;
     NodeId my_node_id_;
     NodeType my_node_type_;
+    IStorage *hint_store_;
+    Config config_;
+
+    // Guards the hint and sighting state below: record_hub_channel() runs on the
+    // worker task, scans on the TX task
+    SemaphoreHandle_t hint_mutex_ = nullptr;
+
+    // Recent hub channels, most recent first, 0 when unused. Persisted via hint_store_.
+    uint8_t hints_[CHANNEL_HINT_COUNT] = {};
+    bool hints_loaded_                 = false;
+
+    // RAM only: sightings over the current power cycle
+    uint8_t hits_[SCAN_MAX_CHANNEL + 1] = {}; // Saturating hub sightings per channel
+    uint32_t latency_ewma_x8_ = 0;            // Hub response latency in 1/8 ms, 0 until measured
+
+    // Scan in progress
+    bool scanning_            = false;
+    ScanCallback on_done_     = nullptr;
+    void *on_done_ctx_        = nullptr;
+    ScanResult result_        = {};
+    uint8_t start_channel_    = 1;
+    uint8_t order_[SCAN_MAX_CHANNEL];
+    size_t channel_count_     = 0;
+    size_t next_index_        = 0; // Position in order_ of the next channel to probe
+    uint8_t pass_             = 0;
+    uint16_t first_dwell_     = 0;
+    uint8_t probe_wire_[ESP_NOW_MAX_DATA_LEN];
+    size_t probe_wire_len_    = 0;
+    int64_t scan_start_us_    = 0;
+    int64_t probe_start_us_   = 0;
 };
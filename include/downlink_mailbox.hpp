@@ -0,0 +1,47 @@
+#pragma once
+
+#include "espnow_types.hpp"
+#include "esp_err.h"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Store-and-forward buffer for frames to peers that cannot hear them yet.
+ *
+ * A sleeping or offline node cannot be reached, so the hub parks frames for it
+ * here until the node is heard from, then releases them in the order they were
+ * held. All peers share SLOTS entries and each peer may take PEER_SLOTS of them.
+ * A DATA or COMMAND frame replaces a held one with the same payload type for
+ * the same peer: only the latest value is worth delivering. Frames older than
+ * TTL_MS are dropped. The mailbox is not locked.
+ */
+class DownlinkMailbox
+{
+public:
+    static constexpr size_t SLOTS      = DOWNLINK_MAILBOX_SLOTS;
+    static constexpr size_t PEER_SLOTS = DOWNLINK_MAILBOX_PEER_SLOTS;
+    static constexpr uint32_t TTL_MS   = DOWNLINK_MAILBOX_TTL_MS;
+
+    // ESP_ERR_NO_MEM if the peer's share or every slot is taken.
+    esp_err_t hold(const TxPacket &packet, uint64_t now_ms);
+    // Removes the oldest live frame held for mac. Returns false if there is none.
+    bool take(const uint8_t *mac, TxPacket &packet, uint64_t now_ms);
+    size_t pending(const uint8_t *mac, uint64_t now_ms);
+    // Drops expired frames and returns how many.
+    size_t expire(uint64_t now_ms);
+    void clear();
+
+private:
+    struct Slot
+    {
+        bool in_use;
+        uint32_t order;
+        uint64_t held_ms;
+        TxPacket packet;
+    };
+
+    Slot *find_coalescable(const TxPacket &packet);
+
+    Slot slots_[SLOTS]   = {};
+    uint32_t next_order_ = 0;
+};
@@ -7,7 +7,6 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include <optional>
-#include <vector>
 
 class IPeerManager
 {
@@ -37,8 +36,21 @@ public:
         return find_mac(static_cast<NodeId>(id), mac);
     }
 
-    virtual std::vector<PeerInfo> get_all()                  = 0;
-    virtual std::vector<NodeId> get_offline(uint64_t now_ms) = 0;
+    // Copy up to max entries into out and return how many were written. Peers
+    // with a heartbeat interval that were not heard from within their offline
+    // timeout count as offline.
+    virtual size_t get_all(PeerInfo *out, size_t max)                    = 0;
+    virtual size_t get_offline(uint64_t now_ms, NodeId *out, size_t max) = 0;
+
+    // Calls visit for every peer in place, without copying the table. It runs
+    // under the peer manager's lock, so visit must not call back into it.
+    using PeerVisitor = void (*)(const PeerInfo &peer, void *ctx);
+    virtual void for_each(PeerVisitor visit, void *ctx) = 0;
+    template <typename Fn> void for_each(Fn &&fn)
+    {
+        for_each([](const PeerInfo &peer, void *ctx) { (*static_cast<std::remove_reference_t<Fn> *>(ctx))(peer); },
+                 &fn);
+    }
 
     virtual void update_last_seen(NodeId id, uint64_t now_ms) = 0;
     template <typename T, typename = std::enable_if_t<std::is_enum_v<T> && sizeof(T) == sizeof(NodeId)>>
@@ -47,6 +59,50 @@ public:
         update_last_seen(static_cast<NodeId>(id), now_ms);
     }
 
+    virtual esp_err_t set_capabilities(NodeId id, uint16_t capabilities) = 0;
+    template <typename T, typename = std::enable_if_t<std::is_enum_v<T> && sizeof(T) == sizeof(NodeId)>>
+    esp_err_t set_capabilities(T id, uint16_t capabilities)
+    {
+        return set_capabilities(static_cast<NodeId>(id), capabilities);
+    }
+
+    // PeerCapability bits of the peer with this MAC, PeerCapability::NONE if unknown
+    virtual uint16_t get_capabilities(const uint8_t *mac) = 0;
+    // True once liveness expired the peer with this MAC, until it is heard from
+    // again. Unknown peers, peers not heard from since they were added or loaded
+    // and peers without a heartbeat interval are never offline.
+    virtual bool is_offline(const uint8_t *mac) = 0;
+
+    // Link quality, reported in PeerInfo::link. record_delivery() is for frames
+    // sent with requires_ack, see LinkMetrics for the arguments. ack_timeout_ms()
+    // falls back to LOGICAL_ACK_TIMEOUT_MS for peers without RTT samples.
+    virtual void record_rx(NodeId id, int8_t rssi) = 0;
+    virtual void record_delivery(const uint8_t *mac, bool delivered, uint8_t retries, uint32_t rtt_ms) = 0;
+    virtual uint32_t ack_timeout_ms(const uint8_t *mac, uint8_t retries) = 0;
+
+    // SecureEnvelope session key agreed during pairing, persisted with the peer.
+    // Passing nullptr clears it. Keys are not part of PeerInfo.
+    virtual esp_err_t set_session_key(NodeId id, const uint8_t *key) = 0;
+    template <typename T, typename = std::enable_if_t<std::is_enum_v<T> && sizeof(T) == sizeof(NodeId)>>
+    esp_err_t set_session_key(T id, const uint8_t *key)
+    {
+        return set_session_key(static_cast<NodeId>(id), key);
+    }
+    virtual bool get_session_key(NodeId id, uint8_t *key) = 0;
+
+    // Moves every peer to the given channel, e.g. after the hub changed channel.
+    // Not persisted; call persist() afterwards.
+    virtual esp_err_t set_channel_all(uint8_t channel) = 0;
+
+    // Liveness: update_last_seen() arms a per-peer offline deadline and
+    // check_liveness() expires the ones that passed. ONLINE/OFFLINE transitions
+    // are posted as PeerEvent to the event queue, if one is set.
+    virtual void set_event_queue(QueueHandle_t queue) = 0;
+    virtual void check_liveness(uint64_t now_ms)      = 0;
+    // Hub's wake period. Peers that agreed PeerCapability::WAKE_SLOTS heartbeat
+    // only once per period, so their offline timeout is based on it.
+    virtual void set_wake_period(uint32_t period_ms) = 0;
+
     virtual esp_err_t load_from_storage(uint8_t &wifi_channel) = 0;
     virtual void persist(uint8_t wifi_channel)                 = 0;
 };
@@ -75,8 +131,23 @@ public:
     {
         uint8_t channel;
         bool hub_found;
+        uint32_t duration_ms; // Time spent scanning with the radio on
+        uint16_t probes;      // Probes sent
     };
-    virtual ScanResult scan(uint8_t start_channel) = 0;
+    using ScanCallback = void (*)(const ScanResult &result, void *ctx);
+
+    // Scans are stepped by the caller so they never block its task: start() sends
+    // the first probe and every later step returns the dwell in ms after which
+    // on_dwell_elapsed() is due, or 0 once the scan is over. on_done runs from
+    // within start(), on_dwell_elapsed() or on_hub_found(), in the caller's task.
+    virtual uint32_t start(uint8_t start_channel, ScanCallback on_done, void *ctx) = 0;
+    virtual uint32_t on_dwell_elapsed() = 0;
+    virtual void on_hub_found() = 0; // A scan response arrived on the current channel
+    virtual bool is_scanning() const = 0;
+    virtual void cancel() = 0; // Abandons the scan without calling on_done
+    // Records a channel the hub was seen on outside a scan (announcement, heartbeat).
+    // Safe to call from any task, including while a scan runs on another.
+    virtual void record_hub_channel(uint8_t channel) = 0;
     virtual void update_node_info(NodeId id, NodeType type) = 0;
 
     template <typename T1, typename T2,
@@ -88,17 +159,62 @@ public:
     }
 };
 
+// Frames travel through the stack in the canonical layout: MessageHeader, payload
+// and a trailing CRC_SIZE slot that is left zero. encode_wire()/decode_wire()
+// translate between it and the format actually sent on air, and are the only
+// places the integrity check is computed and verified.
 class IMessageCodec
 {
 public:
     virtual ~IMessageCodec() = default;
-    virtual std::vector<uint8_t> encode(const MessageHeader &header,
-                                        const void *payload,
-                                        size_t len)                             = 0;
+    // Builds the canonical frame for header and payload in out. Returns its
+    // length, or 0 if it is longer than an ESP-NOW frame or does not fit in out.
+    virtual size_t encode(const MessageHeader &header,
+                          const void *payload,
+                          size_t len,
+                          uint8_t *out,
+                          size_t out_len)                                       = 0;
     virtual std::optional<MessageHeader> decode_header(const uint8_t *data,
                                                        size_t len)              = 0;
     virtual bool validate_crc(const uint8_t *data, size_t len)                  = 0;
     virtual uint8_t calculate_crc(const uint8_t *data, size_t len)              = 0;
+
+    // Serialises a canonical frame for dest_mac using the best format in peer_caps.
+    // Retransmissions never use delta coding, and other frames only once the peer
+    // has acknowledged the reference (see confirm_delivery()). Returns the wire
+    // length, or 0 if the frame is malformed or does not fit in out.
+    virtual size_t encode_wire(const uint8_t *dest_mac,
+                               const uint8_t *frame,
+                               size_t len,
+                               uint16_t peer_caps,
+                               bool retransmission,
+                               uint8_t *out,
+                               size_t out_len)                                  = 0;
+    // Validates a frame received from src_mac in any supported format and expands
+    // it into the canonical layout, which takes up to MAX_FRAME_SIZE bytes. Returns
+    // the canonical length, or 0 if the frame is invalid or is a delta without a
+    // matching reference.
+    virtual size_t decode_wire(const uint8_t *src_mac,
+                               const uint8_t *wire,
+                               size_t len,
+                               uint8_t *out,
+                               size_t out_len)                                  = 0;
+    // dest_mac acknowledged the canonical frame sent to it with encode_wire().
+    // Call from the task that encodes frames.
+    virtual void confirm_delivery(const uint8_t *dest_mac, const uint8_t *frame, size_t len) = 0;
+
+    // PeerCapability bits this node offers during pairing
+    virtual uint16_t capabilities() const                                       = 0;
+    virtual void set_capabilities(uint16_t capabilities)                        = 0;
+
+    // Frames to a MAC with a session key are sealed in a SecureEnvelope, and
+    // plaintext frames from it are rejected apart from the pairing handshake.
+    virtual esp_err_t set_local_mac(const uint8_t *mac)                         = 0;
+    virtual esp_err_t install_session_key(const uint8_t *mac, const uint8_t *key) = 0;
+    virtual void remove_session_key(const uint8_t *mac)                         = 0;
+    // Saves SecureEnvelope replay floors decode_wire() has only kept in memory.
+    // Call periodically from a task off the RX path.
+    virtual void flush_replay_floors()                                          = 0;
 };
 
 class IPersistenceBackend
@@ -113,10 +229,27 @@ class IStorage
 {
 public:
     virtual ~IStorage() = default;
-    virtual esp_err_t load(uint8_t &wifi_channel, std::vector<PersistentPeer> &peers) = 0;
+    // Copies up to max stored peers into peers and sets count to how many
+    virtual esp_err_t load(uint8_t &wifi_channel, PersistentPeer *peers, size_t max, size_t &count) = 0;
     virtual esp_err_t save(uint8_t wifi_channel,
-                           const std::vector<PersistentPeer> &peers,
+                           const PersistentPeer *peers,
+                           size_t count,
                            bool force_nvs_commit = true) = 0;
+    // Boot epoch for SecureEnvelope nonces, strictly increasing even across power loss
+    virtual esp_err_t next_epoch(uint32_t &epoch) = 0;
+    // Recent hub channels, most recent first, zero-padded to count. Saved to RTC
+    // memory only; NVS picks them up with the next regular save.
+    virtual esp_err_t load_channel_hints(uint8_t *hints, size_t count) = 0;
+    virtual esp_err_t save_channel_hints(const uint8_t *hints, size_t count) = 0;
+    // Highest SecureEnvelope (epoch, counter) accepted from mac under the session
+    // key identified by key_check, so replay protection survives a reboot.
+    // ESP_ERR_NOT_FOUND if none is stored for that key.
+    virtual esp_err_t load_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t &epoch, uint32_t &counter) = 0;
+    // Once this returns ESP_OK, frames in the same epoch up to counter +
+    // REPLAY_SAVE_AHEAD - 1 may be accepted before the next save, even across a
+    // power loss. A floor lower than the stored one is ignored.
+    virtual esp_err_t save_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t epoch, uint32_t counter) = 0;
+    static constexpr uint32_t REPLAY_SAVE_AHEAD = 64;
 };
 
 class IWiFiHAL
@@ -128,6 +261,12 @@ public:
     virtual esp_err_t send_packet(const uint8_t *mac, const uint8_t *data, size_t len) = 0;
     virtual bool wait_for_event(uint32_t event_mask, uint32_t timeout_ms) = 0;
     virtual void set_task_to_notify(TaskHandle_t task_handle) = 0;
+    // Receiver duty cycle between wake slots. Frames can still be sent while
+    // not listening.
+    virtual esp_err_t set_listening(bool listening) = 0;
+    // Keeps the receiver on while a reply is awaited (ACK, scan response),
+    // whatever set_listening() last asked for.
+    virtual esp_err_t hold_listening(bool hold) = 0;
 };
 
 class ITxManager
@@ -137,9 +276,21 @@ public:
     virtual esp_err_t init(uint32_t stack_size, UBaseType_t priority) = 0;
     virtual esp_err_t deinit() = 0;
     virtual esp_err_t queue_packet(const TxPacket &packet) = 0;
+    // Holds a standalone ACK so it can be piggybacked on the next frame to the same
+    // peer; the ACK itself is sent if nothing goes out within PIGGYBACK_ACK_WINDOW_MS.
+    virtual esp_err_t schedule_ack(const TxPacket &ack_packet, uint16_t ack_sequence) = 0;
+    // Store-and-forward for peers that sleep or are offline: held frames wait
+    // until release_held() is called for their MAC, i.e. the peer is listening.
+    // See DownlinkMailbox for the bounds, TTL and coalescing.
+    virtual esp_err_t hold_packet(const TxPacket &packet) = 0;
+    virtual void release_held(const uint8_t *mac)         = 0;
+    virtual size_t held_count(const uint8_t *mac)         = 0;
     virtual void notify_physical_fail() = 0;
     virtual void notify_link_alive() = 0;
-    virtual void notify_logical_ack() = 0;
+    // A logical ACK from mac, standalone or piggybacked, for the frame with this
+    // sequence number. Only the low 15 bits are compared, which is all a piggybacked
+    // ACK carries; an ACK for any frame but the one being waited on is ignored.
+    virtual void notify_logical_ack(const uint8_t *mac, uint16_t sequence) = 0;
     virtual void notify_hub_found() = 0;
     virtual TaskHandle_t get_task_handle() const = 0;
 };
@@ -163,19 +314,48 @@ public:
     }
 
     virtual esp_err_t deinit() = 0;
-    virtual void handle_response(NodeId hub_id, uint8_t channel) = 0;
+
+    // Any frame received from a peer proves the link is up; nodes push their
+    // next heartbeat back a full interval when it comes from the hub.
+    virtual void notify_link_activity(NodeId peer_id) = 0;
+
+    // next_heartbeat_ms is the hub's slot hint from HeartbeatResponse, 0 if none
+    virtual void handle_response(NodeId hub_id, uint8_t channel, uint32_t next_heartbeat_ms) = 0;
     template <typename T, typename = std::enable_if_t<std::is_enum_v<T> && sizeof(T) == sizeof(NodeId)>>
-    void handle_response(T hub_id, uint8_t channel)
+    void handle_response(T hub_id, uint8_t channel, uint32_t next_heartbeat_ms)
     {
-        handle_response(static_cast<NodeId>(hub_id), channel);
+        handle_response(static_cast<NodeId>(hub_id), channel, next_heartbeat_ms);
     }
 
-    virtual void handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms) = 0;
+    // received_ms is the local time the heartbeat arrived, echoed for TimeSync
+    virtual void handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms) = 0;
     template <typename T, typename = std::enable_if_t<std::is_enum_v<T> && sizeof(T) == sizeof(NodeId)>>
-    void handle_request(T sender_id, const uint8_t *mac, uint64_t uptime_ms)
+    void handle_request(T sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms)
     {
-        handle_request(static_cast<NodeId>(sender_id), mac, uptime_ms);
+        handle_request(static_cast<NodeId>(sender_id), mac, uptime_ms, received_ms);
     }
+
+    // Feeds the timestamps of an answered heartbeat into the node's TimeSync.
+    // Responses that do not answer the last heartbeat sent are ignored.
+    virtual void handle_time_sample(uint64_t origin_ms, uint64_t hub_receive_ms, uint64_t hub_send_ms,
+                                    uint64_t local_receive_ms) = 0;
+
+    // Conversions between the local esp_timer clock and the network (hub) clock.
+    // They return false until a node has synchronized; the hub is the reference.
+    virtual bool to_network_time(uint64_t local_ms, uint64_t &network_ms) = 0;
+    virtual bool to_local_time(uint64_t network_ms, uint64_t &local_ms)   = 0;
+
+    // Wake slots. On the hub, the period of the slots assigned to nodes that
+    // agreed PeerCapability::WAKE_SLOTS; on a node, non-zero lets it sleep between
+    // the slots it is assigned. Set before init().
+    virtual void set_wake_period(uint32_t period_ms) = 0;
+    // Slot assignment from HeartbeatResponse, a 0 period revokes it
+    virtual void handle_wake_slot(uint32_t period_ms, uint32_t offset_ms) = 0;
+
+    // Frames the hub announced in the last HeartbeatResponse it holds for this
+    // node. A node that sleeps should stay awake until they have arrived.
+    virtual void handle_downlink_pending(uint8_t count) = 0;
+    virtual uint8_t downlink_pending() const            = 0;
 };
 
 class IPairingManager
@@ -192,21 +372,74 @@ public:
     }
 
     virtual esp_err_t deinit() = 0;
+    // Pre-shared key session keys are derived from; nullptr disables AEAD pairing
+    virtual void set_network_key(const uint8_t *key) = 0;
     virtual esp_err_t start(uint32_t timeout_ms) = 0;
     virtual bool is_active() const = 0;
     virtual void handle_request(const RxPacket &packet) = 0;
     virtual void handle_response(const RxPacket &packet) = 0;
 };
 
+// Called with the canonical frame (header, payload, CRC slot) of a matching
+// DATA, COMMAND or other APP-routed frame, in the RX dispatch task. Must not block.
+using AppFrameHandler = void (*)(const RxPacket &packet, void *ctx);
+
+// The APP-routed frames (DATA, COMMAND or a registered type) one consumer wants
+// and where they go: to handler, or to queue without waiting. With item_size 0
+// the queue takes whole RxPackets; otherwise it takes the first item_size bytes
+// of the frame, header included and zero-padded, e.g. a registered message
+// struct (see subscription_to_queue<T>()). Frames shorter than min_size bytes,
+// not counting the CRC slot, are dropped.
+struct AppSubscription
+{
+    MessageType msg_type     = MessageType::DATA;
+    PayloadType payload_type = 0;
+    bool any_payload_type    = false;
+    NodeId sender            = ReservedIds::BROADCAST; // BROADCAST matches every sender
+    size_t min_size          = sizeof(MessageHeader);
+
+    AppFrameHandler handler = nullptr;
+    void *ctx               = nullptr;
+    QueueHandle_t queue     = nullptr;
+    size_t item_size        = 0;
+};
+
+// Where frames of one MessageType are handled
+enum class RouteContext : uint8_t
+{
+    NONE,   // Dropped
+    INLINE, // In the RX dispatch task; must not block
+    WORKER, // In the transport worker task, which may block
+    APP,    // To the subscriptions, then the app queue, from the RX dispatch task
+};
+
+// Handles a frame of a registered MessageType, after the bookkeeping the router
+// does for every frame (last seen, link activity, piggybacked ACKs)
+using MessageHandler = void (*)(const RxPacket &packet, const MessageHeader &header, void *ctx);
+
 class IMessageRouter
 {
 public:
     virtual ~IMessageRouter() = default;
     virtual void handle_packet(const RxPacket &packet)       = 0;
-    virtual bool should_dispatch_to_worker(MessageType type) = 0;
+    virtual RouteContext route_context(MessageType type)     = 0;
+    // Catch-all for DATA and COMMAND frames no subscription takes; may be nullptr
     virtual void set_app_queue(QueueHandle_t app_queue)      = 0;
     virtual void set_node_info(NodeId id, NodeType type)     = 0;
 
+    // Routes a MessageType the stack does not define. INLINE and WORKER take a
+    // handler; APP frames go to subscriptions and take none; NONE removes the
+    // route. Not locked: register before frames arrive, which EspNow enforces.
+    // ESP_ERR_INVALID_STATE for a built-in type, ESP_ERR_INVALID_ARG for a value
+    // reserved by the wire format or a handler that does not fit the context.
+    virtual esp_err_t register_message_type(MessageType type, RouteContext context, MessageHandler handler,
+                                            void *ctx) = 0;
+
+    // A frame goes to every subscription it matches. Sets id for unsubscribe().
+    // ESP_ERR_NO_MEM once APP_SUBSCRIPTIONS_MAX are held.
+    virtual esp_err_t subscribe(const AppSubscription &subscription, int &id) = 0;
+    virtual esp_err_t unsubscribe(int id)                                      = 0;
+
     template <typename T1, typename T2,
               typename = std::enable_if_t<std::is_enum_v<T1> && sizeof(T1) == sizeof(NodeId)>,
               typename = std::enable_if_t<std::is_enum_v<T2> && sizeof(T2) == sizeof(NodeType)>>
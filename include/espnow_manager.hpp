@@ -1,9 +1,9 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <optional>
-#include <vector>
 
 #include "esp_now.h"
 #include "freertos/FreeRTOS.h"
@@ -12,20 +12,46 @@
 #include "freertos/timers.h"
 
 #include "espnow_interfaces.hpp"
+#include "espnow_stats.hpp"
+#include "latency_histogram.hpp"
 #include "espnow_storage.hpp"
 #include "espnow_types.hpp"
 #include "protocol_messages.hpp"
 #include "protocol_types.hpp"
 
+// Receives EspNow::get_stats() snapshots, see EspNowConfig::stats_reporter
+using StatsReporter = void (*)(const EspNowStats &stats, void *ctx);
+
 // Configuration to initialize the EspNow component
 struct EspNowConfig
 {
     NodeId node_id;
     NodeType node_type;
-    QueueHandle_t app_rx_queue;
+    QueueHandle_t app_rx_queue;    // DATA and COMMAND frames no subscription takes; optional
+    QueueHandle_t app_event_queue; // Optional, receives PeerEvent on liveness changes
     uint8_t wifi_channel;
     uint32_t ack_timeout_ms;
     uint32_t heartbeat_interval_ms;
+    uint16_t capabilities; // PeerCapability bits offered during pairing
+
+    // Wake slots for battery nodes. On the hub, the cycle in which every sleeping
+    // node gets a slot; frames for them are held until they are heard from. On a
+    // node, any non-zero value lets it turn the receiver off outside the slot the
+    // hub assigns. 0 keeps the radio listening (default).
+    uint32_t wake_period_ms;
+
+    // Application-layer AEAD. Peers paired while both sides have it enabled get a
+    // session key derived from network_key, which must match across the network.
+    // Encrypted frames carry SecureEnvelope::OVERHEAD extra bytes, so the largest
+    // payloads no longer fit and are rejected instead of being sent in the clear.
+    bool enable_encryption;
+    uint8_t network_key[SecureEnvelope::KEY_SIZE];
+
+    // Optional periodic statistics, e.g. to log or publish them. The reporter runs
+    // in the FreeRTOS timer task every stats_report_interval_ms and must not block.
+    StatsReporter stats_reporter;
+    void *stats_reporter_ctx;
+    uint32_t stats_report_interval_ms;
 
     uint32_t stack_size_rx_dispatch;
     uint32_t stack_size_transport_worker;
@@ -36,9 +62,17 @@ struct EspNowConfig
         : node_id(ReservedIds::HUB)
         , node_type(ReservedTypes::UNKNOWN)
         , app_rx_queue(nullptr)
+        , app_event_queue(nullptr)
         , wifi_channel(DEFAULT_WIFI_CHANNEL)
         , ack_timeout_ms(DEFAULT_ACK_TIMEOUT_MS)
         , heartbeat_interval_ms(DEFAULT_HEARTBEAT_INTERVAL_MS)
+        , capabilities(PeerCapability::SUPPORTED)
+        , wake_period_ms(0)
+        , enable_encryption(false)
+        , network_key{}
+        , stats_reporter(nullptr)
+        , stats_reporter_ctx(nullptr)
+        , stats_report_interval_ms(60000)
         , stack_size_rx_dispatch(4096)
         , stack_size_transport_worker(5120)
         , stack_size_tx_manager(4096)
@@ -131,10 +165,51 @@ public:
     {
         return remove_peer(static_cast<NodeId>(node_id));
     }
-    std::vector<PeerInfo> get_peers();
-    std::vector<NodeId> get_offline_peers() const;
+    // Both copy up to max entries, at most MAX_PEERS, and return how many they wrote
+    size_t get_peers(PeerInfo *peers, size_t max);
+    // Peers silent for longer than their offline timeout. Prefer app_event_queue,
+    // which is told about each transition as it happens.
+    size_t get_offline_peers(NodeId *ids, size_t max) const;
     esp_err_t start_pairing(uint32_t timeout_ms = 30000);
 
+    // Network time is the hub's clock, estimated on nodes from heartbeat round
+    // trips. Both return false on a node that has not synchronized yet.
+    bool get_network_time_ms(uint64_t &network_ms) const;
+    // Local esp_timer time at which the network clock reads network_ms, e.g. to
+    // wake up just before a slot shared with other nodes.
+    bool network_to_local_time_ms(uint64_t network_ms, uint64_t &local_ms) const;
+
+    // Counters of the whole stack plus the current peer table. Counters are
+    // global to the component and survive deinit(); reset_stats() clears them.
+    EspNowStats get_stats() const;
+    void reset_stats(); // Latency histograms included
+
+    // Time frames take to reach a pipeline stage. ESP_ERR_NOT_SUPPORTED unless
+    // CONFIG_ESPNOW_LATENCY_HISTOGRAMS is enabled.
+    esp_err_t get_latency_histogram(LatencyStage stage, LatencyHistogram &histogram) const;
+
+    // On a node, the frames the hub said it was holding in its last heartbeat
+    // response. They follow the response; stay awake until they have arrived.
+    uint8_t get_downlink_pending() const;
+
+    // Routes DATA and COMMAND frames by type, payload type and sender to a handler
+    // or queue instead of app_rx_queue; see AppSubscription and the typed
+    // subscription_to_queue<T>() in message_registry.hpp. May be called before init().
+    esp_err_t subscribe(const AppSubscription &subscription, int &id);
+    esp_err_t unsubscribe(int id);
+
+    // Routes an application-defined MessageType; see
+    // IMessageRouter::register_message_type(). Only before init():
+    // ESP_ERR_INVALID_STATE once the RX tasks are running.
+    esp_err_t register_message_type(MessageType type, RouteContext context, MessageHandler handler, void *ctx);
+
+    // Moves the radio and all peers to another channel, e.g. to follow the access
+    // point. On the hub this first announces the move on the current channel so
+    // paired nodes follow it instead of scanning, and moves from a timer
+    // CHANNEL_SWITCH_DELAY_MS later, once the announcement has gone out; errors
+    // from that switch are logged only.
+    esp_err_t change_channel(uint8_t channel);
+
 private:
     // --- Notification Bits ---
     static constexpr uint32_t NOTIFY_STOP = 0x100;
@@ -158,16 +233,29 @@ private:
     QueueHandle_t transport_worker_queue_      = nullptr;
     TaskHandle_t rx_dispatch_task_handle_      = nullptr;
     TaskHandle_t transport_worker_task_handle_ = nullptr;
+    TimerHandle_t liveness_timer_              = nullptr;
+    TimerHandle_t stats_timer_                 = nullptr;
+    TimerHandle_t channel_switch_timer_        = nullptr;
+    std::atomic<uint8_t> pending_channel_{0}; // Hub channel waiting on channel_switch_timer_
 
     // --- Private Methods ---
     uint64_t get_time_ms() const;
+    uint64_t get_header_time_ms() const;
+    esp_err_t submit(const TxPacket &tx_packet);
 
     // Persistence helpers
     void update_wifi_channel(uint8_t channel);
 
+    // Channel changes
+    esp_err_t switch_channel(uint8_t channel);
+    void follow_channel_announce(const RxPacket &packet, const MessageHeader &header);
+
     // Task functions
     static void rx_dispatch_task(void *arg);
     static void transport_worker_task(void *arg);
+    static void liveness_timer_cb(TimerHandle_t timer);
+    static void stats_timer_cb(TimerHandle_t timer);
+    static void channel_switch_timer_cb(TimerHandle_t timer);
 
     // Static ESP-NOW callbacks (ISR context)
     static void esp_now_recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int len);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Counters since boot or the last Stats::reset(). They wrap around.
+struct EspNowStats
+{
+    // TX
+    uint32_t tx_queued;          // Frames accepted by the TX queue
+    uint32_t tx_queue_full;      // Frames refused because the TX queue was full
+    uint32_t tx_sent;            // Frames handed to the radio, retransmissions included
+    uint32_t tx_phy_failures;    // Send callbacks reporting WIFI_SEND_FAIL
+    uint32_t tx_retries;         // Retransmissions after a missing logical ACK
+    uint32_t tx_ack_timeouts;    // Logical ACKs that did not arrive in time
+    uint32_t tx_max_retry_drops; // Frames given up on after the last retry
+    uint32_t scans;              // Channel scans completed
+    uint32_t scan_time_ms;       // Radio time spent in them
+    // RX
+    uint32_t rx_frames;          // Frames received from the radio
+    uint32_t rx_queue_drops;     // Frames dropped because an internal RX queue was full
+    uint32_t rx_crc_failures;    // Frames failing the integrity check or AEAD authentication
+    uint32_t rx_header_failures; // Frames with a malformed or refused header
+    uint32_t app_queue_drops;    // DATA/COMMAND frames dropped because the app or a subscriber queue was full
+    // Peers and storage
+    uint32_t peers_added;
+    uint32_t peers_removed; // Evictions included
+    uint32_t peers_evicted; // Oldest peer dropped to make room
+    uint32_t nvs_commits;
+    uint32_t nvs_bytes_written;
+
+    // Current state, filled in by EspNow::get_stats()
+    uint16_t peer_count;
+    uint16_t peers_online;
+};
+
+/**
+ * @brief Lock-free counters behind EspNowStats.
+ *
+ * Every core increments its own row of relaxed atomics, so the hot paths never
+ * share a cache line with the other core or take a lock; snapshot() sums the
+ * rows. Counters may be bumped from any task, including the Wi-Fi task.
+ */
+namespace Stats {
+
+// In EspNowStats field order
+enum class Counter : uint8_t
+{
+    TX_QUEUED,
+    TX_QUEUE_FULL,
+    TX_SENT,
+    TX_PHY_FAILURES,
+    TX_RETRIES,
+    TX_ACK_TIMEOUTS,
+    TX_MAX_RETRY_DROPS,
+    SCANS,
+    SCAN_TIME_MS,
+    RX_FRAMES,
+    RX_QUEUE_DROPS,
+    RX_CRC_FAILURES,
+    RX_HEADER_FAILURES,
+    APP_QUEUE_DROPS,
+    PEERS_ADDED,
+    PEERS_REMOVED,
+    PEERS_EVICTED,
+    NVS_COMMITS,
+    NVS_BYTES_WRITTEN,
+    COUNT,
+};
+
+constexpr size_t COUNTERS = static_cast<size_t>(Counter::COUNT);
+
+// Rows are cache-line aligned so the cores do not invalidate each other's
+struct alignas(32) Row
+{
+    std::atomic<uint32_t> values[COUNTERS];
+};
+
+extern Row rows[portNUM_PROCESSORS];
+
+inline void add(Counter counter, uint32_t n = 1)
+{
+#if portNUM_PROCESSORS > 1
+    size_t core = xPortGetCoreID();
+#else
+    size_t core = 0;
+#endif
+    rows[core].values[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Sums the per-core rows. Peer fields are left at 0.
+EspNowStats snapshot();
+void reset();
+
+} // namespace Stats
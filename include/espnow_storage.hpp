@@ -2,13 +2,29 @@
 
 #include "esp_err.h"
 #include "espnow_interfaces.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "protocol_types.hpp"
 
 #include <cstdint>
 #include <cstring>
-#include <vector>
 #include <memory>
 
+/**
+ * @brief Replay protection state for one peer's session key.
+ */
+struct ReplayFloor
+{
+    uint8_t mac[6];
+    bool in_use;
+    uint8_t reserved;
+    uint32_t key_check;
+    uint32_t epoch;
+    uint32_t counter;         // Highest counter accepted in epoch
+    uint32_t counter_ceiling; // Counter last committed to NVS
+    uint32_t last_used;       // Save order, for evicting the stalest entry
+};
+
 /**
  * @brief Internal structure for persistent data.
  */
@@ -16,13 +32,17 @@ struct PersistentData
 {
     static constexpr size_t MAX_PERSISTENT_PEERS = 19;
     static constexpr uint32_t MAGIC = 0x4553504E;
-    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t VERSION = 5;
 
     uint32_t magic;
     uint32_t version;
     uint8_t wifi_channel;
     uint8_t num_peers;
     PersistentPeer peers[MAX_PERSISTENT_PEERS];
+    uint8_t channel_hints[CHANNEL_HINT_COUNT]; // Recent hub channels, most recent first
+    uint32_t boot_epoch;    // Last epoch handed out by next_epoch()
+    uint32_t epoch_ceiling; // No epoch at or above this has been used
+    ReplayFloor replay_floors[MAX_PERSISTENT_PEERS];
     uint32_t crc;
 };
 
@@ -40,27 +60,98 @@ public:
      * @brief Loads data from RTC or NVS.
      *
      * @param wifi_channel Output for the loaded wifi channel.
-     * @param peers Output for the loaded peer list.
+     * @param peers Output for the loaded peers.
+     * @param max Number of entries peers can hold; peers beyond it are dropped.
+     * @param count Output for the number of peers written.
      * @return ESP_OK if loaded successfully, error otherwise.
      */
-    esp_err_t load(uint8_t &wifi_channel, std::vector<PersistentPeer> &peers) override;
+    esp_err_t load(uint8_t &wifi_channel, PersistentPeer *peers, size_t max, size_t &count) override;
 
     /**
      * @brief Saves data to RTC and NVS.
      *
      * @param wifi_channel Current wifi channel.
      * @param peers Current peer list.
+     * @param count Number of entries in peers; only the first MAX_PERSISTENT_PEERS are kept.
      * @param force_nvs_commit If true, forces a save to NVS even if data seems
      * unchanged.
      * @return ESP_OK if saved successfully, error otherwise.
      */
     esp_err_t save(uint8_t wifi_channel,
-                   const std::vector<PersistentPeer> &peers,
+                   const PersistentPeer *peers,
+                   size_t count,
                    bool force_nvs_commit = true) override;
 
+    /**
+     * @brief Hands out a boot epoch greater than any handed out before.
+     *
+     * The current epoch lives in RTC memory; NVS only holds a ceiling reserved
+     * EPOCH_LEASE epochs ahead, so it is written once per lease rather than on
+     * every boot. After a power loss the count resumes from the ceiling.
+     *
+     * @return ESP_ERR_NOT_FOUND if nothing has been saved yet.
+     */
+    esp_err_t next_epoch(uint32_t &epoch) override;
+
+    /**
+     * @brief Loads the recent hub channels, most recent first.
+     *
+     * @return ESP_ERR_NOT_FOUND if none are stored; hints are zeroed.
+     */
+    esp_err_t load_channel_hints(uint8_t *hints, size_t count) override;
+
+    /**
+     * @brief Stores the recent hub channels.
+     *
+     * Hints change on every hub channel move, so they are written to RTC memory
+     * only and reach NVS with the next save(). If nothing has been saved yet they
+     * are kept until then.
+     */
+    esp_err_t save_channel_hints(const uint8_t *hints, size_t count) override;
+
+    /**
+     * @brief Loads the highest envelope accepted from mac under key_check.
+     *
+     * @return ESP_ERR_NOT_FOUND if none is stored or it belongs to another key.
+     */
+    esp_err_t load_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t &epoch, uint32_t &counter) override;
+
+    /**
+     * @brief Records the highest envelope accepted from mac under key_check.
+     *
+     * The exact counter goes to RTC memory on every call. NVS is written when
+     * the epoch changes and otherwise about once per REPLAY_LEASE counters,
+     * before fewer than REPLAY_SAVE_AHEAD are left below the ceiling; after a
+     * power loss the floor is raised to that ceiling, so up to REPLAY_LEASE
+     * frames the sender has not yet reached are refused, never replays let in.
+     * If nothing has been saved yet the floor is kept until the first save().
+     */
+    esp_err_t save_replay_floor(const uint8_t *mac, uint32_t key_check, uint32_t epoch, uint32_t counter) override;
+
 private:
+    static constexpr uint32_t EPOCH_LEASE  = 64;
+    static constexpr uint32_t REPLAY_LEASE = 256;
+    static_assert(REPLAY_LEASE > REPLAY_SAVE_AHEAD, "A renewed lease must cover the frames accepted before the next save");
+
     uint32_t calculate_crc(const PersistentData &data);
+    bool read_valid(IPersistenceBackend &backend, PersistentData &data);
+    bool migrate_v1(PersistentData &data);
+    void load_cached_state();
+    void stamp(PersistentData &data);
+    esp_err_t write(PersistentData &data, bool force_nvs_commit);
+    ReplayFloor *find_floor(const uint8_t *mac);
 
     std::unique_ptr<IPersistenceBackend> rtc_backend_;
     std::unique_ptr<IPersistenceBackend> nvs_backend_;
+    // RX, TX and worker tasks all reach storage through the cipher and managers
+    SemaphoreHandle_t mutex_ = nullptr;
+
+    // State that outlives save(), which rebuilds the record from scratch
+    bool cached_state_loaded_ = false;
+    bool epoch_from_rtc_      = false;
+    uint32_t boot_epoch_      = 0;
+    uint32_t epoch_ceiling_   = 0;
+    uint8_t channel_hints_[CHANNEL_HINT_COUNT] = {};
+    ReplayFloor replay_floors_[PersistentData::MAX_PERSISTENT_PEERS] = {};
+    uint32_t floor_stamp_ = 0;
 };
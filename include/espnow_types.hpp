@@ -1,9 +1,10 @@
 #pragma once
 
 #include "esp_now.h"
+#include "link_metrics.hpp"
 #include "protocol_types.hpp"
+#include "sdkconfig.h"
 #include <cstdint>
-#include <vector>
 
 constexpr int MAX_PEERS = 19;
 
@@ -11,7 +12,7 @@ constexpr int MAX_PEERS = 19;
 struct RxPacket
 {
     uint8_t src_mac[6];
-    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+    uint8_t data[MAX_FRAME_SIZE]; // Raw wire frame until decoded, then canonical
     size_t len;
     int8_t rssi;
     int64_t timestamp_us;
@@ -27,6 +28,23 @@ struct PeerInfo
     uint64_t last_seen_ms;
     bool paired;
     uint32_t heartbeat_interval_ms;
+    uint16_t capabilities; // PeerCapability bits agreed during pairing
+    bool online;           // Heard from within its offline timeout
+    LinkMetrics link;      // Since the peer was added or loaded, not persisted
+};
+
+// Liveness transitions delivered on EspNowConfig::app_event_queue
+enum class PeerEventType : uint8_t
+{
+    ONLINE,
+    OFFLINE,
+};
+
+struct PeerEvent
+{
+    PeerEventType type;
+    NodeId node_id;
+    uint64_t timestamp_ms;
 };
 
 /**
@@ -40,6 +58,9 @@ struct PersistentPeer
     uint8_t channel;
     bool paired;
     uint32_t heartbeat_interval_ms;
+    uint16_t capabilities;
+    bool has_session_key;
+    uint8_t session_key[SecureEnvelope::KEY_SIZE];
 };
 
 // --- FSM and TX Task Structures ---
@@ -49,6 +70,9 @@ struct TxPacket
     uint8_t data[ESP_NOW_MAX_DATA_LEN];
     size_t len;
     bool requires_ack;
+#if CONFIG_ESPNOW_LATENCY_HISTOGRAMS
+    int64_t enqueued_us; // Set by Latency::stamped()
+#endif
 };
 
 enum class TxState
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "espnow_interfaces.hpp"
+#include "espnow_types.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/ccm.h"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Seals and opens SecureEnvelope frames with per-peer AES-128-CCM keys.
+ *
+ * Each installed key keeps its own CCM context and a replay window of the
+ * peer's highest (epoch, counter) seen. The local counter is shared by all
+ * keys; when it runs out, a new epoch is taken from the epoch store. The store
+ * also keeps each key's highest accepted envelope, so a reinstalled key starts
+ * above it rather than accepting old frames again after a reboot. Without a
+ * store the epoch is random and replay state is RAM-only, which is only
+ * suitable for tests.
+ *
+ * open() keeps the floor in memory and only goes to the store when a frame
+ * lies beyond what the last save covers (IStorage::REPLAY_SAVE_AHEAD); the
+ * rest is written by flush_replay_floors(), called periodically off the RX
+ * path. A crash, unlike a power loss, can forget frames accepted since the
+ * last flush.
+ *
+ * All methods are safe to call from different tasks.
+ */
+class FrameCipher
+{
+public:
+    explicit FrameCipher(IStorage *epoch_store = nullptr);
+    ~FrameCipher();
+
+    FrameCipher(const FrameCipher &)            = delete;
+    FrameCipher &operator=(const FrameCipher &) = delete;
+
+    void set_local_mac(const uint8_t *mac);
+
+    esp_err_t install_key(const uint8_t *mac, const uint8_t *key);
+    void remove_key(const uint8_t *mac);
+    bool has_key(const uint8_t *mac);
+
+    // Wraps frame for dest_mac. Returns the envelope length, or 0 on failure.
+    size_t seal(const uint8_t *dest_mac, const uint8_t *frame, size_t len, uint8_t *out, size_t out_len);
+
+    // Authenticates and unwraps an envelope from src_mac, rejecting replays.
+    // Returns the inner frame length, or 0 on failure.
+    size_t open(const uint8_t *src_mac, const uint8_t *envelope, size_t len, uint8_t *out, size_t out_len);
+
+    // Writes replay floors that moved since they were last saved to the store
+    void flush_replay_floors();
+
+    // Session key = HMAC-SHA256(network_key, label | hub_mac | node_mac | node_nonce | hub_nonce),
+    // truncated to SecureEnvelope::KEY_SIZE.
+    static esp_err_t derive_session_key(const uint8_t *network_key,
+                                        const uint8_t *hub_mac,
+                                        const uint8_t *node_mac,
+                                        const uint8_t *node_nonce,
+                                        const uint8_t *hub_nonce,
+                                        uint8_t *session_key);
+
+private:
+    static constexpr size_t REPLAY_WINDOW = 32;
+
+    struct KeySlot
+    {
+        bool in_use;
+        uint8_t mac[6];
+        mbedtls_ccm_context ccm;
+        uint32_t key_check; // Identifies the key in the epoch store
+        bool rx_seen;
+        uint32_t rx_epoch;
+        uint32_t rx_counter; // Highest counter accepted in rx_epoch
+        uint32_t rx_window;  // Bit n set: rx_counter - n was accepted
+        bool saved;          // saved_epoch/saved_counter are in the store
+        bool unsaved;        // The floor moved past them since
+        uint32_t saved_epoch;
+        uint32_t saved_counter;
+    };
+
+    KeySlot *find(const uint8_t *mac);
+    static bool is_replay(const KeySlot &slot, uint32_t epoch, uint32_t counter);
+    static void mark_received(KeySlot &slot, uint32_t epoch, uint32_t counter);
+    static bool covered_by_save(const KeySlot &slot);
+    static void note_saved(KeySlot &slot, uint32_t epoch, uint32_t counter);
+    static uint32_t make_key_check(const uint8_t *key);
+    bool advance_counter();
+
+    IStorage *epoch_store_;
+    SemaphoreHandle_t mutex_ = nullptr;
+    KeySlot slots_[MAX_PEERS];
+    uint8_t local_mac_[6] = {};
+    bool epoch_valid_     = false;
+    uint32_t epoch_       = 0;
+    uint32_t counter_     = 0;
+};
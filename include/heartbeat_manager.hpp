@@ -2,12 +2,14 @@
 
 #include "espnow_interfaces.hpp"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/timers.h"
+#include "time_sync.hpp"
 
 class RealHeartbeatManager : public IHeartbeatManager
 {
 public:
-    RealHeartbeatManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec, NodeId my_id);
+    RealHeartbeatManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec, IWiFiHAL &wifi_hal, NodeId my_id);
     ~RealHeartbeatManager();
 
     using IHeartbeatManager::handle_request;
@@ -18,18 +20,64 @@ public:
     esp_err_t init(uint32_t interval_ms, NodeType type) override;
     void update_node_id(NodeId id) override;
     esp_err_t deinit() override;
-    void handle_response(NodeId hub_id, uint8_t channel) override;
-    void handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms) override;
+    void notify_link_activity(NodeId peer_id) override;
+    void handle_response(NodeId hub_id, uint8_t channel, uint32_t next_heartbeat_ms) override;
+    void handle_request(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms) override;
+    void handle_time_sample(uint64_t origin_ms, uint64_t hub_receive_ms, uint64_t hub_send_ms,
+                            uint64_t local_receive_ms) override;
+    bool to_network_time(uint64_t local_ms, uint64_t &network_ms) override;
+    bool to_local_time(uint64_t network_ms, uint64_t &local_ms) override;
+    void set_wake_period(uint32_t period_ms) override { wake_period_ms_ = period_ms; }
+    void handle_wake_slot(uint32_t period_ms, uint32_t offset_ms) override;
+    void handle_downlink_pending(uint8_t count) override { downlink_pending_ = count; }
+    uint8_t downlink_pending() const override { return downlink_pending_; }
 
 private:
     ITxManager &tx_mgr_;
     IPeerManager &peer_mgr_;
     IMessageCodec &codec_;
+    IWiFiHAL &wifi_hal_;
     NodeId my_id_;
-    NodeType my_type_;
+    NodeType my_type_ = ReservedTypes::UNKNOWN;
     uint32_t interval_ms_;
-    TimerHandle_t timer_ = nullptr;
+    TimerHandle_t timer_ = nullptr; // One-shot, re-armed for every heartbeat
+    SemaphoreHandle_t mutex_ = nullptr;
+    bool awaiting_response_ = false;
+    uint8_t missed_ = 0; // Consecutive unanswered heartbeats
+    uint64_t last_sent_ms_ = 0; // uptime_ms of the last heartbeat, echoed by the hub
+    TimeSync time_sync_;        // Under mutex_
 
+    // Hub only: heartbeats waiting to be acknowledged in the next HeartbeatBeacon
+    TimerHandle_t beacon_timer_ = nullptr;
+    NodeId beacon_acks_[HEARTBEAT_BEACON_MAX_ACKS];
+    uint8_t beacon_count_ = 0;
+
+    // Wake slots: the period assigned (hub) or allowed (node), and on a node the
+    // slot it was given. Under mutex_.
+    uint32_t wake_period_ms_    = 0;
+    uint32_t slot_period_ms_    = 0;
+    uint32_t slot_offset_ms_    = 0;
+    bool listening_             = true;
+    uint8_t downlink_pending_   = 0;
+    TimerHandle_t listen_timer_ = nullptr; // Node only, ends the listen window
+
+    uint32_t phase_offset_ms() const;
+    uint32_t jittered_interval_ms() const;
+    uint32_t backoff_ms() const;
+    uint32_t slot_hint_ms(NodeId sender_id, uint64_t now_ms);
+    uint32_t response_timeout_ms();
+    uint32_t wake_slot_offset_ms(NodeId sender_id);
+    bool in_wake_mode() const;
+    uint32_t next_wake_delay_ms() const;
+    void set_listening(bool listening);
+    void listen_for(uint32_t window_ms);
+    void schedule(uint32_t delay_ms);
+    void on_timer();
     void send_heartbeat();
+    void send_response(NodeId sender_id, const uint8_t *mac, uint64_t uptime_ms, uint64_t received_ms);
+    void queue_beacon_ack(NodeId sender_id);
+    void send_beacon();
     static void timer_cb(TimerHandle_t xTimer);
+    static void beacon_timer_cb(TimerHandle_t xTimer);
+    static void listen_timer_cb(TimerHandle_t xTimer);
 };
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "protocol_types.hpp"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Frame integrity trailers, computed with the ROM CRC routines.
+ *
+ * Legacy frames always carry CRC8. Compact frames select the check through the
+ * version nibble of their marker byte, so a receiver can verify any frame
+ * without per-peer state.
+ */
+namespace IntegrityCheck {
+
+enum class Type : uint8_t
+{
+    CRC8  = CompactHeader::VERSION_1,
+    CRC16 = CompactHeader::VERSION_2,
+    CRC32 = CompactHeader::VERSION_3,
+};
+
+size_t trailer_size(Type type);
+
+// Strongest check allowed by an agreed PeerCapability mask
+Type strongest(uint16_t caps);
+
+// Maps a compact header version to its check. Returns false for unknown versions.
+bool from_version(uint8_t version, Type &type);
+
+// Writes the trailer for frame[0, len) at frame + len. Returns the total length,
+// or 0 if the trailer does not fit in out_len.
+size_t append(Type type, uint8_t *frame, size_t len, size_t out_len);
+
+// Checks a frame whose last trailer_size(type) bytes are the trailer.
+bool verify(Type type, const uint8_t *frame, size_t len);
+
+} // namespace IntegrityCheck
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "espnow_types.hpp"
+#include "sdkconfig.h"
+#include <cstddef>
+#include <cstdint>
+
+// Pipeline stages. Each measures the time since the frame entered its pipeline:
+// TX stages since queue_packet()/schedule_ack(), RX stages since esp_now_recv_cb.
+enum class LatencyStage : uint8_t
+{
+    TX_DEQUEUE,     // Taken off the TX queue by the TX task
+    TX_RADIO_SEND,  // Accepted by esp_now_send(), first attempt only
+    TX_SEND_CB,     // esp_now send callback for the last frame sent
+    TX_ACK,         // Logical ACK received, retries included
+    RX_DISPATCH,    // Taken off the RX queue by the dispatch task
+    RX_WORKER,      // Taken off the worker queue by the transport worker
+    RX_APP_ENQUEUE, // DATA/COMMAND placed on the app RX queue
+    COUNT,
+};
+
+struct LatencyHistogram
+{
+    // Bucket 0 holds samples under 2 us, bucket i samples in [2^i, 2^(i+1)) us and
+    // the last one everything from 2^(BUCKETS-1) us (about 0.5 s) up.
+    static constexpr size_t BUCKETS = 20;
+
+    uint32_t counts[BUCKETS];
+    uint32_t samples;
+    uint64_t total_us;
+    uint32_t max_us;
+};
+
+/**
+ * @brief Per-stage latency histograms, compiled in with CONFIG_ESPNOW_LATENCY_HISTOGRAMS.
+ *
+ * Recording is a handful of relaxed atomic operations and safe from any task.
+ * Without the option every function below is an empty inline and TxPacket has
+ * no timestamp.
+ */
+namespace Latency {
+
+#if CONFIG_ESPNOW_LATENCY_HISTOGRAMS
+
+// Copy of the packet stamped with the time it entered the TX pipeline
+TxPacket stamped(const TxPacket &packet);
+void record(LatencyStage stage, int64_t since_us);
+inline void record(LatencyStage stage, const TxPacket &packet) { record(stage, packet.enqueued_us); }
+// The send callback does not say which frame it is for; ESP-NOW reports them in order
+void note_radio_send(const TxPacket &packet);
+void record_send_cb();
+bool snapshot(LatencyStage stage, LatencyHistogram &histogram);
+void reset();
+
+#else
+
+inline const TxPacket &stamped(const TxPacket &packet) { return packet; }
+inline void record(LatencyStage, int64_t) {}
+inline void record(LatencyStage, const TxPacket &) {}
+inline void note_radio_send(const TxPacket &) {}
+inline void record_send_cb() {}
+inline bool snapshot(LatencyStage, LatencyHistogram &) { return false; }
+inline void reset() {}
+
+#endif
+
+} // namespace Latency
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Rolling link quality of one peer, updated in O(1) per frame.
+ *
+ * RSSI comes from every received frame. Delivery, retries and RTT come from
+ * frames sent with requires_ack: a frame counts as delivered when its logical
+ * ACK arrives and as lost when the retries run out. Like TCP (Karn's rule),
+ * only frames ACKed on the first attempt yield an RTT sample, since the ACK of
+ * a retransmitted frame cannot be matched to one attempt.
+ *
+ * Averages are EWMAs with weight 1/8 in fixed point. RTT percentiles come from
+ * a log2 histogram whose counts are halved when one saturates, so old samples
+ * fade out. All fields are zero for a peer nothing has been measured for.
+ */
+struct LinkMetrics
+{
+    static constexpr size_t RTT_BUCKETS = 8; // Upper bounds 4, 8, ..., 256 ms, then everything above
+
+    int16_t rssi_avg_x16;       // dBm, 1/16 resolution
+    int8_t rssi_min;
+    int8_t rssi_max;
+    uint32_t rx_frames;
+    uint32_t delivered;
+    uint32_t lost;
+    uint16_t delivery_x1024;    // Delivered share of ACKed frames, 1/1024 resolution
+    uint16_t retries_x16;       // Retransmissions per delivered frame, 1/16 resolution
+    uint32_t srtt_x8;           // Smoothed RTT in ms, 1/8 resolution
+    uint32_t rttvar_x4;         // RTT mean deviation in ms, 1/4 resolution
+    uint32_t rtt_max_ms;
+    uint16_t rtt_histogram[RTT_BUCKETS];
+
+    void on_rx(int8_t rssi);
+    // retries: retransmissions before the ACK. rtt_ms: 0 for no sample, e.g. after a retransmission.
+    void on_delivered(uint8_t retries, uint32_t rtt_ms);
+    void on_lost();
+
+    int8_t rssi() const { return static_cast<int8_t>(rssi_avg_x16 / 16); }
+    uint32_t delivery_ratio_permille() const; // 1000 until anything was sent
+    uint32_t srtt_ms() const { return srtt_x8 / 8; }
+    // Upper bound of the histogram bucket holding the given percentile, 0 without samples
+    uint32_t rtt_percentile_ms(uint8_t percent) const;
+    // Logical ACK timeout for a frame already retried retries times
+    uint32_t ack_timeout_ms(uint8_t retries) const;
+};
@@ -1,17 +1,80 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
+#include "frame_cipher.hpp"
+#include "integrity_check.hpp"
+#include "payload_delta.hpp"
 
 class RealMessageCodec : public IMessageCodec
 {
 public:
-    std::vector<uint8_t> encode(const MessageHeader &header,
-                                const void *payload,
-                                size_t len) override;
+    // epoch_store provides SecureEnvelope epochs; see FrameCipher.
+    explicit RealMessageCodec(uint16_t capabilities = PeerCapability::SUPPORTED, IStorage *epoch_store = nullptr);
+
+    size_t encode(const MessageHeader &header,
+                  const void *payload,
+                  size_t len,
+                  uint8_t *out,
+                  size_t out_len) override;
 
     std::optional<MessageHeader> decode_header(const uint8_t *data,
                                                size_t len) override;
 
     bool validate_crc(const uint8_t *data, size_t len) override;
     uint8_t calculate_crc(const uint8_t *data, size_t len) override;
+
+    size_t encode_wire(const uint8_t *dest_mac,
+                       const uint8_t *frame,
+                       size_t len,
+                       uint16_t peer_caps,
+                       bool retransmission,
+                       uint8_t *out,
+                       size_t out_len) override;
+    size_t decode_wire(const uint8_t *src_mac,
+                       const uint8_t *wire,
+                       size_t len,
+                       uint8_t *out,
+                       size_t out_len) override;
+    void confirm_delivery(const uint8_t *dest_mac, const uint8_t *frame, size_t len) override;
+
+    uint16_t capabilities() const override { return capabilities_; }
+    void set_capabilities(uint16_t capabilities) override { capabilities_ = capabilities & PeerCapability::SUPPORTED; }
+
+    esp_err_t set_local_mac(const uint8_t *mac) override;
+    esp_err_t install_session_key(const uint8_t *mac, const uint8_t *key) override;
+    void remove_session_key(const uint8_t *mac) override;
+    void flush_replay_floors() override;
+
+private:
+    size_t encode_plain(const uint8_t *dest_mac,
+                        const MessageHeader &header,
+                        const uint8_t *frame,
+                        size_t len,
+                        uint16_t caps,
+                        bool retransmission,
+                        uint8_t *out,
+                        size_t out_len);
+    size_t decode_plain(const uint8_t *src_mac, const uint8_t *wire, size_t len, uint8_t *out, size_t out_len);
+    size_t encode_legacy(const MessageHeader &header,
+                         const uint8_t *payload,
+                         size_t payload_len,
+                         uint8_t *out,
+                         size_t out_len);
+    size_t encode_compact(const MessageHeader &header,
+                          const uint8_t *payload,
+                          size_t payload_len,
+                          const PayloadDeltaCodec::Encoded *delta,
+                          IntegrityCheck::Type check,
+                          uint8_t *out,
+                          size_t out_len);
+    // Both take the frame length without its integrity trailer, already verified
+    size_t decode_legacy(const uint8_t *wire, size_t len, uint8_t *out, size_t out_len);
+    size_t decode_compact(const uint8_t *src_mac, const uint8_t *wire, size_t len, uint8_t *out, size_t out_len);
+
+    uint16_t capabilities_;
+    PayloadDeltaCodec delta_;
+    uint8_t delta_buf_[MAX_PAYLOAD_SIZE]; // Encoded delta body, TX task only
+    FrameCipher cipher_;
+    uint8_t seal_buf_[ESP_NOW_MAX_DATA_LEN]; // Inner frame before sealing, TX task only
+    uint8_t open_buf_[ESP_NOW_MAX_DATA_LEN]; // Inner frame after opening, RX task only
 };
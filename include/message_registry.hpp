@@ -0,0 +1,143 @@
+#pragma once
+
+#include "espnow_interfaces.hpp"
+#include "protocol_messages.hpp"
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * @brief Compile-time registry of the structs carried in frames.
+ *
+ * A message is registered once, by specializing MessageTraits for its struct
+ * with MessageSpec (or DataMessageSpec for an application payload in DATA
+ * frames). The spec names its MessageType and the shortest frame still
+ * accepted, which is where fields added after older firmware shipped begin.
+ *
+ * encode_message() and decode_message() are generated from that. Decoding
+ * checks the type and length and copies the frame into the struct with one
+ * memcpy, zeroing the fields an older sender left out. It makes no virtual
+ * calls and works on the canonical frames the codec hands to the router.
+ */
+template <typename T> struct MessageTraits; // Not defined: a struct must be registered to be sent or read
+
+template <typename T, MessageType Type, size_t MinSize = sizeof(T)> struct MessageSpec
+{
+    static_assert(std::is_trivially_copyable_v<T> && std::is_standard_layout_v<T>,
+                  "Messages are copied to and from frames byte for byte");
+    static_assert(std::is_same_v<decltype(T::header), MessageHeader> && offsetof(T, header) == 0,
+                  "Messages start with their MessageHeader");
+    static_assert(MinSize >= sizeof(MessageHeader) && MinSize <= sizeof(T), "MinSize must cover the header");
+    static_assert(sizeof(T) <= sizeof(MessageHeader) + MAX_PAYLOAD_SIZE, "Message does not fit in a frame");
+
+    static constexpr MessageType TYPE         = Type;
+    static constexpr size_t MIN_SIZE          = MinSize;
+    static constexpr bool HAS_PAYLOAD_TYPE    = false;
+    static constexpr PayloadType PAYLOAD_TYPE = 0;
+};
+
+// Application struct sent as a DATA frame with the given payload type
+template <typename T, PayloadType Payload, size_t MinSize = sizeof(T)>
+struct DataMessageSpec : MessageSpec<T, MessageType::DATA, MinSize>
+{
+    static constexpr bool HAS_PAYLOAD_TYPE    = true;
+    static constexpr PayloadType PAYLOAD_TYPE = Payload;
+};
+
+template <> struct MessageTraits<PairRequest>
+    : MessageSpec<PairRequest, MessageType::PAIR_REQUEST, offsetof(PairRequest, capabilities)> {};
+template <> struct MessageTraits<PairResponse>
+    : MessageSpec<PairResponse, MessageType::PAIR_RESPONSE, offsetof(PairResponse, capabilities)> {};
+template <> struct MessageTraits<HeartbeatMessage> : MessageSpec<HeartbeatMessage, MessageType::HEARTBEAT> {};
+template <> struct MessageTraits<HeartbeatResponse>
+    : MessageSpec<HeartbeatResponse, MessageType::HEARTBEAT_RESPONSE, offsetof(HeartbeatResponse, next_heartbeat_ms)> {};
+template <> struct MessageTraits<HeartbeatBeacon>
+    : MessageSpec<HeartbeatBeacon, MessageType::HEARTBEAT_BEACON, offsetof(HeartbeatBeacon, acked_ids)> {};
+template <> struct MessageTraits<ChannelAnnounce> : MessageSpec<ChannelAnnounce, MessageType::CHANNEL_ANNOUNCE> {};
+template <> struct MessageTraits<AckMessage> : MessageSpec<AckMessage, MessageType::ACK> {};
+template <> struct MessageTraits<OtaCommand> : MessageSpec<OtaCommand, MessageType::COMMAND> {};
+
+/**
+ * @brief Builds the frame for msg in out, the way IMessageCodec::encode() does.
+ *
+ * The header's msg_type, and payload_type for DATA messages, come from the
+ * registry. len trims trailing fields, e.g. the unused part of a list; it may
+ * not go below the registered MIN_SIZE.
+ *
+ * @return The frame length, or 0 if len is out of range or the frame does not fit.
+ */
+template <typename T>
+size_t encode_message(IMessageCodec &codec, const T &msg, uint8_t *out, size_t out_len, size_t len = sizeof(T))
+{
+    using Traits = MessageTraits<T>;
+    if (len < Traits::MIN_SIZE || len > sizeof(T)) return 0;
+
+    MessageHeader header = msg.header;
+    header.msg_type      = Traits::TYPE;
+    if constexpr (Traits::HAS_PAYLOAD_TYPE) header.payload_type = Traits::PAYLOAD_TYPE;
+    return codec.encode(header, reinterpret_cast<const uint8_t *>(&msg) + sizeof(MessageHeader),
+                        len - sizeof(MessageHeader), out, out_len);
+}
+
+/**
+ * @brief Reads a canonical frame (header, payload, CRC slot) into msg.
+ *
+ * Fields past the end of the frame are zeroed; the return value tells how far
+ * the sender's struct went, for fields whose absence differs from zero.
+ *
+ * @return The number of bytes of msg taken from the frame, or 0 (msg untouched)
+ * if the frame is not a T or is shorter than its MIN_SIZE.
+ */
+template <typename T> size_t decode_message(const uint8_t *frame, size_t len, T &msg)
+{
+    using Traits = MessageTraits<T>;
+    if (frame == nullptr || len < Traits::MIN_SIZE + CRC_SIZE) return 0;
+    if (frame[offsetof(MessageHeader, msg_type)] != static_cast<uint8_t>(Traits::TYPE)) return 0;
+    if constexpr (Traits::HAS_PAYLOAD_TYPE) {
+        if (frame[offsetof(MessageHeader, payload_type)] != Traits::PAYLOAD_TYPE) return 0;
+    }
+
+    size_t size = len - CRC_SIZE < sizeof(T) ? len - CRC_SIZE : sizeof(T);
+    memcpy(&msg, frame, size);
+    memset(reinterpret_cast<uint8_t *>(&msg) + size, 0, sizeof(T) - size);
+    return size;
+}
+
+template <typename T> inline size_t decode_message(const RxPacket &packet, T &msg)
+{
+    return decode_message(packet.data, packet.len, msg);
+}
+
+// Subscription to a registered message: its type, its payload type for DATA
+// structs and its minimum length come from the registry
+template <typename T> AppSubscription subscription_for(NodeId sender = ReservedIds::BROADCAST)
+{
+    using Traits = MessageTraits<T>;
+    AppSubscription subscription;
+    subscription.msg_type         = Traits::TYPE;
+    subscription.payload_type     = Traits::PAYLOAD_TYPE;
+    subscription.any_payload_type = !Traits::HAS_PAYLOAD_TYPE;
+    subscription.sender           = sender;
+    subscription.min_size         = Traits::MIN_SIZE;
+    return subscription;
+}
+
+// Delivers each T, zero-padded as by decode_message(), to a queue of sizeof(T) items
+template <typename T>
+AppSubscription subscription_to_queue(QueueHandle_t queue, NodeId sender = ReservedIds::BROADCAST)
+{
+    AppSubscription subscription = subscription_for<T>(sender);
+    subscription.queue           = queue;
+    subscription.item_size       = sizeof(T);
+    return subscription;
+}
+
+// Calls handler with frames that decode_message() accepts as a T
+template <typename T>
+AppSubscription subscription_to_handler(AppFrameHandler handler, void *ctx, NodeId sender = ReservedIds::BROADCAST)
+{
+    AppSubscription subscription = subscription_for<T>(sender);
+    subscription.handler         = handler;
+    subscription.ctx             = ctx;
+    return subscription;
+}
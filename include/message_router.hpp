@@ -1,6 +1,7 @@
 #pragma once
 
 #include "espnow_interfaces.hpp"
+#include "freertos/semphr.h"
 #include <queue>
 
 class RealMessageRouter : public IMessageRouter
@@ -11,6 +12,7 @@ public:
                       IHeartbeatManager &heartbeat_manager,
                       IPairingManager &pairing_manager,
                       IMessageCodec &message_codec);
+    ~RealMessageRouter();
 
     void set_app_queue(QueueHandle_t app_queue) override { app_queue_ = app_queue; }
 
@@ -22,10 +24,59 @@ public:
     }
 
     void handle_packet(const RxPacket &packet) override;
-    bool should_dispatch_to_worker(MessageType type) override;
+    RouteContext route_context(MessageType type) override
+    {
+        return routes_[static_cast<uint8_t>(type)].context;
+    }
+    esp_err_t register_message_type(MessageType type, RouteContext context, MessageHandler handler,
+                                    void *ctx) override;
+    esp_err_t subscribe(const AppSubscription &subscription, int &id) override;
+    esp_err_t unsubscribe(int id) override;
 
 private:
-    void handle_scan_probe(const RxPacket &packet);
+    using Method = void (RealMessageRouter::*)(const RxPacket &packet, const MessageHeader &header);
+
+    struct Route
+    {
+        MessageHandler handler = nullptr;
+        void *ctx              = nullptr;
+        RouteContext context   = RouteContext::NONE;
+    };
+
+    // A MessageType the stack consumes itself
+    struct BuiltinRoute
+    {
+        MessageType type;
+        RouteContext context;
+        MessageHandler handler; // nullptr when only the facade acts on it
+    };
+    static const BuiltinRoute BUILTIN_ROUTES[];
+    static bool is_builtin(MessageType type);
+
+    template <Method M> static void invoke(const RxPacket &packet, const MessageHeader &header, void *ctx)
+    {
+        (static_cast<RealMessageRouter *>(ctx)->*M)(packet, header);
+    }
+
+    struct SubscriptionSlot
+    {
+        AppSubscription subscription;
+        bool used = false;
+    };
+
+    bool deliver_to_subscribers(const RxPacket &packet, const MessageHeader &header);
+    void deliver_to_queue(const AppSubscription &subscription, const RxPacket &packet);
+    bool is_sleeper(const uint8_t *mac);
+
+    void handle_pair_request(const RxPacket &packet, const MessageHeader &header);
+    void handle_pair_response(const RxPacket &packet, const MessageHeader &header);
+    void handle_heartbeat(const RxPacket &packet, const MessageHeader &header);
+    void handle_heartbeat_response(const RxPacket &packet, const MessageHeader &header);
+    void handle_heartbeat_beacon(const RxPacket &packet, const MessageHeader &header);
+    void handle_ack(const RxPacket &packet, const MessageHeader &header);
+    void handle_scan_probe(const RxPacket &packet, const MessageHeader &header);
+    void handle_scan_response(const RxPacket &packet, const MessageHeader &header);
+    void handle_app_frame(const RxPacket &packet, const MessageHeader &header);
 
     IPeerManager &peer_manager_;
     ITxManager &tx_manager_;
@@ -34,6 +85,9 @@ private:
     IMessageCodec &message_codec_;
 
     QueueHandle_t app_queue_ = nullptr;
+    SemaphoreHandle_t mutex_ = nullptr;
+    SubscriptionSlot subscriptions_[APP_SUBSCRIPTIONS_MAX]; // Under mutex_
+    Route routes_[256];                                     // By MessageType; written before frames arrive
     NodeId my_id_ = ReservedIds::HUB;
     NodeType my_type_ = ReservedTypes::HUB;
 };
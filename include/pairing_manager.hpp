@@ -8,13 +8,14 @@
 class RealPairingManager : public IPairingManager
 {
 public:
-    RealPairingManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec);
+    RealPairingManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec, IWiFiHAL &wifi_hal);
     ~RealPairingManager();
 
     using IPairingManager::init;
 
     esp_err_t init(NodeType type, NodeId id) override;
     esp_err_t deinit() override;
+    void set_network_key(const uint8_t *key) override;
     esp_err_t start(uint32_t timeout_ms) override;
     bool is_active() const override { return is_active_; }
     void handle_request(const RxPacket &packet) override;
@@ -24,14 +25,21 @@ private:
     ITxManager &tx_mgr_;
     IPeerManager &peer_mgr_;
     IMessageCodec &codec_;
+    IWiFiHAL &wifi_hal_;
     NodeType my_type_;
     NodeId my_id_;
     bool is_active_ = false;
     TimerHandle_t timeout_timer_ = nullptr;
     TimerHandle_t periodic_timer_ = nullptr;
     SemaphoreHandle_t mutex_ = nullptr;
+    bool has_network_key_ = false;
+    uint8_t network_key_[SecureEnvelope::KEY_SIZE] = {};
+    uint8_t node_nonce_[SecureEnvelope::NONCE_SIZE] = {};
 
     void send_pair_request();
+    bool derive_session_key(const uint8_t *peer_mac, const uint8_t *node_nonce, const uint8_t *hub_nonce, uint8_t *session_key);
+    bool pair_peer(NodeId id, const uint8_t *mac, uint8_t channel, NodeType type, uint32_t heartbeat_interval_ms,
+                   const uint8_t *session_key);
     static void timeout_cb(TimerHandle_t xTimer);
     static void periodic_cb(TimerHandle_t xTimer);
     void on_timeout();
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "protocol_types.hpp"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief XOR/zero-run delta coding of DATA payloads per (peer, payload_type).
+ *
+ * The sender keeps the last keyframe it sent for each context and encodes later
+ * payloads of the same length as the XOR against it, with runs of unchanged
+ * (zero) bytes collapsed. The receiver keeps the keyframes it received.
+ *
+ * Deltas are only sent once the peer has acknowledged the keyframe they refer
+ * to (see confirm()); until then every payload goes out whole as a keyframe, so
+ * a lost keyframe costs no data. Deltas also name their keyframe by generation
+ * and CRC8, so a receiver that lost it anyway (e.g. rebooted) drops them rather
+ * than decoding garbage.
+ *
+ * encode() only plans a frame; commit() records it once it has actually been
+ * built, so a frame that ends up in another format leaves the context as it was.
+ *
+ * Contexts live in two small LRU tables. The TX table must only be used from
+ * the task that encodes frames and the RX table from the task that decodes
+ * them; neither is locked.
+ */
+class PayloadDeltaCodec
+{
+public:
+    static constexpr size_t CONTEXT_SLOTS        = 8;
+    static constexpr uint8_t KEYFRAME_INTERVAL   = 16; // Frames per context between keyframes
+    static constexpr size_t KEYFRAME_HEADER_SIZE = 1;  // generation
+    static constexpr size_t DELTA_HEADER_SIZE    = 2;  // generation, reference CRC8
+
+    enum class Kind : uint8_t
+    {
+        KEYFRAME,
+        DELTA,
+    };
+
+    struct Encoded
+    {
+        Kind kind;
+        uint8_t header[DELTA_HEADER_SIZE];
+        size_t header_len;
+        size_t body_len; // Bytes written to the body buffer
+    };
+
+    /**
+     * @brief Encodes a payload for a peer, choosing between keyframe and delta.
+     *
+     * Does not change any context; call commit() once the frame is sent.
+     *
+     * @param force_keyframe Set for retransmissions, whose predecessor may have
+     * been lost together with the receiver's reference.
+     * @return false if the payload cannot be represented (e.g. body too small).
+     */
+    bool encode(const uint8_t *mac,
+                PayloadType type,
+                const uint8_t *payload,
+                size_t len,
+                bool force_keyframe,
+                uint8_t *body,
+                size_t body_len,
+                Encoded &result);
+
+    // Records a frame encode() planned as sent in the frame with this sequence
+    // number. A keyframe with a new payload becomes the unconfirmed reference.
+    void commit(const uint8_t *mac, PayloadType type, const uint8_t *payload, size_t len, uint16_t sequence,
+                const Encoded &encoded);
+
+    // The peer acknowledged the frame with this sequence number: if it carried
+    // the current reference, later payloads may be sent as deltas against it.
+    void confirm(const uint8_t *mac, PayloadType type, uint16_t sequence);
+
+    // Records a received keyframe as the reference for later deltas.
+    void store_keyframe(const uint8_t *mac, PayloadType type, uint8_t generation, const uint8_t *payload, size_t len);
+
+    // Reconstructs a delta payload. Returns its length, or 0 if the reference is missing.
+    size_t apply_delta(const uint8_t *mac,
+                       PayloadType type,
+                       const uint8_t *header,
+                       const uint8_t *body,
+                       size_t body_len,
+                       uint8_t *out,
+                       size_t out_len);
+
+    void reset();
+
+private:
+    struct Context
+    {
+        bool in_use;
+        uint8_t mac[6];
+        PayloadType type;
+        uint8_t generation;
+        uint8_t ref_crc;
+        uint8_t frames_since_keyframe;
+        uint16_t ref_sequence; // TX: last frame sent with the reference as a keyframe
+        bool confirmed;        // TX: the peer acknowledged ref_sequence
+        uint32_t last_used;
+        size_t len;
+        uint8_t data[MAX_PAYLOAD_SIZE];
+    };
+
+    struct ContextTable
+    {
+        Context slots[CONTEXT_SLOTS];
+        uint32_t use_counter;
+    };
+
+    static Context *find(ContextTable &table, const uint8_t *mac, PayloadType type);
+    static Context *claim(ContextTable &table, const uint8_t *mac, PayloadType type);
+    static void set_reference(Context &ctx, uint8_t generation, const uint8_t *payload, size_t len);
+    static bool holds(const Context &ctx, const uint8_t *payload, size_t len);
+
+    ContextTable tx_ = {};
+    ContextTable rx_ = {};
+};
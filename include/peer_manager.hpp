@@ -3,7 +3,8 @@
 #include "espnow_interfaces.hpp"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
-#include <vector>
+#include "static_vector.hpp"
+#include "timer_wheel.hpp"
 
 class RealPeerManager : public IPeerManager
 {
@@ -13,25 +14,57 @@ public:
 
     using IPeerManager::add;
     using IPeerManager::find_mac;
+    using IPeerManager::for_each;
     using IPeerManager::remove;
+    using IPeerManager::set_capabilities;
+    using IPeerManager::set_session_key;
     using IPeerManager::update_last_seen;
 
     esp_err_t add(NodeId id, const uint8_t *mac, uint8_t channel, NodeType type, uint32_t heartbeat_interval_ms = 0) override;
     esp_err_t remove(NodeId id) override;
     bool find_mac(NodeId id, uint8_t *mac) override;
-    std::vector<PeerInfo> get_all() override;
-    std::vector<NodeId> get_offline(uint64_t now_ms) override;
+    size_t get_all(PeerInfo *out, size_t max) override;
+    size_t get_offline(uint64_t now_ms, NodeId *out, size_t max) override;
+    void for_each(PeerVisitor visit, void *ctx) override;
     void update_last_seen(NodeId id, uint64_t now_ms) override;
+    esp_err_t set_capabilities(NodeId id, uint16_t capabilities) override;
+    uint16_t get_capabilities(const uint8_t *mac) override;
+    bool is_offline(const uint8_t *mac) override;
+    void record_rx(NodeId id, int8_t rssi) override;
+    void record_delivery(const uint8_t *mac, bool delivered, uint8_t retries, uint32_t rtt_ms) override;
+    uint32_t ack_timeout_ms(const uint8_t *mac, uint8_t retries) override;
+    esp_err_t set_session_key(NodeId id, const uint8_t *key) override;
+    bool get_session_key(NodeId id, uint8_t *key) override;
+    esp_err_t set_channel_all(uint8_t channel) override;
+    void set_event_queue(QueueHandle_t queue) override { event_queue_ = queue; }
+    void check_liveness(uint64_t now_ms) override;
+    void set_wake_period(uint32_t period_ms) override;
 
     // Helper for initialization (loading from storage)
     esp_err_t load_from_storage(uint8_t &wifi_channel) override;
     void persist(uint8_t wifi_channel) override;
 
 private:
+    // Kept apart from PeerInfo so get_all() never hands keys to the application
+    struct SessionKey
+    {
+        NodeId id;
+        uint8_t key[SecureEnvelope::KEY_SIZE];
+    };
+
     IStorage &storage_;
-    std::vector<PeerInfo> peers_;
+    StaticVector<PeerInfo, MAX_PEERS> peers_;          // Most recently added first
+    StaticVector<SessionKey, MAX_PEERS> session_keys_; // At most one per peer
     SemaphoreHandle_t mutex_;
+    TimerWheel liveness_{PEER_LIVENESS_TICK_MS}; // Offline deadlines, under mutex_
+    QueueHandle_t event_queue_ = nullptr;
+    PersistentPeer persist_buf_[MAX_PEERS]; // Staging for storage saves, under mutex_
+    uint32_t wake_period_ms_ = 0;           // Under mutex_
 
+    static uint32_t offline_timeout_ms(uint32_t heartbeat_interval_ms);
+    uint32_t offline_timeout_ms(const PeerInfo &peer) const;
+    void post_event(PeerEventType type, NodeId id, uint64_t now_ms);
+    void erase_session_key(NodeId id);
     void save_to_storage(uint8_t wifi_channel);
     PersistentPeer info_to_persistent(const PeerInfo &info);
     PeerInfo persistent_to_info(const PersistentPeer &persistent);
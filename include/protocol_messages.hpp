@@ -5,6 +5,21 @@
 
 // ========== HEADER UNIVERSAL ==========
 struct MessageHeader
+{
+    MessageType msg_type;
+    uint16_t sequence_number;
+    NodeType sender_type;
+    NodeId sender_node_id;
+    PayloadType payload_type;
+    bool requires_ack;
+    NodeId dest_node_id;
+    uint64_t timestamp_ms;
+    uint16_t piggyback_ack; // PIGGYBACK_ACK_VALID | acknowledged sequence, 0 if none
+};
+
+// Original wire layout of the header, kept for peers that did not negotiate
+// PeerCapability::COMPACT_HEADER. It has no room for a piggybacked ACK.
+struct LegacyMessageHeader
 {
     MessageType msg_type;
     uint16_t sequence_number;
@@ -24,6 +39,8 @@ struct PairRequest
     uint64_t uptime_ms;
     char device_name[16];
     uint32_t heartbeat_interval_ms;
+    uint16_t capabilities; // PeerCapability bits; absent in frames from older firmware
+    uint8_t session_nonce[SecureEnvelope::NONCE_SIZE]; // Only meaningful when offering AEAD
 };
 
 struct PairResponse
@@ -34,6 +51,8 @@ struct PairResponse
     uint32_t heartbeat_interval_ms;
     uint32_t report_interval_ms;
     uint8_t wifi_channel;
+    uint16_t capabilities; // Agreed PeerCapability bits; absent in frames from older firmware
+    uint8_t session_nonce[SecureEnvelope::NONCE_SIZE]; // Only meaningful when AEAD was agreed
 };
 
 struct HeartbeatMessage
@@ -49,6 +68,41 @@ struct HeartbeatResponse
     MessageHeader header;
     uint64_t server_time_ms;
     uint8_t wifi_channel;
+    uint32_t next_heartbeat_ms; // Delay until the node's admission slot, 0 if none; absent from older hubs
+    // Round-trip timestamps for TimeSync; absent from older hubs. server_time_ms
+    // is the hub's send time.
+    uint64_t origin_time_ms;  // HeartbeatMessage::uptime_ms being answered
+    uint64_t receive_time_ms; // Hub clock when that heartbeat arrived
+    // Wake slot for nodes that agreed PeerCapability::WAKE_SLOTS, 0 period if
+    // none; absent from older hubs. Slots start where network time modulo the
+    // period equals the offset.
+    uint32_t wake_period_ms;
+    uint32_t wake_offset_ms;
+    // Frames the hub holds for this node and sends right after this response;
+    // absent from older hubs.
+    uint8_t pending_frames;
+};
+
+// Broadcast by the hub to answer a batch of heartbeats at once. Only the first
+// acked_count ids are sent. Like ChannelAnnounce it cannot be sealed; a node that
+// is not listed keeps waiting for its answer and retries as usual.
+struct HeartbeatBeacon
+{
+    MessageHeader header;
+    uint64_t server_time_ms;
+    uint8_t wifi_channel;
+    uint8_t acked_count;
+    NodeId acked_ids[HEARTBEAT_BEACON_MAX_ACKS];
+};
+
+// Broadcast by the hub on its current channel right before it moves. Broadcasts
+// cannot be sealed, so nodes only follow announcements from the hub MAC they
+// paired with and fall back to scanning if the hub is not on the new channel.
+struct ChannelAnnounce
+{
+    MessageHeader header;
+    uint8_t new_channel;
+    uint16_t switch_delay_ms; // Time until the hub leaves the current channel
 };
 
 // ========== APPLICATION LAYER ==========
@@ -74,6 +128,8 @@ struct OtaCommand
 // Validações de tamanho para garantir que nenhum payload exceda o limite do ESP-NOW
 static_assert(sizeof(MessageHeader) == MESSAGE_HEADER_SIZE,
               "MessageHeader size is incorrect");
+static_assert(sizeof(LegacyMessageHeader) == LEGACY_HEADER_SIZE,
+              "LegacyMessageHeader size is incorrect");
 static_assert(sizeof(PairRequest) <= MAX_PAYLOAD_SIZE, "PairRequest payload is too large");
 static_assert(sizeof(PairResponse) <= MAX_PAYLOAD_SIZE,
               "PairResponse payload is too large");
@@ -81,5 +137,6 @@ static_assert(sizeof(HeartbeatMessage) <= MAX_PAYLOAD_SIZE,
               "HeartbeatMessage payload is too large");
 static_assert(sizeof(HeartbeatResponse) <= MAX_PAYLOAD_SIZE,
               "HeartbeatResponse payload is too large");
+static_assert(sizeof(HeartbeatBeacon) <= MAX_PAYLOAD_SIZE, "HeartbeatBeacon payload is too large");
 static_assert(sizeof(AckMessage) <= MAX_PAYLOAD_SIZE, "AckMessage payload is too large");
 static_assert(sizeof(OtaCommand) <= MAX_PAYLOAD_SIZE, "OtaCommand payload is too large");
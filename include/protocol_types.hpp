@@ -5,24 +5,155 @@
 
 #include "esp_now.h"
 
-// Correct size of the universal message header
-constexpr size_t MESSAGE_HEADER_SIZE = 16;
+// Correct size of the universal message header (in-memory layout used by the stack)
+constexpr size_t MESSAGE_HEADER_SIZE = 18;
+// Size of the original wire header, still sent to peers without the compact format
+constexpr size_t LEGACY_HEADER_SIZE = 16;
 constexpr size_t CRC_SIZE            = 1;
 // The maximum payload size is the total ESP-NOW size minus the header and CRC
 constexpr size_t MAX_PAYLOAD_SIZE = ESP_NOW_MAX_DATA_LEN - MESSAGE_HEADER_SIZE - CRC_SIZE;
+// Legacy senders size payloads against their shorter header, so a full legacy
+// frame does not fit the canonical layout within ESP_NOW_MAX_DATA_LEN
+constexpr size_t LEGACY_MAX_PAYLOAD_SIZE = ESP_NOW_MAX_DATA_LEN - LEGACY_HEADER_SIZE - CRC_SIZE;
+// Largest canonical frame (header, payload, CRC slot) decode_wire() produces
+constexpr size_t MAX_FRAME_SIZE = MESSAGE_HEADER_SIZE + LEGACY_MAX_PAYLOAD_SIZE + CRC_SIZE;
+
+// Compact wire header. Frames start with a marker byte whose high nibble is
+// MARKER and low nibble the header version; legacy frames start with the
+// MessageType, so MessageType values 0xE0-0xEF are reserved.
+//
+//   marker | flags | msg_type | sender_type | sender_id | dest_id
+//   [payload_type] varint(sequence) [varint(piggyback ack)] [varint(timestamp_ms)]
+//   payload | crc
+namespace CompactHeader {
+constexpr uint8_t MARKER      = 0xE0;
+constexpr uint8_t MARKER_MASK = 0xF0;
+constexpr uint8_t VERSION_1   = 0x01; // CRC8 trailer
+constexpr uint8_t VERSION_2   = 0x02; // CRC16 trailer
+constexpr uint8_t VERSION_3   = 0x03; // CRC32 trailer
+constexpr size_t MIN_SIZE     = 7; // Fixed fields plus a one-byte sequence, without trailer
+
+constexpr uint8_t FLAG_REQUIRES_ACK  = 0x01;
+constexpr uint8_t FLAG_PIGGYBACK_ACK = 0x02;
+constexpr uint8_t FLAG_TIMESTAMP     = 0x04;
+constexpr uint8_t FLAG_PAYLOAD_TYPE  = 0x08;
+constexpr uint8_t FLAG_KEYFRAME      = 0x10; // Payload is a delta reference, preceded by its generation
+constexpr uint8_t FLAG_DELTA         = 0x20; // Payload is a delta, preceded by generation and reference CRC8
+} // namespace CompactHeader
+
+// Application-layer AEAD envelope (AES-128-CCM) around a legacy or compact frame,
+// used once both peers hold a session key from pairing:
+//
+//   MARKER | epoch (4) | counter (3) | ciphertext | tag (8)
+//
+// The CCM nonce is the sender MAC followed by epoch and counter. The epoch is a
+// persisted boot counter, so (key, nonce) pairs never repeat across reboots.
+namespace SecureEnvelope {
+constexpr uint8_t MARKER        = 0xD1;
+constexpr size_t EPOCH_SIZE     = 4;
+constexpr size_t COUNTER_SIZE   = 3;
+constexpr uint32_t MAX_COUNTER  = (1u << (8 * COUNTER_SIZE)) - 1;
+constexpr size_t HEADER_SIZE    = 1 + EPOCH_SIZE + COUNTER_SIZE;
+constexpr size_t TAG_SIZE       = 8;
+constexpr size_t OVERHEAD       = HEADER_SIZE + TAG_SIZE;
+constexpr size_t KEY_SIZE       = 16; // Session and network keys
+constexpr size_t NONCE_SIZE     = 8;  // Pairing nonce contributed by each side
+} // namespace SecureEnvelope
+
+// Protocol capabilities advertised in PairRequest and agreed in PairResponse.
+namespace PeerCapability {
+constexpr uint16_t NONE             = 0x0000;
+constexpr uint16_t COMPACT_HEADER   = 0x0001; // Compact wire header, required for piggybacked ACKs
+constexpr uint16_t PAYLOAD_DELTA    = 0x0002; // Delta-coded DATA payloads, requires COMPACT_HEADER
+constexpr uint16_t CRC16            = 0x0004; // CRC16 trailer on compact frames
+constexpr uint16_t CRC32            = 0x0008; // CRC32 trailer on compact frames
+constexpr uint16_t AEAD             = 0x0010; // SecureEnvelope with a session key from pairing
+constexpr uint16_t HEARTBEAT_BEACON = 0x0020; // Heartbeats answered by the hub's batched HeartbeatBeacon
+constexpr uint16_t WAKE_SLOTS       = 0x0040; // Node sleeps between hub-assigned wake slots
+constexpr uint16_t SUPPORTED = COMPACT_HEADER | PAYLOAD_DELTA | CRC16 | CRC32 | AEAD | HEARTBEAT_BEACON | WAKE_SLOTS;
+} // namespace PeerCapability
 
 // Default values (can be overridden in config)
 constexpr uint32_t DEFAULT_ACK_TIMEOUT_MS        = 500;
 constexpr uint32_t DEFAULT_HEARTBEAT_INTERVAL_MS = 60000;
 constexpr uint8_t DEFAULT_WIFI_CHANNEL           = 1;
-constexpr float HEARTBEAT_OFFLINE_MULTIPLIER     = 2.5f;
+
+// A peer with a heartbeat interval goes offline after OFFLINE_NUM / OFFLINE_DEN
+// intervals without any frame from it (a WAKE_SLOTS peer heartbeats no more
+// often than once per wake period, so that bounds its interval). Liveness deadlines are kept in a timer
+// wheel advanced every PEER_LIVENESS_TICK_MS.
+constexpr uint32_t HEARTBEAT_OFFLINE_NUM = 5;
+constexpr uint32_t HEARTBEAT_OFFLINE_DEN = 2;
+constexpr uint32_t PEER_LIVENESS_TICK_MS = 250;
+
+// Heartbeat scheduling. Each node starts at a phase of the interval derived from
+// its MAC and id, and every period is moved by up to +/- interval / JITTER_DIVISOR.
+// An unanswered heartbeat is retried after a random backoff whose window doubles
+// per miss, up to HEARTBEAT_MAX_RETRIES times.
+constexpr uint32_t HEARTBEAT_JITTER_DIVISOR      = 8;
+constexpr uint32_t HEARTBEAT_RESPONSE_TIMEOUT_MS = 100;
+constexpr uint32_t HEARTBEAT_BACKOFF_BASE_MS     = 100;
+constexpr uint8_t HEARTBEAT_MAX_RETRIES          = 3;
+
+// Heartbeat batching: the hub acknowledges heartbeats from peers that agreed
+// PeerCapability::HEARTBEAT_BEACON in one broadcast HeartbeatBeacon, sent
+// HEARTBEAT_BEACON_WINDOW_MS after the first pending one or as soon as
+// HEARTBEAT_BEACON_MAX_ACKS are pending. Such nodes wait that much longer for
+// their answer.
+constexpr uint32_t HEARTBEAT_BEACON_WINDOW_MS = 1000;
+constexpr uint8_t HEARTBEAT_BEACON_MAX_ACKS   = 32;
+
+// Wake slots: the hub gives every node that agreed PeerCapability::WAKE_SLOTS
+// an offset within its wake period, on the network clock. The node sleeps,
+// wakes WAKE_GUARD_MS before its slot, sends its heartbeat and listens until
+// WAKE_LISTEN_MS pass without a frame from the hub. The hub holds frames for
+// such nodes and releases them when the node is heard from.
+constexpr uint32_t WAKE_GUARD_MS          = 5;
+constexpr uint32_t WAKE_LISTEN_MS         = 100;
+constexpr uint32_t WAKE_PENDING_LISTEN_MS = 500; // While the hub still holds frames for the node
+
+// Downlink mailbox on the hub: DOWNLINK_MAILBOX_SLOTS frames shared by all
+// sleeping or offline peers, at most DOWNLINK_MAILBOX_PEER_SLOTS per peer.
+// Frames not delivered within DOWNLINK_MAILBOX_TTL_MS are dropped.
+constexpr size_t DOWNLINK_MAILBOX_SLOTS      = 16;
+constexpr size_t DOWNLINK_MAILBOX_PEER_SLOTS = 4;
+constexpr uint32_t DOWNLINK_MAILBOX_TTL_MS   = 300000;
+
+// Application subscriptions the router holds, see AppSubscription
+constexpr size_t APP_SUBSCRIPTIONS_MAX = 8;
 
 // Constants for retry logic
 constexpr uint32_t LOGICAL_ACK_TIMEOUT_MS = 500;
 constexpr uint8_t MAX_LOGICAL_RETRIES     = 3;
 
+// Adaptive ACK timeout: once a peer has RTT samples, srtt + 4 * rttvar within
+// these bounds replaces LOGICAL_ACK_TIMEOUT_MS, doubled on every retry.
+constexpr uint32_t ACK_TIMEOUT_MIN_MS = 50;
+constexpr uint32_t ACK_TIMEOUT_MAX_MS = 2000;
+
+// Piggybacked ACKs: a pending ACK for a peer rides on the next outbound frame to
+// that peer if one is sent within the window, otherwise a standalone AckMessage
+// is sent when the window expires.
+constexpr uint32_t PIGGYBACK_ACK_WINDOW_MS = 20;
+constexpr uint16_t PIGGYBACK_ACK_VALID     = 0x8000; // Set when the field carries an ACK
+constexpr uint16_t PIGGYBACK_ACK_SEQ_MASK  = 0x7FFF; // Low bits of the acknowledged sequence
+
+// Channel scan: channels are probed in order of likelihood and the scan stops at
+// the first hub response. The first pass dwells for a time derived from measured
+// hub response latency; later passes fall back to the full timeout.
 constexpr uint16_t SCAN_CHANNEL_TIMEOUT_MS = 50;
-constexpr uint8_t SCAN_CHANNEL_ATTEMPTS    = 2;
+constexpr uint16_t SCAN_MIN_DWELL_MS       = 8;
+constexpr uint8_t SCAN_CHANNEL_ATTEMPTS    = 2; // Passes over all channels
+constexpr uint8_t SCAN_MAX_CHANNEL         = 13;
+
+// Nodes keep this many recent hub channels, most recent first, and try them right
+// after the channel the hub was lost on.
+constexpr uint8_t CHANNEL_HINT_COUNT = 4;
+
+// A hub changing channel broadcasts ChannelAnnounce this many times on the old
+// channel and waits CHANNEL_SWITCH_DELAY_MS for them to go out before moving.
+constexpr uint8_t CHANNEL_ANNOUNCE_REPEATS  = 2;
+constexpr uint16_t CHANNEL_SWITCH_DELAY_MS  = 50;
 constexpr uint16_t MAX_SCAN_TIME_MS        = SCAN_CHANNEL_TIMEOUT_MS * SCAN_CHANNEL_ATTEMPTS * 20;
 
 // Generic types for Node identification and categorization
@@ -65,17 +196,22 @@ enum class MessageType : uint8_t
     PAIR_RESPONSE         = 0x01,
     HEARTBEAT             = 0x02,
     HEARTBEAT_RESPONSE    = 0x03,
+    HEARTBEAT_BEACON      = 0x04,
     DATA                  = 0x10,
     ACK                   = 0x11,
     COMMAND               = 0x20,
     CHANNEL_SCAN_PROBE    = 0x30,
     CHANNEL_SCAN_RESPONSE = 0x31,
+    CHANNEL_ANNOUNCE      = 0x32,
+    // 0xD1 reserved for SecureEnvelope::MARKER
+    // 0xE0-0xEF reserved for CompactHeader::MARKER
 };
 
 enum class PairStatus : uint8_t
 {
     ACCEPTED             = 0x00,
     REJECTED_NOT_ALLOWED = 0x01,
+    REJECTED_NO_AEAD     = 0x02, // Hub requires encryption the node did not offer
 };
 
 enum class AckStatus : uint8_t
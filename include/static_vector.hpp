@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+/**
+ * @brief Vector with its storage inline, for tables whose size is bounded.
+ *
+ * Holds up to N default-constructible elements in place and never allocates.
+ * Iterators are plain pointers and are invalidated by insert() and erase() at
+ * or before them, as with std::vector. Adding to a full vector fails instead
+ * of growing it. Not locked.
+ */
+template <typename T, size_t N> class StaticVector
+{
+public:
+    using value_type     = T;
+    using iterator       = T *;
+    using const_iterator = const T *;
+
+    static constexpr size_t capacity() { return N; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == N; }
+
+    iterator begin() { return items_; }
+    iterator end() { return items_ + size_; }
+    const_iterator begin() const { return items_; }
+    const_iterator end() const { return items_ + size_; }
+    T *data() { return items_; }
+    const T *data() const { return items_; }
+
+    T &operator[](size_t i) { return items_[i]; }
+    const T &operator[](size_t i) const { return items_[i]; }
+    T &front() { return items_[0]; }
+    T &back() { return items_[size_ - 1]; }
+    const T &back() const { return items_[size_ - 1]; }
+
+    // Return false, leaving the vector unchanged, if it is full
+    bool push_back(const T &value)
+    {
+        if (full()) return false;
+        items_[size_++] = value;
+        return true;
+    }
+
+    bool insert(iterator pos, const T &value)
+    {
+        if (full()) return false;
+        std::move_backward(pos, end(), end() + 1);
+        *pos = value;
+        size_++;
+        return true;
+    }
+
+    // Copies count elements from values, dropping any beyond capacity
+    void assign(const T *values, size_t count)
+    {
+        size_ = std::min(count, N);
+        std::copy_n(values, size_, items_);
+    }
+
+    iterator erase(iterator pos)
+    {
+        std::move(pos + 1, end(), pos);
+        size_--;
+        return pos;
+    }
+
+    void pop_back() { size_--; }
+    void clear() { size_ = 0; }
+
+private:
+    T items_[N] = {};
+    size_t size_ = 0;
+};
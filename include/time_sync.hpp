@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief NTP-style estimate of the hub clock from heartbeat round trips.
+ *
+ * A round trip yields four timestamps: t1 (node sends) and t4 (node receives)
+ * on the local esp_timer clock, t2 (hub receives) and t3 (hub sends) on the hub
+ * clock. Then offset = ((t2 - t1) + (t3 - t4)) / 2 and delay = (t4 - t1) - (t3 - t2).
+ * Queueing only ever adds delay and skews the offset by up to half of it, so of
+ * the last SAMPLES round trips the one with the smallest delay is trusted, as in
+ * the NTP clock filter. Drift is the smoothed slope between successive trusted
+ * offsets and extrapolates the clock between heartbeats.
+ *
+ * Offsets are kept in microseconds so halving millisecond timestamps is exact.
+ * The estimator is not locked.
+ */
+class TimeSync
+{
+public:
+    static constexpr size_t SAMPLES             = 8;
+    static constexpr uint32_t MIN_DRIFT_SPAN_MS = 10000; // Shorter spans are too noisy at 1 ms resolution
+    static constexpr int32_t MAX_DRIFT_PPM      = 500;   // Steeper slopes are measurement noise, not oscillator error
+    static constexpr uint32_t STEP_THRESHOLD_MS = 128;   // Larger jumps (e.g. a hub reboot) restart the estimate
+
+    // Feeds one round trip. Returns false if the timestamps are inconsistent.
+    bool add_sample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4);
+
+    bool synchronized() const { return synchronized_; }
+    uint64_t to_hub_time(uint64_t local_ms) const;
+    uint64_t to_local_time(uint64_t hub_ms) const;
+
+    int64_t offset_us(uint64_t local_ms) const; // Hub minus local clock at local_ms
+    int32_t drift_ppm() const { return drift_ppm_; }
+    uint32_t delay_ms() const { return anchor_.delay_ms; } // Round trip of the trusted sample
+
+    void reset();
+
+private:
+    struct Sample
+    {
+        uint64_t local_ms; // t4
+        int64_t offset_us;
+        uint32_t delay_ms;
+    };
+
+    Sample samples_[SAMPLES] = {};
+    size_t count_            = 0;
+    size_t next_             = 0;
+    bool synchronized_       = false;
+    Sample anchor_           = {}; // Trusted sample the clock is extrapolated from
+    int32_t drift_ppm_       = 0;
+    bool drift_valid_        = false;
+};
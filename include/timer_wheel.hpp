@@ -0,0 +1,93 @@
+#pragma once
+
+#include "espnow_types.hpp"
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Hashed timer wheel holding one deadline per node id.
+ *
+ * Deadlines are rounded up to whole ticks and hashed into SLOTS buckets by tick
+ * number, so scheduling, cancelling and rescheduling are O(1) and advancing by
+ * one tick only visits the timers that share that bucket. Deadlines further
+ * away than one revolution stay in their bucket until their tick comes round.
+ *
+ * Timers live in a fixed pool of MAX_PEERS entries indexed through a per-id
+ * table; nothing is allocated after construction. The wheel is not locked.
+ */
+class TimerWheel
+{
+public:
+    static constexpr size_t SLOTS = 64;
+
+    explicit TimerWheel(uint32_t tick_ms);
+
+    // (Re)arms the timer for id. Deadlines already due fire on the next advance().
+    // Returns false if the pool is full.
+    bool schedule(NodeId id, uint64_t deadline_ms);
+    void cancel(NodeId id);
+    bool is_scheduled(NodeId id) const { return index_[id] != NIL; }
+    void clear();
+
+    /**
+     * @brief Fires every timer whose deadline is not after now_ms.
+     *
+     * Expired timers are collected and removed first, and on_expired(id) runs for
+     * each once the walk is done, so the callback may schedule or cancel any
+     * timer; one scheduled from it fires no earlier than the next advance().
+     * After a gap longer than a revolution every bucket is visited once.
+     *
+     * @return The number of timers fired.
+     */
+    template <typename Fn> size_t advance(uint64_t now_ms, Fn &&on_expired)
+    {
+        uint64_t now_tick = now_ms / tick_ms_;
+        if (now_tick <= current_tick_) return 0;
+
+        uint64_t ticks = now_tick - current_tick_;
+        if (ticks > SLOTS) ticks = SLOTS;
+
+        NodeId expired[MAX_PEERS];
+        size_t fired = 0;
+        for (uint64_t t = now_tick - ticks + 1; t <= now_tick; t++) {
+            uint8_t i = heads_[t % SLOTS];
+            while (i != NIL) {
+                uint8_t next = entries_[i].next;
+                if (entries_[i].deadline_tick <= now_tick) {
+                    expired[fired++] = entries_[i].id;
+                    release(i);
+                }
+                i = next;
+            }
+        }
+        current_tick_ = now_tick;
+
+        for (size_t i = 0; i < fired; i++) {
+            on_expired(expired[i]);
+        }
+        return fired;
+    }
+
+private:
+    static constexpr uint8_t NIL = 0xFF;
+    static_assert(MAX_PEERS < NIL, "TimerWheel indexes its pool with uint8_t");
+
+    struct Entry
+    {
+        uint64_t deadline_tick;
+        NodeId id;
+        uint8_t prev;
+        uint8_t next;
+    };
+
+    void link(uint8_t i);
+    void unlink(uint8_t i);
+    void release(uint8_t i);
+
+    uint32_t tick_ms_;
+    uint64_t current_tick_ = 0;
+    uint8_t heads_[SLOTS];
+    uint8_t index_[256]; // NodeId -> pool entry
+    uint8_t free_;       // Free entries, chained through next
+    Entry entries_[MAX_PEERS];
+};
@@ -1,11 +1,15 @@
 #pragma once
 
+#include "downlink_mailbox.hpp"
 #include "espnow_interfaces.hpp"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
+#include <atomic>
 #include <memory>
+#include <optional>
 
 class RealTxManager : public ITxManager
 {
@@ -13,33 +17,79 @@ public:
     RealTxManager(ITxStateMachine &fsm,
                   IChannelScanner &scanner,
                   IWiFiHAL &hal,
-                  IMessageCodec &codec);
+                  IMessageCodec &codec,
+                  IPeerManager &peer_mgr);
     ~RealTxManager();
 
     esp_err_t init(uint32_t stack_size, UBaseType_t priority) override;
     esp_err_t deinit() override;
 
     esp_err_t queue_packet(const TxPacket &packet) override;
+    esp_err_t schedule_ack(const TxPacket &ack_packet, uint16_t ack_sequence) override;
+    esp_err_t hold_packet(const TxPacket &packet) override;
+    void release_held(const uint8_t *mac) override;
+    size_t held_count(const uint8_t *mac) override;
 
     // Notifications from outside (ISRs or other tasks)
     void notify_physical_fail() override;
     void notify_link_alive() override;
-    void notify_logical_ack() override;
+    void notify_logical_ack(const uint8_t *mac, uint16_t sequence) override;
     void notify_hub_found() override;
 
     TaskHandle_t get_task_handle() const override { return task_handle_; }
 
+    // Most frames ever waiting in the TX queue since init(), for sizing it
+    uint32_t queue_high_water() const { return queue_high_water_.load(std::memory_order_relaxed); }
+
 private:
+    struct DeferredAck
+    {
+        TxPacket packet;
+        uint16_t sequence;
+    };
+
+    struct AwaitedAck
+    {
+        uint8_t mac[6];
+        uint16_t sequence;
+    };
+
     ITxStateMachine &fsm_;
     IChannelScanner &scanner_;
     IWiFiHAL &hal_;
     IMessageCodec &codec_;
+    IPeerManager &peer_mgr_;
 
     QueueHandle_t tx_queue_ = nullptr;
     TaskHandle_t task_handle_ = nullptr;
     TimerHandle_t ack_timeout_timer_ = nullptr;
+    TimerHandle_t piggyback_timer_ = nullptr;
+    TimerHandle_t scan_timer_ = nullptr; // Paces the channel scanner's dwell
+    SemaphoreHandle_t deferred_ack_mutex_ = nullptr;
+    std::optional<DeferredAck> deferred_ack_;
+    SemaphoreHandle_t awaited_ack_mutex_ = nullptr;
+    std::optional<AwaitedAck> awaited_ack_; // The one ACK that completes the pending frame
+    SemaphoreHandle_t mailbox_mutex_ = nullptr;
+    DownlinkMailbox mailbox_; // Frames for sleeping peers, under mailbox_mutex_
     uint16_t sequence_counter_ = 0;
+    bool listen_held_ = false; // Receiver held on for an ACK or scan response, TX task only
+    std::atomic<uint32_t> queue_high_water_{0};
+    uint8_t wire_buf_[ESP_NOW_MAX_DATA_LEN];
 
     static void tx_task_func(void *arg);
     void run();
+    uint16_t agreed_capabilities(const uint8_t *mac);
+    esp_err_t transmit(TxPacket &packet);
+    esp_err_t send_wire(const TxPacket &packet, uint16_t caps, bool retransmission);
+    void attach_deferred_ack(TxPacket &packet, uint16_t caps);
+    void flush_deferred_ack();
+    void await_ack(const TxPacket &packet);
+    void stop_awaiting_ack();
+    static uint64_t now_ms();
+    void arm_ack_timer(const PendingAck &pending); // Per-peer timeout, see LinkMetrics
+    void record_delivery(bool delivered);
+    void arm_scan_timer(uint32_t dwell_ms);
+    void drain_during_scan();
+    void hold_listening(bool hold);
+    static void on_scan_done(const IChannelScanner::ScanResult &result, void *ctx);
 };
@@ -2,12 +2,14 @@
 
 #include "espnow_interfaces.hpp"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 class RealWiFiHAL : public IWiFiHAL
 {
 public:
     RealWiFiHAL();
+    ~RealWiFiHAL();
 
     void set_task_to_notify(TaskHandle_t task_handle) override { task_handle_ = task_handle; }
 
@@ -15,7 +17,17 @@ public:
     esp_err_t get_channel(uint8_t *channel) override;
     esp_err_t send_packet(const uint8_t *mac, const uint8_t *data, size_t len) override;
     bool wait_for_event(uint32_t event_mask, uint32_t timeout_ms) override;
+    esp_err_t set_listening(bool listening) override;
+    esp_err_t hold_listening(bool hold) override;
 
 private:
     TaskHandle_t task_handle_;
+
+    // The heartbeat timer and the TX task both steer the receiver
+    SemaphoreHandle_t listen_mutex_ = nullptr;
+    bool listening_                 = true;
+    bool held_                      = false;
+    bool receiver_on_               = true;
+
+    esp_err_t apply_listening();
 };
@@ -0,0 +1,86 @@
+#include "integrity_check.hpp"
+#include "esp_rom_crc.h"
+#include <cstring>
+
+namespace IntegrityCheck {
+
+namespace {
+
+uint32_t compute(Type type, const uint8_t *data, size_t len)
+{
+    switch (type) {
+    case Type::CRC16:
+        return esp_rom_crc16_le(0, data, len);
+    case Type::CRC32:
+        return esp_rom_crc32_le(0, data, len);
+    case Type::CRC8:
+    default:
+        return esp_rom_crc8_le(0, data, len);
+    }
+}
+
+} // namespace
+
+size_t trailer_size(Type type)
+{
+    switch (type) {
+    case Type::CRC16:
+        return 2;
+    case Type::CRC32:
+        return 4;
+    case Type::CRC8:
+    default:
+        return 1;
+    }
+}
+
+Type strongest(uint16_t caps)
+{
+    if (caps & PeerCapability::CRC32) return Type::CRC32;
+    if (caps & PeerCapability::CRC16) return Type::CRC16;
+    return Type::CRC8;
+}
+
+bool from_version(uint8_t version, Type &type)
+{
+    switch (version) {
+    case CompactHeader::VERSION_1:
+        type = Type::CRC8;
+        return true;
+    case CompactHeader::VERSION_2:
+        type = Type::CRC16;
+        return true;
+    case CompactHeader::VERSION_3:
+        type = Type::CRC32;
+        return true;
+    default:
+        return false;
+    }
+}
+
+size_t append(Type type, uint8_t *frame, size_t len, size_t out_len)
+{
+    size_t size = trailer_size(type);
+    if (len + size > out_len) return 0;
+
+    // Little-endian, matching the rest of the wire format
+    uint32_t crc = compute(type, frame, len);
+    for (size_t i = 0; i < size; ++i) {
+        frame[len + i] = static_cast<uint8_t>(crc >> (8 * i));
+    }
+    return len + size;
+}
+
+bool verify(Type type, const uint8_t *frame, size_t len)
+{
+    size_t size = trailer_size(type);
+    if (len < size) return false;
+
+    uint32_t crc = compute(type, frame, len - size);
+    for (size_t i = 0; i < size; ++i) {
+        if (frame[len - size + i] != static_cast<uint8_t>(crc >> (8 * i))) return false;
+    }
+    return true;
+}
+
+} // namespace IntegrityCheck
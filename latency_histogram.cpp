@@ -0,0 +1,91 @@
+#include "latency_histogram.hpp"
+
+#if CONFIG_ESPNOW_LATENCY_HISTOGRAMS
+
+#include "esp_timer.h"
+#include <atomic>
+
+namespace {
+
+constexpr size_t STAGES = static_cast<size_t>(LatencyStage::COUNT);
+
+struct Stage
+{
+    std::atomic<uint32_t> counts[LatencyHistogram::BUCKETS];
+    std::atomic<uint32_t> samples;
+    std::atomic<uint64_t> total_us;
+    std::atomic<uint32_t> max_us;
+};
+
+Stage stages[STAGES];
+std::atomic<int64_t> last_send_origin_us{0};
+
+size_t bucket_of(uint32_t us)
+{
+    size_t bucket = us < 2 ? 0 : 31 - __builtin_clz(us);
+    return bucket < LatencyHistogram::BUCKETS ? bucket : LatencyHistogram::BUCKETS - 1;
+}
+
+} // namespace
+
+namespace Latency {
+
+TxPacket stamped(const TxPacket &packet)
+{
+    TxPacket copy    = packet;
+    copy.enqueued_us = esp_timer_get_time();
+    return copy;
+}
+
+void record(LatencyStage stage, int64_t since_us)
+{
+    if (since_us <= 0) return; // Never stamped
+    int64_t elapsed = esp_timer_get_time() - since_us;
+    if (elapsed < 0) return;
+    uint32_t us = elapsed > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(elapsed);
+
+    Stage &s = stages[static_cast<size_t>(stage)];
+    s.counts[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+    s.samples.fetch_add(1, std::memory_order_relaxed);
+    s.total_us.fetch_add(us, std::memory_order_relaxed);
+    uint32_t max = s.max_us.load(std::memory_order_relaxed);
+    while (us > max && !s.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void note_radio_send(const TxPacket &packet)
+{
+    last_send_origin_us.store(packet.enqueued_us, std::memory_order_relaxed);
+}
+
+void record_send_cb()
+{
+    record(LatencyStage::TX_SEND_CB, last_send_origin_us.load(std::memory_order_relaxed));
+}
+
+bool snapshot(LatencyStage stage, LatencyHistogram &histogram)
+{
+    if (stage >= LatencyStage::COUNT) return false;
+    const Stage &s = stages[static_cast<size_t>(stage)];
+    for (size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+        histogram.counts[i] = s.counts[i].load(std::memory_order_relaxed);
+    }
+    histogram.samples  = s.samples.load(std::memory_order_relaxed);
+    histogram.total_us = s.total_us.load(std::memory_order_relaxed);
+    histogram.max_us   = s.max_us.load(std::memory_order_relaxed);
+    return true;
+}
+
+void reset()
+{
+    for (auto &s : stages) {
+        for (auto &count : s.counts) count.store(0, std::memory_order_relaxed);
+        s.samples.store(0, std::memory_order_relaxed);
+        s.total_us.store(0, std::memory_order_relaxed);
+        s.max_us.store(0, std::memory_order_relaxed);
+    }
+}
+
+} // namespace Latency
+
+#endif
@@ -0,0 +1,98 @@
+#include "link_metrics.hpp"
+#include "protocol_types.hpp"
+#include <algorithm>
+
+void LinkMetrics::on_rx(int8_t rssi)
+{
+    if (rx_frames == 0) {
+        rssi_avg_x16 = rssi * 16;
+        rssi_min     = rssi;
+        rssi_max     = rssi;
+    }
+    else {
+        rssi_avg_x16 += (rssi * 16 - rssi_avg_x16) / 8;
+        rssi_min = std::min(rssi_min, rssi);
+        rssi_max = std::max(rssi_max, rssi);
+    }
+    rx_frames++;
+}
+
+void LinkMetrics::on_delivered(uint8_t retries, uint32_t rtt_ms)
+{
+    if (delivered + lost == 0) {
+        delivery_x1024 = 1024;
+    }
+    else {
+        delivery_x1024 += (1024 - delivery_x1024) / 8;
+    }
+    if (delivered == 0) {
+        retries_x16 = retries * 16;
+    }
+    else {
+        retries_x16 += (retries * 16 - retries_x16) / 8;
+    }
+    delivered++;
+
+    if (rtt_ms == 0) return;
+
+    // RFC 6298
+    if (srtt_x8 == 0) {
+        srtt_x8   = rtt_ms * 8;
+        rttvar_x4 = rtt_ms * 2;
+    }
+    else {
+        int32_t error = static_cast<int32_t>(rtt_ms) - static_cast<int32_t>(srtt_x8 / 8);
+        srtt_x8 += error;
+        rttvar_x4 += (error < 0 ? -error : error) - static_cast<int32_t>(rttvar_x4 / 4);
+    }
+    rtt_max_ms = std::max(rtt_max_ms, rtt_ms);
+
+    size_t bucket = 0;
+    while (bucket < RTT_BUCKETS - 1 && rtt_ms > (4u << bucket)) bucket++;
+    if (rtt_histogram[bucket] == UINT16_MAX) {
+        for (auto &count : rtt_histogram) count /= 2;
+    }
+    rtt_histogram[bucket]++;
+}
+
+void LinkMetrics::on_lost()
+{
+    if (delivered + lost == 0) {
+        delivery_x1024 = 0;
+    }
+    else {
+        delivery_x1024 -= delivery_x1024 / 8;
+    }
+    lost++;
+}
+
+uint32_t LinkMetrics::delivery_ratio_permille() const
+{
+    if (delivered + lost == 0) return 1000;
+    return delivery_x1024 * 1000 / 1024;
+}
+
+uint32_t LinkMetrics::rtt_percentile_ms(uint8_t percent) const
+{
+    uint32_t total = 0;
+    for (auto count : rtt_histogram) total += count;
+    if (total == 0) return 0;
+
+    uint32_t target = (total * std::min<uint8_t>(percent, 100) + 99) / 100;
+    uint32_t seen   = 0;
+    for (size_t bucket = 0; bucket < RTT_BUCKETS - 1; bucket++) {
+        seen += rtt_histogram[bucket];
+        if (seen >= std::max<uint32_t>(target, 1)) return std::min(4u << bucket, rtt_max_ms);
+    }
+    return rtt_max_ms;
+}
+
+uint32_t LinkMetrics::ack_timeout_ms(uint8_t retries) const
+{
+    uint32_t timeout = LOGICAL_ACK_TIMEOUT_MS;
+    if (srtt_x8 > 0) {
+        timeout = std::clamp(srtt_x8 / 8 + rttvar_x4, ACK_TIMEOUT_MIN_MS, ACK_TIMEOUT_MAX_MS);
+    }
+    // Exponential backoff, as after an RTO
+    return std::min(timeout << std::min<uint8_t>(retries, 8), ACK_TIMEOUT_MAX_MS);
+}
@@ -1,28 +1,88 @@
 #include "message_codec.hpp"
 #include "esp_rom_crc.h"
+#include "espnow_stats.hpp"
+#include "integrity_check.hpp"
+#include <algorithm>
 #include <cstring>
 
-std::vector<uint8_t> RealMessageCodec::encode(const MessageHeader &header,
-                                             const void *payload,
-                                             size_t len)
+namespace {
+
+// Unsigned LEB128, as used by the compact header for sequence, ACK and timestamp.
+size_t put_varint(uint64_t value, uint8_t *out, size_t out_len)
+{
+    size_t pos = 0;
+    do {
+        if (pos >= out_len) return 0;
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out[pos++] = byte | (value ? 0x80 : 0x00);
+    } while (value);
+    return pos;
+}
+
+size_t get_varint(const uint8_t *in, size_t in_len, uint64_t &value)
+{
+    value = 0;
+    for (size_t pos = 0; pos < in_len && pos < 10; ++pos) {
+        value |= static_cast<uint64_t>(in[pos] & 0x7F) << (7 * pos);
+        if (!(in[pos] & 0x80)) return pos + 1;
+    }
+    return 0;
+}
+
+bool is_compact(const uint8_t *wire)
+{
+    return (wire[0] & CompactHeader::MARKER_MASK) == CompactHeader::MARKER;
+}
+
+// Pairing has to work before a session key exists; scan probes, channel
+// announcements and heartbeat beacons are broadcast
+bool travels_in_clear(MessageType type)
+{
+    return type == MessageType::PAIR_REQUEST || type == MessageType::PAIR_RESPONSE ||
+           type == MessageType::CHANNEL_SCAN_PROBE || type == MessageType::CHANNEL_ANNOUNCE ||
+           type == MessageType::HEARTBEAT_BEACON;
+}
+
+// Message type of a plaintext legacy or compact frame, before it is decoded
+bool peek_msg_type(const uint8_t *wire, size_t len, MessageType &type)
+{
+    size_t offset = is_compact(wire) ? 2 : 0;
+    if (len <= offset) return false;
+    type = static_cast<MessageType>(wire[offset]);
+    return true;
+}
+
+} // namespace
+
+RealMessageCodec::RealMessageCodec(uint16_t capabilities, IStorage *epoch_store)
+    : capabilities_(capabilities & PeerCapability::SUPPORTED)
+    , cipher_(epoch_store)
+{
+}
+
+size_t RealMessageCodec::encode(const MessageHeader &header,
+                               const void *payload,
+                               size_t len,
+                               uint8_t *out,
+                               size_t out_len)
 {
     size_t total_len = sizeof(MessageHeader) + len + CRC_SIZE;
-    if (total_len > ESP_NOW_MAX_DATA_LEN)
+    if (total_len > ESP_NOW_MAX_DATA_LEN || total_len > out_len)
     {
-        return {};
+        return 0;
     }
 
-    std::vector<uint8_t> buffer(total_len);
-    memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    memcpy(out, &header, sizeof(MessageHeader));
     if (payload && len > 0)
     {
-        memcpy(buffer.data() + sizeof(MessageHeader), payload, len);
+        memcpy(out + sizeof(MessageHeader), payload, len);
     }
 
-    uint8_t crc = esp_rom_crc8_le(0, buffer.data(), total_len - CRC_SIZE);
-    buffer.back() = crc;
-
-    return buffer;
+    // The trailing slot stays zero: the integrity check is computed once per
+    // transmission by encode_wire() over the bytes actually sent.
+    memset(out + sizeof(MessageHeader) + len, 0, CRC_SIZE);
+    return total_len;
 }
 
 std::optional<MessageHeader> RealMessageCodec::decode_header(const uint8_t *data,
@@ -55,3 +115,407 @@ uint8_t RealMessageCodec::calculate_crc(const uint8_t *data, size_t len)
 {
     return esp_rom_crc8_le(0, data, len);
 }
+
+size_t RealMessageCodec::encode_wire(const uint8_t *dest_mac,
+                                     const uint8_t *frame,
+                                     size_t len,
+                                     uint16_t peer_caps,
+                                     bool retransmission,
+                                     uint8_t *out,
+                                     size_t out_len)
+{
+    if (!dest_mac || !frame || !out || len < sizeof(MessageHeader) + CRC_SIZE)
+    {
+        return 0;
+    }
+
+    MessageHeader header;
+    memcpy(&header, frame, sizeof(MessageHeader));
+    uint16_t caps = peer_caps & capabilities_;
+
+    if (travels_in_clear(header.msg_type) || !cipher_.has_key(dest_mac))
+    {
+        return encode_plain(dest_mac, header, frame, len, caps, retransmission, out, out_len);
+    }
+
+    // The envelope tag already authenticates the frame, so the inner check stays CRC8.
+    // Frames too large for the envelope fail rather than going out in the clear.
+    if (out_len < SecureEnvelope::OVERHEAD) return 0;
+    caps &= ~(PeerCapability::CRC16 | PeerCapability::CRC32);
+    size_t inner_len = encode_plain(dest_mac, header, frame, len, caps, retransmission, seal_buf_,
+                                    std::min(sizeof(seal_buf_), out_len - SecureEnvelope::OVERHEAD));
+    if (inner_len == 0) return 0;
+    return cipher_.seal(dest_mac, seal_buf_, inner_len, out, out_len);
+}
+
+size_t RealMessageCodec::encode_plain(const uint8_t *dest_mac,
+                                      const MessageHeader &header,
+                                      const uint8_t *frame,
+                                      size_t len,
+                                      uint16_t caps,
+                                      bool retransmission,
+                                      uint8_t *out,
+                                      size_t out_len)
+{
+    const uint8_t *payload = frame + sizeof(MessageHeader);
+    size_t payload_len     = len - sizeof(MessageHeader) - CRC_SIZE;
+
+    if (caps & PeerCapability::COMPACT_HEADER)
+    {
+        // A delta needs the ACK that confirms its reference, so only frames
+        // sent with requires_ack take part
+        PayloadDeltaCodec::Encoded delta;
+        bool use_delta = (caps & PeerCapability::PAYLOAD_DELTA) && header.msg_type == MessageType::DATA &&
+                         header.requires_ack && payload_len > 0 &&
+                         delta_.encode(dest_mac, header.payload_type, payload, payload_len, retransmission,
+                                       delta_buf_, sizeof(delta_buf_), delta);
+        if (use_delta)
+        {
+            payload     = delta_buf_;
+            payload_len = delta.body_len;
+        }
+
+        size_t wire_len = encode_compact(header, payload, payload_len, use_delta ? &delta : nullptr,
+                                         IntegrityCheck::strongest(caps), out, out_len);
+        if (wire_len > 0)
+        {
+            if (use_delta)
+            {
+                delta_.commit(dest_mac, header.payload_type, frame + sizeof(MessageHeader),
+                              len - sizeof(MessageHeader) - CRC_SIZE, header.sequence_number, delta);
+            }
+            return wire_len;
+        }
+        // Very large timestamps can make the compact header longer than the legacy
+        // one; a full-size payload then only fits in the legacy format, and the
+        // delta context stays as it was.
+        if (use_delta)
+        {
+            payload     = frame + sizeof(MessageHeader);
+            payload_len = len - sizeof(MessageHeader) - CRC_SIZE;
+        }
+    }
+
+    return encode_legacy(header, payload, payload_len, out, out_len);
+}
+
+size_t RealMessageCodec::decode_wire(const uint8_t *src_mac,
+                                     const uint8_t *wire,
+                                     size_t len,
+                                     uint8_t *out,
+                                     size_t out_len)
+{
+    if (!src_mac || !wire || !out || len < CRC_SIZE + 1)
+    {
+        Stats::add(Stats::Counter::RX_HEADER_FAILURES);
+        return 0;
+    }
+
+    if (wire[0] == SecureEnvelope::MARKER)
+    {
+        size_t inner_len = cipher_.open(src_mac, wire, len, open_buf_, sizeof(open_buf_));
+        if (inner_len == 0)
+        {
+            Stats::add(Stats::Counter::RX_CRC_FAILURES);
+            return 0;
+        }
+        if (inner_len < CRC_SIZE + 1 || open_buf_[0] == SecureEnvelope::MARKER)
+        {
+            Stats::add(Stats::Counter::RX_HEADER_FAILURES);
+            return 0;
+        }
+        return decode_plain(src_mac, open_buf_, inner_len, out, out_len);
+    }
+
+    // Once a peer has a session key, only the pairing handshake may arrive in the
+    // clear; anything else is a spoofed or downgraded frame. Checked before decoding
+    // so such frames cannot touch delta state either.
+    MessageType type;
+    if (!peek_msg_type(wire, len, type) || (!travels_in_clear(type) && cipher_.has_key(src_mac)))
+    {
+        Stats::add(Stats::Counter::RX_HEADER_FAILURES);
+        return 0;
+    }
+    return decode_plain(src_mac, wire, len, out, out_len);
+}
+
+size_t RealMessageCodec::decode_plain(const uint8_t *src_mac,
+                                      const uint8_t *wire,
+                                      size_t len,
+                                      uint8_t *out,
+                                      size_t out_len)
+{
+    IntegrityCheck::Type check = IntegrityCheck::Type::CRC8;
+    if (is_compact(wire) && !IntegrityCheck::from_version(wire[0] & ~CompactHeader::MARKER_MASK, check))
+    {
+        Stats::add(Stats::Counter::RX_HEADER_FAILURES);
+        return 0;
+    }
+    if (!IntegrityCheck::verify(check, wire, len))
+    {
+        Stats::add(Stats::Counter::RX_CRC_FAILURES);
+        return 0;
+    }
+
+    size_t body_len = len - IntegrityCheck::trailer_size(check);
+    size_t decoded  = is_compact(wire) ? decode_compact(src_mac, wire, body_len, out, out_len)
+                                       : decode_legacy(wire, body_len, out, out_len);
+    if (decoded == 0) Stats::add(Stats::Counter::RX_HEADER_FAILURES);
+    return decoded;
+}
+
+void RealMessageCodec::confirm_delivery(const uint8_t *dest_mac, const uint8_t *frame, size_t len)
+{
+    if (!dest_mac || !frame || len < sizeof(MessageHeader) + CRC_SIZE) return;
+    MessageHeader header;
+    memcpy(&header, frame, sizeof(MessageHeader));
+    if (header.msg_type == MessageType::DATA)
+    {
+        delta_.confirm(dest_mac, header.payload_type, header.sequence_number);
+    }
+}
+
+esp_err_t RealMessageCodec::set_local_mac(const uint8_t *mac)
+{
+    if (!mac) return ESP_ERR_INVALID_ARG;
+    cipher_.set_local_mac(mac);
+    return ESP_OK;
+}
+
+esp_err_t RealMessageCodec::install_session_key(const uint8_t *mac, const uint8_t *key)
+{
+    return cipher_.install_key(mac, key);
+}
+
+void RealMessageCodec::remove_session_key(const uint8_t *mac)
+{
+    if (mac) cipher_.remove_key(mac);
+}
+
+void RealMessageCodec::flush_replay_floors()
+{
+    cipher_.flush_replay_floors();
+}
+
+size_t RealMessageCodec::encode_legacy(const MessageHeader &header,
+                                       const uint8_t *payload,
+                                       size_t payload_len,
+                                       uint8_t *out,
+                                       size_t out_len)
+{
+    size_t total_len = sizeof(LegacyMessageHeader) + payload_len + CRC_SIZE;
+    if (total_len > out_len)
+    {
+        return 0;
+    }
+
+    LegacyMessageHeader legacy;
+    legacy.msg_type        = header.msg_type;
+    legacy.sequence_number = header.sequence_number;
+    legacy.sender_type     = header.sender_type;
+    legacy.sender_node_id  = header.sender_node_id;
+    legacy.payload_type    = header.payload_type;
+    legacy.requires_ack    = header.requires_ack;
+    legacy.dest_node_id    = header.dest_node_id;
+    legacy.timestamp_ms    = header.timestamp_ms;
+
+    memcpy(out, &legacy, sizeof(LegacyMessageHeader));
+    memcpy(out + sizeof(LegacyMessageHeader), payload, payload_len);
+    return IntegrityCheck::append(IntegrityCheck::Type::CRC8, out, total_len - CRC_SIZE, out_len);
+}
+
+size_t RealMessageCodec::encode_compact(const MessageHeader &header,
+                                        const uint8_t *payload,
+                                        size_t payload_len,
+                                        const PayloadDeltaCodec::Encoded *delta,
+                                        IntegrityCheck::Type check,
+                                        uint8_t *out,
+                                        size_t out_len)
+{
+    const size_t trailer_len = IntegrityCheck::trailer_size(check);
+    if (out_len < CompactHeader::MIN_SIZE + trailer_len)
+    {
+        return 0;
+    }
+
+    uint8_t flags = 0;
+    if (header.requires_ack) flags |= CompactHeader::FLAG_REQUIRES_ACK;
+    if (header.piggyback_ack & PIGGYBACK_ACK_VALID) flags |= CompactHeader::FLAG_PIGGYBACK_ACK;
+    if (header.timestamp_ms != 0) flags |= CompactHeader::FLAG_TIMESTAMP;
+    if (header.payload_type != 0) flags |= CompactHeader::FLAG_PAYLOAD_TYPE;
+    if (delta)
+    {
+        flags |= (delta->kind == PayloadDeltaCodec::Kind::DELTA) ? CompactHeader::FLAG_DELTA
+                                                                 : CompactHeader::FLAG_KEYFRAME;
+    }
+
+    size_t pos = 0;
+    out[pos++] = CompactHeader::MARKER | static_cast<uint8_t>(check);
+    out[pos++] = flags;
+    out[pos++] = static_cast<uint8_t>(header.msg_type);
+    out[pos++] = header.sender_type;
+    out[pos++] = header.sender_node_id;
+    out[pos++] = header.dest_node_id;
+    if (flags & CompactHeader::FLAG_PAYLOAD_TYPE)
+    {
+        out[pos++] = header.payload_type;
+    }
+
+    size_t n = put_varint(header.sequence_number, out + pos, out_len - pos);
+    if (n == 0) return 0;
+    pos += n;
+
+    if (flags & CompactHeader::FLAG_PIGGYBACK_ACK)
+    {
+        n = put_varint(header.piggyback_ack & PIGGYBACK_ACK_SEQ_MASK, out + pos, out_len - pos);
+        if (n == 0) return 0;
+        pos += n;
+    }
+
+    if (flags & CompactHeader::FLAG_TIMESTAMP)
+    {
+        n = put_varint(header.timestamp_ms, out + pos, out_len - pos);
+        if (n == 0) return 0;
+        pos += n;
+    }
+
+    size_t delta_header_len = delta ? delta->header_len : 0;
+    if (pos + delta_header_len + payload_len + trailer_len > out_len)
+    {
+        return 0;
+    }
+    if (delta)
+    {
+        memcpy(out + pos, delta->header, delta_header_len);
+        pos += delta_header_len;
+    }
+    memcpy(out + pos, payload, payload_len);
+    pos += payload_len;
+
+    return IntegrityCheck::append(check, out, pos, out_len);
+}
+
+size_t RealMessageCodec::decode_legacy(const uint8_t *wire, size_t len, uint8_t *out, size_t out_len)
+{
+    if (len < sizeof(LegacyMessageHeader))
+    {
+        return 0;
+    }
+
+    // Up to LEGACY_MAX_PAYLOAD_SIZE, which the canonical header leaves no room for
+    // on the air: out must hold MAX_FRAME_SIZE for a full legacy frame
+    size_t payload_len = len - sizeof(LegacyMessageHeader);
+    size_t total_len   = sizeof(MessageHeader) + payload_len + CRC_SIZE;
+    if (payload_len > LEGACY_MAX_PAYLOAD_SIZE || total_len > out_len)
+    {
+        return 0;
+    }
+
+    LegacyMessageHeader legacy;
+    memcpy(&legacy, wire, sizeof(LegacyMessageHeader));
+
+    MessageHeader header;
+    header.msg_type        = legacy.msg_type;
+    header.sequence_number = legacy.sequence_number;
+    header.sender_type     = legacy.sender_type;
+    header.sender_node_id  = legacy.sender_node_id;
+    header.payload_type    = legacy.payload_type;
+    header.requires_ack    = legacy.requires_ack;
+    header.dest_node_id    = legacy.dest_node_id;
+    header.timestamp_ms    = legacy.timestamp_ms;
+    header.piggyback_ack   = 0;
+
+    memcpy(out, &header, sizeof(MessageHeader));
+    memcpy(out + sizeof(MessageHeader), wire + sizeof(LegacyMessageHeader), payload_len);
+    out[total_len - CRC_SIZE] = 0;
+    return total_len;
+}
+
+size_t RealMessageCodec::decode_compact(const uint8_t *src_mac,
+                                        const uint8_t *wire,
+                                        size_t len,
+                                        uint8_t *out,
+                                        size_t out_len)
+{
+    if (len < CompactHeader::MIN_SIZE)
+    {
+        return 0;
+    }
+
+    const size_t end = len;
+    size_t pos       = 1;
+    uint8_t flags    = wire[pos++];
+
+    MessageHeader header = {};
+    header.msg_type       = static_cast<MessageType>(wire[pos++]);
+    header.sender_type    = wire[pos++];
+    header.sender_node_id = wire[pos++];
+    header.dest_node_id   = wire[pos++];
+    header.requires_ack   = (flags & CompactHeader::FLAG_REQUIRES_ACK) != 0;
+    if (flags & CompactHeader::FLAG_PAYLOAD_TYPE)
+    {
+        header.payload_type = wire[pos++];
+    }
+
+    uint64_t value = 0;
+    size_t n       = get_varint(wire + pos, end - pos, value);
+    if (n == 0) return 0;
+    header.sequence_number = static_cast<uint16_t>(value);
+    pos += n;
+
+    if (flags & CompactHeader::FLAG_PIGGYBACK_ACK)
+    {
+        n = get_varint(wire + pos, end - pos, value);
+        if (n == 0) return 0;
+        header.piggyback_ack = PIGGYBACK_ACK_VALID | (value & PIGGYBACK_ACK_SEQ_MASK);
+        pos += n;
+    }
+
+    if (flags & CompactHeader::FLAG_TIMESTAMP)
+    {
+        n = get_varint(wire + pos, end - pos, value);
+        if (n == 0) return 0;
+        header.timestamp_ms = value;
+        pos += n;
+    }
+
+    const uint8_t *delta_header = wire + pos;
+    if (flags & CompactHeader::FLAG_DELTA)
+    {
+        pos += PayloadDeltaCodec::DELTA_HEADER_SIZE;
+    }
+    else if (flags & CompactHeader::FLAG_KEYFRAME)
+    {
+        pos += PayloadDeltaCodec::KEYFRAME_HEADER_SIZE;
+    }
+    if (pos > end) return 0;
+
+    size_t payload_len = end - pos;
+    if (flags & CompactHeader::FLAG_DELTA)
+    {
+        if (out_len < sizeof(MessageHeader) + CRC_SIZE) return 0;
+        payload_len = delta_.apply_delta(src_mac, header.payload_type, delta_header, wire + pos, payload_len,
+                                         out + sizeof(MessageHeader),
+                                         out_len - sizeof(MessageHeader) - CRC_SIZE);
+        // No reference for this delta: drop it, the next keyframe resynchronises
+        if (payload_len == 0) return 0;
+    }
+
+    size_t total_len = sizeof(MessageHeader) + payload_len + CRC_SIZE;
+    if (payload_len > MAX_PAYLOAD_SIZE || total_len > out_len)
+    {
+        return 0;
+    }
+
+    memcpy(out, &header, sizeof(MessageHeader));
+    if (!(flags & CompactHeader::FLAG_DELTA))
+    {
+        memcpy(out + sizeof(MessageHeader), wire + pos, payload_len);
+    }
+    if (flags & CompactHeader::FLAG_KEYFRAME)
+    {
+        delta_.store_keyframe(src_mac, header.payload_type, delta_header[0], wire + pos, payload_len);
+    }
+    out[total_len - CRC_SIZE] = 0;
+    return total_len;
+}
@@ -1,10 +1,33 @@
 #include "message_router.hpp"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "espnow_stats.hpp"
+#include "latency_histogram.hpp"
+#include "message_registry.hpp"
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 
 // static const char *TAG = "MessageRouter";
 
+// Pairing and heartbeats touch storage and the peer table, so they run in the
+// worker; application frames stay in the RX dispatch task
+constexpr RealMessageRouter::BuiltinRoute RealMessageRouter::BUILTIN_ROUTES[] = {
+    {MessageType::PAIR_REQUEST, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_pair_request>},
+    {MessageType::PAIR_RESPONSE, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_pair_response>},
+    {MessageType::HEARTBEAT, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_heartbeat>},
+    {MessageType::HEARTBEAT_RESPONSE, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_heartbeat_response>},
+    {MessageType::HEARTBEAT_BEACON, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_heartbeat_beacon>},
+    {MessageType::DATA, RouteContext::APP, &invoke<&RealMessageRouter::handle_app_frame>},
+    {MessageType::ACK, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_ack>},
+    {MessageType::COMMAND, RouteContext::APP, &invoke<&RealMessageRouter::handle_app_frame>},
+    {MessageType::CHANNEL_SCAN_PROBE, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_scan_probe>},
+    {MessageType::CHANNEL_SCAN_RESPONSE, RouteContext::WORKER, &invoke<&RealMessageRouter::handle_scan_response>},
+    // Followed by the facade, which owns the radio channel
+    {MessageType::CHANNEL_ANNOUNCE, RouteContext::WORKER, nullptr},
+};
+
 RealMessageRouter::RealMessageRouter(IPeerManager &peer_manager,
                                      ITxManager &tx_manager,
                                      IHeartbeatManager &heartbeat_manager,
@@ -16,6 +39,86 @@ RealMessageRouter::RealMessageRouter(IPeerManager &peer_manager,
     , pairing_manager_(pairing_manager)
     , message_codec_(message_codec)
 {
+    mutex_ = xSemaphoreCreateMutex();
+    for (const auto &builtin : BUILTIN_ROUTES) {
+        routes_[static_cast<uint8_t>(builtin.type)] = {builtin.handler, this, builtin.context};
+    }
+}
+
+RealMessageRouter::~RealMessageRouter()
+{
+    if (mutex_) vSemaphoreDelete(mutex_);
+}
+
+bool RealMessageRouter::is_builtin(MessageType type)
+{
+    for (const auto &builtin : BUILTIN_ROUTES) {
+        if (builtin.type == type) return true;
+    }
+    return false;
+}
+
+esp_err_t RealMessageRouter::register_message_type(MessageType type, RouteContext context, MessageHandler handler,
+                                                   void *ctx)
+{
+    if (is_builtin(type)) return ESP_ERR_INVALID_STATE;
+    // Either would be read as a wire marker rather than a legacy header's MessageType
+    uint8_t value = static_cast<uint8_t>(type);
+    if (value == SecureEnvelope::MARKER || (value & CompactHeader::MARKER_MASK) == CompactHeader::MARKER) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    Route &route = routes_[value];
+    switch (context) {
+    case RouteContext::NONE:
+        route = {};
+        return ESP_OK;
+    case RouteContext::INLINE:
+    case RouteContext::WORKER:
+        if (handler == nullptr) return ESP_ERR_INVALID_ARG;
+        route = {handler, ctx, context};
+        return ESP_OK;
+    case RouteContext::APP:
+        if (handler != nullptr) return ESP_ERR_INVALID_ARG;
+        route = {&invoke<&RealMessageRouter::handle_app_frame>, this, context};
+        return ESP_OK;
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t RealMessageRouter::subscribe(const AppSubscription &subscription, int &id)
+{
+    // Everything else is consumed by the stack itself
+    if (route_context(subscription.msg_type) != RouteContext::APP) return ESP_ERR_INVALID_ARG;
+    if ((subscription.handler == nullptr) == (subscription.queue == nullptr) ||
+        subscription.min_size < sizeof(MessageHeader) || subscription.item_size > sizeof(RxPacket::data)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    esp_err_t result = ESP_ERR_NO_MEM;
+    for (size_t i = 0; i < APP_SUBSCRIPTIONS_MAX; i++) {
+        if (!subscriptions_[i].used) {
+            subscriptions_[i].subscription = subscription;
+            subscriptions_[i].used         = true;
+            id                             = static_cast<int>(i);
+            result                         = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(mutex_);
+    return result;
+}
+
+esp_err_t RealMessageRouter::unsubscribe(int id)
+{
+    if (id < 0 || id >= static_cast<int>(APP_SUBSCRIPTIONS_MAX)) return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    esp_err_t result = subscriptions_[id].used ? ESP_OK : ESP_ERR_NOT_FOUND;
+    subscriptions_[id].used = false;
+    xSemaphoreGive(mutex_);
+    return result;
 }
 
 void RealMessageRouter::handle_packet(const RxPacket &packet)
@@ -26,84 +129,198 @@ void RealMessageRouter::handle_packet(const RxPacket &packet)
 
     tx_manager_.notify_link_alive();
 
-    switch (header.msg_type) {
-    case MessageType::PAIR_REQUEST:
-        pairing_manager_.handle_request(packet);
-        break;
-    case MessageType::PAIR_RESPONSE:
-        pairing_manager_.handle_response(packet);
-        break;
-    case MessageType::HEARTBEAT: {
-        auto msg = reinterpret_cast<const HeartbeatMessage *>(packet.data);
-        heartbeat_manager_.handle_request(header.sender_node_id, packet.src_mac, msg->uptime_ms);
-        break;
-    }
-    case MessageType::HEARTBEAT_RESPONSE: {
-        auto resp = reinterpret_cast<const HeartbeatResponse *>(packet.data);
-        heartbeat_manager_.handle_response(header.sender_node_id, resp->wifi_channel);
-        // Note: Channel update should be handled by the observer/facade if needed
-        break;
-    }
-    case MessageType::ACK:
-        tx_manager_.notify_logical_ack();
-        break;
-    case MessageType::CHANNEL_SCAN_PROBE:
-        handle_scan_probe(packet);
-        break;
-    case MessageType::CHANNEL_SCAN_RESPONSE: {
-        uint8_t ch;
-        esp_wifi_get_channel(&ch, nullptr);
-        peer_manager_.add(header.sender_node_id, packet.src_mac, ch, header.sender_type);
-        tx_manager_.notify_hub_found();
-        break;
-    }
-    case MessageType::DATA:
-    case MessageType::COMMAND:
-        if (app_queue_) {
-            xQueueSend(app_queue_, &packet, 0);
+    // Every frame counts as proof of life, not only heartbeats. A beacon is
+    // broadcast, so it only answers the heartbeats it lists.
+    peer_manager_.update_last_seen(header.sender_node_id, esp_timer_get_time() / 1000);
+    peer_manager_.record_rx(header.sender_node_id, packet.rssi);
+    if (header.msg_type != MessageType::HEARTBEAT_BEACON) {
+        heartbeat_manager_.notify_link_activity(header.sender_node_id);
+    }
+
+    if (header.piggyback_ack & PIGGYBACK_ACK_VALID) {
+        tx_manager_.notify_logical_ack(packet.src_mac, header.piggyback_ack & PIGGYBACK_ACK_SEQ_MASK);
+    }
+
+    // A peer that does not sleep between wake slots is listening whenever it
+    // sends, so what was held for it while it was offline can follow any frame
+    if (my_type_ == ReservedTypes::HUB && !is_sleeper(packet.src_mac)) {
+        tx_manager_.release_held(packet.src_mac);
+    }
+
+    const Route &route = routes_[static_cast<uint8_t>(header.msg_type)];
+    if (route.handler) route.handler(packet, header, route.ctx);
+}
+
+bool RealMessageRouter::is_sleeper(const uint8_t *mac)
+{
+    // The hub only agrees WAKE_SLOTS while it has a wake period
+    return peer_manager_.get_capabilities(mac) & PeerCapability::WAKE_SLOTS;
+}
+
+void RealMessageRouter::handle_pair_request(const RxPacket &packet, const MessageHeader &header)
+{
+    pairing_manager_.handle_request(packet);
+}
+
+void RealMessageRouter::handle_pair_response(const RxPacket &packet, const MessageHeader &header)
+{
+    pairing_manager_.handle_response(packet);
+}
+
+void RealMessageRouter::handle_heartbeat(const RxPacket &packet, const MessageHeader &header)
+{
+    HeartbeatMessage msg;
+    if (decode_message(packet, msg) == 0) return;
+    heartbeat_manager_.handle_request(header.sender_node_id, packet.src_mac, msg.uptime_ms,
+                                      packet.timestamp_us / 1000);
+
+    // The heartbeat is a sleeping peer's wake poll: it listens once the response
+    // is out, so what was held for it follows. Other frames from a sleeper may
+    // come while it is about to turn its receiver off.
+    if (my_type_ == ReservedTypes::HUB && is_sleeper(packet.src_mac)) {
+        tx_manager_.release_held(packet.src_mac);
+    }
+}
+
+void RealMessageRouter::handle_heartbeat_response(const RxPacket &packet, const MessageHeader &header)
+{
+    // Fields an older hub did not send read as zero; the ones below are only
+    // acted on when present
+    HeartbeatResponse resp;
+    size_t resp_len = decode_message(packet, resp);
+    if (resp_len == 0) return;
+    if (resp_len >= offsetof(HeartbeatResponse, wake_period_ms)) {
+        heartbeat_manager_.handle_time_sample(resp.origin_time_ms, resp.receive_time_ms, resp.server_time_ms,
+                                              packet.timestamp_us / 1000);
+    }
+    if (resp_len >= offsetof(HeartbeatResponse, pending_frames)) {
+        heartbeat_manager_.handle_wake_slot(resp.wake_period_ms, resp.wake_offset_ms);
+    }
+    if (resp_len == sizeof(HeartbeatResponse)) {
+        heartbeat_manager_.handle_downlink_pending(resp.pending_frames);
+    }
+    heartbeat_manager_.handle_response(header.sender_node_id, resp.wifi_channel, resp.next_heartbeat_ms);
+    // Note: Channel update should be handled by the observer/facade if needed
+}
+
+void RealMessageRouter::handle_ack(const RxPacket &packet, const MessageHeader &header)
+{
+    AckMessage ack;
+    if (decode_message(packet, ack) == 0) return;
+    tx_manager_.notify_logical_ack(packet.src_mac, ack.ack_sequence);
+}
+
+void RealMessageRouter::handle_scan_response(const RxPacket &packet, const MessageHeader &header)
+{
+    // Broadcast to a node the hub cannot unicast to; others scanning may hear it
+    if (header.dest_node_id != my_id_) return;
+    uint8_t ch;
+    esp_wifi_get_channel(&ch, nullptr);
+    peer_manager_.add(header.sender_node_id, packet.src_mac, ch, header.sender_type);
+    tx_manager_.notify_hub_found();
+}
+
+void RealMessageRouter::handle_app_frame(const RxPacket &packet, const MessageHeader &header)
+{
+    if (deliver_to_subscribers(packet, header)) return;
+    if (app_queue_) {
+        if (xQueueSend(app_queue_, &packet, 0) == pdTRUE) {
+            Latency::record(LatencyStage::RX_APP_ENQUEUE, packet.timestamp_us);
+        } else {
+            Stats::add(Stats::Counter::APP_QUEUE_DROPS);
         }
-        break;
-    default:
-        break;
     }
 }
 
-bool RealMessageRouter::should_dispatch_to_worker(MessageType type)
+bool RealMessageRouter::deliver_to_subscribers(const RxPacket &packet, const MessageHeader &header)
 {
-    switch (type) {
-    case MessageType::PAIR_REQUEST:
-    case MessageType::PAIR_RESPONSE:
-    case MessageType::HEARTBEAT:
-    case MessageType::HEARTBEAT_RESPONSE:
-    case MessageType::ACK:
-    case MessageType::CHANNEL_SCAN_PROBE:
-    case MessageType::CHANNEL_SCAN_RESPONSE:
-        return true;
-    default:
-        return false;
+    size_t frame_size = packet.len - CRC_SIZE;
+
+    // Copied out so that handlers may subscribe and unsubscribe
+    AppSubscription matched[APP_SUBSCRIPTIONS_MAX];
+    size_t count = 0;
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    for (const auto &slot : subscriptions_) {
+        const AppSubscription &sub = slot.subscription;
+        if (!slot.used || sub.msg_type != header.msg_type || frame_size < sub.min_size) continue;
+        if (!sub.any_payload_type && sub.payload_type != header.payload_type) continue;
+        if (sub.sender != ReservedIds::BROADCAST && sub.sender != header.sender_node_id) continue;
+        matched[count++] = sub;
+    }
+    xSemaphoreGive(mutex_);
+
+    for (size_t i = 0; i < count; i++) {
+        if (matched[i].handler) {
+            matched[i].handler(packet, matched[i].ctx);
+        } else {
+            deliver_to_queue(matched[i], packet);
+        }
+    }
+    return count > 0;
+}
+
+void RealMessageRouter::deliver_to_queue(const AppSubscription &subscription, const RxPacket &packet)
+{
+    BaseType_t sent;
+    if (subscription.item_size == 0) {
+        sent = xQueueSend(subscription.queue, &packet, 0);
+    } else {
+        uint8_t item[sizeof(RxPacket::data)];
+        size_t copied = std::min(packet.len - CRC_SIZE, subscription.item_size);
+        memcpy(item, packet.data, copied);
+        memset(item + copied, 0, subscription.item_size - copied);
+        sent = xQueueSend(subscription.queue, item, 0);
+    }
+
+    if (sent == pdTRUE) {
+        Latency::record(LatencyStage::RX_APP_ENQUEUE, packet.timestamp_us);
+    } else {
+        Stats::add(Stats::Counter::APP_QUEUE_DROPS);
     }
 }
 
-void RealMessageRouter::handle_scan_probe(const RxPacket &packet)
+void RealMessageRouter::handle_heartbeat_beacon(const RxPacket &packet, const MessageHeader &header)
+{
+    // Beacons are not sealed: only trust the hub this node paired with
+    uint8_t hub_mac[6];
+    if (my_type_ == ReservedTypes::HUB || !peer_manager_.find_mac(ReservedIds::HUB, hub_mac) ||
+        memcmp(hub_mac, packet.src_mac, 6) != 0) {
+        return;
+    }
+
+    HeartbeatBeacon beacon;
+    size_t beacon_len = decode_message(packet, beacon);
+    if (beacon_len == 0) return;
+    size_t count = std::min<size_t>(beacon.acked_count, beacon_len - offsetof(HeartbeatBeacon, acked_ids));
+    for (size_t i = 0; i < count; i++) {
+        if (beacon.acked_ids[i] == my_id_) {
+            heartbeat_manager_.handle_response(header.sender_node_id, beacon.wifi_channel, 0);
+            return;
+        }
+    }
+}
+
+void RealMessageRouter::handle_scan_probe(const RxPacket &packet, const MessageHeader &header)
 {
     if (my_type_ != ReservedTypes::HUB) return;
-    auto header_opt = message_codec_.decode_header(packet.data, packet.len);
-    if (!header_opt) return;
 
+    // esp_now_send() only reaches MACs in the driver's peer table, which a node
+    // that has not paired yet, or was evicted, is not in: answer it by broadcast
     TxPacket tx_packet;
-    memcpy(tx_packet.dest_mac, packet.src_mac, 6);
-    MessageHeader resp;
+    static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t peer_mac[6];
+    bool registered = peer_manager_.find_mac(header.sender_node_id, peer_mac) &&
+                      memcmp(peer_mac, packet.src_mac, 6) == 0;
+    memcpy(tx_packet.dest_mac, registered ? packet.src_mac : broadcast_mac, 6);
+    MessageHeader resp = {};
     resp.msg_type = MessageType::CHANNEL_SCAN_RESPONSE;
     resp.sender_node_id = my_id_;
     resp.sender_type = my_type_;
-    resp.dest_node_id = header_opt->sender_node_id;
+    resp.dest_node_id = header.sender_node_id;
     resp.sequence_number = 0;
 
-    auto encoded = message_codec_.encode(resp, nullptr, 0);
-    if (encoded.empty()) return;
-
-    tx_packet.len = encoded.size();
-    memcpy(tx_packet.data, encoded.data(), tx_packet.len);
+    tx_packet.len = message_codec_.encode(resp, nullptr, 0, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len == 0) return;
     tx_packet.requires_ack = false;
     tx_manager_.queue_packet(tx_packet);
 }
@@ -1,14 +1,20 @@
 #include "pairing_manager.hpp"
 #include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
 #include "esp_timer.h"
+#include "frame_cipher.hpp"
+#include "message_registry.hpp"
+#include <cstddef>
 #include <cstring>
 
 static const char *TAG = "PairingMgr";
 
-RealPairingManager::RealPairingManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec)
+RealPairingManager::RealPairingManager(ITxManager &tx_mgr, IPeerManager &peer_mgr, IMessageCodec &codec, IWiFiHAL &wifi_hal)
     : tx_mgr_(tx_mgr)
     , peer_mgr_(peer_mgr)
     , codec_(codec)
+    , wifi_hal_(wifi_hal)
 {
     mutex_ = xSemaphoreCreateMutex();
 }
@@ -36,11 +42,23 @@ esp_err_t RealPairingManager::deinit()
     return ESP_OK;
 }
 
+void RealPairingManager::set_network_key(const uint8_t *key)
+{
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    has_network_key_ = (key != nullptr);
+    if (key) memcpy(network_key_, key, sizeof(network_key_));
+    else memset(network_key_, 0, sizeof(network_key_));
+    xSemaphoreGive(mutex_);
+}
+
 esp_err_t RealPairingManager::start(uint32_t timeout_ms)
 {
     xSemaphoreTake(mutex_, portMAX_DELAY);
     if (is_active_) { xSemaphoreGive(mutex_); return ESP_ERR_INVALID_STATE; }
 
+    // One nonce per pairing attempt, repeated by the periodic requests
+    esp_fill_random(node_nonce_, sizeof(node_nonce_));
+
     ESP_LOGI(TAG, "Pairing started for %u ms.", (unsigned int)timeout_ms);
 
     timeout_timer_ = xTimerCreate("pair_timeout", pdMS_TO_TICKS(timeout_ms), pdFALSE, this, timeout_cb);
@@ -62,38 +80,77 @@ void RealPairingManager::handle_request(const RxPacket &packet)
     if (!is_active_ || my_type_ != ReservedTypes::HUB) { xSemaphoreGive(mutex_); return; }
     xSemaphoreGive(mutex_);
 
-    auto header_opt = codec_.decode_header(packet.data, packet.len);
-    if (!header_opt) return;
-    const MessageHeader &header = header_opt.value();
-    const PairRequest *req = reinterpret_cast<const PairRequest *>(packet.data);
+    PairRequest req;
+    size_t req_len = decode_message(packet, req);
+    if (req_len == 0) return;
+    const MessageHeader &header = req.header;
 
     ESP_LOGI(TAG, "Pair request from Node ID %d", (int)header.sender_node_id);
 
-    PairResponse resp;
-    resp.header.msg_type = MessageType::PAIR_RESPONSE;
+    PairResponse resp = {};
     resp.header.sender_node_id = my_id_;
     resp.header.sender_type = my_type_;
     resp.header.dest_node_id = header.sender_node_id;
     resp.header.sequence_number = 0;
 
+    // Requests from older firmware end before the capabilities field, which
+    // then reads as PeerCapability::NONE
+    uint16_t peer_caps = req.capabilities & codec_.capabilities();
+    if (req_len < sizeof(PairRequest))
+    {
+        peer_caps &= ~PeerCapability::AEAD;
+    }
+
     if (header.sender_type == ReservedTypes::HUB)
     {
         resp.status = PairStatus::REJECTED_NOT_ALLOWED;
     }
+    else if (has_network_key_ && !(peer_caps & PeerCapability::AEAD))
+    {
+        // Pairing is unauthenticated; accepting it in the clear would let anyone
+        // downgrade a keyed peer
+        ESP_LOGW(TAG, "Node ID %d cannot encrypt, pairing refused", (int)header.sender_node_id);
+        resp.status = PairStatus::REJECTED_NO_AEAD;
+    }
     else
     {
-        peer_mgr_.add(header.sender_node_id, packet.src_mac, 1, header.sender_type, req->heartbeat_interval_ms);
-        resp.status = PairStatus::ACCEPTED;
-        resp.wifi_channel = 1; // Needs real channel
+        uint8_t channel = DEFAULT_WIFI_CHANNEL;
+        wifi_hal_.get_channel(&channel);
+
+        esp_fill_random(resp.session_nonce, sizeof(resp.session_nonce));
+        uint8_t session_key[SecureEnvelope::KEY_SIZE];
+        bool keyed = has_network_key_ &&
+                     derive_session_key(packet.src_mac, req.session_nonce, resp.session_nonce, session_key);
+        resp.capabilities = keyed ? peer_caps : (peer_caps & ~PeerCapability::AEAD);
+
+        if (has_network_key_ && !keyed)
+        {
+            resp.status = PairStatus::REJECTED_NO_AEAD;
+        }
+        else if (!pair_peer(header.sender_node_id, packet.src_mac, channel, header.sender_type,
+                            req.heartbeat_interval_ms, keyed ? session_key : nullptr))
+        {
+            resp.status = keyed ? PairStatus::REJECTED_NO_AEAD : PairStatus::REJECTED_NOT_ALLOWED;
+        }
+        else
+        {
+            peer_mgr_.set_capabilities(header.sender_node_id, resp.capabilities);
+            resp.status = PairStatus::ACCEPTED;
+            resp.wifi_channel = channel;
+        }
+        memset(session_key, 0, sizeof(session_key));
     }
 
+    // A refused node has no peer entry, and esp_now_send() cannot unicast to it
     TxPacket tx_packet;
-    memcpy(tx_packet.dest_mac, packet.src_mac, 6);
-    auto encoded = codec_.encode(resp.header, &resp.status, sizeof(PairResponse) - sizeof(MessageHeader));
-    if (!encoded.empty())
+    const uint8_t broadcast_mac[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint8_t peer_mac[6];
+    bool registered = peer_mgr_.find_mac(header.sender_node_id, peer_mac) &&
+                      memcmp(peer_mac, packet.src_mac, 6) == 0;
+    memcpy(tx_packet.dest_mac, registered ? packet.src_mac : broadcast_mac, 6);
+    tx_packet.len = encode_message(codec_, resp, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len > 0)
     {
-        tx_packet.len = encoded.size();
-        memcpy(tx_packet.data, encoded.data(), tx_packet.len);
         tx_packet.requires_ack = false;
         tx_mgr_.queue_packet(tx_packet);
     }
@@ -104,45 +161,111 @@ void RealPairingManager::handle_response(const RxPacket &packet)
     xSemaphoreTake(mutex_, portMAX_DELAY);
     if (!is_active_ || my_type_ == ReservedTypes::HUB) { xSemaphoreGive(mutex_); return; }
 
-    auto header_opt = codec_.decode_header(packet.data, packet.len);
-    if (!header_opt) { xSemaphoreGive(mutex_); return; }
+    PairResponse resp;
+    size_t resp_len = decode_message(packet, resp);
+    if (resp_len == 0) { xSemaphoreGive(mutex_); return; }
 
-    const PairResponse *resp = reinterpret_cast<const PairResponse *>(packet.data);
-    if (resp->status == PairStatus::ACCEPTED)
+    uint16_t agreed_caps = resp.capabilities & codec_.capabilities();
+    if (resp_len < sizeof(PairResponse))
+    {
+        agreed_caps &= ~PeerCapability::AEAD;
+    }
+    if (resp.status == PairStatus::ACCEPTED && has_network_key_ && !(agreed_caps & PeerCapability::AEAD))
+    {
+        // Keep pairing; a cleartext response must not downgrade the link
+        ESP_LOGW(TAG, "Ignoring pair response without encryption.");
+    }
+    else if (resp.status == PairStatus::ACCEPTED)
     {
-        ESP_LOGI(TAG, "Pairing accepted by Hub.");
-        peer_mgr_.add(header_opt->sender_node_id, packet.src_mac, resp->wifi_channel, header_opt->sender_type);
-        is_active_ = false;
-        if (periodic_timer_) { xTimerStop(periodic_timer_, 0); }
-        if (timeout_timer_) { xTimerStop(timeout_timer_, 0); }
+        const MessageHeader &header = resp.header;
+        uint8_t session_key[SecureEnvelope::KEY_SIZE];
+        bool keyed = has_network_key_ && derive_session_key(packet.src_mac, node_nonce_, resp.session_nonce, session_key);
+        if (!keyed)
+        {
+            agreed_caps &= ~PeerCapability::AEAD;
+        }
+
+        if ((has_network_key_ && !keyed) ||
+            !pair_peer(header.sender_node_id, packet.src_mac, resp.wifi_channel, header.sender_type, 0,
+                       keyed ? session_key : nullptr))
+        {
+            // Keep pairing; the next response may get through
+            ESP_LOGW(TAG, "Pairing accepted by Hub, but no session key was agreed.");
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Pairing accepted by Hub.");
+            peer_mgr_.set_capabilities(header.sender_node_id, agreed_caps);
+            is_active_ = false;
+            if (periodic_timer_) { xTimerStop(periodic_timer_, 0); }
+            if (timeout_timer_) { xTimerStop(timeout_timer_, 0); }
+        }
+        memset(session_key, 0, sizeof(session_key));
     }
     xSemaphoreGive(mutex_);
 }
 
 void RealPairingManager::send_pair_request()
 {
-    PairRequest req;
-    req.header.msg_type = MessageType::PAIR_REQUEST;
+    PairRequest req = {};
     req.header.sender_node_id = my_id_;
     req.header.sender_type = my_type_;
     req.header.dest_node_id = ReservedIds::HUB;
     req.header.sequence_number = 0;
     req.heartbeat_interval_ms = 60000;
+    req.capabilities = codec_.capabilities();
+    memcpy(req.session_nonce, node_nonce_, sizeof(req.session_nonce));
 
     TxPacket tx_packet;
     const uint8_t broadcast_mac[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
     memcpy(tx_packet.dest_mac, broadcast_mac, 6);
 
-    auto encoded = codec_.encode(req.header, &req.firmware_version, sizeof(PairRequest) - sizeof(MessageHeader));
-    if (!encoded.empty())
+    tx_packet.len = encode_message(codec_, req, tx_packet.data, sizeof(tx_packet.data));
+    if (tx_packet.len > 0)
     {
-        tx_packet.len = encoded.size();
-        memcpy(tx_packet.data, encoded.data(), tx_packet.len);
         tx_packet.requires_ack = false;
         tx_mgr_.queue_packet(tx_packet);
     }
 }
 
+// Derives the session key from the network key, before anything about the
+// peer is changed: pairing frames are not authenticated, so one whose key
+// cannot be agreed must never take a key away.
+bool RealPairingManager::derive_session_key(const uint8_t *peer_mac,
+                                            const uint8_t *node_nonce,
+                                            const uint8_t *hub_nonce,
+                                            uint8_t *session_key)
+{
+    uint8_t own_mac[6];
+    if (esp_read_mac(own_mac, ESP_MAC_WIFI_STA) != ESP_OK) return false;
+
+    const uint8_t *hub_mac  = (my_type_ == ReservedTypes::HUB) ? own_mac : peer_mac;
+    const uint8_t *node_mac = (my_type_ == ReservedTypes::HUB) ? peer_mac : own_mac;
+    return FrameCipher::derive_session_key(network_key_, hub_mac, node_mac, node_nonce, hub_nonce, session_key) == ESP_OK;
+}
+
+// Adds or updates the peer and installs its session key, if it has one. A peer
+// whose key does not go in is removed again rather than left sendable in the clear.
+bool RealPairingManager::pair_peer(NodeId id,
+                                   const uint8_t *mac,
+                                   uint8_t channel,
+                                   NodeType type,
+                                   uint32_t heartbeat_interval_ms,
+                                   const uint8_t *session_key)
+{
+    if (peer_mgr_.add(id, mac, channel, type, heartbeat_interval_ms) != ESP_OK) return false;
+    if (session_key != nullptr &&
+        (peer_mgr_.set_session_key(id, session_key) != ESP_OK || codec_.install_session_key(mac, session_key) != ESP_OK))
+    {
+        codec_.remove_session_key(mac);
+        peer_mgr_.remove(id);
+        return false;
+    }
+    // The frame that paired it came before the entry existed, so did not count
+    peer_mgr_.update_last_seen(id, esp_timer_get_time() / 1000);
+    return true;
+}
+
 void RealPairingManager::timeout_cb(TimerHandle_t xTimer)
 {
     static_cast<RealPairingManager *>(pvTimerGetTimerID(xTimer))->on_timeout();
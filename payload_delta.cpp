@@ -0,0 +1,226 @@
+#include "payload_delta.hpp"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Body layout: repeated [zero_run][literal_count][literal XOR bytes...]
+size_t encode_xor_runs(const uint8_t *ref, const uint8_t *payload, size_t len, uint8_t *out, size_t out_len)
+{
+    size_t i   = 0;
+    size_t pos = 0;
+    while (i < len) {
+        uint8_t run = 0;
+        while (i < len && run < 255 && ref[i] == payload[i]) {
+            ++run;
+            ++i;
+        }
+
+        size_t lit_start = i;
+        uint8_t lit      = 0;
+        while (i < len && lit < 255 && ref[i] != payload[i]) {
+            ++lit;
+            ++i;
+        }
+
+        if (pos + 2 + lit > out_len) return 0;
+        out[pos++] = run;
+        out[pos++] = lit;
+        for (size_t k = 0; k < lit; ++k) {
+            out[pos++] = ref[lit_start + k] ^ payload[lit_start + k];
+        }
+    }
+    return pos;
+}
+
+size_t decode_xor_runs(const uint8_t *ref, size_t len, const uint8_t *body, size_t body_len, uint8_t *out)
+{
+    size_t i   = 0;
+    size_t pos = 0;
+    while (pos < body_len) {
+        if (pos + 2 > body_len) return 0;
+        uint8_t run = body[pos++];
+        uint8_t lit = body[pos++];
+        if (i + run + lit > len || pos + lit > body_len) return 0;
+
+        memcpy(out + i, ref + i, run);
+        i += run;
+        for (uint8_t k = 0; k < lit; ++k, ++i) {
+            out[i] = ref[i] ^ body[pos++];
+        }
+    }
+    return (i == len) ? len : 0;
+}
+
+} // namespace
+
+bool PayloadDeltaCodec::encode(const uint8_t *mac,
+                               PayloadType type,
+                               const uint8_t *payload,
+                               size_t len,
+                               bool force_keyframe,
+                               uint8_t *body,
+                               size_t body_len,
+                               Encoded &result)
+{
+    Context *ctx = find(tx_, mac, type);
+
+    bool keyframe = force_keyframe || !ctx || !ctx->confirmed || ctx->len != len ||
+                    ctx->frames_since_keyframe + 1 >= KEYFRAME_INTERVAL;
+    if (!keyframe && len > DELTA_HEADER_SIZE) {
+        // Only worth it if the delta beats the keyframe it would replace
+        size_t limit = std::min(body_len, len + KEYFRAME_HEADER_SIZE - DELTA_HEADER_SIZE - 1);
+        size_t n     = encode_xor_runs(ctx->data, payload, len, body, limit);
+        if (n > 0) {
+            result.kind       = Kind::DELTA;
+            result.header[0]  = ctx->generation;
+            result.header[1]  = ctx->ref_crc;
+            result.header_len = DELTA_HEADER_SIZE;
+            result.body_len   = n;
+            return true;
+        }
+    }
+
+    if (len > body_len) return false;
+
+    // Resending the reference keeps its generation, so a copy the receiver
+    // already holds stays valid whichever of the two frames it was acked for.
+    // A random starting generation keeps a rebooted sender from matching the
+    // stale reference a receiver may still hold for it.
+    uint8_t generation;
+    if (!ctx) {
+        generation = static_cast<uint8_t>(esp_random());
+    } else if (holds(*ctx, payload, len)) {
+        generation = ctx->generation;
+    } else {
+        generation = ctx->generation + 1;
+    }
+
+    memcpy(body, payload, len);
+    result.kind       = Kind::KEYFRAME;
+    result.header[0]  = generation;
+    result.header_len = KEYFRAME_HEADER_SIZE;
+    result.body_len   = len;
+    return true;
+}
+
+void PayloadDeltaCodec::commit(const uint8_t *mac,
+                               PayloadType type,
+                               const uint8_t *payload,
+                               size_t len,
+                               uint16_t sequence,
+                               const Encoded &encoded)
+{
+    Context *ctx = find(tx_, mac, type);
+    if (encoded.kind == Kind::DELTA) {
+        if (!ctx) return;
+        ctx->frames_since_keyframe++;
+        ctx->last_used = ++tx_.use_counter;
+        return;
+    }
+
+    if (!ctx) {
+        ctx = claim(tx_, mac, type);
+    }
+    if (ctx->generation == encoded.header[0] && holds(*ctx, payload, len)) {
+        ctx->frames_since_keyframe = 0;
+    } else {
+        set_reference(*ctx, encoded.header[0], payload, len);
+        ctx->confirmed = false;
+    }
+    ctx->ref_sequence = sequence;
+    ctx->last_used    = ++tx_.use_counter;
+}
+
+void PayloadDeltaCodec::confirm(const uint8_t *mac, PayloadType type, uint16_t sequence)
+{
+    Context *ctx = find(tx_, mac, type);
+    if (ctx && ctx->ref_sequence == sequence) ctx->confirmed = true;
+}
+
+void PayloadDeltaCodec::store_keyframe(const uint8_t *mac,
+                                       PayloadType type,
+                                       uint8_t generation,
+                                       const uint8_t *payload,
+                                       size_t len)
+{
+    if (len > MAX_PAYLOAD_SIZE) return;
+
+    Context *ctx = find(rx_, mac, type);
+    if (!ctx) {
+        ctx = claim(rx_, mac, type);
+    }
+    set_reference(*ctx, generation, payload, len);
+    ctx->last_used = ++rx_.use_counter;
+}
+
+size_t PayloadDeltaCodec::apply_delta(const uint8_t *mac,
+                                      PayloadType type,
+                                      const uint8_t *header,
+                                      const uint8_t *body,
+                                      size_t body_len,
+                                      uint8_t *out,
+                                      size_t out_len)
+{
+    Context *ctx = find(rx_, mac, type);
+    if (!ctx || ctx->generation != header[0] || ctx->ref_crc != header[1] || ctx->len > out_len) {
+        return 0;
+    }
+
+    ctx->last_used = ++rx_.use_counter;
+    return decode_xor_runs(ctx->data, ctx->len, body, body_len, out);
+}
+
+void PayloadDeltaCodec::reset()
+{
+    tx_ = {};
+    rx_ = {};
+}
+
+PayloadDeltaCodec::Context *PayloadDeltaCodec::find(ContextTable &table, const uint8_t *mac, PayloadType type)
+{
+    for (auto &ctx : table.slots) {
+        if (ctx.in_use && ctx.type == type && memcmp(ctx.mac, mac, 6) == 0) {
+            return &ctx;
+        }
+    }
+    return nullptr;
+}
+
+PayloadDeltaCodec::Context *PayloadDeltaCodec::claim(ContextTable &table, const uint8_t *mac, PayloadType type)
+{
+    Context *victim = &table.slots[0];
+    for (auto &ctx : table.slots) {
+        if (!ctx.in_use) {
+            victim = &ctx;
+            break;
+        }
+        if (ctx.last_used < victim->last_used) {
+            victim = &ctx;
+        }
+    }
+
+    victim->in_use = true;
+    memcpy(victim->mac, mac, 6);
+    victim->type       = type;
+    victim->generation = static_cast<uint8_t>(esp_random());
+    victim->len        = 0;
+    victim->confirmed  = false;
+    return victim;
+}
+
+void PayloadDeltaCodec::set_reference(Context &ctx, uint8_t generation, const uint8_t *payload, size_t len)
+{
+    ctx.generation            = generation;
+    ctx.len                   = len;
+    ctx.frames_since_keyframe = 0;
+    memcpy(ctx.data, payload, len);
+    ctx.ref_crc = esp_rom_crc8_le(0, ctx.data, len);
+}
+
+bool PayloadDeltaCodec::holds(const Context &ctx, const uint8_t *payload, size_t len)
+{
+    return ctx.len == len && memcmp(ctx.data, payload, len) == 0;
+}
@@ -2,6 +2,7 @@
 #include "esp_log.h"
 #include "esp_now.h"
 #include "esp_wifi.h"
+#include "espnow_stats.hpp"
 #include <algorithm>
 #include <cstring>
 
@@ -68,10 +69,21 @@ esp_err_t RealPeerManager::add(NodeId id,
         }
 
         if (result == ESP_OK) {
+            if (mac_changed) {
+                // A different device took over this ID; its protocol support is unknown
+                it->capabilities = PeerCapability::NONE;
+                erase_session_key(id);
+            }
             memcpy(it->mac, mac, 6);
             it->type                  = type;
             it->channel               = channel;
             it->heartbeat_interval_ms = heartbeat_interval_ms;
+            if (heartbeat_interval_ms == 0) {
+                liveness_.cancel(id);
+            }
+            else if (it->online) {
+                liveness_.schedule(id, it->last_seen_ms + offline_timeout_ms(*it));
+            }
             // Move to front (LRU)
             PeerInfo updated = *it;
             peers_.erase(it);
@@ -84,7 +96,11 @@ esp_err_t RealPeerManager::add(NodeId id,
             ESP_LOGW(TAG, "Peer list is full. Removing the oldest peer.");
             const PeerInfo &oldest = peers_.back();
             esp_now_del_peer(oldest.mac);
+            erase_session_key(oldest.node_id);
+            liveness_.cancel(oldest.node_id);
             peers_.pop_back();
+            Stats::add(Stats::Counter::PEERS_EVICTED);
+            Stats::add(Stats::Counter::PEERS_REMOVED);
         }
 
         esp_now_peer_info_t peer_info = {};
@@ -103,7 +119,11 @@ esp_err_t RealPeerManager::add(NodeId id,
             new_peer.last_seen_ms          = 0; // Will be updated by caller if needed
             new_peer.paired                = true;
             new_peer.heartbeat_interval_ms = heartbeat_interval_ms;
+            new_peer.capabilities          = PeerCapability::NONE;
+            new_peer.online                = false;
+            new_peer.link                  = {};
             peers_.insert(peers_.begin(), new_peer);
+            Stats::add(Stats::Counter::PEERS_ADDED);
             ESP_LOGI(TAG, "New peer added: ID %d", (int)id);
         }
     }
@@ -132,6 +152,9 @@ esp_err_t RealPeerManager::remove(NodeId id)
     esp_err_t result     = esp_now_del_peer(it->mac);
     uint8_t last_channel = it->channel;
     peers_.erase(it);
+    erase_session_key(id);
+    liveness_.cancel(id);
+    Stats::add(Stats::Counter::PEERS_REMOVED);
 
     save_to_storage(last_channel);
 
@@ -159,63 +182,366 @@ bool RealPeerManager::find_mac(NodeId id, uint8_t *mac)
     return found;
 }
 
-std::vector<PeerInfo> RealPeerManager::get_all()
+size_t RealPeerManager::get_all(PeerInfo *out, size_t max)
 {
     if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
-        return {};
+        return 0;
     }
-    std::vector<PeerInfo> copy = peers_;
+    size_t count = std::min(max, peers_.size());
+    std::copy_n(peers_.begin(), count, out);
     xSemaphoreGive(mutex_);
-    return copy;
+    return count;
 }
 
-std::vector<NodeId> RealPeerManager::get_offline(uint64_t now_ms)
+size_t RealPeerManager::get_offline(uint64_t now_ms, NodeId *out, size_t max)
 {
     if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
-        return {};
+        return 0;
     }
 
-    std::vector<NodeId> offline;
+    size_t count = 0;
     for (const auto &p : peers_) {
+        if (count == max) break;
         if (p.heartbeat_interval_ms > 0) {
-            uint32_t timeout = p.heartbeat_interval_ms * HEARTBEAT_OFFLINE_MULTIPLIER;
+            uint32_t timeout = offline_timeout_ms(p);
             if (p.last_seen_ms > 0 && (now_ms - p.last_seen_ms > timeout)) {
-                offline.push_back(p.node_id);
+                out[count++] = p.node_id;
             }
         }
     }
 
     xSemaphoreGive(mutex_);
-    return offline;
+    return count;
+}
+
+void RealPeerManager::for_each(PeerVisitor visit, void *ctx)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+    for (const auto &p : peers_) visit(p, ctx);
+    xSemaphoreGive(mutex_);
 }
 
 void RealPeerManager::update_last_seen(NodeId id, uint64_t now_ms)
 {
-    if (xSemaphoreTake(mutex_, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+
+    bool came_online = false;
+    for (auto &p : peers_) {
+        if (p.node_id == id) {
+            p.last_seen_ms = now_ms;
+            if (p.heartbeat_interval_ms > 0) {
+                liveness_.schedule(id, now_ms + offline_timeout_ms(p));
+            }
+            came_online = !p.online;
+            p.online    = true;
+            break;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    if (came_online) post_event(PeerEventType::ONLINE, id, now_ms);
+}
+
+void RealPeerManager::check_liveness(uint64_t now_ms)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+
+    NodeId expired[MAX_PEERS];
+    size_t count = 0;
+    liveness_.advance(now_ms, [&](NodeId id) {
         for (auto &p : peers_) {
             if (p.node_id == id) {
-                p.last_seen_ms = now_ms;
+                if (p.online) expired[count++] = id;
+                p.online = false;
                 break;
             }
         }
+    });
+
+    xSemaphoreGive(mutex_);
+    for (size_t i = 0; i < count; i++) {
+        post_event(PeerEventType::OFFLINE, expired[i], now_ms);
+    }
+}
+
+uint32_t RealPeerManager::offline_timeout_ms(uint32_t heartbeat_interval_ms)
+{
+    return static_cast<uint32_t>(static_cast<uint64_t>(heartbeat_interval_ms) * HEARTBEAT_OFFLINE_NUM /
+                                 HEARTBEAT_OFFLINE_DEN);
+}
+
+uint32_t RealPeerManager::offline_timeout_ms(const PeerInfo &peer) const
+{
+    // A sleeper heartbeats at its wake slot, which may come round less often
+    // than its own interval
+    uint32_t interval = peer.heartbeat_interval_ms;
+    if (peer.capabilities & PeerCapability::WAKE_SLOTS) {
+        interval = std::max(interval, wake_period_ms_);
+    }
+    return offline_timeout_ms(interval);
+}
+
+void RealPeerManager::set_wake_period(uint32_t period_ms)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+    wake_period_ms_ = period_ms;
+    for (const auto &p : peers_) {
+        if (p.online && p.heartbeat_interval_ms > 0) {
+            liveness_.schedule(p.node_id, p.last_seen_ms + offline_timeout_ms(p));
+        }
+    }
+    xSemaphoreGive(mutex_);
+}
+
+void RealPeerManager::post_event(PeerEventType type, NodeId id, uint64_t now_ms)
+{
+    if (event_queue_ == nullptr) return;
+
+    PeerEvent event = {type, id, now_ms};
+    if (xQueueSend(event_queue_, &event, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Event queue full, dropped %s event for Node ID %d",
+                 type == PeerEventType::ONLINE ? "online" : "offline", (int)id);
+    }
+}
+
+esp_err_t RealPeerManager::set_capabilities(NodeId id, uint16_t capabilities)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    auto it = std::find_if(peers_.begin(), peers_.end(), [id](const PeerInfo &p) { return p.node_id == id; });
+    if (it == peers_.end()) {
         xSemaphoreGive(mutex_);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (it->capabilities != capabilities) {
+        it->capabilities = capabilities;
+        if (it->online && it->heartbeat_interval_ms > 0) {
+            liveness_.schedule(id, it->last_seen_ms + offline_timeout_ms(*it));
+        }
+        save_to_storage(it->channel);
     }
+
+    xSemaphoreGive(mutex_);
+    return ESP_OK;
 }
 
-esp_err_t RealPeerManager::load_from_storage(uint8_t &wifi_channel)
+uint16_t RealPeerManager::get_capabilities(const uint8_t *mac)
+{
+    if (mac == nullptr || xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return PeerCapability::NONE;
+    }
+
+    uint16_t capabilities = PeerCapability::NONE;
+    for (const auto &p : peers_) {
+        if (memcmp(p.mac, mac, 6) == 0) {
+            capabilities = p.capabilities;
+            break;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    return capabilities;
+}
+
+bool RealPeerManager::is_offline(const uint8_t *mac)
+{
+    if (mac == nullptr || xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+
+    // Only check_liveness() clears online on a peer that has been seen
+    bool offline = false;
+    for (const auto &p : peers_) {
+        if (memcmp(p.mac, mac, 6) == 0) {
+            offline = !p.online && p.last_seen_ms > 0 && p.heartbeat_interval_ms > 0;
+            break;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    return offline;
+}
+
+void RealPeerManager::record_rx(NodeId id, int8_t rssi)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+
+    for (auto &p : peers_) {
+        if (p.node_id == id) {
+            p.link.on_rx(rssi);
+            break;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+}
+
+void RealPeerManager::record_delivery(const uint8_t *mac, bool delivered, uint8_t retries, uint32_t rtt_ms)
 {
-    std::vector<PersistentPeer> stored_peers;
-    esp_err_t err = storage_.load(wifi_channel, stored_peers);
-    if (err == ESP_OK) {
-        if (xSemaphoreTake(mutex_, portMAX_DELAY) == pdTRUE) {
-            peers_.clear();
-            for (const auto &sp : stored_peers) {
-                peers_.push_back(persistent_to_info(sp));
+    if (mac == nullptr || xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return;
+    }
+
+    for (auto &p : peers_) {
+        if (memcmp(p.mac, mac, 6) == 0) {
+            if (delivered) {
+                p.link.on_delivered(retries, rtt_ms);
+            }
+            else {
+                p.link.on_lost();
             }
-            xSemaphoreGive(mutex_);
+            break;
         }
     }
-    return err;
+
+    xSemaphoreGive(mutex_);
+}
+
+uint32_t RealPeerManager::ack_timeout_ms(const uint8_t *mac, uint8_t retries)
+{
+    LinkMetrics unknown = {};
+    if (mac == nullptr || xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return unknown.ack_timeout_ms(retries);
+    }
+
+    uint32_t timeout = unknown.ack_timeout_ms(retries);
+    for (const auto &p : peers_) {
+        if (memcmp(p.mac, mac, 6) == 0) {
+            timeout = p.link.ack_timeout_ms(retries);
+            break;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    return timeout;
+}
+
+esp_err_t RealPeerManager::set_session_key(NodeId id, const uint8_t *key)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    auto it = std::find_if(peers_.begin(), peers_.end(), [id](const PeerInfo &p) { return p.node_id == id; });
+    if (it == peers_.end()) {
+        xSemaphoreGive(mutex_);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    erase_session_key(id);
+    if (key) {
+        SessionKey entry;
+        entry.id = id;
+        memcpy(entry.key, key, sizeof(entry.key));
+        session_keys_.push_back(entry);
+    }
+    save_to_storage(it->channel);
+
+    xSemaphoreGive(mutex_);
+    return ESP_OK;
+}
+
+bool RealPeerManager::get_session_key(NodeId id, uint8_t *key)
+{
+    if (key == nullptr || xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+
+    bool found = false;
+    for (const auto &entry : session_keys_) {
+        if (entry.id == id) {
+            memcpy(key, entry.key, sizeof(entry.key));
+            found = true;
+            break;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    return found;
+}
+
+esp_err_t RealPeerManager::set_channel_all(uint8_t channel)
+{
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    esp_err_t result = ESP_OK;
+    for (auto &p : peers_) {
+        if (p.channel == channel) continue;
+
+        esp_now_peer_info_t peer_info = {};
+        memcpy(peer_info.peer_addr, p.mac, 6);
+        peer_info.channel = channel;
+        peer_info.ifidx   = WIFI_IF_STA;
+        peer_info.encrypt = false;
+        esp_err_t err     = esp_now_mod_peer(&peer_info);
+        if (err == ESP_OK) {
+            p.channel = channel;
+        }
+        else {
+            ESP_LOGW(TAG, "Failed to move Node ID %d to channel %d: %s", (int)p.node_id, channel, esp_err_to_name(err));
+            result = err;
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    return result;
+}
+
+void RealPeerManager::erase_session_key(NodeId id)
+{
+    for (auto it = session_keys_.begin(); it != session_keys_.end(); ++it) {
+        if (it->id == id) {
+            memset(it->key, 0, sizeof(it->key));
+            session_keys_.erase(it);
+            return;
+        }
+    }
+}
+
+esp_err_t RealPeerManager::load_from_storage(uint8_t &wifi_channel)
+{
+    // Read before taking the lock: NVS access can take milliseconds, and RX
+    // and TX look peers up under it
+    PersistentPeer loaded[MAX_PEERS];
+    size_t count  = 0;
+    esp_err_t err = storage_.load(wifi_channel, loaded, MAX_PEERS, count);
+    if (err != ESP_OK) return err;
+
+    if (xSemaphoreTake(mutex_, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    peers_.clear();
+    session_keys_.clear();
+    liveness_.clear();
+    for (size_t i = 0; i < count; i++) {
+        const PersistentPeer &sp = loaded[i];
+        peers_.push_back(persistent_to_info(sp));
+        if (sp.has_session_key) {
+            SessionKey entry;
+            entry.id = sp.node_id;
+            memcpy(entry.key, sp.session_key, sizeof(entry.key));
+            session_keys_.push_back(entry);
+        }
+    }
+
+    xSemaphoreGive(mutex_);
+    return ESP_OK;
 }
 
 void RealPeerManager::persist(uint8_t wifi_channel)
@@ -228,11 +554,11 @@ void RealPeerManager::persist(uint8_t wifi_channel)
 
 void RealPeerManager::save_to_storage(uint8_t wifi_channel)
 {
-    std::vector<PersistentPeer> to_save;
+    size_t count = 0;
     for (const auto &p : peers_) {
-        to_save.push_back(info_to_persistent(p));
+        persist_buf_[count++] = info_to_persistent(p);
     }
-    esp_err_t err = storage_.save(wifi_channel, to_save, true);
+    esp_err_t err = storage_.save(wifi_channel, persist_buf_, count, true);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to save peers to storage: %s", esp_err_to_name(err));
     }
@@ -240,13 +566,21 @@ void RealPeerManager::save_to_storage(uint8_t wifi_channel)
 
 PersistentPeer RealPeerManager::info_to_persistent(const PeerInfo &info)
 {
-    PersistentPeer p;
+    PersistentPeer p = {};
     memcpy(p.mac, info.mac, 6);
     p.type                  = info.type;
     p.node_id               = info.node_id;
     p.channel               = info.channel;
     p.paired                = info.paired;
     p.heartbeat_interval_ms = info.heartbeat_interval_ms;
+    p.capabilities          = info.capabilities;
+    for (const auto &entry : session_keys_) {
+        if (entry.id == info.node_id) {
+            p.has_session_key = true;
+            memcpy(p.session_key, entry.key, sizeof(p.session_key));
+            break;
+        }
+    }
     return p;
 }
 
@@ -260,5 +594,8 @@ PeerInfo RealPeerManager::persistent_to_info(const PersistentPeer &persistent)
     info.last_seen_ms          = 0;
     info.paired                = persistent.paired;
     info.heartbeat_interval_ms = persistent.heartbeat_interval_ms;
+    info.capabilities          = persistent.capabilities;
+    info.online                = false;
+    info.link                  = {};
     return info;
 }
@@ -0,0 +1,90 @@
+#include "time_sync.hpp"
+
+bool TimeSync::add_sample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4)
+{
+    if (t4 < t1 || t3 < t2 || t4 - t1 < t3 - t2) return false;
+
+    Sample sample;
+    sample.local_ms  = t4;
+    sample.offset_us = ((static_cast<int64_t>(t2 - t1) + static_cast<int64_t>(t3) - static_cast<int64_t>(t4)) * 1000) / 2;
+    sample.delay_ms  = static_cast<uint32_t>((t4 - t1) - (t3 - t2));
+
+    // A jump far beyond what the delay explains means the hub clock restarted:
+    // everything learnt so far is stale
+    if (synchronized_) {
+        int64_t error_us = sample.offset_us - offset_us(sample.local_ms);
+        int64_t bound_us = static_cast<int64_t>(STEP_THRESHOLD_MS) * 1000 + sample.delay_ms * 500;
+        if (error_us > bound_us || error_us < -bound_us) reset();
+    }
+
+    samples_[next_] = sample;
+    next_           = (next_ + 1) % SAMPLES;
+    if (count_ < SAMPLES) count_++;
+
+    const Sample *best = &samples_[0];
+    for (size_t i = 1; i < count_; i++) {
+        if (samples_[i].delay_ms < best->delay_ms ||
+            (samples_[i].delay_ms == best->delay_ms && samples_[i].local_ms > best->local_ms)) {
+            best = &samples_[i];
+        }
+    }
+
+    if (!synchronized_) {
+        anchor_       = *best;
+        synchronized_ = true;
+        return true;
+    }
+
+    // Like NTP, never step back to a sample older than the one in use
+    if (best->local_ms <= anchor_.local_ms) return true;
+
+    uint64_t span_ms = best->local_ms - anchor_.local_ms;
+    if (span_ms >= MIN_DRIFT_SPAN_MS) {
+        int64_t measured = (best->offset_us - anchor_.offset_us) * 1000 / static_cast<int64_t>(span_ms);
+        // Slopes no oscillator could produce are noise; keep the previous estimate
+        if (measured <= MAX_DRIFT_PPM && measured >= -MAX_DRIFT_PPM) {
+            if (drift_valid_) {
+                drift_ppm_ += static_cast<int32_t>((measured - drift_ppm_) / 4);
+            }
+            else {
+                drift_ppm_   = static_cast<int32_t>(measured);
+                drift_valid_ = true;
+            }
+        }
+        anchor_ = *best;
+    }
+    else if (best->delay_ms < anchor_.delay_ms) {
+        anchor_ = *best;
+    }
+    return true;
+}
+
+int64_t TimeSync::offset_us(uint64_t local_ms) const
+{
+    int64_t elapsed_ms = static_cast<int64_t>(local_ms - anchor_.local_ms);
+    return anchor_.offset_us + elapsed_ms * drift_ppm_ / 1000;
+}
+
+uint64_t TimeSync::to_hub_time(uint64_t local_ms) const
+{
+    if (!synchronized_) return local_ms;
+    return static_cast<uint64_t>(static_cast<int64_t>(local_ms) + offset_us(local_ms) / 1000);
+}
+
+uint64_t TimeSync::to_local_time(uint64_t hub_ms) const
+{
+    if (!synchronized_) return hub_ms;
+    // The offset changes by under a millisecond between the two clocks' readings
+    uint64_t guess = static_cast<uint64_t>(static_cast<int64_t>(hub_ms) - anchor_.offset_us / 1000);
+    return static_cast<uint64_t>(static_cast<int64_t>(hub_ms) - offset_us(guess) / 1000);
+}
+
+void TimeSync::reset()
+{
+    count_        = 0;
+    next_         = 0;
+    synchronized_ = false;
+    anchor_       = {};
+    drift_ppm_    = 0;
+    drift_valid_  = false;
+}
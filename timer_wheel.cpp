@@ -0,0 +1,75 @@
+#include "timer_wheel.hpp"
+#include <cstring>
+
+TimerWheel::TimerWheel(uint32_t tick_ms)
+    : tick_ms_(tick_ms > 0 ? tick_ms : 1)
+{
+    clear();
+}
+
+bool TimerWheel::schedule(NodeId id, uint64_t deadline_ms)
+{
+    uint8_t i = index_[id];
+    if (i != NIL) {
+        unlink(i);
+    }
+    else {
+        if (free_ == NIL) return false;
+        i          = free_;
+        free_      = entries_[i].next;
+        index_[id] = i;
+    }
+
+    uint64_t deadline_tick = (deadline_ms + tick_ms_ - 1) / tick_ms_;
+    if (deadline_tick <= current_tick_) deadline_tick = current_tick_ + 1;
+
+    entries_[i].id            = id;
+    entries_[i].deadline_tick = deadline_tick;
+    link(i);
+    return true;
+}
+
+void TimerWheel::cancel(NodeId id)
+{
+    uint8_t i = index_[id];
+    if (i != NIL) release(i);
+}
+
+void TimerWheel::clear()
+{
+    memset(heads_, NIL, sizeof(heads_));
+    memset(index_, NIL, sizeof(index_));
+    for (uint8_t i = 0; i < MAX_PEERS; i++) {
+        entries_[i].next = (i + 1 < MAX_PEERS) ? i + 1 : NIL;
+    }
+    free_ = 0;
+}
+
+void TimerWheel::link(uint8_t i)
+{
+    uint8_t &head    = heads_[entries_[i].deadline_tick % SLOTS];
+    entries_[i].prev = NIL;
+    entries_[i].next = head;
+    if (head != NIL) entries_[head].prev = i;
+    head = i;
+}
+
+void TimerWheel::unlink(uint8_t i)
+{
+    Entry &e = entries_[i];
+    if (e.prev != NIL) {
+        entries_[e.prev].next = e.next;
+    }
+    else {
+        heads_[e.deadline_tick % SLOTS] = e.next;
+    }
+    if (e.next != NIL) entries_[e.next].prev = e.prev;
+}
+
+void TimerWheel::release(uint8_t i)
+{
+    unlink(i);
+    index_[entries_[i].id] = NIL;
+    entries_[i].next       = free_;
+    free_                  = i;
+}
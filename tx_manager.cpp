@@ -1,5 +1,9 @@
 #include "tx_manager.hpp"
 #include "esp_log.h"
+#include "espnow_stats.hpp"
+#include "latency_histogram.hpp"
+#include "esp_timer.h"
+#include <algorithm>
 #include <cstring>
 
 static const char *TAG = "TxManager";
@@ -8,19 +12,29 @@ static const char *TAG = "TxManager";
 static constexpr uint32_t NOTIFY_LOGICAL_ACK     = 0x01;
 static constexpr uint32_t NOTIFY_PHYSICAL_FAIL   = 0x02;
 static constexpr uint32_t NOTIFY_HUB_FOUND       = 0x04;
+static constexpr uint32_t NOTIFY_ACK_FLUSH       = 0x08;
+static constexpr uint32_t NOTIFY_SCAN_STEP       = 0x10;
 static constexpr uint32_t NOTIFY_DATA            = 0x20;
 static constexpr uint32_t NOTIFY_ACK_TIMEOUT     = 0x40;
 static constexpr uint32_t NOTIFY_STOP            = 0x100;
 static constexpr uint32_t NOTIFY_LINK_ALIVE      = 0x200;
 
+static bool is_broadcast(const uint8_t *mac)
+{
+    static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    return memcmp(mac, broadcast_mac, 6) == 0;
+}
+
 RealTxManager::RealTxManager(ITxStateMachine &fsm,
                              IChannelScanner &scanner,
                              IWiFiHAL &hal,
-                             IMessageCodec &codec)
+                             IMessageCodec &codec,
+                             IPeerManager &peer_mgr)
     : fsm_(fsm)
     , scanner_(scanner)
     , hal_(hal)
     , codec_(codec)
+    , peer_mgr_(peer_mgr)
 {
 }
 
@@ -33,6 +47,12 @@ esp_err_t RealTxManager::init(uint32_t stack_size, UBaseType_t priority)
 {
     tx_queue_ = xQueueCreate(20, sizeof(TxPacket));
     if (!tx_queue_) return ESP_ERR_NO_MEM;
+    queue_high_water_.store(0, std::memory_order_relaxed);
+
+    deferred_ack_mutex_ = xSemaphoreCreateMutex();
+    awaited_ack_mutex_  = xSemaphoreCreateMutex();
+    mailbox_mutex_      = xSemaphoreCreateMutex();
+    if (!deferred_ack_mutex_ || !awaited_ack_mutex_ || !mailbox_mutex_) return ESP_ERR_NO_MEM;
 
     ack_timeout_timer_ = xTimerCreate("ack_timeout", pdMS_TO_TICKS(500), pdFALSE, this, [](TimerHandle_t xTimer) {
         RealTxManager *self = static_cast<RealTxManager *>(pvTimerGetTimerID(xTimer));
@@ -41,6 +61,22 @@ esp_err_t RealTxManager::init(uint32_t stack_size, UBaseType_t priority)
         }
     });
 
+    piggyback_timer_ = xTimerCreate("ack_piggyback", pdMS_TO_TICKS(PIGGYBACK_ACK_WINDOW_MS), pdFALSE, this, [](TimerHandle_t xTimer) {
+        RealTxManager *self = static_cast<RealTxManager *>(pvTimerGetTimerID(xTimer));
+        if (self->task_handle_) {
+            xTaskNotify(self->task_handle_, NOTIFY_ACK_FLUSH, eSetBits);
+        }
+    });
+
+    // Period is set per channel with xTimerChangePeriod()
+    scan_timer_ = xTimerCreate("scan_dwell", pdMS_TO_TICKS(SCAN_CHANNEL_TIMEOUT_MS), pdFALSE, this, [](TimerHandle_t xTimer) {
+        RealTxManager *self = static_cast<RealTxManager *>(pvTimerGetTimerID(xTimer));
+        if (self->task_handle_) {
+            xTaskNotify(self->task_handle_, NOTIFY_SCAN_STEP, eSetBits);
+        }
+    });
+    if (!ack_timeout_timer_ || !piggyback_timer_ || !scan_timer_) return ESP_ERR_NO_MEM;
+
     if (xTaskCreate(tx_task_func, "tx_manager_task", stack_size, this, priority, &task_handle_) != pdPASS) {
         return ESP_FAIL;
     }
@@ -69,24 +105,141 @@ esp_err_t RealTxManager::deinit()
         ack_timeout_timer_ = nullptr;
     }
 
+    if (piggyback_timer_) {
+        xTimerDelete(piggyback_timer_, portMAX_DELAY);
+        piggyback_timer_ = nullptr;
+    }
+
+    if (scan_timer_) {
+        xTimerDelete(scan_timer_, portMAX_DELAY);
+        scan_timer_ = nullptr;
+    }
+    scanner_.cancel();
+
+    if (deferred_ack_mutex_) {
+        vSemaphoreDelete(deferred_ack_mutex_);
+        deferred_ack_mutex_ = nullptr;
+    }
+    deferred_ack_.reset();
+
+    if (awaited_ack_mutex_) {
+        vSemaphoreDelete(awaited_ack_mutex_);
+        awaited_ack_mutex_ = nullptr;
+    }
+    awaited_ack_.reset();
+
+    if (mailbox_mutex_) {
+        vSemaphoreDelete(mailbox_mutex_);
+        mailbox_mutex_ = nullptr;
+    }
+    mailbox_.clear();
+
     return ESP_OK;
 }
 
 esp_err_t RealTxManager::queue_packet(const TxPacket &packet)
 {
     if (!tx_queue_) return ESP_ERR_INVALID_STATE;
-    if (xQueueSend(tx_queue_, &packet, pdMS_TO_TICKS(100)) != pdTRUE) {
+    const TxPacket &queued = Latency::stamped(packet);
+    if (xQueueSend(tx_queue_, &queued, pdMS_TO_TICKS(100)) != pdTRUE) {
+        Stats::add(Stats::Counter::TX_QUEUE_FULL);
         return ESP_ERR_TIMEOUT;
     }
+    Stats::add(Stats::Counter::TX_QUEUED);
+
+    uint32_t depth = uxQueueMessagesWaiting(tx_queue_);
+    uint32_t peak  = queue_high_water_.load(std::memory_order_relaxed);
+    while (depth > peak && !queue_high_water_.compare_exchange_weak(peak, depth, std::memory_order_relaxed)) {
+    }
     if (task_handle_) {
         xTaskNotify(task_handle_, NOTIFY_DATA, eSetBits);
     }
     return ESP_OK;
 }
 
-void RealTxManager::notify_physical_fail() { if (task_handle_) xTaskNotify(task_handle_, NOTIFY_PHYSICAL_FAIL, eSetBits); }
+esp_err_t RealTxManager::schedule_ack(const TxPacket &ack_packet, uint16_t ack_sequence)
+{
+    if (!tx_queue_ || !deferred_ack_mutex_) return ESP_ERR_INVALID_STATE;
+
+    // Legacy peers have no header field to carry the ACK, so there is nothing to wait for.
+    if (!(agreed_capabilities(ack_packet.dest_mac) & PeerCapability::COMPACT_HEADER)) {
+        return queue_packet(ack_packet);
+    }
+
+    std::optional<TxPacket> displaced;
+    xSemaphoreTake(deferred_ack_mutex_, portMAX_DELAY);
+    if (deferred_ack_) {
+        displaced = deferred_ack_->packet;
+    }
+    deferred_ack_ = DeferredAck{Latency::stamped(ack_packet), ack_sequence};
+    xSemaphoreGive(deferred_ack_mutex_);
+
+    xTimerReset(piggyback_timer_, 0);
+
+    // Only one ACK is held at a time; an older one cannot wait any longer.
+    if (displaced) {
+        return queue_packet(*displaced);
+    }
+    return ESP_OK;
+}
+
+esp_err_t RealTxManager::hold_packet(const TxPacket &packet)
+{
+    if (!mailbox_mutex_) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(mailbox_mutex_, portMAX_DELAY);
+    esp_err_t err = mailbox_.hold(packet, esp_timer_get_time() / 1000);
+    xSemaphoreGive(mailbox_mutex_);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Downlink mailbox full, frame for a sleeping peer dropped");
+    }
+    return err;
+}
+
+void RealTxManager::release_held(const uint8_t *mac)
+{
+    if (!mailbox_mutex_) return;
+    TxPacket packet;
+    while (true) {
+        xSemaphoreTake(mailbox_mutex_, portMAX_DELAY);
+        bool found = mailbox_.take(mac, packet, esp_timer_get_time() / 1000);
+        xSemaphoreGive(mailbox_mutex_);
+        if (!found) break;
+        if (queue_packet(packet) != ESP_OK) {
+            ESP_LOGW(TAG, "TX queue full, held frame for a woken peer dropped");
+            break;
+        }
+    }
+}
+
+size_t RealTxManager::held_count(const uint8_t *mac)
+{
+    if (!mailbox_mutex_) return 0;
+    xSemaphoreTake(mailbox_mutex_, portMAX_DELAY);
+    size_t count = mailbox_.pending(mac, esp_timer_get_time() / 1000);
+    xSemaphoreGive(mailbox_mutex_);
+    return count;
+}
+
+void RealTxManager::notify_physical_fail()
+{
+    Stats::add(Stats::Counter::TX_PHY_FAILURES);
+    if (task_handle_) xTaskNotify(task_handle_, NOTIFY_PHYSICAL_FAIL, eSetBits);
+}
 void RealTxManager::notify_link_alive() { if (task_handle_) xTaskNotify(task_handle_, NOTIFY_LINK_ALIVE, eSetBits); }
-void RealTxManager::notify_logical_ack() { if (task_handle_) xTaskNotify(task_handle_, NOTIFY_LOGICAL_ACK, eSetBits); }
+void RealTxManager::notify_logical_ack(const uint8_t *mac, uint16_t sequence)
+{
+    if (!task_handle_ || !awaited_ack_mutex_) return;
+
+    // On a hub every peer's ACKs arrive here, and a late ACK for a frame already
+    // given up on can still be in flight; neither may complete the pending frame.
+    xSemaphoreTake(awaited_ack_mutex_, portMAX_DELAY);
+    bool matches = awaited_ack_ && memcmp(awaited_ack_->mac, mac, 6) == 0 &&
+                   ((awaited_ack_->sequence ^ sequence) & PIGGYBACK_ACK_SEQ_MASK) == 0;
+    if (matches) awaited_ack_.reset(); // A duplicate ACK must not complete the next frame
+    xSemaphoreGive(awaited_ack_mutex_);
+
+    if (matches) xTaskNotify(task_handle_, NOTIFY_LOGICAL_ACK, eSetBits);
+}
 void RealTxManager::notify_hub_found() { if (task_handle_) xTaskNotify(task_handle_, NOTIFY_HUB_FOUND, eSetBits); }
 
 void RealTxManager::tx_task_func(void *arg)
@@ -95,6 +248,153 @@ void RealTxManager::tx_task_func(void *arg)
     vTaskDelete(NULL);
 }
 
+uint16_t RealTxManager::agreed_capabilities(const uint8_t *mac)
+{
+    return peer_mgr_.get_capabilities(mac) & codec_.capabilities();
+}
+
+void RealTxManager::attach_deferred_ack(TxPacket &packet, uint16_t caps)
+{
+    MessageHeader *header = reinterpret_cast<MessageHeader *>(packet.data);
+    header->piggyback_ack = 0;
+    if (!(caps & PeerCapability::COMPACT_HEADER)) return;
+
+    xSemaphoreTake(deferred_ack_mutex_, portMAX_DELAY);
+    if (deferred_ack_ && memcmp(deferred_ack_->packet.dest_mac, packet.dest_mac, 6) == 0) {
+        header->piggyback_ack = PIGGYBACK_ACK_VALID | (deferred_ack_->sequence & PIGGYBACK_ACK_SEQ_MASK);
+        deferred_ack_.reset();
+        xTimerStop(piggyback_timer_, 0);
+    }
+    xSemaphoreGive(deferred_ack_mutex_);
+}
+
+void RealTxManager::flush_deferred_ack()
+{
+    std::optional<DeferredAck> expired;
+    xSemaphoreTake(deferred_ack_mutex_, portMAX_DELAY);
+    expired.swap(deferred_ack_);
+    xSemaphoreGive(deferred_ack_mutex_);
+
+    if (expired) {
+        transmit(expired->packet);
+    }
+}
+
+void RealTxManager::await_ack(const TxPacket &packet)
+{
+    const MessageHeader *header = reinterpret_cast<const MessageHeader *>(packet.data);
+    AwaitedAck awaited;
+    memcpy(awaited.mac, packet.dest_mac, 6);
+    awaited.sequence = header->sequence_number;
+
+    xSemaphoreTake(awaited_ack_mutex_, portMAX_DELAY);
+    awaited_ack_ = awaited;
+    xSemaphoreGive(awaited_ack_mutex_);
+    // Left over from a frame that was given up on just as its ACK came in
+    ulTaskNotifyValueClear(nullptr, NOTIFY_LOGICAL_ACK);
+}
+
+void RealTxManager::stop_awaiting_ack()
+{
+    xSemaphoreTake(awaited_ack_mutex_, portMAX_DELAY);
+    awaited_ack_.reset();
+    xSemaphoreGive(awaited_ack_mutex_);
+}
+
+esp_err_t RealTxManager::transmit(TxPacket &packet)
+{
+    MessageHeader *header = reinterpret_cast<MessageHeader *>(packet.data);
+    header->sequence_number = sequence_counter_++;
+
+    uint16_t caps = agreed_capabilities(packet.dest_mac);
+    attach_deferred_ack(packet, caps);
+    // Armed before sending, the ACK can beat send_wire() back
+    if (packet.requires_ack) await_ack(packet);
+    return send_wire(packet, caps, false);
+}
+
+esp_err_t RealTxManager::send_wire(const TxPacket &packet, uint16_t caps, bool retransmission)
+{
+    size_t wire_len = codec_.encode_wire(packet.dest_mac, packet.data, packet.len, caps, retransmission, wire_buf_,
+                                         sizeof(wire_buf_));
+    if (wire_len == 0) return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t err = hal_.send_packet(packet.dest_mac, wire_buf_, wire_len);
+    if (err == ESP_OK) {
+        Stats::add(Stats::Counter::TX_SENT);
+        if (!retransmission) Latency::record(LatencyStage::TX_RADIO_SEND, packet);
+        Latency::note_radio_send(packet);
+    }
+    return err;
+}
+
+uint64_t RealTxManager::now_ms() { return esp_timer_get_time() / 1000; }
+
+void RealTxManager::arm_ack_timer(const PendingAck &pending)
+{
+    uint8_t retries     = MAX_LOGICAL_RETRIES - pending.retries_left;
+    uint32_t timeout_ms = peer_mgr_.ack_timeout_ms(pending.packet.dest_mac, retries);
+    xTimerChangePeriod(ack_timeout_timer_, std::max<TickType_t>(pdMS_TO_TICKS(timeout_ms), 1), 0);
+}
+
+void RealTxManager::record_delivery(bool delivered)
+{
+    // delivered comes only from the ACK notify_logical_ack() matched to this frame.
+    // Anything looser would time another peer's ACK as this link's RTT, and confirm
+    // a delta keyframe the peer may not have.
+    auto pending = fsm_.get_pending_ack();
+    if (!pending) return;
+
+    // Karn's rule: an ACK after a retransmission cannot be matched to one attempt
+    uint8_t retries = MAX_LOGICAL_RETRIES - pending->retries_left;
+    uint32_t rtt_ms = 0;
+    if (delivered && retries == 0) {
+        rtt_ms = std::max<uint32_t>(static_cast<uint32_t>(now_ms() - pending->timestamp_ms), 1);
+    }
+    peer_mgr_.record_delivery(pending->packet.dest_mac, delivered, retries, rtt_ms);
+    if (delivered) codec_.confirm_delivery(pending->packet.dest_mac, pending->packet.data, pending->packet.len);
+}
+
+void RealTxManager::arm_scan_timer(uint32_t dwell_ms)
+{
+    if (dwell_ms == 0) return; // Scan finished, on_scan_done() already ran
+    xTimerChangePeriod(scan_timer_, std::max<TickType_t>(pdMS_TO_TICKS(dwell_ms), 1), 0);
+}
+
+void RealTxManager::drain_during_scan()
+{
+    // Broadcasts that expect no ACK go out as they come, on whatever channel is
+    // being probed. A unicast frame would reach nobody there, so the first one
+    // waits for the scan to settle, and so does everything queued behind it.
+    TxPacket packet;
+    while (xQueuePeek(tx_queue_, &packet, 0) == pdTRUE && !packet.requires_ack && is_broadcast(packet.dest_mac)) {
+        xQueueReceive(tx_queue_, &packet, 0);
+        Latency::record(LatencyStage::TX_DEQUEUE, packet);
+        transmit(packet);
+    }
+}
+
+void RealTxManager::hold_listening(bool hold)
+{
+    // A node sleeping between wake slots would miss the reply otherwise
+    if (hold == listen_held_) return;
+    if (hal_.hold_listening(hold) == ESP_OK) listen_held_ = hold;
+}
+
+void RealTxManager::on_scan_done(const IChannelScanner::ScanResult &result, void *ctx)
+{
+    RealTxManager *self = static_cast<RealTxManager *>(ctx);
+    xTimerStop(self->scan_timer_, 0);
+    Stats::add(Stats::Counter::SCANS);
+    Stats::add(Stats::Counter::SCAN_TIME_MS, result.duration_ms);
+    if (result.hub_found) {
+        self->hal_.set_channel(result.channel);
+        self->fsm_.on_link_alive();
+    }
+    self->fsm_.reset(); // Back to IDLE
+    self->flush_deferred_ack(); // Held back while the radio was off channel
+}
+
 void RealTxManager::run()
 {
     TxPacket packet_to_send;
@@ -108,29 +408,31 @@ void RealTxManager::run()
         case TxState::IDLE:
         {
             if (xQueueReceive(tx_queue_, &packet_to_send, 0) == pdTRUE) {
+                Latency::record(LatencyStage::TX_DEQUEUE, packet_to_send);
                 // Transition to SENDING
                 // We'll handle sending in the next loop iteration or just fall through
                 // For simplicity, let's just use the logic from original task.
 
-                MessageHeader *header = reinterpret_cast<MessageHeader *>(packet_to_send.data);
-                header->sequence_number = sequence_counter_++;
-                // Update CRC
-                packet_to_send.data[packet_to_send.len - CRC_SIZE] = codec_.calculate_crc(packet_to_send.data, packet_to_send.len - CRC_SIZE);
-
-                esp_err_t send_result = hal_.send_packet(packet_to_send.dest_mac, packet_to_send.data, packet_to_send.len);
+                hold_listening(packet_to_send.requires_ack);
+                esp_err_t send_result = transmit(packet_to_send);
+                const MessageHeader *header = reinterpret_cast<const MessageHeader *>(packet_to_send.data);
 
                 TxState next = fsm_.on_tx_success(packet_to_send.requires_ack && send_result == ESP_OK);
                 if (next == TxState::WAITING_FOR_ACK) {
-                    PendingAck pending = { .sequence_number = header->sequence_number, .timestamp_ms = 0, .retries_left = 3, .packet = packet_to_send };
+                    PendingAck pending = { .sequence_number = header->sequence_number, .timestamp_ms = now_ms(), .retries_left = MAX_LOGICAL_RETRIES, .packet = packet_to_send };
                     fsm_.set_pending_ack(pending);
-                    xTimerStart(ack_timeout_timer_, 0);
+                    arm_ack_timer(pending);
+                } else {
+                    stop_awaiting_ack();
                 }
                 break;
             }
 
+            hold_listening(false);
             if (xTaskNotifyWait(0, 0xFFFFFFFF, &notifications, portMAX_DELAY) == pdTRUE) {
                 if (notifications & NOTIFY_STOP) goto exit;
                 if (notifications & NOTIFY_LINK_ALIVE) fsm_.on_link_alive();
+                if (notifications & NOTIFY_ACK_FLUSH) flush_deferred_ack();
                 if (notifications & NOTIFY_PHYSICAL_FAIL) {
                     if (fsm_.on_physical_fail() == TxState::SCANNING) {
                         // Handle scanning below
@@ -146,12 +448,16 @@ void RealTxManager::run()
             if (xTaskNotifyWait(0, 0xFFFFFFFF, &notifications, portMAX_DELAY) == pdTRUE) {
                 if (notifications & NOTIFY_STOP) goto exit;
                 if (notifications & NOTIFY_LINK_ALIVE) fsm_.on_link_alive();
+                if (notifications & NOTIFY_ACK_FLUSH) flush_deferred_ack();
                 if (notifications & NOTIFY_LOGICAL_ACK) {
+                    if (auto pending = fsm_.get_pending_ack()) Latency::record(LatencyStage::TX_ACK, pending->packet);
+                    record_delivery(true);
                     fsm_.on_ack_received();
                     xTimerStop(ack_timeout_timer_, 0);
                 } else if (notifications & NOTIFY_PHYSICAL_FAIL) {
                     fsm_.on_physical_fail();
                 } else if (notifications & NOTIFY_ACK_TIMEOUT) {
+                    Stats::add(Stats::Counter::TX_ACK_TIMEOUTS);
                     fsm_.on_ack_timeout();
                 }
             }
@@ -164,12 +470,19 @@ void RealTxManager::run()
             if (pending_opt && pending_opt->retries_left > 0) {
                 PendingAck pending = pending_opt.value();
                 pending.retries_left--;
+                // A piggybacked ACK rides the first attempt only; repeated later it
+                // could complete a newer frame the peer is waiting on
+                reinterpret_cast<MessageHeader *>(pending.packet.data)->piggyback_ack = 0;
                 fsm_.set_pending_ack(pending);
 
-                hal_.send_packet(pending.packet.dest_mac, pending.packet.data, pending.packet.len);
-                xTimerStart(ack_timeout_timer_, 0);
+                Stats::add(Stats::Counter::TX_RETRIES);
+                send_wire(pending.packet, agreed_capabilities(pending.packet.dest_mac), true);
+                arm_ack_timer(pending);
                 fsm_.on_tx_success(true); // Back to WAITING_FOR_ACK
             } else {
+                Stats::add(Stats::Counter::TX_MAX_RETRY_DROPS);
+                stop_awaiting_ack();
+                record_delivery(false);
                 fsm_.on_max_retries();
             }
             break;
@@ -181,19 +494,36 @@ void RealTxManager::run()
 
         case TxState::SCANNING:
         {
-            uint8_t current_channel = 1;
-            hal_.get_channel(&current_channel);
-            auto result = scanner_.scan(current_channel);
-            if (result.hub_found) {
-                hal_.set_channel(result.channel);
-                fsm_.on_link_alive();
+            if (!scanner_.is_scanning()) {
+                uint8_t current_channel = 1;
+                hal_.get_channel(&current_channel);
+                hold_listening(true);
+                ulTaskNotifyValueClear(nullptr, NOTIFY_SCAN_STEP);
+                arm_scan_timer(scanner_.start(current_channel, on_scan_done, this));
+                break;
+            }
+
+            drain_during_scan();
+            if (xTaskNotifyWait(0, 0xFFFFFFFF, &notifications, portMAX_DELAY) == pdTRUE) {
+                if (notifications & NOTIFY_STOP) goto exit;
+                // NOTIFY_ACK_FLUSH is left to on_scan_done(): the deferred ACK is unicast too
+                // Any received frame raises LINK_ALIVE, including other nodes' probes;
+                // only a scan response proves the hub is on this channel.
+                if (notifications & NOTIFY_HUB_FOUND) {
+                    scanner_.on_hub_found();
+                } else if (notifications & NOTIFY_SCAN_STEP) {
+                    // A step raised while the last one was handled would cut the
+                    // next channel's dwell short
+                    ulTaskNotifyValueClear(nullptr, NOTIFY_SCAN_STEP);
+                    arm_scan_timer(scanner_.on_dwell_elapsed());
+                }
             }
-            fsm_.reset(); // Back to IDLE
             break;
         }
         }
     }
 
 exit:
+    hold_listening(false);
     ESP_LOGI(TAG, "TX Manager task exiting.");
 }
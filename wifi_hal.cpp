@@ -5,6 +5,12 @@
 RealWiFiHAL::RealWiFiHAL()
     : task_handle_(nullptr)
 {
+    listen_mutex_ = xSemaphoreCreateMutex();
+}
+
+RealWiFiHAL::~RealWiFiHAL()
+{
+    if (listen_mutex_) vSemaphoreDelete(listen_mutex_);
 }
 
 esp_err_t RealWiFiHAL::set_channel(uint8_t channel)
@@ -22,6 +28,37 @@ esp_err_t RealWiFiHAL::send_packet(const uint8_t *mac, const uint8_t *data, size
     return esp_now_send(mac, data, len);
 }
 
+esp_err_t RealWiFiHAL::set_listening(bool listening)
+{
+    xSemaphoreTake(listen_mutex_, portMAX_DELAY);
+    listening_    = listening;
+    esp_err_t err = apply_listening();
+    xSemaphoreGive(listen_mutex_);
+    return err;
+}
+
+esp_err_t RealWiFiHAL::hold_listening(bool hold)
+{
+    xSemaphoreTake(listen_mutex_, portMAX_DELAY);
+    held_         = hold;
+    esp_err_t err = apply_listening();
+    xSemaphoreGive(listen_mutex_);
+    return err;
+}
+
+esp_err_t RealWiFiHAL::apply_listening()
+{
+    bool on = listening_ || held_;
+    if (on == receiver_on_) return ESP_OK;
+
+    // ESP-NOW power save: a zero window keeps the receiver off between wake-ups,
+    // the maximum keeps it always on. Needs CONFIG_ESP_WIFI_STA_DISCONNECTED_PM_ENABLE
+    // when the station is not connected to an AP.
+    esp_err_t err = esp_now_set_wake_window(on ? UINT16_MAX : 0);
+    if (err == ESP_OK) receiver_on_ = on;
+    return err;
+}
+
 bool RealWiFiHAL::wait_for_event(uint32_t event_mask, uint32_t timeout_ms)
 {
     uint32_t notifications = 0;